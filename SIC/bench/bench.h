@@ -0,0 +1,10 @@
+// Shared by the benchmarks: the assembler itself, built without its main.
+// They time with its monotonicSeconds().
+
+#ifndef SIC_BENCH_H
+#define SIC_BENCH_H
+
+#define SIC_NO_MAIN
+#include "../main.c"
+
+#endif
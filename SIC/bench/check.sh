@@ -0,0 +1,139 @@
+#!/bin/sh
+# Output regression check: assembles the sample sources and two generated
+# programs in every mode and compares what each writes with a plain two-pass
+# assembly. Threads, one pass, --no-listing and every SIC_SIMD level have to
+# write the same files; -i has to match on a first run, a rerun and a
+# size-changing edit; -1 and -b, whose records are split differently, have to
+# load the same memory image, also after converting -b back to text; and
+# --disassemble has to accept both object formats against the listing.
+# Pass one only splits sources over PASS_ONE_CHUNK_BYTES (1 MB) across its
+# threads, so -t also runs on two larger programs, one of which defines
+# labels again in later chunks; there the diagnostics have to match too.
+#
+#   ./check.sh [lines]
+#
+# Exits non-zero when any mode differs, naming the source and mode.
+
+lines=${1:-20000}
+bigLines=100000
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -r "$work"' EXIT
+failures=0
+
+cc -O2 -pthread -o "$work/sic" "$here/../main.c" || exit 1
+cc -O2 -pthread -o "$work/image_dump" "$here/image_dump.c" || exit 1
+cc -O2 -o "$work/workload_gen" "$here/workload_gen.c" || exit 1
+"$work/workload_gen" "$lines" > "$work/mixed.asm" 2> /dev/null || exit 1
+"$work/workload_gen" "$lines" -format4 40 -base 40 -seed 7 > "$work/far.asm" 2> /dev/null || exit 1
+"$work/workload_gen" "$bigLines" > "$work/big.asm" 2> /dev/null || exit 1
+# Every 4000th label after the first line is renamed to one of the first ones.
+awk '/^[A-Za-z]/ && NR > 1 { n++; if (n % 4000 == 0) sub(/^[A-Za-z0-9]+/, first[n / 4000]); else if (n <= 50) first[n] = $1 }
+     { print }' "$work/big.asm" > "$work/duplicate.asm"
+
+fail()
+{
+    echo "FAIL $name: $1"
+    failures=$((failures + 1))
+}
+
+# assemble dir [flags...]: assembles the current source in a fresh directory.
+assemble()
+{
+    dir=$work/$name.$1
+    shift
+    rm -rf "$dir"
+    mkdir "$dir"
+    cp "$source" "$dir/source.asm"
+    (cd "$dir" && "$work/sic" "$@" source.asm > out 2>&1)
+}
+
+# same dir [files...]: compares the given outputs of dir with the reference.
+same()
+{
+    dir=$work/$name.$1
+    shift
+    for file in "$@"; do
+        cmp -s "$work/$name.ref/$file" "$dir/$file" || fail "$file differs in $(basename "$dir")"
+    done
+}
+
+# loads dir object: compares the memory image an object loads with the reference.
+loads()
+{
+    "$work/image_dump" "$work/$name.$1/$2" > "$work/$name.$1/image" &&
+        cmp -s "$work/$name.ref/image" "$work/$name.$1/image" || fail "$2 loads differently in $name.$1"
+}
+
+for source in "$here/../source.asm" "$here/loop.asm" "$work/mixed.asm" "$work/far.asm"; do
+    name=$(basename "$source" .asm)
+    assemble ref || fail "default assembly failed"
+    "$work/image_dump" "$work/$name.ref/output.obj" > "$work/$name.ref/image"
+
+    for threads in 1 2 4; do
+        assemble t$threads -t $threads
+        same t$threads output.obj output.lst out
+    done
+
+    assemble onepass -1
+    loads onepass output.obj
+
+    assemble nolisting --no-listing
+    same nolisting output.obj
+    [ -e "$work/$name.nolisting/output.lst" ] && fail "--no-listing wrote a listing"
+
+    for level in scalar sse2 avx2; do
+        SIC_SIMD=$level assemble simd.$level
+        same simd.$level output.obj output.lst
+    done
+
+    assemble incremental -i
+    same incremental output.obj output.lst
+    (cd "$work/$name.incremental" && "$work/sic" -i source.asm > out 2>&1)
+    same incremental output.obj output.lst
+    # Growing the first RESW and then shrinking it back moves every later
+    # address both ways; each -i run has to match a full assembly.
+    if grep -q 'RESW    1$' "$source"; then
+        sed '0,/RESW    1$/s//RESW    3/' "$source" > "$work/$name.grown.asm"
+        saved=$source
+        for edit in "$work/$name.grown.asm" "$saved"; do
+            cp "$edit" "$work/$name.incremental/source.asm"
+            (cd "$work/$name.incremental" && "$work/sic" -i source.asm > out 2>&1)
+            source=$edit
+            assemble edited
+            for file in output.obj output.lst; do
+                cmp -s "$work/$name.edited/$file" "$work/$name.incremental/$file" ||
+                    fail "$file differs after an -i edit to $(basename "$edit")"
+            done
+        done
+        source=$saved
+    fi
+
+    assemble binary -b
+    same binary output.lst
+    loads binary output.obj
+    "$work/sic" --convert "$work/$name.binary/output.obj" "$work/$name.binary/text.obj" > /dev/null
+    loads binary text.obj
+
+    ref=$work/$name.ref
+    "$work/sic" --disassemble "$ref/output.obj" "$ref/text.dis" "$ref/output.lst" > /dev/null 2>&1 ||
+        fail "--disassemble rejects the text object"
+    "$work/sic" --disassemble "$work/$name.binary/output.obj" "$ref/binary.dis" "$ref/output.lst" > /dev/null 2>&1 ||
+        fail "--disassemble rejects the binary object"
+    cmp -s "$ref/text.dis" "$ref/binary.dis" || fail "--disassemble differs between the object formats"
+done
+
+for source in "$work/big.asm" "$work/duplicate.asm"; do
+    name=$(basename "$source" .asm)
+    assemble ref
+    for threads in 2 4; do
+        assemble t$threads -t $threads
+        same t$threads output.obj output.lst out
+    done
+done
+
+if [ "$failures" -gt 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
+echo "all modes match"
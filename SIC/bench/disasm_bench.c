@@ -0,0 +1,116 @@
+// Disassembler benchmark: assembles a generated program, then times
+// --disassemble on its object file alone and checked against its listing,
+// next to a plain line-by-line copy of both files, best of several runs.
+//
+//   cc -O2 -pthread -o disasm_bench disasm_bench.c
+//   ./disasm_bench [lines] [runs]
+
+#include "bench.h"
+
+#define WORKLOAD_NO_MAIN
+#include "workload_gen.c"
+
+double bestDisassembly(const char *objPath, const char *outPath, const char *lstPath, int runs)
+{
+    double best = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        double start = monotonicSeconds();
+        int ok = disassembleObject(objPath, outPath, lstPath);
+        double seconds = monotonicSeconds() - start;
+        if (!ok)
+            exit(1);
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+// Copies the files line by line through an output buffer, the floor for
+// anything that reads them and writes as much.
+double bestCopy(const char *objPath, const char *lstPath, const char *outPath, int runs, long *bytes)
+{
+    const char *paths[] = {objPath, lstPath};
+    double best = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        OutputBuffer out;
+        double start = monotonicSeconds();
+        if (!openOutput(&out, outPath))
+            exit(1);
+        for (int i = 0; i < 2; i++)
+        {
+            SourceFile file;
+            size_t pos = 0, size;
+            int lineNum = 0;
+            const char *line;
+            if (!openSourceFile(paths[i], &file))
+                exit(1);
+            while ((line = nextRecord(&file, &pos, &size, &lineNum)) != NULL)
+            {
+                writeOutput(&out, line, size);
+                writeOutput(&out, "\n", 1);
+            }
+            bytes[i] = (long)file.size;
+            closeSourceFile(&file);
+        }
+        if (!closeOutput(&out))
+            exit(1);
+        double seconds = monotonicSeconds() - start;
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    long lines = argc > 1 ? atol(argv[1]) : 300000;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    char dir[] = "/tmp/disasm_bench_XXXXXX";
+    if (lines < 1 || runs < 1 || !mkdtemp(dir))
+        return 1;
+
+    char sourcePath[256], objPath[256], lstPath[256], outPath[256];
+    snprintf(sourcePath, sizeof(sourcePath), "%s/bench.asm", dir);
+    snprintf(objPath, sizeof(objPath), "%s/bench.obj", dir);
+    snprintf(lstPath, sizeof(lstPath), "%s/bench.lst", dir);
+    snprintf(outPath, sizeof(outPath), "%s/bench.dis", dir);
+    FILE *source = fopen(sourcePath, "w");
+    if (!source)
+        return 1;
+    WorkloadMix mix = {30, 30, 20, 10, 25, 12345};
+    WorkloadStats stats;
+    generateWorkload(source, lines, &mix, &stats);
+    fclose(source);
+
+    AssemblyContext ctx = {0};
+    ctx.sourcePath = sourcePath;
+    ctx.objPath = objPath;
+    ctx.lstPath = lstPath;
+    ctx.passTwoThreads = 1;
+    int ok = assembleFile(&ctx) && ctx.diagnostics.count == 0;
+    printDiagnostics(&ctx, stderr, 1);
+    releaseAssembly(&ctx);
+    freeDiagnostics(&ctx.diagnostics);
+    if (!ok)
+        return 1;
+
+    startOutputWriter();
+    long bytes[2];
+    double copySeconds = bestCopy(objPath, lstPath, outPath, runs, bytes);
+    double objectSeconds = bestDisassembly(objPath, outPath, NULL, runs);
+    double checkedSeconds = bestDisassembly(objPath, outPath, lstPath, runs);
+
+    printf("\n%ld-line program: %ld-byte object, %ld-byte listing\n", stats.lines, bytes[0], bytes[1]);
+    printf("copy:    %8.2f ms %8.1f MB/s\n", copySeconds * 1e3, (bytes[0] + bytes[1]) / copySeconds / 1e6);
+    printf("object:  %8.2f ms %8.1f MB/s\n", objectSeconds * 1e3, bytes[0] / objectSeconds / 1e6);
+    printf("checked: %8.2f ms %8.1f MB/s\n", checkedSeconds * 1e3, (bytes[0] + bytes[1]) / checkedSeconds / 1e6);
+
+    unlink(sourcePath);
+    unlink(objPath);
+    unlink(lstPath);
+    unlink(outPath);
+    rmdir(dir);
+    return 0;
+}
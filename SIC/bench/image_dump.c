@@ -0,0 +1,27 @@
+// Memory image dump for check.sh: links the given object files of either
+// format into a machine, as -r does, and writes its whole memory to stdout,
+// so two object programs that load the same bytes compare equal however
+// their records are split.
+//
+//   cc -O2 -pthread -o image_dump image_dump.c
+//   ./image_dump <object file>... > image
+
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <object file>...\n", argv[0]);
+        return 1;
+    }
+    Machine machine;
+    Linker linker;
+    initMachine(&machine);
+    int ok = linkObjectModules(&machine, &linker, argv + 1, argc - 1);
+    if (ok)
+        ok = fwrite(machine.memory, 1, MEMORY_SIZE, stdout) == MEMORY_SIZE;
+    freeLinker(&linker);
+    freeMachine(&machine);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+// Linking loader benchmark: writes a ring of generated modules that call and
+// reference each other through EXTDEF/EXTREF, assembles every one of them,
+// then links the object files into one memory image. Relinking is what
+// changes to a single module cost once the others are already assembled.
+//
+//   cc -O2 -pthread -o link_bench link_bench.c && ./link_bench [modules] [lines]
+
+#include "bench.h"
+
+char *joinPath(const char *dir, int module, const char *extension)
+{
+    char *path = (char *)malloc(strlen(dir) + 32);
+    sprintf(path, "%s/m%05d%s", dir, module, extension);
+    return path;
+}
+
+int main(int argc, char *argv[])
+{
+    int moduleCount = argc > 1 ? atoi(argv[1]) : 2000;
+    int lineCount = argc > 2 ? atoi(argv[2]) : 100;
+    char dir[] = "/tmp/link_bench_XXXXXX";
+    if (moduleCount < 1 || !mkdtemp(dir))
+        return 1;
+
+    char **sources = (char **)malloc(moduleCount * sizeof(char *));
+    char **objects = (char **)malloc(moduleCount * sizeof(char *));
+    char **listings = (char **)malloc(moduleCount * sizeof(char *));
+    for (int m = 0; m < moduleCount; m++)
+    {
+        sources[m] = joinPath(dir, m, ".asm");
+        objects[m] = joinPath(dir, m, ".obj");
+        listings[m] = joinPath(dir, m, ".lst");
+
+        int next = (m + 1) % moduleCount;
+        FILE *source = fopen(sources[m], "w");
+        if (!source)
+            return 1;
+        fprintf(source, "M%05d START 0\n EXTDEF E%05d,V%05d\n EXTREF E%05d,V%05d\n", m, m, m, next, next);
+        fprintf(source, "E%05d +LDA V%05d\n", m, next);
+        for (int i = 0; i < lineCount; i++)
+        {
+            switch (i % 5)
+            {
+            case 0: fprintf(source, "L%d LDA V%05d\n", i, m); break;
+            case 1: fprintf(source, " ADD #%d\n", i); break;
+            case 2: fprintf(source, " +STA V%05d\n", next); break;
+            case 3: fprintf(source, " +JSUB E%05d\n", next); break;
+            default: fprintf(source, " STA V%05d,X\n", m); break;
+            }
+        }
+        fprintf(source, " RSUB\nV%05d WORD E%05d\n WORD V%05d\n END\n", m, next, m);
+        fclose(source);
+    }
+
+    double start = monotonicSeconds();
+    for (int m = 0; m < moduleCount; m++)
+    {
+        AssemblyContext ctx = {0};
+        ctx.sourcePath = sources[m];
+        ctx.objPath = objects[m];
+        ctx.lstPath = listings[m];
+        ctx.passTwoThreads = 1;
+        int ok = assembleFile(&ctx) && ctx.diagnostics.count == 0;
+        printDiagnostics(&ctx, stderr, 1);
+        releaseAssembly(&ctx);
+        freeDiagnostics(&ctx.diagnostics);
+        if (!ok)
+            return 1;
+    }
+    double assembleTime = monotonicSeconds() - start;
+
+    Machine machine;
+    Linker linker;
+    initMachine(&machine);
+    start = monotonicSeconds();
+    if (!linkObjectModules(&machine, &linker, objects, moduleCount))
+        return 1;
+    double linkTime = monotonicSeconds() - start;
+
+    printf("%d modules of %d lines: %d bytes, %d fixups\n",
+           moduleCount, lineCount + 5, machine.progLength, linker.fixupCount);
+    printf("assemble all: %8.1f ms\n", assembleTime * 1e3);
+    printf("link all:     %8.1f ms (%.1fx cheaper)\n", linkTime * 1e3, assembleTime / linkTime);
+    freeLinker(&linker);
+    freeMachine(&machine);
+
+    for (int m = 0; m < moduleCount; m++)
+    {
+        unlink(sources[m]);
+        unlink(objects[m]);
+        unlink(listings[m]);
+        free(sources[m]);
+        free(objects[m]);
+        free(listings[m]);
+    }
+    rmdir(dir);
+    free(sources);
+    free(objects);
+    free(listings);
+    return 0;
+}
@@ -0,0 +1,22 @@
+; Interpreter throughput workload: 1000 passes of a three-instruction inner
+; loop that adds 0..99999 into A, storing the running total after each pass.
+;
+;   ../main -x loop.asm
+LOOP    START   0
+        LDS     #1000
+        CLEAR   A
+OUTER   CLEAR   X
+        +LDT    #100000
+INNER   ADDR    X,A
+        TIXR    T
+        JLT     INNER
+        STA     TOTAL
+        LDT     PASSES
+        RMO     T,X
+        TIXR    S
+        STX     PASSES
+        JLT     OUTER
+        RSUB
+TOTAL   RESW    1
+PASSES  WORD    0
+        END     LOOP
@@ -0,0 +1,123 @@
+// Object format benchmark: assembles a generated program into a text and a
+// binary object file, links it into one absolute image and writes that image
+// in both formats too, then times loading each file into a machine. Each load
+// is the best of several; the image has to fit the 1 MB machine, about
+// 340000 generated lines.
+//
+//   cc -O2 -pthread -o object_bench object_bench.c
+//   ./object_bench [lines] [runs]
+
+#include "bench.h"
+
+#define WORKLOAD_NO_MAIN
+#include "workload_gen.c"
+
+double bestLoad(char *path, int runs, Machine *machine)
+{
+    double best = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        Linker linker;
+        double start = monotonicSeconds();
+        if (!linkObjectModules(machine, &linker, &path, 1))
+            exit(1);
+        double seconds = monotonicSeconds() - start;
+        freeLinker(&linker);
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+long fileSize(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+int assembleObject(const char *sourcePath, const char *objPath, const char *lstPath, int binary)
+{
+    AssemblyContext ctx = {0};
+    ctx.sourcePath = (char *)sourcePath;
+    ctx.objPath = (char *)objPath;
+    ctx.lstPath = (char *)lstPath;
+    ctx.passTwoThreads = 1;
+    ctx.binaryObject = binary;
+    int ok = assembleFile(&ctx) && ctx.diagnostics.count == 0;
+    printDiagnostics(&ctx, stderr, 1);
+    releaseAssembly(&ctx);
+    freeDiagnostics(&ctx.diagnostics);
+    return ok;
+}
+
+// Loads both files and prints how they compare; returns whether the images match.
+int compareFormats(const char *what, char *textPath, char *binaryPath, int runs)
+{
+    Machine text, binary;
+    initMachine(&text);
+    initMachine(&binary);
+    double textSeconds = bestLoad(textPath, runs, &text);
+    double binarySeconds = bestLoad(binaryPath, runs, &binary);
+    int same = memcmp(text.memory, binary.memory, MEMORY_SIZE) == 0 && text.execAddress == binary.execAddress;
+    long textBytes = fileSize(textPath), binaryBytes = fileSize(binaryPath);
+
+    printf("%s:\n", what);
+    printf("  text:   %10ld bytes %8.2f ms\n", textBytes, textSeconds * 1e3);
+    printf("  binary: %10ld bytes %8.2f ms (%.1fx smaller, %.1fx faster)\n", binaryBytes, binarySeconds * 1e3,
+           (double)textBytes / binaryBytes, textSeconds / binarySeconds);
+    if (!same)
+        printf("  Images differ\n");
+    freeMachine(&text);
+    freeMachine(&binary);
+    return same;
+}
+
+int main(int argc, char *argv[])
+{
+    long lines = argc > 1 ? atol(argv[1]) : 300000;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    char dir[] = "/tmp/object_bench_XXXXXX";
+    if (lines < 1 || runs < 1 || !mkdtemp(dir))
+        return 1;
+
+    char sourcePath[256], objPath[256], binaryObjPath[256], lstPath[256], textPath[256], binaryPath[256];
+    snprintf(sourcePath, sizeof(sourcePath), "%s/bench.asm", dir);
+    snprintf(objPath, sizeof(objPath), "%s/bench.obj", dir);
+    snprintf(binaryObjPath, sizeof(binaryObjPath), "%s/bench.sob", dir);
+    snprintf(lstPath, sizeof(lstPath), "%s/bench.lst", dir);
+    snprintf(textPath, sizeof(textPath), "%s/linked.obj", dir);
+    snprintf(binaryPath, sizeof(binaryPath), "%s/linked.sob", dir);
+    FILE *source = fopen(sourcePath, "w");
+    if (!source)
+        return 1;
+    WorkloadMix mix = {30, 30, 20, 10, 25, 12345};
+    WorkloadStats stats;
+    generateWorkload(source, lines, &mix, &stats);
+    fclose(source);
+
+    if (!assembleObject(sourcePath, objPath, lstPath, 0) || !assembleObject(sourcePath, binaryObjPath, lstPath, 1))
+        return 1;
+
+    Machine machine;
+    Linker linker;
+    char *paths[] = {objPath};
+    initMachine(&machine);
+    if (!linkObjectModules(&machine, &linker, paths, 1) || !writeLinkedProgram(&machine, &linker, textPath, 0) ||
+        !writeLinkedProgram(&machine, &linker, binaryPath, 1))
+        return 1;
+    freeLinker(&linker);
+    printf("%ld-line program, %d-byte image\n", stats.lines, machine.progLength);
+    freeMachine(&machine);
+
+    int same = compareFormats("assembled object", objPath, binaryObjPath, runs);
+    same = compareFormats("linked image", textPath, binaryPath, runs) && same;
+
+    unlink(sourcePath);
+    unlink(objPath);
+    unlink(binaryObjPath);
+    unlink(lstPath);
+    unlink(textPath);
+    unlink(binaryPath);
+    rmdir(dir);
+    return same ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+// Opcode lookup microbenchmark: perfect-hash lookupOpcode() against the
+// linear strcmp scan it replaced, run over the same full SIC/XE mnemonic set.
+//
+//   cc -O2 -o opcode_bench opcode_bench.c && ./opcode_bench [iterations]
+
+#include "bench.h"
+
+#define OPCODE_COUNT ((int)(sizeof(opcodeTable) / sizeof(opcodeTable[0])))
+#define MAX_WORKLOAD 256
+
+typedef struct
+{
+    char mnemonic[MAX_MNEMONIC];
+    int opcode;
+    int format;
+} LinearOpcodeEntry;
+
+LinearOpcodeEntry linearTable[2 * OPCODE_COUNT];
+int linearCount = 0;
+
+int linearLookupOpcode(const char *mnemonic, int *opcode, int *format)
+{
+    for (int i = 0; i < linearCount; i++)
+    {
+        if (strcmp(linearTable[i].mnemonic, mnemonic) == 0)
+        {
+            if (opcode != NULL)
+                *opcode = linearTable[i].opcode;
+            if (format != NULL)
+                *format = linearTable[i].format;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    char workload[MAX_WORKLOAD][MAX_MNEMONIC];
+    int workloadCount = 0;
+
+    for (int i = 0; i < OPCODE_COUNT; i++)
+    {
+        LinearOpcodeEntry *entry = &linearTable[linearCount++];
+        strcpy(entry->mnemonic, opcodeTable[i].mnemonic);
+        entry->opcode = opcodeTable[i].opcode;
+        entry->format = opcodeTable[i].format;
+        strcpy(workload[workloadCount++], entry->mnemonic);
+        if (opcodeTable[i].format == 3)
+        {
+            entry = &linearTable[linearCount++];
+            sprintf(entry->mnemonic, "+%s", opcodeTable[i].mnemonic);
+            entry->opcode = opcodeTable[i].opcode;
+            entry->format = 4;
+            strcpy(workload[workloadCount++], entry->mnemonic);
+        }
+    }
+
+    // Labels and directives reach lookupOpcode() from parseLine() as well.
+    const char *misses[] = {"START", "END", "BYTE", "WORD", "RESW", "RESB", "LOOP", "BUFFER", "+CLEAR"};
+    for (int i = 0; i < (int)(sizeof(misses) / sizeof(misses[0])); i++)
+        strcpy(workload[workloadCount++], misses[i]);
+
+    for (int i = 0; i < workloadCount; i++)
+    {
+        int hashOpcode = -1, hashFormat = -1, linearOpcode = -1, linearFormat = -1;
+        int hashFound = lookupOpcode(workload[i], &hashOpcode, &hashFormat);
+        int linearFound = linearLookupOpcode(workload[i], &linearOpcode, &linearFormat);
+        if (hashFound != linearFound || hashOpcode != linearOpcode || hashFormat != linearFormat)
+        {
+            fprintf(stderr, "Mismatch for '%s'\n", workload[i]);
+            return 1;
+        }
+    }
+
+    long lookups = iterations * workloadCount;
+    long found = 0;
+
+    double start = monotonicSeconds();
+    for (long n = 0; n < iterations; n++)
+        for (int i = 0; i < workloadCount; i++)
+            found += linearLookupOpcode(workload[i], NULL, NULL);
+    double linearTime = monotonicSeconds() - start;
+
+    start = monotonicSeconds();
+    for (long n = 0; n < iterations; n++)
+        for (int i = 0; i < workloadCount; i++)
+            found += lookupOpcode(workload[i], NULL, NULL);
+    double hashTime = monotonicSeconds() - start;
+
+    printf("%d mnemonics (%d linear entries), %ld lookups per table, %ld hits\n",
+           workloadCount, linearCount, lookups, found / 2);
+    printf("linear scan:  %10.2f M lookups/sec\n", lookups / linearTime / 1e6);
+    printf("perfect hash: %10.2f M lookups/sec (%.1fx)\n", lookups / hashTime / 1e6, linearTime / hashTime);
+    return 0;
+}
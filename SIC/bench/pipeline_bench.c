@@ -0,0 +1,298 @@
+// End-to-end assembler benchmark: generates synthetic programs with
+// workload_gen.c and times each phase of assembling them (reading the source,
+// pass one, pass two with its object and listing output). Every size runs in
+// its own child process so the peak RSS reported is that size's alone.
+//
+//   cc -O2 -pthread -o pipeline_bench pipeline_bench.c
+//   ./pipeline_bench [-sizes 1000,10000,...] [-runs n] [-j threads] [-save file] [-baseline file] [-threshold pct]
+//
+// -save writes the results as a baseline; -baseline compares against one and
+// exits non-zero when pass one, pass two or the total is slower by more than
+// the threshold (default 25%, best of 5 runs). baseline.txt in this directory
+// was recorded with the defaults; rerun -save after an intended change.
+
+#include "bench.h"
+
+#define WORKLOAD_NO_MAIN
+#include "workload_gen.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_SIZES 16
+#define PHASE_COUNT 4
+
+typedef struct
+{
+    double seconds[PHASE_COUNT];
+    long peakKilobytes[PHASE_COUNT];
+    long lines;
+    long bytes;
+    int diagnostics;
+} PhaseResult;
+
+typedef struct
+{
+    long lines;
+    int phase;
+    double linesPerSecond;
+} BaselineEntry;
+
+const char *phaseNames[PHASE_COUNT] = {"read", "pass1", "pass2", "total"};
+
+long peakKilobytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Runs in the child: one assembly of the source with every phase timed.
+void measureAssembly(const char *dir, const char *sourcePath, int threads, PhaseResult *result)
+{
+    char objPath[256], lstPath[256];
+    snprintf(objPath, sizeof(objPath), "%s/bench.obj", dir);
+    snprintf(lstPath, sizeof(lstPath), "%s/bench.lst", dir);
+
+    AssemblyContext ctx = {0};
+    ctx.sourcePath = sourcePath;
+    ctx.objPath = objPath;
+    ctx.lstPath = lstPath;
+    ctx.passOneThreads = threads;
+    ctx.passTwoThreads = threads;
+
+    double start = monotonicSeconds();
+    if (!openSourceFile(sourcePath, &ctx.source))
+        exit(1);
+    // Large sources are mapped lazily; fault them in so reading is its own phase.
+    volatile unsigned char sink = 0;
+    for (size_t offset = 0; offset < ctx.source.size; offset += 4096)
+        sink ^= (unsigned char)ctx.source.data[offset];
+    result->seconds[0] = monotonicSeconds() - start;
+    result->peakKilobytes[0] = peakKilobytes();
+
+    double phase = monotonicSeconds();
+    passOne(&ctx);
+    result->seconds[1] = monotonicSeconds() - phase;
+    result->peakKilobytes[1] = peakKilobytes();
+
+    phase = monotonicSeconds();
+    OutputBuffer objFile, lstFile;
+    if (!openOutput(&objFile, objPath) || !openOutput(&lstFile, lstPath))
+        exit(1);
+    passTwo(&ctx, &objFile, &lstFile);
+    if (!closeOutput(&objFile) || !closeOutput(&lstFile))
+        exit(1);
+    result->seconds[2] = monotonicSeconds() - phase;
+    result->peakKilobytes[2] = peakKilobytes();
+
+    result->seconds[3] = monotonicSeconds() - start;
+    result->peakKilobytes[3] = result->peakKilobytes[2];
+    result->lines = ctx.lines.count;
+    result->bytes = (long)ctx.source.size;
+    result->diagnostics = ctx.diagnostics.count;
+    printDiagnostics(&ctx, stderr, 1);
+    releaseAssembly(&ctx);
+    freeDiagnostics(&ctx.diagnostics);
+    unlink(objPath);
+    unlink(lstPath);
+}
+
+// Forks a child per run and keeps the fastest time for each phase.
+int benchmarkSize(const char *dir, const char *sourcePath, int threads, int runs, PhaseResult *best)
+{
+    for (int run = 0; run < runs; run++)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+            return 0;
+        pid_t child = fork();
+        if (child < 0)
+            return 0;
+        if (child == 0)
+        {
+            PhaseResult result = {0};
+            close(fds[0]);
+            measureAssembly(dir, sourcePath, threads, &result);
+            _exit(write(fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result) ? 0 : 1);
+        }
+
+        close(fds[1]);
+        PhaseResult result;
+        ssize_t got = read(fds[0], &result, sizeof(result));
+        close(fds[0]);
+        int status;
+        waitpid(child, &status, 0);
+        if (got != (ssize_t)sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            return 0;
+
+        if (run == 0)
+            *best = result;
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            if (result.seconds[p] < best->seconds[p])
+                best->seconds[p] = result.seconds[p];
+            if (result.peakKilobytes[p] > best->peakKilobytes[p])
+                best->peakKilobytes[p] = result.peakKilobytes[p];
+        }
+    }
+    return 1;
+}
+
+int loadBaseline(const char *path, BaselineEntry **entries)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening baseline '%s': %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    int count = 0, capacity = 0;
+    char line[256], phase[16];
+    long lines;
+    double linesPerSecond;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '#' || sscanf(line, "%ld %15s %lf", &lines, phase, &linesPerSecond) != 3)
+            continue;
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            if (strcmp(phase, phaseNames[p]) != 0)
+                continue;
+            if (count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 16;
+                *entries = (BaselineEntry *)realloc(*entries, capacity * sizeof(BaselineEntry));
+                if (!*entries)
+                {
+                    fprintf(stderr, "Memory allocation error for baseline\n");
+                    exit(1);
+                }
+            }
+            (*entries)[count].lines = lines;
+            (*entries)[count].phase = p;
+            (*entries)[count].linesPerSecond = linesPerSecond;
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    long sizes[MAX_SIZES] = {1000, 10000, 100000, 1000000};
+    int sizeCount = 4;
+    int runs = 5;
+    int threads = 1;
+    double threshold = 25;
+    const char *savePath = NULL;
+    const char *baselinePath = NULL;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-sizes") == 0)
+        {
+            sizeCount = 0;
+            for (char *item = strtok(argv[i + 1], ","); item && sizeCount < MAX_SIZES; item = strtok(NULL, ","))
+                sizes[sizeCount++] = atol(item);
+        }
+        else if (strcmp(argv[i], "-runs") == 0)
+            runs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-j") == 0)
+            threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-save") == 0)
+            savePath = argv[i + 1];
+        else if (strcmp(argv[i], "-baseline") == 0)
+            baselinePath = argv[i + 1];
+        else if (strcmp(argv[i], "-threshold") == 0)
+            threshold = atof(argv[i + 1]);
+        else
+        {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    if (runs < 1)
+        runs = 1;
+    if (threads < 1)
+        threads = 1;
+
+    BaselineEntry *baseline = NULL;
+    int baselineCount = baselinePath ? loadBaseline(baselinePath, &baseline) : 0;
+    FILE *save = NULL;
+    if (savePath && !(save = fopen(savePath, "w")))
+    {
+        fprintf(stderr, "Error creating baseline '%s': %s\n", savePath, strerror(errno));
+        return 1;
+    }
+    if (save)
+        fprintf(save, "# lines phase lines/s bytes/s peak-kb (best of %d, %d threads)\n", runs, threads);
+
+    char dir[] = "/tmp/pipeline_bench_XXXXXX";
+    if (!mkdtemp(dir))
+        return 1;
+    char sourcePath[256];
+    snprintf(sourcePath, sizeof(sourcePath), "%s/bench.asm", dir);
+
+    WorkloadMix mix = {30, 30, 20, 10, 25, 12345};
+    int regressions = 0;
+    printf("%9s %-6s %10s %12s %10s %9s\n", "lines", "phase", "ms", "lines/s", "MB/s", "peak KB");
+    for (int s = 0; s < sizeCount; s++)
+    {
+        FILE *source = fopen(sourcePath, "w");
+        if (!source)
+            return 1;
+        WorkloadStats stats;
+        generateWorkload(source, sizes[s], &mix, &stats);
+        fclose(source);
+
+        PhaseResult result;
+        if (!benchmarkSize(dir, sourcePath, threads, runs, &result))
+        {
+            fprintf(stderr, "Benchmark run failed for %ld lines\n", sizes[s]);
+            return 1;
+        }
+        if (result.diagnostics)
+            fprintf(stderr, "Warning: %d diagnostics for %ld lines\n", result.diagnostics, sizes[s]);
+
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            double linesPerSecond = result.lines / result.seconds[p];
+            double bytesPerSecond = result.bytes / result.seconds[p];
+            printf("%9ld %-6s %10.2f %12.0f %10.1f %9ld", sizes[s], phaseNames[p],
+                   result.seconds[p] * 1e3, linesPerSecond, bytesPerSecond / 1e6, result.peakKilobytes[p]);
+            if (save)
+                fprintf(save, "%ld %s %.0f %.0f %ld\n", sizes[s], phaseNames[p],
+                        linesPerSecond, bytesPerSecond, result.peakKilobytes[p]);
+
+            for (int b = 0; b < baselineCount; b++)
+            {
+                if (baseline[b].lines != sizes[s] || baseline[b].phase != p)
+                    continue;
+                double change = (linesPerSecond / baseline[b].linesPerSecond - 1) * 100;
+                printf("  %+6.1f%%", change);
+                // Reading is page-cache bound and too short to gate on.
+                if (p > 0 && change < -threshold)
+                {
+                    printf(" REGRESSION");
+                    regressions++;
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    unlink(sourcePath);
+    rmdir(dir);
+    if (save)
+        fclose(save);
+    free(baseline);
+    if (regressions)
+    {
+        printf("%d phases regressed by more than %.0f%% against %s\n", regressions, threshold, baselinePath);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Object record emitter benchmark: the buffered RecordWriter against the
+// sprintf/strcat/fprintf emitter it replaced, over a synthetic stream of
+// format 2/3/4 instructions and constants. Both write the same H/T/E text;
+// the outputs are compared byte for byte after the timed runs.
+//
+//   cc -O2 -pthread -o record_bench record_bench.c && ./record_bench [instructions]
+
+#include "bench.h"
+
+typedef struct
+{
+    int address;
+    int count;
+    unsigned char bytes[8];
+} BenchItem;
+
+void legacyEmit(FILE *objFile, const BenchItem *items, int itemCount, int start, int length)
+{
+    char textRecord[70] = "";
+    char objCode[20];
+    int textStart = 0;
+    int textLength = 0;
+
+    fprintf(objFile, "H%-6s%06X%06X\n", "BENCH", start, length);
+    for (int i = 0; i < itemCount; i++)
+    {
+        const BenchItem *item = &items[i];
+        if (textLength > 0 && (item->address != textStart + textLength || textLength + item->count > MAX_RECORD_BYTES))
+        {
+            char lengthText[9];
+            sprintf(lengthText, "%02X", textLength);
+            memcpy(&textRecord[7], lengthText, 2);
+            fprintf(objFile, "%s\n", textRecord);
+            textLength = 0;
+        }
+        if (textLength == 0)
+        {
+            sprintf(textRecord, "T%06X00", item->address);
+            textStart = item->address;
+        }
+        objCode[0] = '\0';
+        for (int b = 0; b < item->count; b++)
+            sprintf(objCode + 2 * b, "%02X", item->bytes[b]);
+        strcat(textRecord, objCode);
+        textLength += item->count;
+    }
+    if (textLength > 0)
+    {
+        char lengthText[9];
+        sprintf(lengthText, "%02X", textLength);
+        memcpy(&textRecord[7], lengthText, 2);
+        fprintf(objFile, "%s\n", textRecord);
+    }
+    fprintf(objFile, "E%06X\n", start);
+}
+
+void bufferedEmit(OutputBuffer *obj, OutputBuffer *lst, const BenchItem *items, int itemCount, int start, int length)
+{
+    RecordWriter writer = {0};
+    writer.obj = obj;
+    writer.lst = lst;
+    writeHeaderRecord(&writer, "BENCH", start, length);
+    for (int i = 0; i < itemCount; i++)
+        appendTextRecord(&writer, items[i].address, items[i].bytes, items[i].count);
+    flushTextRecord(&writer);
+    writeEndRecord(&writer, start);
+}
+
+int main(int argc, char *argv[])
+{
+    int itemCount = argc > 1 ? atoi(argv[1]) : 2000000;
+    BenchItem *items = (BenchItem *)malloc((size_t)itemCount * sizeof(BenchItem));
+    if (!items)
+        return 1;
+
+    // Mostly format 3, some format 2/4 and WORDs, and an occasional RESW gap
+    // so records break on address discontinuities as well as on length.
+    unsigned int seed = 12345;
+    int address = 0;
+    for (int i = 0; i < itemCount; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        unsigned int pick = (seed >> 16) % 100;
+        BenchItem *item = &items[i];
+        item->count = pick < 10 ? 2 : pick < 20 ? 4 : 3;
+        for (int b = 0; b < item->count; b++)
+            item->bytes[b] = (unsigned char)(seed >> (b * 7));
+        if (pick == 99)
+            address += 30;
+        item->address = address & 0xFFFFFF;
+        address += item->count;
+    }
+    int length = address & 0xFFFFFF;
+
+    char legacyPath[] = "/tmp/record_bench_legacy_XXXXXX";
+    char bufferedPath[] = "/tmp/record_bench_buffered_XXXXXX";
+    close(mkstemp(legacyPath));
+    close(mkstemp(bufferedPath));
+
+    FILE *legacyFile = fopen(legacyPath, "w");
+    double legacyTime = monotonicSeconds();
+    legacyEmit(legacyFile, items, itemCount, 0, length);
+    fclose(legacyFile);
+    legacyTime = monotonicSeconds() - legacyTime;
+
+    OutputBuffer obj, lst;
+    double bufferedTime = monotonicSeconds();
+    if (!openOutput(&obj, bufferedPath) || !openOutput(&lst, "/dev/null"))
+        return 1;
+    bufferedEmit(&obj, &lst, items, itemCount, 0, length);
+    closeOutput(&obj);
+    closeOutput(&lst);
+    bufferedTime = monotonicSeconds() - bufferedTime;
+
+    SourceFile legacyOut, bufferedOut;
+    if (!openSourceFile(legacyPath, &legacyOut) || !openSourceFile(bufferedPath, &bufferedOut))
+        return 1;
+    int same = legacyOut.size == bufferedOut.size && memcmp(legacyOut.data, bufferedOut.data, legacyOut.size) == 0;
+    double megabytes = bufferedOut.size / 1e6;
+    closeSourceFile(&legacyOut);
+    closeSourceFile(&bufferedOut);
+    unlink(legacyPath);
+    unlink(bufferedPath);
+    free(items);
+
+    if (!same)
+    {
+        fprintf(stderr, "Object output differs between emitters\n");
+        return 1;
+    }
+
+    // The buffered run also writes the listing copy of every record to /dev/null.
+    printf("%d instructions, %.1f MB of object records (identical)\n", itemCount, megabytes);
+    printf("sprintf/fprintf: %8.1f MB/s\n", megabytes / legacyTime);
+    printf("record writer:   %8.1f MB/s (%.1fx)\n", megabytes / bufferedTime, legacyTime / bufferedTime);
+    return 0;
+}
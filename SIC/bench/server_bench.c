@@ -0,0 +1,143 @@
+// Assembler server benchmark: the latency of many small assemblies when each
+// one execs the assembler binary, against the same requests sent to a
+// --server process over its Unix socket. The server runs in a forked child
+// of this program; the exec path needs the built binary.
+//
+//   cc -O2 -pthread -o server_bench server_bench.c
+//   ./server_bench <assembler binary> [requests] [lines]
+
+#include "bench.h"
+
+#define WORKLOAD_NO_MAIN
+#include "workload_gen.c"
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+void report(const char *name, double *latency, int count)
+{
+    double total = 0;
+    for (int i = 0; i < count; i++)
+        total += latency[i];
+    qsort(latency, count, sizeof(double), compareDoubles);
+    printf("%-8s %9.1f us mean %9.1f us p50 %9.1f us p99 %8.0f req/s\n", name, total / count * 1e6,
+           latency[count / 2] * 1e6, latency[count * 99 / 100] * 1e6, count / total);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <assembler binary> [requests] [lines]\n", argv[0]);
+        return 1;
+    }
+    int requests = argc > 2 ? atoi(argv[2]) : 500;
+    long lines = argc > 3 ? atol(argv[3]) : 200;
+    char dir[] = "/tmp/server_bench_XXXXXX";
+    if (requests < 1 || !mkdtemp(dir))
+        return 1;
+
+    char sourcePath[256], objPath[256], lstPath[256], socketPath[256];
+    snprintf(sourcePath, sizeof(sourcePath), "%s/small.asm", dir);
+    snprintf(objPath, sizeof(objPath), "%s/small.obj", dir);
+    snprintf(lstPath, sizeof(lstPath), "%s/small.lst", dir);
+    snprintf(socketPath, sizeof(socketPath), "%s/sic.sock", dir);
+    FILE *source = fopen(sourcePath, "w");
+    if (!source)
+        return 1;
+    WorkloadMix mix = {30, 30, 20, 10, 25, 12345};
+    WorkloadStats stats;
+    generateWorkload(source, lines, &mix, &stats);
+    fclose(source);
+
+    double *latency = (double *)malloc(requests * sizeof(double));
+    if (!latency)
+        return 1;
+
+    // Batch mode writes small.obj and small.lst into the directory, like the server.
+    char *spawnArgs[] = {argv[1], "-j", "1", "-o", dir, sourcePath, NULL};
+    int devNull = open("/dev/null", O_WRONLY);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, devNull, STDOUT_FILENO);
+    for (int i = 0; i < requests; i++)
+    {
+        double start = monotonicSeconds();
+        pid_t child;
+        int status;
+        if (posix_spawn(&child, argv[1], &actions, NULL, spawnArgs, environ) != 0 ||
+            waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "Running '%s' failed\n", argv[1]);
+            return 1;
+        }
+        latency[i] = monotonicSeconds() - start;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(devNull);
+    report("exec", latency, requests);
+
+    pid_t server = fork();
+    if (server == 0)
+        _exit(runServer(socketPath, 1) ? 0 : 1);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    int client = -1;
+    for (int attempt = 0; attempt < 200 && client < 0; attempt++)
+    {
+        client = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(client, (struct sockaddr *)&address, sizeof(address)) != 0)
+        {
+            close(client);
+            client = -1;
+            usleep(10000);
+        }
+    }
+    if (client < 0)
+    {
+        fprintf(stderr, "Cannot connect to the server on '%s'\n", socketPath);
+        return 1;
+    }
+
+    FILE *in = fdopen(client, "r");
+    FILE *out = fdopen(dup(client), "w");
+    char reply[MAX_LINE_LENGTH];
+    for (int i = 0; i < requests; i++)
+    {
+        double start = monotonicSeconds();
+        fprintf(out, "%s\t%s\t%s\n", sourcePath, objPath, lstPath);
+        fflush(out);
+        if (!fgets(reply, sizeof(reply), in) || strncmp(reply, "OK 0", 4) != 0)
+        {
+            fprintf(stderr, "Server request failed: %s", reply);
+            return 1;
+        }
+        latency[i] = monotonicSeconds() - start;
+    }
+    report("server", latency, requests);
+
+    fprintf(out, "SHUTDOWN\n");
+    fflush(out);
+    fgets(reply, sizeof(reply), in);
+    fclose(in);
+    fclose(out);
+    waitpid(server, NULL, 0);
+
+    printf("%d requests for a %ld-line source\n", requests, stats.lines);
+    unlink(sourcePath);
+    unlink(objPath);
+    unlink(lstPath);
+    rmdir(dir);
+    free(latency);
+    return 0;
+}
@@ -0,0 +1,195 @@
+// Hex and whitespace kernel benchmark: times byte-to-hex encoding, hex
+// decoding and token scanning at every SIMD level this CPU supports, checks
+// that each level produces the scalar result, then assembles a program of
+// long BYTE constants at each level.
+//
+//   cc -O2 -pthread -o simd_bench simd_bench.c
+//   ./simd_bench [megabytes] [runs] [constant lines]
+
+#include "bench.h"
+
+typedef struct
+{
+    unsigned char *bytes;
+    char *hex;
+    unsigned char *decoded;
+    char *text;
+    size_t size;
+} KernelData;
+
+// Token-like runs of 1 to 40 characters separated by blanks and newlines.
+void fillKernelData(KernelData *data, size_t size)
+{
+    data->size = size;
+    data->bytes = (unsigned char *)malloc(size);
+    data->hex = (char *)malloc(2 * size);
+    data->decoded = (unsigned char *)malloc(size);
+    data->text = (char *)malloc(size);
+    if (!data->bytes || !data->hex || !data->decoded || !data->text)
+    {
+        fprintf(stderr, "Memory allocation error for benchmark data\n");
+        exit(1);
+    }
+    unsigned int state = 12345;
+    for (size_t i = 0; i < size; i++)
+    {
+        state = state * 1103515245 + 12345;
+        data->bytes[i] = (unsigned char)(state >> 16);
+    }
+    for (size_t i = 0; i < size;)
+    {
+        state = state * 1103515245 + 12345;
+        size_t run = 1 + (state >> 16) % 40;
+        for (size_t j = 0; j < run && i < size; j++)
+            data->text[i++] = 'A' + j % 26;
+        if (i < size)
+            data->text[i++] = (state >> 8) % 8 == 0 ? '\n' : ' ';
+    }
+}
+
+// Walks the text the way tokenizeLine does and returns a checksum of the
+// token boundaries, so every level must find the same ones.
+size_t scanTokens(const char *text, size_t size)
+{
+    size_t sum = 0;
+    for (size_t pos = 0; pos < size;)
+    {
+        pos = skipBlanks(text, pos, size);
+        if (pos < size && text[pos] == '\n')
+            pos++;
+        else if (pos < size)
+        {
+            size_t end = findSpace(text, pos, size);
+            sum += end - pos;
+            pos = end;
+        }
+    }
+    return sum;
+}
+
+double timeKernel(int kernel, KernelData *data, int runs, size_t *check)
+{
+    double best = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        double start = monotonicSeconds();
+        if (kernel == 0)
+            encodeHex(data->hex, data->bytes, data->size);
+        else if (kernel == 1 && !parseHexBytes(data->hex, 2 * data->size, data->decoded))
+            exit(1);
+        else if (kernel == 2)
+            *check = scanTokens(data->text, data->size);
+        double seconds = monotonicSeconds() - start;
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    if (kernel == 0)
+        *check = contentHash(data->hex, 2 * data->size);
+    else if (kernel == 1)
+        *check = contentHash((const char *)data->decoded, data->size);
+    return best;
+}
+
+double timeAssembly(const char *dir, const char *sourcePath, int runs)
+{
+    char objPath[256], lstPath[256];
+    snprintf(objPath, sizeof(objPath), "%s/tables.obj", dir);
+    snprintf(lstPath, sizeof(lstPath), "%s/tables.lst", dir);
+    double best = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        AssemblyContext ctx = {0};
+        ctx.sourcePath = sourcePath;
+        ctx.objPath = objPath;
+        ctx.lstPath = lstPath;
+        ctx.passTwoThreads = 1;
+        double start = monotonicSeconds();
+        int ok = assembleFile(&ctx) && ctx.diagnostics.count == 0;
+        double seconds = monotonicSeconds() - start;
+        printDiagnostics(&ctx, stderr, 1);
+        releaseAssembly(&ctx);
+        freeDiagnostics(&ctx.diagnostics);
+        if (!ok)
+            exit(1);
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    unlink(objPath);
+    unlink(lstPath);
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *kernelNames[] = {"encode", "decode", "scan"};
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 16;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    int constants = argc > 3 ? atoi(argv[3]) : 100000;
+    if (megabytes < 1 || runs < 1 || constants < 1)
+        return 1;
+
+    KernelData data;
+    fillKernelData(&data, megabytes << 20);
+    int best = detectSimdLevel();
+    size_t scalarCheck[3] = {0};
+    int mismatches = 0;
+
+    printf("%-8s %-7s %10s %10s %8s\n", "kernel", "level", "ms", "MB/s", "speedup");
+    for (int kernel = 0; kernel < 3; kernel++)
+    {
+        double scalarSeconds = 0;
+        for (int level = SIMD_SCALAR; level <= best; level++)
+        {
+            size_t check;
+            atomic_store(&simdLevel, level);
+            double seconds = timeKernel(kernel, &data, runs, &check);
+            if (level == SIMD_SCALAR)
+            {
+                scalarSeconds = seconds;
+                scalarCheck[kernel] = check;
+            }
+            int same = check == scalarCheck[kernel];
+            mismatches += !same;
+            printf("%-8s %-7s %10.2f %10.0f %7.1fx%s\n", kernelNames[kernel], simdLevelNames[level], seconds * 1e3,
+                   megabytes / seconds, scalarSeconds / seconds, same ? "" : " MISMATCH");
+        }
+    }
+
+    char dir[] = "/tmp/simd_bench_XXXXXX";
+    if (!mkdtemp(dir))
+        return 1;
+    char sourcePath[256];
+    snprintf(sourcePath, sizeof(sourcePath), "%s/tables.asm", dir);
+    FILE *source = fopen(sourcePath, "w");
+    if (!source)
+        return 1;
+    fprintf(source, "TABLES  START   0\n");
+    for (int i = 0; i < constants; i++)
+    {
+        fprintf(source, "T%-6d BYTE    %c'", i, i % 2 ? 'X' : 'C');
+        for (int j = 0; j < 64; j++)
+            fputc(i % 2 ? hexDigits[(i + j) % 16] : 'A' + (i + j) % 26, source);
+        fputs("'\n", source);
+    }
+    fprintf(source, "        END     TABLES\n");
+    fclose(source);
+
+    printf("\nassembling %d 32-to-64-byte constants\n", constants);
+    double scalarSeconds = 0;
+    for (int level = SIMD_SCALAR; level <= best; level++)
+    {
+        atomic_store(&simdLevel, level);
+        double seconds = timeAssembly(dir, sourcePath, runs);
+        if (level == SIMD_SCALAR)
+            scalarSeconds = seconds;
+        printf("%-7s %10.2f ms %7.1fx\n", simdLevelNames[level], seconds * 1e3, scalarSeconds / seconds);
+    }
+
+    unlink(sourcePath);
+    rmdir(dir);
+    free(data.bytes);
+    free(data.hex);
+    free(data.decoded);
+    free(data.text);
+    return mismatches ? 1 : 0;
+}
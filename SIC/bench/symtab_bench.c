@@ -0,0 +1,128 @@
+// Symbol table benchmark: inserts and looks up machine-generated labels in the
+// Robin Hood symbol table, and in the fixed 211-bucket chained table it
+// replaced (pass --chained; that one is quadratic, so keep the count modest).
+//
+//   cc -O2 -o symtab_bench symtab_bench.c && ./symtab_bench [count] [--chained]
+
+#include "bench.h"
+
+#define CHAINED_TABLE_SIZE 211
+
+typedef struct ChainedSymbol
+{
+    char label[MAX_OPERAND];
+    int address;
+    struct ChainedSymbol *next;
+} ChainedSymbol;
+
+ChainedSymbol *chainedTable[CHAINED_TABLE_SIZE];
+
+unsigned int chainedHash(const char *str)
+{
+    unsigned int hash = 0;
+    while (*str)
+        hash = (hash << 3) + toupper(*str++);
+    return hash % CHAINED_TABLE_SIZE;
+}
+
+int chainedAddSymbol(const char *label, int address)
+{
+    unsigned int index = chainedHash(label);
+    for (ChainedSymbol *current = chainedTable[index]; current; current = current->next)
+        if (strcmp(current->label, label) == 0)
+            return 0;
+
+    ChainedSymbol *newSymbol = (ChainedSymbol *)malloc(sizeof(ChainedSymbol));
+    strcpy(newSymbol->label, label);
+    newSymbol->address = address;
+    newSymbol->next = chainedTable[index];
+    chainedTable[index] = newSymbol;
+    return 1;
+}
+
+int chainedLookupSymbol(const char *label)
+{
+    for (ChainedSymbol *current = chainedTable[chainedHash(label)]; current; current = current->next)
+        if (strcmp(current->label, label) == 0)
+            return current->address;
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 1000000;
+    int chained = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--chained") == 0)
+            chained = 1;
+        else
+            count = atoi(argv[i]);
+    }
+
+    // Labels shaped like code generator output: shared prefixes, dense suffixes.
+    char *labels = (char *)malloc((size_t)count * 16);
+    for (int i = 0; i < count; i++)
+        snprintf(labels + (size_t)i * 16, 16, "L%c%07d", 'A' + i % 26, i);
+
+    SymbolTable table = {0};
+    double start = monotonicSeconds();
+    for (int i = 0; i < count; i++)
+    {
+        const char *label = labels + (size_t)i * 16;
+        if (!insertSymbol(&table, label, strlen(label), i))
+            return 1;
+    }
+    double insertTime = monotonicSeconds() - start;
+
+    long sum = 0;
+    start = monotonicSeconds();
+    for (int i = 0; i < count; i++)
+    {
+        const char *label = labels + (size_t)i * 16;
+        sum += findSymbol(&table, label, strlen(label))->address;
+    }
+    sum += findSymbol(&table, "MISSING", 7) == NULL;
+    double lookupTime = monotonicSeconds() - start;
+
+    unsigned int maxProbe = 0;
+    double totalProbe = 0;
+    for (unsigned int i = 0; i < table.capacity; i++)
+    {
+        if (!table.entries[i].label)
+            continue;
+        unsigned int probe = (i - table.entries[i].hash) & (table.capacity - 1);
+        totalProbe += probe;
+        if (probe > maxProbe)
+            maxProbe = probe;
+    }
+
+    printf("robin hood: %d labels, capacity %u, load %.2f, avg probe %.2f, max probe %u\n",
+           count, table.capacity, (double)table.count / table.capacity,
+           totalProbe / table.count, maxProbe);
+    printf("  insert %8.1f ns/op  lookup %8.1f ns/op  (checksum %ld)\n",
+           insertTime * 1e9 / count, lookupTime * 1e9 / count, sum);
+    freeSymbolTable(&table);
+
+    if (chained)
+    {
+        start = monotonicSeconds();
+        for (int i = 0; i < count; i++)
+            chainedAddSymbol(labels + (size_t)i * 16, i);
+        insertTime = monotonicSeconds() - start;
+
+        sum = 0;
+        start = monotonicSeconds();
+        for (int i = 0; i < count; i++)
+            sum += chainedLookupSymbol(labels + (size_t)i * 16);
+        sum += chainedLookupSymbol("MISSING");
+        lookupTime = monotonicSeconds() - start;
+
+        printf("chained:    %d labels, %d buckets\n", count, CHAINED_TABLE_SIZE);
+        printf("  insert %8.1f ns/op  lookup %8.1f ns/op  (checksum %ld)\n",
+               insertTime * 1e9 / count, lookupTime * 1e9 / count, sum);
+    }
+
+    free(labels);
+    return 0;
+}
@@ -0,0 +1,300 @@
+// Synthetic SIC/XE workload generator. Emits a program of the requested
+// number of lines built from segments of code followed by a data area, with
+// a configurable share of labels, forward jumps, BASE-relative data
+// references, format 4 cross-segment references and BYTE/WORD data. Every
+// displacement is planned against the real layout, so the output assembles
+// without diagnostics (addresses wrap past 16 MB, around 5M lines).
+//
+//   cc -O2 -o workload_gen workload_gen.c
+//   ./workload_gen lines [-labels pct] [-forward pct] [-base pct] [-format4 pct] [-data pct] [-seed n] > big.asm
+//
+// Also included by pipeline_bench.c with WORKLOAD_NO_MAIN defined.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEGMENT_CODE_LINES 600
+#define MAX_SEGMENT_DATA_LINES 600
+
+typedef struct
+{
+    int labelPct;
+    int forwardPct;
+    int basePct;
+    int format4Pct;
+    int dataPct;
+    unsigned int seed;
+} WorkloadMix;
+
+typedef struct
+{
+    long lines;
+    long labels;
+    long forwardRefs;
+    long baseRefs;
+    long format4;
+    long dataLines;
+} WorkloadStats;
+
+typedef enum
+{
+    CODE_FORMAT2,
+    CODE_JUMP,
+    CODE_DATA,
+    CODE_IMMEDIATE,
+    CODE_FORMAT4,
+    CODE_RETURN
+} CodeKind;
+
+typedef struct
+{
+    unsigned char kind;
+    unsigned char labeled;
+    int address;
+} CodeLine;
+
+unsigned int workloadRandom(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+int workloadChance(unsigned int *state, int pct)
+{
+    return (int)(workloadRandom(state) % 100) < pct;
+}
+
+// Finds a labeled line within pc-relative range of line i, preferring the
+// requested direction; returns -1 when there is none.
+int findJumpTarget(const CodeLine *code, int count, int i, int forward)
+{
+    for (int pass = 0; pass < 2; pass++, forward = !forward)
+    {
+        int step = forward ? 1 : -1;
+        for (int j = i + step; j >= 0 && j < count; j += step)
+        {
+            int disp = code[j].address - (code[i].address + 3);
+            if (disp < -2048 || disp > 2047)
+                break;
+            if (code[j].labeled)
+                return j;
+        }
+    }
+    return -1;
+}
+
+void generateWorkload(FILE *out, long lines, const WorkloadMix *mix, WorkloadStats *stats)
+{
+    static const char *format2[] = {"CLEAR   X", "ADDR    S,A", "COMPR   A,S", "TIXR    T", "RMO     A,S"};
+    static const char *dataOps[] = {"LDA", "STA", "ADD", "SUB", "COMP", "LDX", "STX", "LDCH", "STCH", "LDT", "AND", "OR"};
+    static const char *jumpOps[] = {"J", "JEQ", "JGT", "JLT"};
+    static const char *immediateOps[] = {"LDA", "ADD", "COMP", "LDT", "LDS"};
+    static const char *far4Ops[] = {"+LDA", "+STA", "+ADD", "+JSUB"};
+
+    CodeLine code[SEGMENT_CODE_LINES];
+    int dataAddress[MAX_SEGMENT_DATA_LINES + 1];
+    unsigned int state = mix->seed ? mix->seed : 1;
+    int dataPct = mix->dataPct > 50 ? 50 : mix->dataPct;
+    long segmentLines = 2 + SEGMENT_CODE_LINES + SEGMENT_CODE_LINES * dataPct / (100 - dataPct);
+    long body = lines > 4 ? lines - 2 : 2;
+    int segments = (int)((body + segmentLines - 1) / segmentLines);
+    int address = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    fprintf(out, "BENCH   START   0\n");
+
+    for (int s = 0; s < segments; s++)
+    {
+        long remaining = body - (long)s * segmentLines;
+        long total = remaining < segmentLines ? remaining : segmentLines;
+        int codeCount = (int)((total - 2) * (100 - dataPct) / 100);
+        int dataCount = (int)(total - 2 - codeCount);
+        if (codeCount < 1)
+        {
+            codeCount = 1;
+            dataCount = total > 3 ? (int)total - 3 : 0;
+        }
+        if (dataCount < 1)
+            dataCount = 1;
+        if (dataCount > MAX_SEGMENT_DATA_LINES)
+            dataCount = MAX_SEGMENT_DATA_LINES;
+
+        // Plan the layout first so every operand can be chosen in range.
+        address += 4;
+        for (int i = 0; i < codeCount; i++)
+        {
+            CodeLine *line = &code[i];
+            unsigned int pick = workloadRandom(&state) % 100;
+            if (workloadChance(&state, mix->format4Pct))
+                line->kind = CODE_FORMAT4;
+            else if (pick < 10)
+                line->kind = CODE_FORMAT2;
+            else if (pick < 22)
+                line->kind = CODE_JUMP;
+            else if (pick < 32)
+                line->kind = CODE_IMMEDIATE;
+            else if (pick < 34)
+                line->kind = CODE_RETURN;
+            else
+                line->kind = CODE_DATA;
+            line->labeled = i == 0 || workloadChance(&state, mix->labelPct);
+            line->address = address;
+            address += line->kind == CODE_FORMAT2 ? 2 : line->kind == CODE_FORMAT4 ? 4 : 3;
+        }
+
+        char dataText[MAX_SEGMENT_DATA_LINES][32];
+        for (int j = 0; j < dataCount; j++)
+        {
+            unsigned int value = workloadRandom(&state);
+            dataAddress[j] = address;
+            switch (value % 4)
+            {
+            case 0:
+                snprintf(dataText[j], sizeof(dataText[j]), "WORD    %u", value % 100000);
+                address += 3;
+                break;
+            case 1:
+                snprintf(dataText[j], sizeof(dataText[j]), "BYTE    X'%02X%02X'", value >> 8 & 0xFF, value >> 16 & 0xFF);
+                address += 2;
+                break;
+            case 2:
+                snprintf(dataText[j], sizeof(dataText[j]), "BYTE    C'EOF%u'", value % 10);
+                address += 4;
+                break;
+            default:
+                snprintf(dataText[j], sizeof(dataText[j]), "RESW    1");
+                address += 3;
+                break;
+            }
+        }
+        dataAddress[dataCount] = address;
+
+        fprintf(out, "        +LDB    #S%dD0\n        BASE    S%dD0\n", s, s);
+        for (int i = 0; i < codeCount; i++)
+        {
+            CodeLine *line = &code[i];
+            unsigned int value = workloadRandom(&state);
+            char label[16] = "";
+            if (line->labeled)
+            {
+                snprintf(label, sizeof(label), "S%dC%d", s, i);
+                stats->labels++;
+            }
+
+            int kind = line->kind;
+            int target = -1;
+            if (kind == CODE_JUMP)
+            {
+                int forward = workloadChance(&state, mix->forwardPct);
+                target = findJumpTarget(code, codeCount, i, forward);
+                if (target < 0)
+                    kind = CODE_IMMEDIATE;
+                else if (target > i)
+                    stats->forwardRefs++;
+            }
+
+            fprintf(out, "%-8s ", label);
+            switch (kind)
+            {
+            case CODE_FORMAT2:
+                fprintf(out, "%s\n", format2[value % 5]);
+                break;
+            case CODE_JUMP:
+                fprintf(out, "%-7sS%dC%d\n", jumpOps[value % 4], s, target);
+                break;
+            case CODE_IMMEDIATE:
+                fprintf(out, "%-7s#%u\n", immediateOps[value % 5], value % 4096);
+                break;
+            case CODE_RETURN:
+                fputs("RSUB\n", out);
+                break;
+            case CODE_FORMAT4:
+            {
+                int other = (int)(workloadRandom(&state) % segments);
+                int forward = workloadChance(&state, mix->forwardPct);
+                if (forward && other <= s && s + 1 < segments)
+                    other = s + 1 + (int)(workloadRandom(&state) % (segments - s - 1));
+                else if (!forward && other > s)
+                    other = (int)(workloadRandom(&state) % (s + 1));
+                if (other > s)
+                    stats->forwardRefs++;
+                const char *op = far4Ops[value % 4];
+                fprintf(out, "%-7sS%d%s0\n", op, other, op[1] == 'J' ? "C" : "D");
+                stats->format4++;
+                break;
+            }
+            default:
+            {
+                // Items past pc + 2047 can only be reached through BASE.
+                int pc = line->address + 3;
+                int near = 0;
+                while (near < dataCount && dataAddress[near] - pc <= 2047)
+                    near++;
+                int wantBase = workloadChance(&state, mix->basePct);
+                int item;
+                if ((wantBase && near < dataCount) || near == 0)
+                    item = near + (int)(workloadRandom(&state) % (dataCount - near));
+                else
+                    item = (int)(workloadRandom(&state) % near);
+                if (item >= near)
+                    stats->baseRefs++;
+                stats->forwardRefs++;
+                const char *op = dataOps[value % 12];
+                int indexed = (value >> 8) % 10 == 0;
+                fprintf(out, "%-7sS%dD%d%s\n", op, s, item, indexed ? ",X" : "");
+                break;
+            }
+            }
+        }
+        for (int j = 0; j < dataCount; j++)
+            fprintf(out, "S%dD%-5d %s\n", s, j, dataText[j]);
+
+        stats->labels += dataCount;
+        stats->dataLines += dataCount;
+        stats->lines += 2 + codeCount + dataCount;
+    }
+
+    fprintf(out, "        END     BENCH\n");
+    stats->lines += 2;
+}
+
+#ifndef WORKLOAD_NO_MAIN
+int main(int argc, char *argv[])
+{
+    WorkloadMix mix = {30, 30, 20, 10, 25, 12345};
+    long lines = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-labels") == 0)
+            mix.labelPct = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-forward") == 0)
+            mix.forwardPct = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-base") == 0)
+            mix.basePct = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-format4") == 0)
+            mix.format4Pct = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-data") == 0)
+            mix.dataPct = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-seed") == 0)
+            mix.seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else
+            lines = atol(argv[i]);
+    }
+    if (lines <= 0)
+    {
+        fprintf(stderr, "Usage: %s lines [-labels pct] [-forward pct] [-base pct] [-format4 pct] [-data pct] [-seed n]\n", argv[0]);
+        return 1;
+    }
+
+    WorkloadStats stats;
+    generateWorkload(stdout, lines, &mix, &stats);
+    fprintf(stderr, "%ld lines: %ld labels, %ld forward refs, %ld base-relative, %ld format 4, %ld data\n",
+            stats.lines, stats.labels, stats.forwardRefs, stats.baseRefs, stats.format4, stats.dataLines);
+    return 0;
+}
+#endif
@@ -2,58 +2,1294 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIC_X86 1
+#endif
 
-#define MAX_SYMBOLS 1000
-#define MAX_OPCODES 200
-#define MAX_LINES 10000
 #define MAX_LINE_LENGTH 1024
 #define MAX_MNEMONIC 10
 #define MAX_OPERAND 50
-#define MAX_OBJECT_CODE 20
-#define HASH_TABLE_SIZE 211
+#define MAX_TOKENS 3
+#define PASS_ONE_CHUNK_BYTES (1024 * 1024)
+#define PASS_TWO_CHUNK_LINES 16384
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_RING_SLOTS 8
+#define SIMD_MIN_BYTES 16
+#define MAX_RECORD_BYTES 30
+#define REGISTER_COUNT 10
+#define DISASSEMBLY_REPORT_LIMIT 20
+#define COST_MEMORY_CYCLES 2
+#define COST_LOOP_WEIGHT 10
+#define COST_MAX_DEPTH 6
+#define SYMBOL_TABLE_INITIAL_CAPACITY 1024
+#define LITERAL_TABLE_INITIAL_CAPACITY 256
+#define MAX_MACRO_DEPTH 256
+#define MAX_MACRO_PARAMS 64
+#define MACRO_PIECE_TEXT -1
+#define MACRO_PIECE_UNIQUE -2
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define MMAP_THRESHOLD (64 * 1024)
+#define OPCODE_SLOTS 256
+#define OPCODE_HASH_SEED 0x23Du
+#define OPCODE_SEED_TRIES 65536
 
 #define DEFAULT_PROG_NAME "DEFAULT"
 #define DEFAULT_START_ADDR 0
+#define EXTERNAL_ADDRESS -2
+#define BINARY_OBJECT_MAGIC "SICB"
+#define BINARY_OBJECT_VERSION 2
+#define BINARY_HEADER_SIZE 16
+#define BINARY_RECORD_SIZE 12
+#define MAX_BINARY_TEXT 65536
+#define FORWARD_PENDING -3
+#define UNKNOWN_SHIFT 0x40000000
+#define MEMORY_SIZE (1 << 20)
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+#define RETURN_ADDRESS MEMORY_SIZE
 
-typedef struct Symbol
+// Hot-path counters cost a load and a not-taken branch unless --stats is
+// given; build with -DSIC_NO_STATS to drop them entirely.
+#ifdef SIC_NO_STATS
+#define COUNT_STAT(counter) ((void)0)
+#else
+#define COUNT_STAT(counter) \
+    (activeStats ? (void)atomic_fetch_add_explicit(&activeStats->counter, 1, memory_order_relaxed) : (void)0)
+#endif
+
+typedef enum
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_LEVEL_COUNT
+} SimdLevel;
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *head;
+} Arena;
+
+typedef struct
 {
-    char label[MAX_OPERAND];
+    const char *label;
+    unsigned int hash;
     int address;
-    struct Symbol *next;
 } Symbol;
 
 typedef struct
 {
-    char mnemonic[MAX_MNEMONIC];
-    char opcode[3];
-    int format;
+    Symbol *entries;
+    unsigned int capacity;
+    unsigned int count;
+    Arena labels;
+} SymbolTable;
+
+typedef struct
+{
+    const char *mnemonic;
+    unsigned char opcode;
+    unsigned char format;
 } OpcodeEntry;
 
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+} TextBuffer;
+
+// Text produced by macro expansion is addressed by offsets past the end of
+// the file, so token views can refer to either.
+typedef struct
+{
+    const char *data;
+    size_t size;
+    int mapped;
+    TextBuffer expansion;
+} SourceFile;
+
+typedef struct
+{
+    unsigned int offset;
+    unsigned int length;
+} TokenView;
+
+typedef enum
+{
+    DIR_NONE,
+    DIR_START,
+    DIR_END,
+    DIR_BYTE,
+    DIR_WORD,
+    DIR_RESW,
+    DIR_RESB,
+    DIR_BASE,
+    DIR_NOBASE,
+    DIR_CSECT,
+    DIR_EXTDEF,
+    DIR_EXTREF,
+    DIR_LTORG,
+    DIR_EQU,
+    DIR_ORG,
+    DIR_LITERAL,
+    DIR_COUNT
+} Directive;
+
+// What the operand is once the #, @ and ,X around it are set aside.
+typedef enum
+{
+    OPERAND_NONE,
+    OPERAND_NUMBER,
+    OPERAND_SYMBOL,
+    OPERAND_LITERAL,
+    OPERAND_EXPRESSION,
+    OPERAND_REGISTERS,
+    OPERAND_CHARS,
+    OPERAND_HEX
+} OperandKind;
+
+// A line is classified once, in parseLine; both passes switch on these
+// fields instead of looking at the mnemonic or operand text again.
+// addressing holds an AddressingMode, the n and i bits of format 3/4.
 typedef struct
 {
     int lineNum;
-    char label[MAX_OPERAND];
-    char opcode[MAX_MNEMONIC];
-    char operand[MAX_OPERAND];
     int address;
-    char objectCode[MAX_OBJECT_CODE];
-    char errorMsg[256];
+    TokenView label;
+    TokenView mnemonic;
+    TokenView operand;
+    unsigned char directive;
+    unsigned char opcode;
+    unsigned char format;
+    unsigned char addressing;
+    unsigned char indexed;
+    unsigned char operandKind;
 } LineInfo;
 
-Symbol *symbolTable[HASH_TABLE_SIZE] = {NULL};
-OpcodeEntry opcodeTable[MAX_OPCODES];
-int opcodeCount = 0;
+typedef struct
+{
+    LineInfo *lines;
+    int count;
+    int capacity;
+} LineStore;
+
+typedef struct
+{
+    int lineNum;
+    const char *message;
+} Diagnostic;
+
+typedef struct
+{
+    Diagnostic *items;
+    int count;
+    int capacity;
+    Arena text;
+} DiagnosticList;
+
+typedef struct
+{
+    TokenView name;
+    int lineNum;
+} ExternalName;
+
+// A literal operand, placed with its pool at the next LTORG, CSECT or END.
+// Literals of equal value share one entry within a pool.
+typedef struct
+{
+    const unsigned char *bytes;
+    unsigned int length;
+    unsigned int hash;
+    int pool;
+    int address;
+    int forwardRefs;
+    TokenView text;
+} Literal;
+
+// Literals in pool order, indexed by an open-addressed table of item + 1.
+typedef struct
+{
+    Literal *items;
+    int count;
+    int capacity;
+    unsigned int *slots;
+    unsigned int slotCapacity;
+    int pool;
+    int placed;
+    Arena bytes;
+} LiteralTable;
+
+// A macro body token is a run of pieces: source text, a positional parameter,
+// or the expansion number that makes $-labels unique.
+typedef struct
+{
+    TokenView text;
+    int param;
+} MacroPiece;
+
+typedef struct
+{
+    int firstPiece;
+    int tokenCount;
+    int pieceCount[MAX_TOKENS];
+} MacroLine;
+
+typedef struct
+{
+    int firstLine;
+    int lineCount;
+    int paramCount;
+} MacroDefinition;
+
+typedef struct
+{
+    int macro;
+    int nextLine;
+    int firstArg;
+    int argCount;
+    unsigned int id;
+    TokenView label;
+} MacroFrame;
+
+// NAMTAB maps names to definitions; DEFTAB is the lines and pieces arrays.
+// Expansion runs on a stack of frames whose arguments are views, so a nested
+// call costs only the text it produces.
+typedef struct
+{
+    SymbolTable names;
+    MacroDefinition *definitions;
+    int definitionCount;
+    int definitionCapacity;
+    MacroLine *lines;
+    int lineCount;
+    int lineCapacity;
+    MacroPiece *pieces;
+    int pieceCount;
+    int pieceCapacity;
+    MacroFrame *frames;
+    int depth;
+    int frameCapacity;
+    TokenView *args;
+    int argCount;
+    int argCapacity;
+    unsigned int expansions;
+} MacroProcessor;
+
+typedef enum
+{
+    EXPR_OK,
+    EXPR_UNDEFINED,
+    EXPR_EXTERNAL,
+    EXPR_SYNTAX,
+    EXPR_RELATIVE
+} ExpressionStatus;
+
+// relative is 1 for an address and 0 for an absolute value; a failed
+// evaluation names the offending term. EXPR_EXTERNAL with externals > 0
+// means the value is complete but for that many external symbols, each
+// added or subtracted on its own, which only a loader can supply; relative
+// may then also be -1, for an address subtracted from them.
+typedef struct
+{
+    int value;
+    int relative;
+    int externals;
+    TokenView term;
+} ExpressionValue;
+
+// An EQU keeps its own copy of the line: one-pass mode reuses line storage
+// before a forward definition resolves. line is the listing line to update,
+// or -1 when there is none.
+typedef struct
+{
+    TokenView label;
+    TokenView operand;
+    int lineNum;
+    int locctr;
+    int line;
+    int next;
+    int resolved;
+    TokenView waitingOn;
+} PendingEqu;
+
+// EQU definitions that refer forward form a dependency graph: each one waits
+// on the first undefined name in its expression, and defining that name
+// re-evaluates the definitions chained to it, so chains of any depth resolve
+// in topological order as pass one goes.
+typedef struct
+{
+    PendingEqu *items;
+    int count;
+    int capacity;
+    SymbolTable waiting;
+    int *ready;
+    int readyCount;
+    int readyCapacity;
+    int draining;
+} EquGraph;
+
+// Each control section has its own symbol scope; EXTREF names are entered
+// with EXTERNAL_ADDRESS. Absolute EQU names are also kept in absolutes, and
+// highest is the furthest location counter an ORG moved back from.
+typedef struct
+{
+    char name[MAX_OPERAND];
+    int firstLine;
+    int startAddress;
+    int length;
+    int highest;
+    SymbolTable symbols;
+    SymbolTable absolutes;
+    ExternalName *defs;
+    int defCount;
+    int defCapacity;
+    ExternalName *refs;
+    int refCount;
+    int refCapacity;
+} ControlSection;
+
+// What -i keeps of one stored line from the last clean assembly. The base
+// is the BASE address in effect entering the line, or -1.
+typedef struct
+{
+    int lineNum;
+    int address;
+    int baseAddress;
+    int objLength;
+    unsigned int bytesOffset;
+    unsigned char directive;
+    unsigned char labeled;
+    unsigned char modification;
+    unsigned char reserved;
+    unsigned int listingLength;
+    unsigned long long listingOffset;
+} CachedLine;
+
+// A T record and where its hex text sits in the object file and in the
+// record copy of the listing.
+typedef struct
+{
+    int address;
+    int count;
+    unsigned long long objOffset;
+    unsigned long long lstOffset;
+} CachedRecord;
+
+// A size-changing edit for shiftCachedAssembly: physical lines firstLine to
+// lastLine, now regionCount statements ending at regionEnd, replace cached
+// lines a to b - 1, which ran from oldStart to oldEnd. Everything from oldEnd
+// on moves by delta addresses and lineShift lines.
+typedef struct
+{
+    int firstLine;
+    int lastLine;
+    int lineShift;
+    int a;
+    int b;
+    int regionCount;
+    int regionEnd;
+    int oldStart;
+    int oldEnd;
+    int delta;
+} CacheShift;
+
+typedef struct
+{
+    char magic[8];
+    unsigned int sourceLines;
+    unsigned int lineCount;
+    unsigned int recordCount;
+    unsigned int symbolCount;
+    unsigned long long bytesSize;
+    unsigned long long symbolBytes;
+    unsigned long long objSize;
+    unsigned long long lstSize;
+    long long objModified;
+    long long lstModified;
+} CacheHeader;
+
+// The pass-one and pass-two results of a clean assembly, saved next to the
+// outputs so an edit that moves no addresses re-encodes only the lines that
+// changed and patches them into the existing object and listing files.
+typedef struct
+{
+    CacheHeader header;
+    uint64_t *lineHashes;
+    int sourceLines;
+    int hashCapacity;
+    CachedLine *lines;
+    int lineCount;
+    int lineCapacity;
+    CachedRecord *records;
+    int recordCount;
+    int recordCapacity;
+    TextBuffer bytes;
+    // What the last reassembly from the cache wrote, for --stats.
+    unsigned long long objWritten;
+    unsigned long long lstWritten;
+} AssemblyCache;
+
+typedef struct
+{
+    const char *sourcePath;
+    char *objPath;
+    char *lstPath;
+    SourceFile source;
+    LineStore lines;
+    ControlSection *sections;
+    int sectionCount;
+    int sectionCapacity;
+    int sectionsAllocated;
+    LiteralTable literals;
+    DiagnosticList diagnostics;
+    int execAddress;
+    int passOneThreads;
+    int passTwoThreads;
+    int failed;
+    int incremental;
+    int macroDefinitions;
+    int relax;
+    int relaxCandidates;
+    int relaxPromoted;
+    int relaxRounds;
+    int binaryObject;
+    int noListing;
+    int costReport;
+    int costBlocks;
+    int costLoops;
+    AssemblyCache *cache;
+    struct OnePassState *onePass;
+    int drainedLines;
+} AssemblyContext;
+
+typedef enum
+{
+    STAT_READ,
+    STAT_PASS_ONE,
+    STAT_PASS_TWO,
+    STAT_OUTPUT,
+    STAT_PHASE_COUNT
+} StatPhase;
+
+// Totals for --stats. The lookup counters are bumped from the hot paths,
+// possibly from several threads; the rest is merged once per file.
+typedef struct
+{
+    atomic_llong opcodeLookups;
+    atomic_llong symbolLookups;
+    pthread_mutex_t lock;
+    double wall[STAT_PHASE_COUNT];
+    double cpu[STAT_PHASE_COUNT];
+    int files;
+    long long lines;
+    long long sourceBytes;
+    long long objBytes;
+    long long lstBytes;
+    long long symbols;
+    long long symbolCapacity;
+    long long probeTotal;
+    unsigned int maxProbe;
+} AssemblyStats;
+
+typedef struct
+{
+    double wall[STAT_PHASE_COUNT];
+    double cpu[STAT_PHASE_COUNT];
+    double lastWall;
+    double lastCpu;
+} PhaseTimer;
+
+typedef struct
+{
+    int jobCount;
+    atomic_int nextJob;
+    void (*run)(void *arg, int job);
+    void *arg;
+} WorkerPool;
+
+typedef struct
+{
+    char **items;
+    int count;
+    int capacity;
+} PathList;
+
+// The --server state shared by its connection threads. Idle contexts are
+// kept, with their tables, for the next connection; clients lists the
+// sockets being served so a SHUTDOWN can end their reads.
+typedef struct
+{
+    int listener;
+    int sourceThreads;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    AssemblyContext **contexts;
+    int contextCount;
+    int contextCapacity;
+    int *clients;
+    int clientCount;
+    int clientCapacity;
+    int stopping;
+} AssemblyServer;
+
+typedef struct
+{
+    AssemblyServer *server;
+    int client;
+} ServerConnection;
+
+// A field the loader must relocate, or fill in from an external symbol
+// when symbol is not empty. With expression set, symbol is an operand
+// expression: each of its external terms gets a record with the term's
+// sign, and relative (1 or -1) adds one for the field's own section.
+typedef struct
+{
+    int line;
+    int address;
+    int halfBytes;
+    TokenView symbol;
+    unsigned char expression;
+    signed char relative;
+} Modification;
+
+// The location counter and section state carried from line to line.
+typedef struct
+{
+    ControlSection *section;
+    MacroProcessor macros;
+    EquGraph equs;
+    int locctr;
+    int programStarted;
+    int endOperand;
+    int orgReturn;
+} PassOneState;
+
+// A run of whole source lines parsed on a worker. The addresses of its lines
+// are relative to the chunk while simple is set, that is while every line
+// has a size of its own; length is then the size of the chunk.
+typedef struct
+{
+    size_t begin;
+    size_t end;
+    LineStore lines;
+    int lineCount;
+    int length;
+    int simple;
+    int stopped;
+} PassOneChunk;
+
+typedef struct
+{
+    const AssemblyContext *ctx;
+    PassOneChunk *chunks;
+} PassOneWave;
+
+typedef struct
+{
+    int first;
+    int last;
+    int useBase;
+    int baseAddress;
+    int section;
+    int pool;
+    TokenView baseName;
+    int onePass;
+    int forwardKind;
+    int forwardLiteral;
+    TokenView forwardName;
+    int needsFormat4;
+    Modification *mods;
+    int modCount;
+    int modCapacity;
+    TextBuffer objBytes;
+    TextBuffer listing;
+    unsigned int *objEnd;
+    unsigned int *listingEnd;
+    DiagnosticList diagnostics;
+} PassTwoChunk;
+
+typedef struct
+{
+    const AssemblyContext *ctx;
+    PassTwoChunk *chunks;
+    int listing;
+} PassTwoWave;
+
+typedef struct OutputBuffer
+{
+    int fd;
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t written;
+    int failed;
+    int pending;
+    struct OutputWriter *writer;
+} OutputBuffer;
+
+typedef struct
+{
+    OutputBuffer *out;
+    char *data;
+    size_t size;
+    size_t capacity;
+} OutputBlock;
+
+// Full output buffers queue in a bounded ring for one writer thread; the
+// thread hands written blocks back as spares, so the producer only waits
+// when OUTPUT_RING_SLOTS blocks are already queued.
+typedef struct OutputWriter
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    OutputBlock ring[OUTPUT_RING_SLOTS];
+    int head;
+    int count;
+    OutputBlock spares[OUTPUT_RING_SLOTS];
+    int spareCount;
+} OutputWriter;
+
+typedef enum
+{
+    REG_A = 0,
+    REG_X = 1,
+    REG_L = 2,
+    REG_B = 3,
+    REG_S = 4,
+    REG_T = 5,
+    REG_F = 6,
+    REG_PC = 8,
+    REG_SW = 9,
+    REG_COUNT = 16
+} Register;
+
+typedef enum
+{
+    CC_EQ = 0x00,
+    CC_LT = 0x40,
+    CC_GT = 0x80
+} ConditionCode;
+
+typedef enum
+{
+    MODE_IMMEDIATE = 1,
+    MODE_INDIRECT = 2,
+    MODE_SIMPLE = 3
+} AddressingMode;
+
+typedef enum
+{
+    ADDR_BASE = 1,
+    ADDR_INDEX = 2
+} AddressFlags;
+
+typedef enum
+{
+    KIND_DECODE = 0,
+    KIND_INVALID = 65,
+    KIND_COUNT = 66
+} InstructionKind;
+
+typedef enum
+{
+    HALT_JUMP_TO_SELF,
+    HALT_RETURN,
+    HALT_SVC,
+    HALT_STEP_LIMIT,
+    HALT_INVALID_OPCODE,
+    HALT_DIVIDE_BY_ZERO,
+    HALT_OUT_OF_RANGE,
+    HALT_COUNT
+} HaltStatus;
+
+// Format 2 instructions keep r1 in mode and r2 in flags.
+typedef struct
+{
+    unsigned char kind;
+    unsigned char length;
+    unsigned char mode;
+    unsigned char flags;
+    int target;
+} DecodedInstruction;
+
+typedef struct
+{
+    unsigned char *memory;
+    DecodedInstruction *decoded;
+    int reg[REG_COUNT];
+    double f;
+    int pc;
+    long long instructions;
+    unsigned char formats[64];
+    char progName[MAX_OPERAND];
+    int startAddress;
+    int progLength;
+    int execAddress;
+} Machine;
+
+typedef struct
+{
+    int address;
+    int halfBytes;
+    int value;
+} Fixup;
+
+typedef struct
+{
+    int address;
+    int length;
+} Segment;
+
+typedef struct
+{
+    char *const *paths;
+    SourceFile *modules;
+    int moduleCount;
+    int sectionCount;
+    SymbolTable estab;
+    Fixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    Segment *segments;
+    int segmentCount;
+    int segmentCapacity;
+} Linker;
+
+// One record of a binary object file: the fields of the matching text
+// record, with the name and (for T records) the raw bytes following the
+// fixed part. flags holds the sign of an M record and whether an E record
+// names an entry point. A binary M record covers count fields of the same
+// width, sign and symbol: data holds their addresses, and address the first.
+typedef struct
+{
+    int type;
+    int flags;
+    int address;
+    int length;
+    const char *name;
+    int nameLength;
+    const unsigned char *data;
+    int count;
+} BinaryRecord;
+
+// Records of either object format, one at a time: a text D or R record
+// yields one record per name and T record bytes are decoded into bytes.
+typedef struct
+{
+    const SourceFile *file;
+    int binary;
+    size_t pos;
+    size_t offset;
+    int lineNum;
+    const char *line;
+    size_t size;
+    size_t field;
+    TextBuffer bytes;
+    BinaryRecord group;
+    const char *error;
+} ObjectReader;
+
+typedef struct
+{
+    const char *mnemonic;
+    unsigned char format;
+} DisassemblyEntry;
+
+// A name tied to an address: a label from a D record or the listing, the
+// symbol an M record adds into a field (value holds its half-bytes), or a
+// BASE statement (value holds the base register, -1 when unknown).
+typedef struct
+{
+    int address;
+    int value;
+    const char *name;
+    int nameLength;
+} AddressName;
+
+// What starts at each byte of a disassembled section. Only bytes the
+// listing describes are known to start code or data; the rest are decoded
+// as instructions where they can be.
+typedef enum
+{
+    IMAGE_UNLOADED,
+    IMAGE_LOADED,
+    IMAGE_CODE,
+    IMAGE_DATA,
+    IMAGE_WORD
+} ImageByte;
+
+typedef struct
+{
+    const char *name;
+    int nameLength;
+    int start;
+    int length;
+    int execAddress;
+    unsigned char *bytes;
+    unsigned char *kinds;
+    int *symbolAt;
+    int capacity;
+    AddressName *symbols;
+    int symbolCount;
+    int symbolCapacity;
+    AddressName *fields;
+    int fieldCount;
+    int fieldCapacity;
+} DisassemblySection;
 
-void initializeOpcodeTable();
-int lookupOpcode(const char *mnemonic, char *opcode, int *format);
-int addSymbol(const char *label, int address);
-int lookupSymbol(const char *label);
-unsigned int hash(const char *str);
+// The listing read alongside the object, one section at a time.
+typedef struct
+{
+    SourceFile file;
+    const char *path;
+    size_t pos;
+    int lineNum;
+    TextBuffer bytes;
+    int statements;
+    int mismatches;
+} ListingCheck;
+
+typedef struct
+{
+    int address;
+    TokenView label;
+    TokenView mnemonic;
+    TokenView operand;
+    TokenView hex;
+    int directive;
+    int opcode;
+    char name[MAX_MNEMONIC];
+} ListingStatement;
+
+// One instruction of the --cost graph. Sites are kept in source order, and
+// a copy sorted by section and address finds the site a jump lands on.
+typedef struct
+{
+    int line;
+    int section;
+    int address;
+    int target;
+    int block;
+    int index;
+} CostSite;
+
+// A run of sites entered only at its first and left only after its last.
+// Its successors are edges[edgeStart .. edgeStart + edgeCount).
+typedef struct
+{
+    int first;
+    int count;
+    int cycles;
+    int depth;
+    long long weighted;
+    int edgeStart;
+    int edgeCount;
+} BasicBlock;
+
+// A natural loop: the blocks that reach one of the header's back edges
+// without passing through the header.
+typedef struct
+{
+    int header;
+    int backEdges;
+    int blocks;
+    int instructions;
+    int cycles;
+} CostLoop;
+
+typedef struct
+{
+    CostSite *sites;
+    int siteCount;
+    BasicBlock *blocks;
+    int blockCount;
+    int *edges;
+    int edgeCount;
+    int *predStart;
+    int *preds;
+    CostLoop *loops;
+    int loopCount;
+} CostGraph;
+
+// With binary set the object file gets binary records and the listing, if
+// any, still gets the text ones. M records wait in modRecords (text) and
+// binaryMods until the section ends.
+typedef struct
+{
+    OutputBuffer *obj;
+    OutputBuffer *lst;
+    char record[10 + 2 * MAX_RECORD_BYTES];
+    int recordBytes;
+    int recordAddress;
+    AssemblyCache *cache;
+    TextBuffer modRecords;
+    int binary;
+    TextBuffer text;
+    int textAddress;
+    TextBuffer binaryMods;
+    size_t modGroup;
+    int sections;
+    unsigned int textBytes;
+} RecordWriter;
+
+typedef enum
+{
+    FORWARD_PC_RELATIVE,
+    FORWARD_EXTENDED,
+    FORWARD_WORD,
+    FORWARD_BASE
+} ForwardKind;
+
+// A field encoded before its symbol or literal had an address. The chain
+// hangs off the symbol, whose address is FORWARD_PENDING - first node, or off
+// the literal; resolved nodes go back on a free list.
+typedef struct
+{
+    int address;
+    int lineNum;
+    int next;
+    unsigned char kind;
+    unsigned char flags;
+    TokenView base;
+} ForwardRef;
+
+// One-pass output goes to machine memory for load-and-go, otherwise to an
+// object file whose header length is patched once the program is complete.
+typedef struct OnePassState
+{
+    Machine *machine;
+    RecordWriter writer;
+    PassTwoChunk chunk;
+    ForwardRef *refs;
+    int refCount;
+    int refCapacity;
+    int freeRef;
+    int started;
+    size_t lengthOffset;
+} OnePassState;
+
+AssemblyStats *activeStats = NULL;
+OutputWriter *outputWriter = NULL;
+atomic_int simdLevel = -1;
+
+const char hexDigits[] = "0123456789ABCDEF";
+const char hexPairs[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+const char *haltReasons[HALT_COUNT] = {"jump to self", "return to caller", "SVC", "instruction limit reached",
+                                        "invalid opcode", "division by zero", "PC out of range"};
+const char *registerNames[REGISTER_COUNT] = {"A", "X", "L", "B", "S", "T", "F", "", "PC", "SW"};
+const char *simdLevelNames[SIMD_LEVEL_COUNT] = {"scalar", "sse2", "avx2"};
+const char *statPhaseNames[STAT_PHASE_COUNT] = {"read", "pass_one", "pass_two", "output"};
+const char *directiveNames[DIR_COUNT] = {"", "START", "END", "BYTE", "WORD", "RESW", "RESB", "BASE", "NOBASE",
+                                       "CSECT", "EXTDEF", "EXTREF", "LTORG", "EQU", "ORG", ""};
+const OpcodeEntry opcodeTable[] = {
+    {"ADD", 0x18, 3}, {"ADDF", 0x58, 3}, {"ADDR", 0x90, 2}, {"AND", 0x40, 3},
+    {"CLEAR", 0xB4, 2}, {"COMP", 0x28, 3}, {"COMPF", 0x88, 3}, {"COMPR", 0xA0, 2},
+    {"DIV", 0x24, 3}, {"DIVF", 0x64, 3}, {"DIVR", 0x9C, 2}, {"FIX", 0xC4, 1},
+    {"FLOAT", 0xC0, 1}, {"HIO", 0xF4, 1}, {"J", 0x3C, 3}, {"JEQ", 0x30, 3},
+    {"JGT", 0x34, 3}, {"JLT", 0x38, 3}, {"JSUB", 0x48, 3}, {"LDA", 0x00, 3},
+    {"LDB", 0x68, 3}, {"LDCH", 0x50, 3}, {"LDF", 0x70, 3}, {"LDL", 0x08, 3},
+    {"LDS", 0x6C, 3}, {"LDT", 0x74, 3}, {"LDX", 0x04, 3}, {"LPS", 0xD0, 3},
+    {"MUL", 0x20, 3}, {"MULF", 0x60, 3}, {"MULR", 0x98, 2}, {"NORM", 0xC8, 1},
+    {"OR", 0x44, 3}, {"RD", 0xD8, 3}, {"RMO", 0xAC, 2}, {"RSUB", 0x4C, 3},
+    {"SHIFTL", 0xA4, 2}, {"SHIFTR", 0xA8, 2}, {"SIO", 0xF0, 1}, {"SSK", 0xEC, 3},
+    {"STA", 0x0C, 3}, {"STB", 0x78, 3}, {"STCH", 0x54, 3}, {"STF", 0x80, 3},
+    {"STI", 0xD4, 3}, {"STL", 0x14, 3}, {"STS", 0x7C, 3}, {"STSW", 0xE8, 3},
+    {"STT", 0x84, 3}, {"STX", 0x10, 3}, {"SUB", 0x1C, 3}, {"SUBF", 0x5C, 3},
+    {"SUBR", 0x94, 2}, {"SVC", 0xB0, 2}, {"TD", 0xE0, 3}, {"TIO", 0xF8, 1},
+    {"TIX", 0x2C, 3}, {"TIXR", 0xB8, 2}, {"WD", 0xDC, 3}};
+
+// Indexed by the first byte of an instruction; built from opcodeTable, with
+// each format 3 opcode in the four entries its n and i bits select.
+DisassemblyEntry disassemblyTable[256];
+
+// Perfect hash over opcodeTable: opcodeHash() of every mnemonic lands in its
+// own slot, holding the entry index + 1. Filled before main by
+// initMnemonicSlots, which picks the seed.
+unsigned int opcodeHashSeed = OPCODE_HASH_SEED;
+unsigned char opcodeSlots[OPCODE_SLOTS];
+
+// The directives under the same hash, each slot holding its Directive.
+unsigned char directiveSlots[OPCODE_SLOTS];
+
+unsigned int opcodeHash(const char *mnemonic);
+int placeMnemonic(unsigned char *slots, const char *mnemonic, int value);
+int fillMnemonicSlots(void);
+void initMnemonicSlots(void);
+int lookupOpcode(const char *mnemonic, int *opcode, int *format);
+int registerNumber(const char *name);
+int parseRegisterOperands(const char *operand, size_t length, int opcode, int *r1, int *r2);
+void *arenaAlloc(Arena *arena, size_t size);
+char *arenaStrdup(Arena *arena, const char *str, size_t length);
+void arenaReset(Arena *arena);
+void arenaFree(Arena *arena);
+void growSymbolTable(SymbolTable *table);
+const char *insertSymbol(SymbolTable *table, const char *label, size_t length, int address);
+Symbol *findSymbol(const SymbolTable *table, const char *label, size_t length);
+void resetSymbolTable(SymbolTable *table);
+void freeSymbolTable(SymbolTable *table);
+LineInfo *appendLine(LineStore *store);
+void freeLineStore(LineStore *store);
+void addDiagnostic(DiagnosticList *diagnostics, int lineNum, const char *format, ...);
+void printDiagnostics(const AssemblyContext *ctx, FILE *out, int showPath);
+void freeDiagnostics(DiagnosticList *diagnostics);
+unsigned int hash(const char *str, size_t length);
+int labelsEqual(const char *a, const char *b, size_t length);
 void toUpperCase(char *str);
-void parseLine(char *line, LineInfo *lineInfo);
-int isCommentOrEmpty(const char *line);
-void passOne(FILE *srcFile, LineInfo lines[], int *lineCount, int *startAddress, int *progLength, char *progName);
-void passTwo(LineInfo lines[], int lineCount, int startAddress, int progLength, const char *progName, FILE *objFile, FILE *lstFile);
+int openSourceFile(const char *path, SourceFile *source);
+void closeSourceFile(SourceFile *source);
+const char *viewText(const SourceFile *source, TokenView view);
+int parseNumber(const char *text, size_t length, int base, int *value);
+size_t tokenizeLine(const SourceFile *source, size_t pos, TokenView tokens[], int *tokenCount);
+int lookupDirective(const char *mnemonic);
+int classifyMnemonic(const SourceFile *source, TokenView token, LineInfo *lineInfo);
+void classifyOperand(const SourceFile *source, LineInfo *lineInfo);
+TokenView operandTarget(const LineInfo *line);
+void parseLine(const SourceFile *source, const TokenView tokens[], int tokenCount, LineInfo *lineInfo);
+int lookupSymbolView(const AssemblyContext *ctx, int section, TokenView view);
+int isAbsoluteSymbol(const AssemblyContext *ctx, int section, TokenView view);
+int isExpression(const char *text, size_t length);
+int evaluateExpression(const AssemblyContext *ctx, int section, int locctr, TokenView view, ExpressionValue *result);
+void reportExpression(DiagnosticList *diagnostics, int lineNum, const SourceFile *source, TokenView view, int status,
+                      const ExpressionValue *result);
+int operandAddress(const AssemblyContext *ctx, int section, const LineInfo *line);
+void growArray(void **items, int count, int *capacity, size_t itemSize, const char *what);
+int viewEquals(const SourceFile *source, TokenView view, const char *text);
+char *reserveExpansion(SourceFile *source, size_t length);
+void addMacroPiece(MacroProcessor *macros, unsigned int offset, unsigned int length, int param);
+void defineMacro(AssemblyContext *ctx, MacroProcessor *macros, size_t *pos, int *lineNum, TokenView name, TokenView list);
+int callMacro(AssemblyContext *ctx, MacroProcessor *macros, const TokenView tokens[], int tokenCount, int lineNum);
+int expandMacroLine(AssemblyContext *ctx, MacroProcessor *macros, TokenView tokens[], int *tokenCount, int lineNum);
+int nextLine(AssemblyContext *ctx, MacroProcessor *macros, size_t *pos, TokenView tokens[], int *tokenCount, int *lineNum);
+void freeMacroProcessor(MacroProcessor *macros);
+int parseLiteral(const char *text, size_t length, unsigned char *bytes);
+unsigned int literalHash(const unsigned char *bytes, size_t length, int pool);
+Literal *findLiteral(const LiteralTable *table, const unsigned char *bytes, size_t length, int pool);
+void growLiteralTable(LiteralTable *table);
+void addLiteral(LiteralTable *table, TokenView text, const unsigned char *bytes, size_t length);
+int lookupLiteral(const AssemblyContext *ctx, int pool, TokenView view);
+int placeLiterals(AssemblyContext *ctx, int locctr, int lineNum);
+void resetLiteralTable(LiteralTable *table);
+void freeLiteralTable(LiteralTable *table);
+ControlSection *beginSection(AssemblyContext *ctx, int firstLine);
+void addExternalNames(AssemblyContext *ctx, ControlSection *section, const LineInfo *line);
+void endSection(AssemblyContext *ctx, ControlSection *section, int locctr);
+void defineSymbol(AssemblyContext *ctx, SymbolTable *symbols, TokenView label, int address, int lineNum);
+int reservedBytes(const AssemblyContext *ctx, int section, const LineInfo *line, int locctr, DiagnosticList *diagnostics);
+void defineEqu(AssemblyContext *ctx, EquGraph *graph, int section, const PendingEqu *equ, int node);
+void resolveWaitingEqus(AssemblyContext *ctx, EquGraph *graph, int section, TokenView name);
+void finishEqus(AssemblyContext *ctx, EquGraph *graph);
+void freeEquGraph(EquGraph *graph);
+int passOneLine(AssemblyContext *ctx, PassOneState *state, const LineInfo *parsed);
+void parseChunk(void *arg, int job);
+int passOneChunks(AssemblyContext *ctx, PassOneState *state, size_t *pos, int *lineNum);
+void passOne(AssemblyContext *ctx);
+void setSymbolAddress(AssemblyContext *ctx, int section, TokenView label, int address);
+int layoutLines(AssemblyContext *ctx);
+void relaxFormats(AssemblyContext *ctx);
+void reserveText(TextBuffer *buffer, size_t extra);
+int writeAll(int fd, const char *data, size_t length);
+void *outputWriterThread(void *arg);
+void startOutputWriter(void);
+int openOutput(OutputBuffer *out, const char *path);
+int flushOutput(OutputBuffer *out);
+int drainOutput(OutputBuffer *out);
+char *reserveOutput(OutputBuffer *out, size_t length);
+void writeOutput(OutputBuffer *out, const char *data, size_t length);
+int closeOutput(OutputBuffer *out);
+int patchOutput(OutputBuffer *out, size_t offset, const char *data, size_t length);
+void writeHex(char *out, unsigned int value, int digits);
+int detectSimdLevel(void);
+int currentSimdLevel(void);
+size_t encodeHexSse2(char *out, const unsigned char *bytes, size_t count);
+size_t encodeHexAvx2(char *out, const unsigned char *bytes, size_t count);
+long decodeHexSse2(const char *text, size_t length, unsigned char *bytes);
+long decodeHexAvx2(const char *text, size_t length, unsigned char *bytes);
+size_t findSpaceSse2(const char *data, size_t pos, size_t size, int blanksOnly);
+size_t findSpaceAvx2(const char *data, size_t pos, size_t size, int blanksOnly);
+size_t findSpace(const char *data, size_t pos, size_t size);
+size_t skipBlanks(const char *data, size_t pos, size_t size);
+void encodeHex(char *out, const unsigned char *bytes, size_t count);
+char *writeField(char *out, const char *text, int length, int width, int upper);
+void writeRecord(RecordWriter *writer, const char *record, size_t length);
+void writeHeaderRecord(RecordWriter *writer, const char *name, int start, int length);
+void flushTextLine(RecordWriter *writer);
+void flushTextRecord(RecordWriter *writer);
+void flushBinaryText(RecordWriter *writer);
+void appendTextRecord(RecordWriter *writer, int address, const unsigned char *bytes, int count);
+void writeEndRecord(RecordWriter *writer, int address);
+void finishRecords(RecordWriter *writer);
+void freeRecordWriter(RecordWriter *writer);
+int hexDigitValue(unsigned char c);
+int parseHexBytes(const char *text, size_t length, unsigned char *bytes);
+int resolveTarget(const AssemblyContext *ctx, PassTwoChunk *chunk, TokenView view, int literal, int kind, int placeholder);
+int encodeLine(const AssemblyContext *ctx, PassTwoChunk *chunk, const LineInfo *currentLine, unsigned char *objCode, int *objLength,
+               Modification *mod);
+void formatListingLine(TextBuffer *listing, const SourceFile *source, const LineInfo *currentLine,
+                       const unsigned char *objCode, int objLength, int cycles);
+void encodeChunk(void *arg, int job);
+void writeSectionHeader(const AssemblyContext *ctx, RecordWriter *writer, int index);
+void writeExternalRecords(const AssemblyContext *ctx, RecordWriter *writer, int index);
+void writeModificationRecord(RecordWriter *writer, int address, int halfBytes, char sign, const char *name, int nameLength);
+void appendModificationRecord(RecordWriter *writer, const AssemblyContext *ctx, int section, const Modification *mod);
+void writeModificationRecords(RecordWriter *writer);
+void finishSection(RecordWriter *writer, int execAddress);
+void passTwo(AssemblyContext *ctx, OutputBuffer *objFile, OutputBuffer *lstFile);
+int instructionCycles(const LineInfo *line);
+int isJump(int opcode);
+int jumpTarget(const AssemblyContext *ctx, int section, const LineInfo *line);
+int compareCostSites(const void *a, const void *b);
+int findCostSite(const CostSite *sorted, int count, int section, int address);
+void buildCostGraph(const AssemblyContext *ctx, CostGraph *graph);
+void findCostLoops(CostGraph *graph);
+int compareBlockHeat(const void *a, const void *b);
+char *writeCount(char *out, long long value, int width);
+char *writeCostSite(char *out, const AssemblyContext *ctx, const CostSite *site);
+void printOutput(OutputBuffer *out, const char *format, ...);
+void writeCostReport(AssemblyContext *ctx, OutputBuffer *out);
+void freeCostGraph(CostGraph *graph);
+void storeOnePassBytes(AssemblyContext *ctx, int lineNum, int address, const unsigned char *bytes, int count);
+void addForwardRef(AssemblyContext *ctx, const LineInfo *line, const unsigned char *objCode);
+void patchForwardRef(AssemblyContext *ctx, const ForwardRef *ref, TokenView name, int value);
+void resolveForwardRefs(AssemblyContext *ctx, int head, TokenView name, int value);
+void startOnePassOutput(AssemblyContext *ctx);
+void emitOnePassLines(AssemblyContext *ctx);
+void finishOnePass(AssemblyContext *ctx);
+int assembleOnePass(AssemblyContext *ctx, Machine *machine);
+uint64_t contentHash(const char *text, size_t length);
+void hashSourceLines(const SourceFile *source, AssemblyCache *cache);
+void cacheLine(AssemblyCache *cache, const LineInfo *line, int baseAddress, const unsigned char *objCode, int objLength,
+               int modification, unsigned long long listingOffset, unsigned int listingLength);
+long long fileModified(const char *path, unsigned long long *size);
+int writeAssemblyCache(const AssemblyContext *ctx, AssemblyCache *cache, const char *path);
+int loadAssemblyCache(AssemblyContext *ctx, AssemblyCache *cache, const char *path);
+void freeAssemblyCache(AssemblyCache *cache);
+int statementSize(const AssemblyContext *ctx, const LineInfo *line);
+void patchCachedBytes(const AssemblyCache *cache, int objFd, int lstFd, char *listing, int address,
+                      const unsigned char *bytes, int count);
+int symbolShift(const AssemblyContext *ctx, const CacheShift *shift, TokenView name);
+int operandShift(const AssemblyContext *ctx, const CacheShift *shift, const LineInfo *line, int lineShift);
+int readObjectBounds(const char *path, char *name, size_t nameSize, int *start, int *length, int *execAddress);
+int shiftCachedAssembly(AssemblyContext *ctx, AssemblyCache *cache, const char *path, CacheShift *shift,
+                        PhaseTimer *timer);
+int reassembleFromCache(AssemblyContext *ctx, AssemblyCache *cache, const char *path, PhaseTimer *timer);
+int assembleIncremental(AssemblyContext *ctx);
+int assembleFile(AssemblyContext *ctx);
+int writeListing(AssemblyContext *ctx, const char *path);
+void resetAssembly(AssemblyContext *ctx);
+void releaseAssembly(AssemblyContext *ctx);
+void *workerThread(void *arg);
+void runWorkerPool(int threadCount, int jobCount, void (*run)(void *arg, int job), void *arg);
+void assembleJob(void *arg, int job);
+char *outputPath(const char *sourcePath, const char *outputDir, const char *extension);
+int compareObjectPaths(const void *a, const void *b);
+int reportOutputCollisions(AssemblyContext *contexts, int count);
+void appendPath(PathList *list, const char *path);
+int readManifest(const char *path, PathList *list);
+int serveClient(AssemblyContext *ctx, int client);
+void stopServer(AssemblyServer *server);
+void *serveConnection(void *arg);
+int runServer(const char *socketPath, int sourceThreads);
+double monotonicSeconds(void);
+double cpuSeconds(void);
+void startPhaseTimer(PhaseTimer *timer);
+void endPhase(PhaseTimer *timer, StatPhase phase);
+void recordAssemblyStats(const AssemblyContext *ctx, const PhaseTimer *timer, const OutputBuffer *objFile,
+                         const OutputBuffer *lstFile);
+void addAssemblyStats(const AssemblyContext *ctx, const PhaseTimer *timer, long long lines, long long objBytes,
+                      long long lstBytes);
+void printStats(const AssemblyStats *stats, FILE *out, int json);
+int signExtend24(int value);
+int readWord(const unsigned char *memory, int address);
+void writeWord(Machine *machine, int address, int value);
+void invalidateDecoded(Machine *machine, int address, int length);
+double readFloat(const unsigned char *memory, int address);
+void writeFloat(Machine *machine, int address, double value);
+int initMachine(Machine *machine);
+void freeMachine(Machine *machine);
+const char *nextRecord(const SourceFile *file, size_t *pos, size_t *length, int *lineNum);
+size_t trimmedLength(const char *text, size_t length);
+void addSegment(Linker *linker, int address, int length);
+void addFixup(Linker *linker, int address, int halfBytes, int value);
+int scanBinaryModule(Machine *machine, Linker *linker, int m, int pass, int *csaddr, int *sections);
+int scanObjectModules(Machine *machine, Linker *linker, int pass);
+void applyFixups(Machine *machine, const Linker *linker);
+int linkObjectModules(Machine *machine, Linker *linker, char *const paths[], int count);
+void freeLinker(Linker *linker);
+int writeLinkedProgram(const Machine *machine, const Linker *linker, const char *path, int binary);
+void putLittle32(unsigned char *out, unsigned int value);
+unsigned int getLittle32(const unsigned char *in);
+int isBinaryObject(const SourceFile *file);
+int nextBinaryRecord(const SourceFile *file, size_t *pos, BinaryRecord *record);
+void writeBinaryHeader(OutputBuffer *out, int sections, unsigned int textBytes);
+void writeBinaryRecord(OutputBuffer *out, int type, int flags, const char *name, int nameLength, int address, int length,
+                       const unsigned char *data);
+int textToBinaryObject(const SourceFile *file, const char *path, OutputBuffer *out);
+int binaryToTextObject(const SourceFile *file, const char *path, OutputBuffer *out);
+int convertObjectFile(const char *inPath, const char *outPath, int toBinary);
+int nextObjectRecord(ObjectReader *reader, BinaryRecord *record);
+void reportObjectError(const ObjectReader *reader, const char *path);
+void initDisassemblyTable(void);
+void addAddressName(AddressName **names, int *count, int *capacity, int address, int value, const char *name,
+                    int nameLength);
+int compareAddressNames(const void *a, const void *b);
+const AddressName *findAddressName(const AddressName *names, int count, int address);
+void indexSymbols(DisassemblySection *section);
+const AddressName *symbolAt(const DisassemblySection *section, int address);
+int loadObjectSection(ObjectReader *reader, const char *path, DisassemblySection *section);
+int instructionFits(const DisassemblySection *section, int offset, int length);
+char *writeDecimal(char *out, int value, int sign);
+char *writeTarget(char *out, const DisassemblySection *section, int target, int address, int relative);
+int disassembleInstruction(const DisassemblySection *section, int offset, int base, char *mnemonic, char *operand,
+                           int *target);
+size_t listingField(const SourceFile *file, const char *line, size_t pos, size_t size, int width, TokenView *view);
+int parseListingStatement(const SourceFile *file, const char *line, size_t size, ListingStatement *statement);
+void reportListingMismatch(ListingCheck *check, const char *format, ...);
+int checkListingSection(ListingCheck *check, DisassemblySection *section);
+void writeDisassemblyLine(OutputBuffer *out, int address, const AddressName *label, const char *mnemonic,
+                          const char *operand, const unsigned char *bytes, int count);
+void disassembleSection(const DisassemblySection *section, OutputBuffer *out, int first, int *instructions,
+                        int *dataBytes);
+int disassembleObject(const char *objPath, const char *outPath, const char *lstPath);
+void decodeInstruction(const Machine *machine, int address, DecodedInstruction *decoded);
+int effectiveAddress(const DecodedInstruction *d, const int *reg);
+int operandValue(const DecodedInstruction *d, const unsigned char *memory, const int *reg);
+int storeAddress(const DecodedInstruction *d, const unsigned char *memory, const int *reg);
+int conditionCode(int left, int right);
+int runMachine(Machine *machine, long long limit);
+int runProgram(Machine *machine, long long limit);
+int linkObjectProgram(char *const paths[], int count, const char *linkPath, int binary, int run, long long limit);
 void trim(char *str);
 
 void trim(char *str)
@@ -67,12 +1303,37 @@ void trim(char *str)
         str[i] = '\0';
 }
 
-unsigned int hash(const char *str)
+unsigned int hash(const char *str, size_t length)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = str[i];
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        hash = (hash ^ c) * 0x100000001B3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return (unsigned int)hash;
+}
+
+int labelsEqual(const char *a, const char *b, size_t length)
 {
-    unsigned int hash = 0;
-    while (*str)
-        hash = (hash << 3) + toupper(*str++);
-    return hash % HASH_TABLE_SIZE;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char x = a[i], y = b[i];
+        if (x == y)
+            continue;
+        if (x >= 'a' && x <= 'z')
+            x -= 'a' - 'A';
+        if (y >= 'a' && y <= 'z')
+            y -= 'a' - 'A';
+        if (x != y)
+            return 0;
+    }
+    return 1;
 }
 
 void toUpperCase(char *str)
@@ -81,610 +1342,8105 @@ void toUpperCase(char *str)
         *str = toupper(*str);
 }
 
-void initializeOpcodeTable()
+unsigned int opcodeHash(const char *mnemonic)
+{
+    unsigned int hash = opcodeHashSeed;
+    while (*mnemonic)
+        hash = (hash ^ (unsigned char)*mnemonic++) * 16777619u;
+    return (hash ^ (hash >> 15)) & (OPCODE_SLOTS - 1);
+}
+
+int placeMnemonic(unsigned char *slots, const char *mnemonic, int value)
+{
+    unsigned int slot = opcodeHash(mnemonic);
+    if (slots[slot] != 0)
+        return 0;
+    slots[slot] = (unsigned char)value;
+    return 1;
+}
+
+// Fills both tables under the current seed; 0 if two opcodes or two
+// directives collide.
+int fillMnemonicSlots(void)
+{
+    memset(opcodeSlots, 0, sizeof(opcodeSlots));
+    memset(directiveSlots, 0, sizeof(directiveSlots));
+    for (size_t i = 0; i < sizeof(opcodeTable) / sizeof(opcodeTable[0]); i++)
+    {
+        if (!placeMnemonic(opcodeSlots, opcodeTable[i].mnemonic, (int)i + 1))
+            return 0;
+    }
+    for (int directive = DIR_NONE + 1; directive < DIR_COUNT; directive++)
+    {
+        if (directiveNames[directive][0] != '\0' && !placeMnemonic(directiveSlots, directiveNames[directive], directive))
+            return 0;
+    }
+    return 1;
+}
+
+// Tries seeds from OPCODE_HASH_SEED up until every opcode and every
+// directive has a slot of its own in its table, so an entry added to either
+// can never make lookups miss.
+// Runs before main, and before the benchmarks' mains that include this file.
+__attribute__((constructor)) void initMnemonicSlots(void)
+{
+    for (unsigned int seed = OPCODE_HASH_SEED; seed < OPCODE_HASH_SEED + OPCODE_SEED_TRIES; seed++)
+    {
+        opcodeHashSeed = seed;
+        if (fillMnemonicSlots())
+            return;
+    }
+    fprintf(stderr, "No collision-free opcode hash seed in %d tries\n", OPCODE_SEED_TRIES);
+    exit(1);
+}
+
+int lookupOpcode(const char *mnemonic, int *opcode, int *format)
+{
+    int extended = 0;
+    if (mnemonic[0] == '+')
+    {
+        extended = 1;
+        mnemonic++;
+    }
+
+    COUNT_STAT(opcodeLookups);
+    int index = opcodeSlots[opcodeHash(mnemonic)];
+    if (index == 0)
+        return 0;
+
+    const OpcodeEntry *entry = &opcodeTable[index - 1];
+    if (strcmp(entry->mnemonic, mnemonic) != 0)
+        return 0;
+    if (extended && entry->format != 3)
+        return 0;
+
+    if (opcode != NULL)
+        *opcode = entry->opcode;
+    if (format != NULL)
+        *format = extended ? 4 : entry->format;
+    return 1;
+}
+
+int registerNumber(const char *name)
+{
+    for (int i = 0; i < REGISTER_COUNT; i++)
+    {
+        if (registerNames[i][0] != '\0' && strcmp(registerNames[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int parseRegisterOperands(const char *operand, size_t length, int opcode, int *r1, int *r2)
+{
+    char first[MAX_OPERAND] = "";
+    char second[MAX_OPERAND] = "";
+    const char *comma = (const char *)memchr(operand, ',', length);
+    size_t firstLength = comma ? (size_t)(comma - operand) : length;
+    size_t secondLength = comma ? length - firstLength - 1 : 0;
+    if (firstLength >= sizeof(first) || secondLength >= sizeof(second))
+        return 0;
+    memcpy(first, operand, firstLength);
+    first[firstLength] = '\0';
+    if (comma)
+    {
+        memcpy(second, comma + 1, secondLength);
+        second[secondLength] = '\0';
+    }
+    toUpperCase(first);
+    toUpperCase(second);
+
+    *r1 = 0;
+    *r2 = 0;
+    if (opcode == 0xB0) // SVC n
+    {
+        *r1 = atoi(first);
+        return isdigit((unsigned char)first[0]) && *r1 <= 15 && second[0] == '\0';
+    }
+
+    *r1 = registerNumber(first);
+    if (*r1 < 0)
+        return 0;
+    if (opcode == 0xA4 || opcode == 0xA8) // SHIFTL/SHIFTR r1,n
+    {
+        int count = atoi(second);
+        *r2 = count - 1;
+        return isdigit((unsigned char)second[0]) && count >= 1 && count <= 16;
+    }
+    if (second[0] == '\0')
+        return 1;
+    *r2 = registerNumber(second);
+    return *r2 >= 0;
+}
+
+void *arenaAlloc(Arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = arena->head;
+    if (!block || block->size - block->used < size)
+    {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + blockSize);
+        if (!block)
+        {
+            fprintf(stderr, "Memory allocation error for arena block\n");
+            exit(1);
+        }
+        block->used = 0;
+        block->size = blockSize;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arenaStrdup(Arena *arena, const char *str, size_t length)
+{
+    char *copy = (char *)arenaAlloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Keeps the newest block for reuse and frees the others.
+void arenaReset(Arena *arena)
+{
+    ArenaBlock *block = arena->head;
+    if (!block)
+        return;
+    block->used = 0;
+    ArenaBlock *next = block->next;
+    block->next = NULL;
+    while (next)
+    {
+        block = next->next;
+        free(next);
+        next = block;
+    }
+}
+
+void arenaFree(Arena *arena)
+{
+    ArenaBlock *block = arena->head;
+    while (block)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+void growSymbolTable(SymbolTable *table)
+{
+    Symbol *oldEntries = table->entries;
+    unsigned int oldCapacity = table->capacity;
+
+    table->capacity = oldCapacity ? oldCapacity * 2 : SYMBOL_TABLE_INITIAL_CAPACITY;
+    table->entries = (Symbol *)calloc(table->capacity, sizeof(Symbol));
+    if (!table->entries)
+    {
+        fprintf(stderr, "Memory allocation error for symbol table\n");
+        exit(1);
+    }
+    table->count = 0;
+
+    for (unsigned int i = 0; i < oldCapacity; i++)
+    {
+        if (!oldEntries[i].label)
+            continue;
+        Symbol entry = oldEntries[i];
+        unsigned int mask = table->capacity - 1;
+        unsigned int index = entry.hash & mask;
+        unsigned int distance = 0;
+        while (table->entries[index].label)
+        {
+            unsigned int existing = (index - table->entries[index].hash) & mask;
+            if (existing < distance)
+            {
+                Symbol displaced = table->entries[index];
+                table->entries[index] = entry;
+                entry = displaced;
+                distance = existing;
+            }
+            index = (index + 1) & mask;
+            distance++;
+        }
+        table->entries[index] = entry;
+        table->count++;
+    }
+    free(oldEntries);
+}
+
+const char *insertSymbol(SymbolTable *table, const char *label, size_t length, int address)
+{
+    if ((table->count + 1) * 8 > table->capacity * 7)
+        growSymbolTable(table);
+
+    unsigned int mask = table->capacity - 1;
+    unsigned int labelHash = hash(label, length);
+    unsigned int index = labelHash & mask;
+    unsigned int distance = 0;
+    Symbol entry = {NULL, labelHash, address};
+    const char *stored = NULL;
+
+    // Robin Hood probing: an entry that is further from its home slot than
+    // the resident takes the slot, so probe lengths stay short and uniform.
+    while (table->entries[index].label)
+    {
+        Symbol *current = &table->entries[index];
+        if (!stored && current->hash == labelHash &&
+            labelsEqual(current->label, label, length) && current->label[length] == '\0')
+            return NULL;
+
+        unsigned int existing = (index - current->hash) & mask;
+        if (existing < distance)
+        {
+            if (!stored)
+                entry.label = stored = arenaStrdup(&table->labels, label, length);
+            Symbol displaced = *current;
+            *current = entry;
+            entry = displaced;
+            distance = existing;
+        }
+        index = (index + 1) & mask;
+        distance++;
+    }
+
+    if (!stored)
+        entry.label = stored = arenaStrdup(&table->labels, label, length);
+    table->entries[index] = entry;
+    table->count++;
+    return stored;
+}
+
+Symbol *findSymbol(const SymbolTable *table, const char *label, size_t length)
+{
+    if (table->count == 0)
+        return NULL;
+
+    unsigned int mask = table->capacity - 1;
+    unsigned int labelHash = hash(label, length);
+    unsigned int index = labelHash & mask;
+    for (unsigned int distance = 0;; distance++)
+    {
+        Symbol *current = &table->entries[index];
+        if (!current->label || ((index - current->hash) & mask) < distance)
+            return NULL;
+        if (current->hash == labelHash &&
+            labelsEqual(current->label, label, length) && current->label[length] == '\0')
+            return current;
+        index = (index + 1) & mask;
+    }
+}
+
+void resetSymbolTable(SymbolTable *table)
+{
+    if (table->entries)
+        memset(table->entries, 0, table->capacity * sizeof(Symbol));
+    table->count = 0;
+    arenaReset(&table->labels);
+}
+
+void freeSymbolTable(SymbolTable *table)
+{
+    free(table->entries);
+    arenaFree(&table->labels);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+LineInfo *appendLine(LineStore *store)
+{
+    if (store->count == store->capacity)
+    {
+        store->capacity = store->capacity ? store->capacity * 2 : 1024;
+        store->lines = (LineInfo *)realloc(store->lines, store->capacity * sizeof(LineInfo));
+        if (!store->lines)
+        {
+            fprintf(stderr, "Memory allocation error for line store\n");
+            exit(1);
+        }
+    }
+    LineInfo *lineInfo = &store->lines[store->count++];
+    memset(lineInfo, 0, sizeof(*lineInfo));
+    return lineInfo;
+}
+
+void freeLineStore(LineStore *store)
+{
+    free(store->lines);
+    store->lines = NULL;
+    store->count = 0;
+    store->capacity = 0;
+}
+
+void addDiagnostic(DiagnosticList *diagnostics, int lineNum, const char *format, ...)
+{
+    char message[MAX_LINE_LENGTH];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    if (diagnostics->count == diagnostics->capacity)
+    {
+        diagnostics->capacity = diagnostics->capacity ? diagnostics->capacity * 2 : 16;
+        diagnostics->items = (Diagnostic *)realloc(diagnostics->items, diagnostics->capacity * sizeof(Diagnostic));
+        if (!diagnostics->items)
+        {
+            fprintf(stderr, "Memory allocation error for diagnostics\n");
+            exit(1);
+        }
+    }
+    diagnostics->items[diagnostics->count].lineNum = lineNum;
+    diagnostics->items[diagnostics->count].message = arenaStrdup(&diagnostics->text, message, strlen(message));
+    diagnostics->count++;
+}
+
+void printDiagnostics(const AssemblyContext *ctx, FILE *out, int showPath)
+{
+    for (int i = 0; i < ctx->diagnostics.count; i++)
+    {
+        if (showPath)
+            fprintf(out, "%s: ", ctx->sourcePath);
+        fprintf(out, "Error: %s at line %d\n", ctx->diagnostics.items[i].message, ctx->diagnostics.items[i].lineNum);
+    }
+}
+
+void freeDiagnostics(DiagnosticList *diagnostics)
+{
+    free(diagnostics->items);
+    arenaFree(&diagnostics->text);
+    diagnostics->items = NULL;
+    diagnostics->count = 0;
+    diagnostics->capacity = 0;
+}
+
+int openSourceFile(const char *path, SourceFile *source)
+{
+    memset(source, 0, sizeof(*source));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if ((uint64_t)st.st_size > UINT32_MAX)
+        {
+            close(fd);
+            errno = EFBIG;
+            return 0;
+        }
+        source->size = (size_t)st.st_size;
+        if (source->size == 0)
+        {
+            close(fd);
+            return 1;
+        }
+        // Mapping costs more than a copy for small files such as object modules.
+        void *data = source->size >= MMAP_THRESHOLD ? mmap(NULL, source->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (data != MAP_FAILED)
+        {
+            madvise(data, source->size, MADV_SEQUENTIAL);
+            source->data = (const char *)data;
+            source->mapped = 1;
+            close(fd);
+            return 1;
+        }
+    }
+
+    // Small files, pipes and other unmappable inputs are read into memory.
+    size_t capacity = source->size > 0 ? source->size + 1 : 64 * 1024;
+    size_t size = 0;
+    char *buffer = (char *)malloc(capacity);
+    ssize_t bytesRead = 0;
+    while (buffer && (bytesRead = read(fd, buffer + size, capacity - size)) > 0)
+    {
+        size += (size_t)bytesRead;
+        if (size == capacity)
+        {
+            capacity *= 2;
+            char *larger = (char *)realloc(buffer, capacity);
+            if (!larger)
+                free(buffer);
+            buffer = larger;
+        }
+    }
+    close(fd);
+    if (!buffer || bytesRead < 0 || size > UINT32_MAX)
+    {
+        free(buffer);
+        return 0;
+    }
+    source->data = buffer;
+    source->size = size;
+    return 1;
+}
+
+void closeSourceFile(SourceFile *source)
+{
+    if (source->mapped)
+        munmap((void *)source->data, source->size);
+    else
+        free((void *)source->data);
+    source->data = NULL;
+    source->size = 0;
+    source->mapped = 0;
+    free(source->expansion.data);
+    memset(&source->expansion, 0, sizeof(source->expansion));
+}
+
+const char *viewText(const SourceFile *source, TokenView view)
+{
+    if (view.offset < source->size)
+        return source->data + view.offset;
+    return source->expansion.data + (view.offset - source->size);
+}
+
+int parseNumber(const char *text, size_t length, int base, int *value)
+{
+    size_t i = 0;
+    int negative = 0;
+    if (length > 0 && (text[0] == '-' || text[0] == '+'))
+    {
+        negative = text[0] == '-';
+        i++;
+    }
+    if (i == length)
+        return 0;
+
+    long result = 0;
+    for (; i < length; i++)
+    {
+        int digit;
+        char c = text[i];
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            return 0;
+        if (digit >= base)
+            return 0;
+        result = result * base + digit;
+        if (result > 0xFFFFFF)
+            return 0;
+    }
+    *value = negative ? (int)-result : (int)result;
+    return 1;
+}
+
+size_t tokenizeLine(const SourceFile *source, size_t pos, TokenView tokens[], int *tokenCount)
+{
+    const char *data = source->data;
+    size_t size = source->size;
+    *tokenCount = 0;
+
+    while ((pos = skipBlanks(data, pos, size)) < size && data[pos] != '\n')
+    {
+        if ((data[pos] == ';' && *tokenCount == 0) || *tokenCount == MAX_TOKENS)
+        {
+            const char *newline = (const char *)memchr(data + pos, '\n', size - pos);
+            pos = newline ? (size_t)(newline - data) : size;
+            break;
+        }
+
+        size_t start = pos;
+        pos = findSpace(data, pos, size);
+        tokens[*tokenCount].offset = (unsigned int)start;
+        tokens[*tokenCount].length = (unsigned int)(pos - start);
+        (*tokenCount)++;
+    }
+    return pos < size ? pos + 1 : size;
+}
+
+int lookupDirective(const char *mnemonic)
+{
+    int directive = directiveSlots[opcodeHash(mnemonic)];
+    return directive != DIR_NONE && strcmp(directiveNames[directive], mnemonic) == 0 ? directive : DIR_NONE;
+}
+
+int classifyMnemonic(const SourceFile *source, TokenView token, LineInfo *lineInfo)
+{
+    char mnemonic[MAX_MNEMONIC];
+    if (token.length >= sizeof(mnemonic))
+        return 0;
+    const char *text = viewText(source, token);
+    for (unsigned int i = 0; i < token.length; i++)
+        mnemonic[i] = toupper((unsigned char)text[i]);
+    mnemonic[token.length] = '\0';
+
+    int opcode, format;
+    int directive = lookupDirective(mnemonic);
+    if (directive != DIR_NONE)
+    {
+        lineInfo->directive = directive;
+    }
+    else if (lookupOpcode(mnemonic, &opcode, &format))
+    {
+        lineInfo->opcode = opcode;
+        lineInfo->format = format;
+    }
+    else
+    {
+        return 0;
+    }
+    lineInfo->mnemonic = token;
+    return 1;
+}
+
+void parseLine(const SourceFile *source, const TokenView tokens[], int tokenCount, LineInfo *lineInfo)
+{
+    memset(lineInfo, 0, sizeof(*lineInfo));
+    if (tokenCount == 0)
+        return;
+
+    if (classifyMnemonic(source, tokens[0], lineInfo))
+    {
+        if (tokenCount > 1)
+            lineInfo->operand = tokens[1];
+    }
+    else
+    {
+        lineInfo->label = tokens[0];
+        if (tokenCount > 1)
+        {
+            if (!classifyMnemonic(source, tokens[1], lineInfo))
+                lineInfo->mnemonic = tokens[1];
+            if (tokenCount > 2)
+                lineInfo->operand = tokens[2];
+        }
+    }
+    classifyOperand(source, lineInfo);
+}
+
+void classifyOperand(const SourceFile *source, LineInfo *lineInfo)
+{
+    const char *operand = viewText(source, lineInfo->operand);
+    unsigned int length = lineInfo->operand.length;
+    lineInfo->addressing = MODE_SIMPLE;
+    lineInfo->indexed = 0;
+    lineInfo->operandKind = OPERAND_NONE;
+    if (length == 0)
+        return;
+
+    if (lineInfo->directive == DIR_BYTE)
+    {
+        if (length >= 3 && operand[0] == 'C')
+            lineInfo->operandKind = OPERAND_CHARS;
+        else if (length >= 3 && operand[0] == 'X')
+            lineInfo->operandKind = OPERAND_HEX;
+        return;
+    }
+    if (lineInfo->directive == DIR_WORD)
+    {
+        // Anything that is not a name must parse as a number.
+        if (isExpression(operand, length))
+            lineInfo->operandKind = OPERAND_EXPRESSION;
+        else if (isalpha((unsigned char)operand[0]) || operand[0] == '_')
+            lineInfo->operandKind = OPERAND_SYMBOL;
+        else
+            lineInfo->operandKind = OPERAND_NUMBER;
+        return;
+    }
+    if (lineInfo->directive == DIR_NONE && lineInfo->format == 2)
+    {
+        lineInfo->operandKind = OPERAND_REGISTERS;
+        return;
+    }
+
+    if (lineInfo->directive == DIR_NONE && lineInfo->format >= 3)
+    {
+        if (operand[0] == '#')
+            lineInfo->addressing = MODE_IMMEDIATE;
+        else if (operand[0] == '@')
+            lineInfo->addressing = MODE_INDIRECT;
+        else if (length > 2 && operand[length - 2] == ',' && toupper((unsigned char)operand[length - 1]) == 'X')
+            lineInfo->indexed = 1;
+        TokenView target = operandTarget(lineInfo);
+        operand = viewText(source, target);
+        length = target.length;
+        if (length == 0)
+            return;
+        if (lineInfo->addressing == MODE_SIMPLE && operand[0] == '=')
+        {
+            lineInfo->operandKind = OPERAND_LITERAL;
+            return;
+        }
+    }
+    if (isExpression(operand, length))
+        lineInfo->operandKind = OPERAND_EXPRESSION;
+    else if (isdigit((unsigned char)operand[0]))
+        lineInfo->operandKind = OPERAND_NUMBER;
+    else
+        lineInfo->operandKind = OPERAND_SYMBOL;
+}
+
+// The operand without its addressing prefix or index suffix.
+TokenView operandTarget(const LineInfo *line)
+{
+    TokenView target = line->operand;
+    if (line->addressing != MODE_SIMPLE && target.length > 0)
+    {
+        target.offset++;
+        target.length--;
+    }
+    if (line->indexed)
+        target.length -= 2;
+    return target;
+}
+
+int lookupSymbolView(const AssemblyContext *ctx, int section, TokenView view)
+{
+    COUNT_STAT(symbolLookups);
+    Symbol *symbol = findSymbol(&ctx->sections[section].symbols, viewText(&ctx->source, view), view.length);
+    return symbol ? symbol->address : -1;
+}
+
+int isAbsoluteSymbol(const AssemblyContext *ctx, int section, TokenView view)
+{
+    const SymbolTable *absolutes = &ctx->sections[section].absolutes;
+    return absolutes->count > 0 && findSymbol(absolutes, viewText(&ctx->source, view), view.length);
+}
+
+int isExpression(const char *text, size_t length)
+{
+    if (length > 0 && text[0] == '*')
+        return 1;
+    for (size_t i = 1; i < length; i++)
+    {
+        if (text[i] == '+' || text[i] == '-' || text[i] == '*' || text[i] == '/')
+            return 1;
+    }
+    return 0;
+}
+
+// Evaluates decimal numbers, symbols and * (the location counter) joined by
+// + - * /, with * and / binding tighter and applying to absolute terms only.
+// Absolute symbols hold 24-bit values and read back sign-extended.
+int evaluateExpression(const AssemblyContext *ctx, int section, int locctr, TokenView view, ExpressionValue *result)
+{
+    const char *text = viewText(&ctx->source, view);
+    int sum = 0, sumRelative = 0, sign = 1;
+    int term = 0, termRelative = 0;
+    char op = 0;
+    size_t pos = 0;
+
+    memset(result, 0, sizeof(*result));
+    result->term = view;
+    for (;;)
+    {
+        size_t start = pos;
+        int value, relative = 0;
+        if (pos < view.length && text[pos] == '*')
+        {
+            value = locctr;
+            relative = 1;
+            pos++;
+        }
+        else if (pos < view.length && isdigit((unsigned char)text[pos]))
+        {
+            while (pos < view.length && isdigit((unsigned char)text[pos]))
+                pos++;
+            if (!parseNumber(text + start, pos - start, 10, &value))
+                return EXPR_SYNTAX;
+        }
+        else if (pos < view.length && (isalpha((unsigned char)text[pos]) || text[pos] == '_'))
+        {
+            while (pos < view.length && (isalnum((unsigned char)text[pos]) || text[pos] == '_'))
+                pos++;
+            TokenView name = {view.offset + (unsigned int)start, (unsigned int)(pos - start)};
+            value = lookupSymbolView(ctx, section, name);
+            // An external symbol can only be added or subtracted whole; the
+            // loader does that from a modification record.
+            int alone = !op && (pos == view.length || text[pos] == '+' || text[pos] == '-');
+            if (value == -1 || value <= FORWARD_PENDING || (value == EXTERNAL_ADDRESS && !alone))
+            {
+                result->term = name;
+                return value == EXTERNAL_ADDRESS ? EXPR_EXTERNAL : EXPR_UNDEFINED;
+            }
+            if (value == EXTERNAL_ADDRESS)
+            {
+                if (result->externals++ == 0)
+                    result->term = name;
+                value = 0;
+            }
+            else
+            {
+                relative = !isAbsoluteSymbol(ctx, section, name);
+                if (!relative)
+                    value = signExtend24(value);
+            }
+        }
+        else
+            return EXPR_SYNTAX;
+
+        if (op)
+        {
+            if (termRelative || relative)
+                return EXPR_RELATIVE;
+            if (op == '/' && value == 0)
+                return EXPR_SYNTAX;
+            term = op == '*' ? term * value : term / value;
+        }
+        else
+        {
+            term = value;
+            termRelative = relative;
+        }
+
+        if (pos == view.length || text[pos] == '+' || text[pos] == '-')
+        {
+            sum += sign * term;
+            sumRelative += sign * termRelative;
+            if (pos == view.length)
+                break;
+            sign = text[pos] == '+' ? 1 : -1;
+            op = 0;
+        }
+        else if (text[pos] == '*' || text[pos] == '/')
+            op = text[pos];
+        else
+            return EXPR_SYNTAX;
+        pos++;
+    }
+
+    if (sumRelative != 0 && sumRelative != 1 && (sumRelative != -1 || result->externals == 0))
+        return EXPR_RELATIVE;
+    result->value = sum;
+    result->relative = sumRelative;
+    return result->externals > 0 ? EXPR_EXTERNAL : EXPR_OK;
+}
+
+void reportExpression(DiagnosticList *diagnostics, int lineNum, const SourceFile *source, TokenView view, int status,
+                      const ExpressionValue *result)
+{
+    const char *term = viewText(source, result->term);
+    int termLength = (int)result->term.length;
+    if (status == EXPR_UNDEFINED)
+        addDiagnostic(diagnostics, lineNum, "Undefined symbol '%.*s'", termLength, term);
+    else if (status == EXPR_EXTERNAL)
+        addDiagnostic(diagnostics, lineNum, "External symbol '%.*s' in expression", termLength, term);
+    else if (status == EXPR_RELATIVE)
+        addDiagnostic(diagnostics, lineNum, "Invalid relative expression '%.*s'", (int)view.length, viewText(source, view));
+    else
+        addDiagnostic(diagnostics, lineNum, "Invalid expression '%.*s'", (int)view.length, viewText(source, view));
+}
+
+// The value of a symbol or expression operand, or -1 when it has none.
+int operandAddress(const AssemblyContext *ctx, int section, const LineInfo *line)
+{
+    if (line->operandKind != OPERAND_EXPRESSION)
+        return lookupSymbolView(ctx, section, line->operand);
+    ExpressionValue result;
+    if (evaluateExpression(ctx, section, line->address, line->operand, &result) != EXPR_OK)
+        return -1;
+    return result.value;
+}
+
+// Decodes =C'...' or =X'...' into bytes; returns the byte count, or -1.
+int parseLiteral(const char *text, size_t length, unsigned char *bytes)
+{
+    if (length < 4 || text[0] != '=' || text[2] != '\'' || text[length - 1] != '\'')
+        return -1;
+    char type = toupper((unsigned char)text[1]);
+    if (type == 'C' && length > 4)
+    {
+        memcpy(bytes, text + 3, length - 4);
+        return (int)length - 4;
+    }
+    if (type == 'X' && length > 4 && parseHexBytes(text + 3, length - 4, bytes))
+        return (int)(length - 4) / 2;
+    return -1;
+}
+
+unsigned int literalHash(const unsigned char *bytes, size_t length, int pool)
+{
+    uint64_t hash = 0xCBF29CE484222325ull ^ (uint64_t)pool;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return (unsigned int)hash;
+}
+
+Literal *findLiteral(const LiteralTable *table, const unsigned char *bytes, size_t length, int pool)
+{
+    if (table->count == 0)
+        return NULL;
+
+    unsigned int mask = table->slotCapacity - 1;
+    unsigned int literalHashValue = literalHash(bytes, length, pool);
+    for (unsigned int index = literalHashValue & mask; table->slots[index]; index = (index + 1) & mask)
+    {
+        Literal *current = &table->items[table->slots[index] - 1];
+        if (current->hash == literalHashValue && current->pool == pool && current->length == length &&
+            memcmp(current->bytes, bytes, length) == 0)
+            return current;
+    }
+    return NULL;
+}
+
+void growLiteralTable(LiteralTable *table)
+{
+    free(table->slots);
+    table->slotCapacity = table->slotCapacity ? table->slotCapacity * 2 : LITERAL_TABLE_INITIAL_CAPACITY;
+    table->slots = (unsigned int *)calloc(table->slotCapacity, sizeof(unsigned int));
+    if (!table->slots)
+    {
+        fprintf(stderr, "Memory allocation error for literal table\n");
+        exit(1);
+    }
+    unsigned int mask = table->slotCapacity - 1;
+    for (int i = 0; i < table->count; i++)
+    {
+        unsigned int index = table->items[i].hash & mask;
+        while (table->slots[index])
+            index = (index + 1) & mask;
+        table->slots[index] = i + 1;
+    }
+}
+
+void addLiteral(LiteralTable *table, TokenView text, const unsigned char *bytes, size_t length)
+{
+    if (findLiteral(table, bytes, length, table->pool))
+        return;
+
+    if ((unsigned int)(table->count + 1) * 4 > table->slotCapacity * 3)
+        growLiteralTable(table);
+    if (table->count == table->capacity)
+    {
+        table->capacity = table->capacity ? table->capacity * 2 : 64;
+        table->items = (Literal *)realloc(table->items, table->capacity * sizeof(Literal));
+        if (!table->items)
+        {
+            fprintf(stderr, "Memory allocation error for literal table\n");
+            exit(1);
+        }
+    }
+
+    Literal *literal = &table->items[table->count];
+    unsigned char *copy = (unsigned char *)arenaAlloc(&table->bytes, length);
+    memcpy(copy, bytes, length);
+    literal->bytes = copy;
+    literal->length = (unsigned int)length;
+    literal->hash = literalHash(bytes, length, table->pool);
+    literal->pool = table->pool;
+    literal->address = -1;
+    literal->forwardRefs = -1;
+    literal->text = text;
+
+    unsigned int mask = table->slotCapacity - 1;
+    unsigned int index = literal->hash & mask;
+    while (table->slots[index])
+        index = (index + 1) & mask;
+    table->slots[index] = ++table->count;
+}
+
+int lookupLiteral(const AssemblyContext *ctx, int pool, TokenView view)
+{
+    unsigned char bytes[MAX_LINE_LENGTH];
+    int length = parseLiteral(viewText(&ctx->source, view), view.length, bytes);
+    Literal *literal = length > 0 ? findLiteral(&ctx->literals, bytes, length, pool) : NULL;
+    return literal ? literal->address : -1;
+}
+
+// Assigns addresses to the literals collected since the last pool and adds a
+// listing line for each, so pass two emits them like BYTE constants.
+int placeLiterals(AssemblyContext *ctx, int locctr, int lineNum)
+{
+    LiteralTable *table = &ctx->literals;
+    for (; table->placed < table->count; table->placed++)
+    {
+        Literal *literal = &table->items[table->placed];
+        LineInfo *line = appendLine(&ctx->lines);
+        line->lineNum = lineNum;
+        line->address = locctr;
+        line->operand = literal->text;
+        line->directive = DIR_LITERAL;
+        line->addressing = MODE_SIMPLE;
+        line->operandKind = OPERAND_LITERAL;
+        literal->address = locctr;
+        if (literal->forwardRefs >= 0)
+            resolveForwardRefs(ctx, literal->forwardRefs, literal->text, locctr);
+        literal->forwardRefs = -1;
+        locctr += literal->length;
+    }
+    table->pool++;
+    return locctr;
+}
+
+void resetLiteralTable(LiteralTable *table)
+{
+    if (table->slots)
+        memset(table->slots, 0, table->slotCapacity * sizeof(unsigned int));
+    table->count = 0;
+    table->pool = 0;
+    table->placed = 0;
+    arenaReset(&table->bytes);
+}
+
+void freeLiteralTable(LiteralTable *table)
+{
+    free(table->items);
+    free(table->slots);
+    arenaFree(&table->bytes);
+    memset(table, 0, sizeof(*table));
+}
+
+void growArray(void **items, int count, int *capacity, size_t itemSize, const char *what)
+{
+    if (count < *capacity)
+        return;
+    *capacity = *capacity ? *capacity * 2 : 64;
+    *items = realloc(*items, (size_t)*capacity * itemSize);
+    if (!*items)
+    {
+        fprintf(stderr, "Memory allocation error for %s\n", what);
+        exit(1);
+    }
+}
+
+int viewEquals(const SourceFile *source, TokenView view, const char *text)
+{
+    return view.length == strlen(text) && labelsEqual(viewText(source, view), text, view.length);
+}
+
+// Returns room for length bytes of expanded text; the caller fills it in and
+// advances expansion.size.
+char *reserveExpansion(SourceFile *source, size_t length)
+{
+    if (source->size + source->expansion.size + length > UINT32_MAX)
+    {
+        fprintf(stderr, "Macro expansion exceeds 4 GB\n");
+        exit(1);
+    }
+    reserveText(&source->expansion, length);
+    return source->expansion.data + source->expansion.size;
+}
+
+void addMacroPiece(MacroProcessor *macros, unsigned int offset, unsigned int length, int param)
+{
+    growArray((void **)&macros->pieces, macros->pieceCount, &macros->pieceCapacity, sizeof(MacroPiece), "macro bodies");
+    MacroPiece *piece = &macros->pieces[macros->pieceCount++];
+    piece->text.offset = offset;
+    piece->text.length = length;
+    piece->param = param;
+}
+
+// Reads a definition from the header line to MEND, splitting every body token
+// at its &parameter references so expansion never rescans the text.
+void defineMacro(AssemblyContext *ctx, MacroProcessor *macros, size_t *pos, int *lineNum, TokenView name, TokenView list)
+{
+    const SourceFile *source = &ctx->source;
+    int headerLine = *lineNum;
+    TokenView params[MAX_MACRO_PARAMS];
+    int paramCount = 0;
+    const char *listText = viewText(source, list);
+    for (unsigned int i = 0, start = 0; list.length > 0 && i <= list.length; i++)
+    {
+        if (i < list.length && listText[i] != ',')
+            continue;
+        TokenView param = {list.offset + start, i - start};
+        if (param.length < 2 || listText[start] != '&' || paramCount == MAX_MACRO_PARAMS)
+            addDiagnostic(&ctx->diagnostics, headerLine, "Invalid macro parameter '%.*s'", (int)param.length,
+                          listText + start);
+        else
+            params[paramCount++] = param;
+        start = i + 1;
+    }
+
+    if (!insertSymbol(&macros->names, viewText(source, name), name.length, macros->definitionCount))
+        addDiagnostic(&ctx->diagnostics, headerLine, "Duplicate macro '%.*s'", (int)name.length, viewText(source, name));
+    growArray((void **)&macros->definitions, macros->definitionCount, &macros->definitionCapacity,
+              sizeof(MacroDefinition), "macro definitions");
+    MacroDefinition *definition = &macros->definitions[macros->definitionCount++];
+    definition->firstLine = macros->lineCount;
+    definition->lineCount = 0;
+    definition->paramCount = paramCount;
+
+    TokenView body[MAX_TOKENS];
+    int bodyCount;
+    while (*pos < source->size)
+    {
+        *pos = tokenizeLine(source, *pos, body, &bodyCount);
+        (*lineNum)++;
+        if (bodyCount == 0)
+            continue;
+        if (viewEquals(source, body[0], "MEND") || (bodyCount > 1 && viewEquals(source, body[1], "MEND")))
+            return;
+        if (bodyCount > 1 && viewEquals(source, body[1], "MACRO"))
+            addDiagnostic(&ctx->diagnostics, *lineNum, "Nested macro definitions are not supported");
+
+        growArray((void **)&macros->lines, macros->lineCount, &macros->lineCapacity, sizeof(MacroLine), "macro bodies");
+        MacroLine *line = &macros->lines[macros->lineCount++];
+        line->firstPiece = macros->pieceCount;
+        line->tokenCount = bodyCount;
+        definition->lineCount++;
+
+        for (int t = 0; t < bodyCount; t++)
+        {
+            int firstPiece = macros->pieceCount;
+            TokenView token = body[t];
+            const char *text = viewText(source, token);
+            int unique = text[0] == '$' && token.length > 1;
+            unsigned int start = unique;
+            unsigned int i = start;
+            while (i < token.length)
+            {
+                if (text[i] != '&')
+                {
+                    i++;
+                    continue;
+                }
+                unsigned int end = i + 1;
+                while (end < token.length && (isalnum((unsigned char)text[end]) || text[end] == '_'))
+                    end++;
+                int param = -1;
+                for (int p = 0; p < paramCount && param < 0; p++)
+                    if (params[p].length == end - i && labelsEqual(viewText(source, params[p]), text + i, end - i))
+                        param = p;
+                if (param >= 0)
+                {
+                    if (i > start)
+                        addMacroPiece(macros, token.offset + start, i - start, MACRO_PIECE_TEXT);
+                    addMacroPiece(macros, 0, 0, param);
+                    start = end;
+                }
+                i = end;
+            }
+            if (token.length > start)
+                addMacroPiece(macros, token.offset + start, token.length - start, MACRO_PIECE_TEXT);
+            if (unique)
+                addMacroPiece(macros, 0, 0, MACRO_PIECE_UNIQUE);
+            line->pieceCount[t] = macros->pieceCount - firstPiece;
+        }
+    }
+    addDiagnostic(&ctx->diagnostics, headerLine, "Missing MEND for macro '%.*s'", (int)name.length, viewText(source, name));
+}
+
+// Starts an expansion if the line's mnemonic names a macro; returns 0 if not.
+int callMacro(AssemblyContext *ctx, MacroProcessor *macros, const TokenView tokens[], int tokenCount, int lineNum)
+{
+    const SourceFile *source = &ctx->source;
+    int labeled = 0;
+    Symbol *name = findSymbol(&macros->names, viewText(source, tokens[0]), tokens[0].length);
+    if (!name && tokenCount > 1)
+    {
+        name = findSymbol(&macros->names, viewText(source, tokens[1]), tokens[1].length);
+        labeled = 1;
+    }
+    if (!name)
+        return 0;
+    if (macros->depth == MAX_MACRO_DEPTH)
+    {
+        addDiagnostic(&ctx->diagnostics, lineNum, "Macro expansion nested deeper than %d", MAX_MACRO_DEPTH);
+        return 1;
+    }
+
+    growArray((void **)&macros->frames, macros->depth, &macros->frameCapacity, sizeof(MacroFrame), "macro expansion");
+    MacroFrame *frame = &macros->frames[macros->depth++];
+    frame->macro = name->address;
+    frame->nextLine = 0;
+    frame->firstArg = macros->argCount;
+    frame->argCount = 0;
+    frame->id = macros->expansions++;
+    frame->label = labeled ? tokens[0] : (TokenView){0, 0};
+
+    if (labeled + 1 < tokenCount)
+    {
+        TokenView operand = tokens[labeled + 1];
+        const char *text = viewText(source, operand);
+        for (unsigned int i = 0, start = 0; i <= operand.length; i++)
+        {
+            if (i < operand.length && text[i] != ',')
+                continue;
+            growArray((void **)&macros->args, macros->argCount, &macros->argCapacity, sizeof(TokenView), "macro arguments");
+            macros->args[macros->argCount].offset = operand.offset + start;
+            macros->args[macros->argCount++].length = i - start;
+            frame->argCount++;
+            start = i + 1;
+        }
+    }
+    if (frame->argCount > macros->definitions[frame->macro].paramCount)
+        addDiagnostic(&ctx->diagnostics, lineNum, "Too many arguments for macro '%.*s'", (int)tokens[labeled].length,
+                      viewText(source, tokens[labeled]));
+    return 1;
+}
+
+// Produces the next line of the innermost expansion, popping finished frames;
+// returns 0 once every expansion is done.
+int expandMacroLine(AssemblyContext *ctx, MacroProcessor *macros, TokenView tokens[], int *tokenCount, int lineNum)
+{
+    SourceFile *source = &ctx->source;
+    while (macros->depth > 0)
+    {
+        MacroFrame *frame = &macros->frames[macros->depth - 1];
+        const MacroDefinition *definition = &macros->definitions[frame->macro];
+        if (frame->nextLine == definition->lineCount)
+        {
+            macros->argCount = frame->firstArg;
+            macros->depth--;
+            continue;
+        }
+
+        const MacroLine *line = &macros->lines[definition->firstLine + frame->nextLine++];
+        const MacroPiece *pieces = &macros->pieces[line->firstPiece];
+        *tokenCount = 0;
+        for (int t = 0; t < line->tokenCount; pieces += line->pieceCount[t++])
+        {
+            // A token made of one text piece or one argument keeps pointing at
+            // it; only joined tokens and $-labels are copied.
+            char unique[16];
+            int uniqueLength = 0;
+            TokenView parts[MAX_LINE_LENGTH / 8];
+            int partCount = 0;
+            size_t length = 0;
+            for (int p = 0; p < line->pieceCount[t]; p++)
+            {
+                TokenView part = pieces[p].text;
+                if (pieces[p].param == MACRO_PIECE_UNIQUE)
+                    uniqueLength = snprintf(unique, sizeof(unique), "$%X", frame->id);
+                else if (pieces[p].param >= 0)
+                    part = pieces[p].param < frame->argCount ? macros->args[frame->firstArg + pieces[p].param]
+                                                               : (TokenView){0, 0};
+                if (part.length > 0 && partCount < (int)(sizeof(parts) / sizeof(parts[0])))
+                {
+                    parts[partCount++] = part;
+                    length += part.length;
+                }
+            }
+
+            if (partCount == 1 && uniqueLength == 0)
+            {
+                tokens[(*tokenCount)++] = parts[0];
+            }
+            else if (length + uniqueLength > 0)
+            {
+                char *out = reserveExpansion(source, length + uniqueLength);
+                for (int p = 0; p < partCount; p++)
+                {
+                    memcpy(out, viewText(source, parts[p]), parts[p].length);
+                    out += parts[p].length;
+                }
+                memcpy(out, unique, uniqueLength);
+                tokens[*tokenCount].offset = (unsigned int)(source->size + source->expansion.size);
+                tokens[(*tokenCount)++].length = (unsigned int)(length + uniqueLength);
+                source->expansion.size += length + uniqueLength;
+            }
+        }
+
+        if (frame->nextLine == 1 && frame->label.length > 0)
+        {
+            LineInfo scratch;
+            if (*tokenCount > 0 && (classifyMnemonic(source, tokens[0], &scratch) ||
+                                    findSymbol(&macros->names, viewText(source, tokens[0]), tokens[0].length)))
+            {
+                tokens[2] = tokens[1];
+                tokens[1] = tokens[0];
+                tokens[0] = frame->label;
+                *tokenCount = *tokenCount < MAX_TOKENS ? *tokenCount + 1 : MAX_TOKENS;
+            }
+            else
+            {
+                addDiagnostic(&ctx->diagnostics, lineNum, "Label '%.*s' on macro call ignored; the first line has one",
+                              (int)frame->label.length, viewText(source, frame->label));
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// The macro stage in front of parseLine: yields source and expanded lines and
+// consumes definitions and calls. Expanded lines carry the number of the
+// outermost call.
+int nextLine(AssemblyContext *ctx, MacroProcessor *macros, size_t *pos, TokenView tokens[], int *tokenCount, int *lineNum)
+{
+    const SourceFile *source = &ctx->source;
+    for (;;)
+    {
+        if (!expandMacroLine(ctx, macros, tokens, tokenCount, *lineNum))
+        {
+            if (*pos >= source->size)
+                return 0;
+            *pos = tokenizeLine(source, *pos, tokens, tokenCount);
+            (*lineNum)++;
+            if (*tokenCount >= 2 && viewEquals(source, tokens[1], "MACRO"))
+            {
+                defineMacro(ctx, macros, pos, lineNum, tokens[0], *tokenCount > 2 ? tokens[2] : (TokenView){0, 0});
+                continue;
+            }
+        }
+        if (*tokenCount > 0 && macros->names.count > 0 && callMacro(ctx, macros, tokens, *tokenCount, *lineNum))
+            continue;
+        return 1;
+    }
+}
+
+void freeMacroProcessor(MacroProcessor *macros)
+{
+    freeSymbolTable(&macros->names);
+    free(macros->definitions);
+    free(macros->lines);
+    free(macros->pieces);
+    free(macros->frames);
+    free(macros->args);
+    memset(macros, 0, sizeof(*macros));
+}
+
+ControlSection *beginSection(AssemblyContext *ctx, int firstLine)
+{
+    if (ctx->sectionCount == ctx->sectionCapacity)
+    {
+        ctx->sectionCapacity = ctx->sectionCapacity ? ctx->sectionCapacity * 2 : 4;
+        ctx->sections = (ControlSection *)realloc(ctx->sections, ctx->sectionCapacity * sizeof(ControlSection));
+        if (!ctx->sections)
+        {
+            fprintf(stderr, "Memory allocation error for control sections\n");
+            exit(1);
+        }
+    }
+    // Sections left by resetAssembly keep their emptied tables.
+    ControlSection *section = &ctx->sections[ctx->sectionCount++];
+    if (ctx->sectionCount > ctx->sectionsAllocated)
+    {
+        memset(section, 0, sizeof(*section));
+        ctx->sectionsAllocated = ctx->sectionCount;
+    }
+    strcpy(section->name, DEFAULT_PROG_NAME);
+    section->firstLine = firstLine;
+    section->startAddress = 0;
+    section->length = 0;
+    section->highest = 0;
+    return section;
+}
+
+void addExternalNames(AssemblyContext *ctx, ControlSection *section, const LineInfo *line)
+{
+    int refs = line->directive == DIR_EXTREF;
+    const char *operand = viewText(&ctx->source, line->operand);
+    TokenView name = {line->operand.offset, 0};
+
+    for (unsigned int i = 0; i <= line->operand.length; i++)
+    {
+        if (i < line->operand.length && operand[i] != ',')
+        {
+            name.length++;
+            continue;
+        }
+
+        const char *text = viewText(&ctx->source, name);
+        if (name.length == 0 || name.length > 6)
+            addDiagnostic(&ctx->diagnostics, line->lineNum, "Invalid external symbol '%.*s'", (int)name.length, text);
+        else if (refs && !insertSymbol(&section->symbols, text, name.length, EXTERNAL_ADDRESS))
+            addDiagnostic(&ctx->diagnostics, line->lineNum, "Duplicate or invalid symbol '%.*s'", (int)name.length, text);
+        else
+        {
+            int *count = refs ? &section->refCount : &section->defCount;
+            int *capacity = refs ? &section->refCapacity : &section->defCapacity;
+            ExternalName **names = refs ? &section->refs : &section->defs;
+            if (*count == *capacity)
+            {
+                *capacity = *capacity ? *capacity * 2 : 8;
+                *names = (ExternalName *)realloc(*names, *capacity * sizeof(ExternalName));
+                if (!*names)
+                {
+                    fprintf(stderr, "Memory allocation error for external symbols\n");
+                    exit(1);
+                }
+            }
+            (*names)[*count].name = name;
+            (*names)[*count].lineNum = line->lineNum;
+            (*count)++;
+        }
+        name.offset += name.length + 1;
+        name.length = 0;
+    }
+}
+
+void endSection(AssemblyContext *ctx, ControlSection *section, int locctr)
+{
+    if (locctr < section->highest)
+        locctr = section->highest;
+    section->length = locctr - section->startAddress;
+    for (int i = 0; i < section->defCount; i++)
+    {
+        TokenView name = section->defs[i].name;
+        if (lookupSymbolView(ctx, section - ctx->sections, name) < 0)
+            addDiagnostic(&ctx->diagnostics, section->defs[i].lineNum, "Undefined external definition '%.*s'",
+                          (int)name.length, viewText(&ctx->source, name));
+    }
+}
+
+// In one-pass mode a label that is already pending resolves the fields
+// waiting for it instead of being a duplicate.
+void defineSymbol(AssemblyContext *ctx, SymbolTable *symbols, TokenView label, int address, int lineNum)
+{
+    const char *text = viewText(&ctx->source, label);
+    if (insertSymbol(symbols, text, label.length, address))
+        return;
+
+    Symbol *symbol = ctx->onePass ? findSymbol(symbols, text, label.length) : NULL;
+    if (symbol && symbol->address <= FORWARD_PENDING)
+    {
+        int head = FORWARD_PENDING - symbol->address;
+        symbol->address = address;
+        resolveForwardRefs(ctx, head, label, address);
+        return;
+    }
+    addDiagnostic(&ctx->diagnostics, lineNum, "Duplicate or invalid symbol '%.*s'", (int)label.length, text);
+}
+
+// The count of a RESW or RESB is a number or an absolute expression of
+// symbols defined above; a bad one reserves nothing.
+int reservedBytes(const AssemblyContext *ctx, int section, const LineInfo *line, int locctr, DiagnosticList *diagnostics)
+{
+    const char *operand = viewText(&ctx->source, line->operand);
+    int operandLength = line->operand.length;
+    int value;
+    if (!parseNumber(operand, operandLength, 10, &value))
+    {
+        ExpressionValue result;
+        int status = evaluateExpression(ctx, section, locctr, line->operand, &result);
+        value = 0;
+        if (status == EXPR_OK && !result.relative && result.value >= 0)
+            value = result.value;
+        else if (!diagnostics)
+            return 0;
+        else if (status == EXPR_OK || status == EXPR_SYNTAX)
+            addDiagnostic(diagnostics, line->lineNum, "Invalid operand '%.*s'", operandLength, operand);
+        else
+            reportExpression(diagnostics, line->lineNum, &ctx->source, line->operand, status, &result);
+    }
+    return line->directive == DIR_RESW ? 3 * value : value;
+}
+
+// Evaluates an EQU. While its expression still names an undefined symbol,
+// the definition (node, or a new one when node is -1) is chained to that
+// name; * is the location counter at the EQU line.
+void defineEqu(AssemblyContext *ctx, EquGraph *graph, int section, const PendingEqu *equ, int node)
+{
+    ExpressionValue result;
+    int status = evaluateExpression(ctx, section, equ->locctr, equ->operand, &result);
+    const char *text = viewText(&ctx->source, equ->label);
+    if (status == EXPR_UNDEFINED)
+    {
+        if (node < 0)
+        {
+            growArray((void **)&graph->items, graph->count, &graph->capacity, sizeof(PendingEqu), "EQU definitions");
+            node = graph->count++;
+            graph->items[node] = *equ;
+            if (ctx->onePass)
+                graph->items[node].line = -1;
+        }
+        const char *name = viewText(&ctx->source, result.term);
+        Symbol *waiting = findSymbol(&graph->waiting, name, result.term.length);
+        if (!waiting)
+        {
+            insertSymbol(&graph->waiting, name, result.term.length, -1);
+            waiting = findSymbol(&graph->waiting, name, result.term.length);
+        }
+        graph->items[node].waitingOn = result.term;
+        graph->items[node].next = waiting->address;
+        waiting->address = node;
+        return;
+    }
+    if (node >= 0)
+        graph->items[node].resolved = 1;
+    if (status != EXPR_OK)
+    {
+        reportExpression(&ctx->diagnostics, equ->lineNum, &ctx->source, equ->operand, status, &result);
+        return;
+    }
+
+    ControlSection *owner = &ctx->sections[section];
+    int value = result.value & 0xFFFFFF;
+    if (equ->line >= 0)
+        ctx->lines.lines[equ->line].address = value;
+    Symbol *existing = findSymbol(&owner->symbols, text, equ->label.length);
+    if (!result.relative && (!existing || existing->address <= FORWARD_PENDING))
+    {
+        // One-pass fields already waiting on the name were encoded as addresses.
+        if (existing)
+            addDiagnostic(&ctx->diagnostics, equ->lineNum, "Forward reference to absolute symbol '%.*s'",
+                          (int)equ->label.length, text);
+        insertSymbol(&owner->absolutes, text, equ->label.length, value);
+    }
+    defineSymbol(ctx, &owner->symbols, equ->label, value, equ->lineNum);
+    resolveWaitingEqus(ctx, graph, section, equ->label);
+}
+
+// Runs the definitions waiting on a name that has just been defined. Those
+// define names in turn, so they go through a work list rather than recursion.
+void resolveWaitingEqus(AssemblyContext *ctx, EquGraph *graph, int section, TokenView name)
+{
+    if (graph->waiting.count == 0)
+        return;
+    Symbol *waiting = findSymbol(&graph->waiting, viewText(&ctx->source, name), name.length);
+    if (!waiting || waiting->address < 0)
+        return;
+    for (int node = waiting->address; node >= 0; node = graph->items[node].next)
+    {
+        growArray((void **)&graph->ready, graph->readyCount, &graph->readyCapacity, sizeof(int), "EQU definitions");
+        graph->ready[graph->readyCount++] = node;
+    }
+    waiting->address = -1;
+    if (graph->draining)
+        return;
+
+    graph->draining = 1;
+    while (graph->readyCount > 0)
+    {
+        int node = graph->ready[--graph->readyCount];
+        PendingEqu equ = graph->items[node];
+        defineEqu(ctx, graph, section, &equ, node);
+    }
+    graph->draining = 0;
+}
+
+// Definitions still waiting when their section ends refer to a name that is
+// never defined, or to each other.
+void finishEqus(AssemblyContext *ctx, EquGraph *graph)
+{
+    for (int i = 0; i < graph->count; i++)
+    {
+        const PendingEqu *pending = &graph->items[i];
+        if (!pending->resolved)
+            addDiagnostic(&ctx->diagnostics, pending->lineNum, "Unresolved symbol '%.*s' in EQU",
+                          (int)pending->waitingOn.length, viewText(&ctx->source, pending->waitingOn));
+    }
+    graph->count = 0;
+    if (graph->waiting.count > 0)
+        resetSymbolTable(&graph->waiting);
+}
+
+void freeEquGraph(EquGraph *graph)
+{
+    free(graph->items);
+    free(graph->ready);
+    freeSymbolTable(&graph->waiting);
+}
+
+// Enters one parsed line into the line store and the symbol tables and
+// advances the location counter; returns 0 at END.
+int passOneLine(AssemblyContext *ctx, PassOneState *state, const LineInfo *parsed)
+{
+    const SourceFile *source = &ctx->source;
+    LineStore *store = &ctx->lines;
+    ControlSection *section = state->section;
+    int lineNum = parsed->lineNum;
+    int value;
+
+    // A pool ends before the CSECT or END line, so it stays in its section.
+    if (parsed->directive == DIR_CSECT || parsed->directive == DIR_END)
+        state->locctr = placeLiterals(ctx, state->locctr, lineNum);
+    LineInfo *current = appendLine(store);
+    *current = *parsed;
+
+    const char *label = viewText(source, current->label);
+    const char *operand = viewText(source, current->operand);
+    int labelLength = current->label.length;
+    int operandLength = current->operand.length;
+
+    if (!state->programStarted)
+    {
+        state->programStarted = 1;
+        if (current->directive == DIR_START)
+        {
+            if (operandLength > 0)
+            {
+                if (parseNumber(operand, operandLength, 16, &value))
+                    state->locctr = value;
+                else
+                    addDiagnostic(&ctx->diagnostics, lineNum, "Invalid start address '%.*s'", operandLength, operand);
+                section->startAddress = state->locctr;
+                if (labelLength > 0)
+                    snprintf(section->name, MAX_OPERAND, "%.*s", labelLength, label);
+            }
+            current->address = state->locctr;
+            if (labelLength > 0)
+                insertSymbol(&section->symbols, label, labelLength, state->locctr);
+            return 1;
+        }
+    }
+
+    if (current->directive == DIR_CSECT)
+    {
+        if (ctx->onePass)
+            addDiagnostic(&ctx->diagnostics, lineNum, "CSECT is not supported in one-pass mode");
+        finishEqus(ctx, &state->equs);
+        endSection(ctx, section, state->locctr);
+        state->orgReturn = -1;
+        section = state->section = beginSection(ctx, store->count - 1);
+        state->locctr = 0;
+        if (labelLength > 0 && labelLength <= 6)
+            snprintf(section->name, MAX_OPERAND, "%.*s", labelLength, label);
+        else
+            addDiagnostic(&ctx->diagnostics, lineNum, "Invalid control section name '%.*s'", labelLength, label);
+    }
+
+    int locctr = state->locctr;
+    current->address = locctr;
+
+    if (labelLength > 0 && current->directive != DIR_EQU)
+    {
+        defineSymbol(ctx, &section->symbols, current->label, locctr, lineNum);
+        resolveWaitingEqus(ctx, &state->equs, section - ctx->sections, current->label);
+    }
+
+    switch (current->directive)
+    {
+    case DIR_END:
+        if (operandLength > 0)
+        {
+            state->endOperand = lookupSymbolView(ctx, 0, current->operand);
+            if (state->endOperand < 0)
+                addDiagnostic(&ctx->diagnostics, lineNum, "Undefined symbol '%.*s'", operandLength, operand);
+        }
+        finishEqus(ctx, &state->equs);
+        endSection(ctx, section, locctr);
+        ctx->execAddress = state->endOperand >= 0 ? state->endOperand : ctx->sections[0].startAddress;
+        return 0;
+    case DIR_BYTE:
+        if (current->operandKind == OPERAND_CHARS)
+            locctr += operandLength - 3;
+        else if (current->operandKind == OPERAND_HEX)
+            locctr += (operandLength - 3) / 2;
+        break;
+    case DIR_WORD:
+        locctr += 3;
+        break;
+    case DIR_RESW:
+    case DIR_RESB:
+        locctr += reservedBytes(ctx, section - ctx->sections, current, locctr, &ctx->diagnostics);
+        break;
+    case DIR_EQU:
+        if (labelLength > 0)
+        {
+            PendingEqu equ = {current->label, current->operand, lineNum, locctr, store->count - 1, -1, 0, {0, 0}};
+            defineEqu(ctx, &state->equs, section - ctx->sections, &equ, -1);
+        }
+        else
+            addDiagnostic(&ctx->diagnostics, lineNum, "EQU requires a label");
+        break;
+    case DIR_ORG:
+        // ORG moves the location counter to a defined expression; a bare
+        // ORG returns to where the last one left.
+        if (locctr > section->highest)
+            section->highest = locctr;
+        if (operandLength == 0)
+        {
+            if (state->orgReturn >= 0)
+                locctr = state->orgReturn;
+            state->orgReturn = -1;
+        }
+        else
+        {
+            ExpressionValue result;
+            int status = evaluateExpression(ctx, section - ctx->sections, locctr, current->operand, &result);
+            if (status == EXPR_OK && result.value >= 0)
+            {
+                state->orgReturn = locctr;
+                locctr = result.value;
+            }
+            else if (status == EXPR_OK)
+                addDiagnostic(&ctx->diagnostics, lineNum, "Invalid ORG address '%.*s'", operandLength, operand);
+            else
+                reportExpression(&ctx->diagnostics, lineNum, source, current->operand, status, &result);
+        }
+        break;
+    case DIR_EXTDEF:
+    case DIR_EXTREF:
+        addExternalNames(ctx, section, current);
+        break;
+    case DIR_LTORG:
+        locctr = placeLiterals(ctx, locctr, lineNum);
+        break;
+    case DIR_BASE:
+    case DIR_NOBASE:
+    case DIR_CSECT:
+        break;
+    default:
+        if (current->operandKind == OPERAND_LITERAL)
+        {
+            unsigned char bytes[MAX_LINE_LENGTH];
+            TokenView literal = operandTarget(current);
+            int length = parseLiteral(viewText(source, literal), literal.length, bytes);
+            if (length > 0)
+                addLiteral(&ctx->literals, literal, bytes, length);
+            else
+                addDiagnostic(&ctx->diagnostics, lineNum, "Invalid literal '%.*s'", operandLength, operand);
+        }
+        if (current->format != 0)
+            locctr += current->format;
+        else
+            addDiagnostic(&ctx->diagnostics, lineNum, "Invalid opcode '%.*s'", (int)current->mnemonic.length,
+                          viewText(source, current->mnemonic));
+        break;
+    }
+    state->locctr = locctr;
+    return 1;
+}
+
+// Tokenizes and classifies the lines of one chunk, sizing each where the
+// line alone decides it. A macro definition stops the chunk, since macro
+// expansion has to see every line after it in order.
+void parseChunk(void *arg, int job)
+{
+    PassOneWave *wave = (PassOneWave *)arg;
+    const AssemblyContext *ctx = wave->ctx;
+    const SourceFile *source = &ctx->source;
+    PassOneChunk *chunk = &wave->chunks[job];
+    TokenView tokens[MAX_TOKENS];
+    int tokenCount;
+
+    chunk->lines.count = 0;
+    chunk->lineCount = 0;
+    chunk->length = 0;
+    chunk->simple = 1;
+    chunk->stopped = 0;
+    for (size_t pos = chunk->begin; pos < chunk->end;)
+    {
+        size_t next = tokenizeLine(source, pos, tokens, &tokenCount);
+        if (tokenCount >= 2 && viewEquals(source, tokens[1], "MACRO"))
+        {
+            chunk->end = pos;
+            chunk->stopped = 1;
+            break;
+        }
+        pos = next;
+        chunk->lineCount++;
+        if (tokenCount == 0)
+            continue;
+
+        LineInfo *line = appendLine(&chunk->lines);
+        parseLine(source, tokens, tokenCount, line);
+        line->lineNum = chunk->lineCount;
+        if (ctx->relax && line->format == 4)
+            line->format = 3;
+        // BASE only matters to pass two; statementSize declines it for -i.
+        int size = line->directive == DIR_BASE || line->directive == DIR_NOBASE ? 0 : statementSize(ctx, line);
+        line->address = chunk->length;
+        if (size >= 0)
+            chunk->length += size;
+        else
+            chunk->simple = 0;
+    }
+}
+
+// Pass one over threads: waves of chunks are parsed in parallel, then
+// entered in source order. A chunk of simple lines is placed whole at the
+// location counter, its addresses offset by the running sum of the chunk
+// lengths before it, and its labels merged into the section's symbol table,
+// where duplicates across chunks are found; any other chunk goes through
+// passOneLine line by line. Returns 1 at END; otherwise pos and lineNum are
+// where the serial pass takes over, at a macro definition or the end.
+int passOneChunks(AssemblyContext *ctx, PassOneState *state, size_t *pos, int *lineNum)
+{
+    const SourceFile *source = &ctx->source;
+    LineStore *store = &ctx->lines;
+    int threads = ctx->passOneThreads;
+    PassOneChunk *chunks = (PassOneChunk *)calloc(threads, sizeof(PassOneChunk));
+    if (!chunks)
+    {
+        fprintf(stderr, "Memory allocation error for pass one chunks\n");
+        exit(1);
+    }
+    PassOneWave wave = {ctx, chunks};
+    int ended = 0;
+    int stopped = 0;
+
+    while (*pos < source->size && !ended && !stopped)
+    {
+        int chunkCount = 0;
+        for (size_t begin = *pos; chunkCount < threads && begin < source->size; chunkCount++)
+        {
+            size_t end = source->size;
+            if (source->size - begin > PASS_ONE_CHUNK_BYTES)
+            {
+                const char *newline =
+                    (const char *)memchr(source->data + begin + PASS_ONE_CHUNK_BYTES, '\n',
+                                         source->size - begin - PASS_ONE_CHUNK_BYTES);
+                end = newline ? (size_t)(newline - source->data) + 1 : source->size;
+            }
+            chunks[chunkCount].begin = begin;
+            chunks[chunkCount].end = end;
+            begin = end;
+        }
+
+        runWorkerPool(threads, chunkCount, parseChunk, &wave);
+
+        for (int c = 0; c < chunkCount && !ended && !stopped; c++)
+        {
+            PassOneChunk *chunk = &chunks[c];
+            if (chunk->simple && state->programStarted)
+            {
+                if (store->count + chunk->lines.count > store->capacity)
+                {
+                    while (store->count + chunk->lines.count > store->capacity)
+                        store->capacity = store->capacity ? store->capacity * 2 : 1024;
+                    store->lines = (LineInfo *)realloc(store->lines, store->capacity * sizeof(LineInfo));
+                    if (!store->lines)
+                    {
+                        fprintf(stderr, "Memory allocation error for line store\n");
+                        exit(1);
+                    }
+                }
+                LineInfo *lines = &store->lines[store->count];
+                memcpy(lines, chunk->lines.lines, chunk->lines.count * sizeof(LineInfo));
+                store->count += chunk->lines.count;
+                ControlSection *section = state->section;
+                for (int i = 0; i < chunk->lines.count; i++)
+                {
+                    lines[i].address += state->locctr;
+                    lines[i].lineNum += *lineNum;
+                    if (lines[i].label.length > 0)
+                    {
+                        defineSymbol(ctx, &section->symbols, lines[i].label, lines[i].address, lines[i].lineNum);
+                        resolveWaitingEqus(ctx, &state->equs, section - ctx->sections, lines[i].label);
+                    }
+                }
+                state->locctr += chunk->length;
+            }
+            else
+            {
+                for (int i = 0; i < chunk->lines.count && !ended; i++)
+                {
+                    chunk->lines.lines[i].lineNum += *lineNum;
+                    ended = !passOneLine(ctx, state, &chunk->lines.lines[i]);
+                }
+            }
+            *lineNum += chunk->lineCount;
+            *pos = chunk->end;
+            stopped = chunk->stopped;
+        }
+    }
+
+    for (int c = 0; c < threads; c++)
+        freeLineStore(&chunks[c].lines);
+    free(chunks);
+    return ended;
+}
+
+void passOne(AssemblyContext *ctx)
+{
+    TokenView tokens[MAX_TOKENS];
+    int tokenCount;
+    size_t pos = 0;
+    int lineNum = 0;
+    PassOneState state = {0};
+    state.locctr = DEFAULT_START_ADDR;
+    state.endOperand = -1;
+    state.orgReturn = -1;
+    state.section = beginSection(ctx, 0);
+    state.section->startAddress = DEFAULT_START_ADDR;
+
+    // One-pass mode emits lines as it goes and stays serial.
+    int ended = !ctx->onePass && ctx->passOneThreads > 1 && ctx->source.size > PASS_ONE_CHUNK_BYTES &&
+                passOneChunks(ctx, &state, &pos, &lineNum);
+    while (!ended && nextLine(ctx, &state.macros, &pos, tokens, &tokenCount, &lineNum))
+    {
+        if (tokenCount == 0)
+            continue;
+        if (ctx->onePass)
+            emitOnePassLines(ctx);
+
+        LineInfo parsed;
+        parseLine(&ctx->source, tokens, tokenCount, &parsed);
+        parsed.lineNum = lineNum;
+        if (ctx->relax && parsed.format == 4)
+            parsed.format = 3;
+        ended = !passOneLine(ctx, &state, &parsed);
+    }
+
+    if (!ended)
+    {
+        state.locctr = placeLiterals(ctx, state.locctr, lineNum);
+        finishEqus(ctx, &state.equs);
+        endSection(ctx, state.section, state.locctr);
+        ctx->execAddress = ctx->sections[0].startAddress;
+    }
+    ctx->macroDefinitions = state.macros.definitionCount;
+    freeMacroProcessor(&state.macros);
+    freeEquGraph(&state.equs);
+}
+
+void setSymbolAddress(AssemblyContext *ctx, int section, TokenView label, int address)
+{
+    Symbol *symbol = findSymbol(&ctx->sections[section].symbols, viewText(&ctx->source, label), label.length);
+    if (symbol && symbol->address >= 0)
+        symbol->address = address;
+}
+
+// Lays the parsed lines out again after instruction sizes changed, moving
+// labels, EQU values, literal pools, ORG targets and section lengths
+// without reading the source. An EQU that refers forward is read before the
+// labels after it have moved, so the walk repeats until every EQU agrees
+// with its expression; returns the number of walks.
+int layoutLines(AssemblyContext *ctx)
+{
+    LineStore *store = &ctx->lines;
+    int *equLocctr = NULL;
+    int equCount, equCapacity = 0;
+    int walks = 0;
+    int changed;
+    do
+    {
+        int section = 0;
+        equCount = 0;
+        int locctr = ctx->sections[0].startAddress;
+        int orgReturn = -1;
+        int literal = 0;
+        ctx->sections[0].highest = 0;
+        for (int i = 0; i < store->count; i++)
+        {
+            LineInfo *line = &store->lines[i];
+            if (i == 0 && line->directive == DIR_START)
+                continue;
+            if (line->directive == DIR_CSECT)
+            {
+                ControlSection *ended = &ctx->sections[section++];
+                ended->length = (locctr > ended->highest ? locctr : ended->highest) - ended->startAddress;
+                ctx->sections[section].highest = 0;
+                locctr = 0;
+                orgReturn = -1;
+            }
+            line->address = locctr;
+            if (line->label.length > 0 && line->directive != DIR_EQU)
+                setSymbolAddress(ctx, section, line->label, locctr);
+
+            ExpressionValue result;
+            switch (line->directive)
+            {
+            case DIR_NONE:
+                locctr += line->format;
+                break;
+            case DIR_BYTE:
+                if (line->operandKind == OPERAND_CHARS)
+                    locctr += line->operand.length - 3;
+                else if (line->operandKind == OPERAND_HEX)
+                    locctr += (line->operand.length - 3) / 2;
+                break;
+            case DIR_WORD:
+                locctr += 3;
+                break;
+            case DIR_RESW:
+            case DIR_RESB:
+                locctr += reservedBytes(ctx, section, line, locctr, NULL);
+                break;
+            case DIR_LITERAL:
+                ctx->literals.items[literal].address = locctr;
+                locctr += ctx->literals.items[literal++].length;
+                break;
+            case DIR_EQU:
+                growArray((void **)&equLocctr, equCount, &equCapacity, sizeof(int), "EQU layout");
+                equLocctr[equCount++] = locctr;
+                if (evaluateExpression(ctx, section, locctr, line->operand, &result) == EXPR_OK)
+                {
+                    line->address = result.value & 0xFFFFFF;
+                    setSymbolAddress(ctx, section, line->label, line->address);
+                }
+                break;
+            case DIR_ORG:
+                if (locctr > ctx->sections[section].highest)
+                    ctx->sections[section].highest = locctr;
+                if (line->operand.length == 0)
+                {
+                    if (orgReturn >= 0)
+                        locctr = orgReturn;
+                    orgReturn = -1;
+                }
+                else if (evaluateExpression(ctx, section, locctr, line->operand, &result) == EXPR_OK && result.value >= 0)
+                {
+                    orgReturn = locctr;
+                    locctr = result.value;
+                }
+                break;
+            case DIR_END:
+                if (line->operand.length > 0 && lookupSymbolView(ctx, 0, line->operand) >= 0)
+                    ctx->execAddress = lookupSymbolView(ctx, 0, line->operand);
+                break;
+            default:
+                break;
+            }
+        }
+        ControlSection *last = &ctx->sections[section];
+        last->length = (locctr > last->highest ? locctr : last->highest) - last->startAddress;
+        walks++;
+
+        changed = 0;
+        section = 0;
+        equCount = 0;
+        for (int i = 0; i < store->count && !changed; i++)
+        {
+            const LineInfo *line = &store->lines[i];
+            ExpressionValue result;
+            if (line->directive == DIR_CSECT)
+                section++;
+            else if (line->directive == DIR_EQU &&
+                     evaluateExpression(ctx, section, equLocctr[equCount++], line->operand, &result) == EXPR_OK)
+                changed = (result.value & 0xFFFFFF) != line->address;
+        }
+    } while (changed);
+    free(equLocctr);
+    return walks;
+}
+
+// -R starts every format 3/4 instruction as format 3 and promotes to format
+// 4 only those whose operand does not fit: a displacement neither PC nor
+// BASE relative can reach, a constant over 4095 or an external symbol. Each
+// round probes the format 3 lines with encodeLine, promotes what it must and
+// lays the program out again; promotion only ever grows the program, so the
+// rounds stop at the first that promotes nothing.
+void relaxFormats(AssemblyContext *ctx)
+{
+    LineStore *store = &ctx->lines;
+    ctx->relaxCandidates = 0;
+    ctx->relaxPromoted = 0;
+    ctx->relaxRounds = 0;
+    for (int i = 0; i < store->count; i++)
+        ctx->relaxCandidates += store->lines[i].directive == DIR_NONE && store->lines[i].format == 3;
+    if (ctx->diagnostics.count > 0)
+        return;
+
+    for (;;)
+    {
+        PassTwoChunk probe = {0};
+        unsigned char objCode[MAX_LINE_LENGTH];
+        int objLength;
+        Modification mod;
+        int promoted = 0;
+        for (int i = 0; i < store->count; i++)
+        {
+            LineInfo *line = &store->lines[i];
+            int directive = line->directive;
+            if (directive == DIR_NONE ? line->format != 3
+                                      : directive != DIR_BASE && directive != DIR_NOBASE && directive != DIR_CSECT &&
+                                            directive != DIR_LTORG)
+                continue;
+            probe.needsFormat4 = 0;
+            encodeLine(ctx, &probe, line, objCode, &objLength, &mod);
+            if (probe.needsFormat4)
+            {
+                line->format = 4;
+                promoted++;
+            }
+        }
+        freeDiagnostics(&probe.diagnostics);
+        ctx->relaxRounds++;
+        if (promoted == 0)
+            return;
+        ctx->relaxPromoted += promoted;
+        layoutLines(ctx);
+    }
+}
+
+void reserveText(TextBuffer *buffer, size_t extra)
+{
+    if (buffer->size + extra <= buffer->capacity)
+        return;
+    size_t capacity = buffer->capacity ? buffer->capacity : 64 * 1024;
+    while (buffer->size + extra > capacity)
+        capacity *= 2;
+    buffer->data = (char *)realloc(buffer->data, capacity);
+    if (!buffer->data)
+    {
+        fprintf(stderr, "Memory allocation error for output buffer\n");
+        exit(1);
+    }
+    buffer->capacity = capacity;
+}
+
+int writeAll(int fd, const char *data, size_t length)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        written += (size_t)n;
+    }
+    return 1;
+}
+
+// A block stays counted in its buffer's pending until it is written, so
+// drainOutput can wait for that buffer's blocks alone.
+void *outputWriterThread(void *arg)
+{
+    OutputWriter *writer = (OutputWriter *)arg;
+    pthread_mutex_lock(&writer->lock);
+    for (;;)
+    {
+        while (writer->count == 0)
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        OutputBlock block = writer->ring[writer->head];
+        pthread_mutex_unlock(&writer->lock);
+        int ok = writeAll(block.out->fd, block.data, block.size);
+
+        pthread_mutex_lock(&writer->lock);
+        if (!ok)
+            block.out->failed = 1;
+        block.out->pending--;
+        writer->head = (writer->head + 1) % OUTPUT_RING_SLOTS;
+        writer->count--;
+        if (writer->spareCount < OUTPUT_RING_SLOTS)
+            writer->spares[writer->spareCount++] = block;
+        else
+            free(block.data);
+        pthread_cond_broadcast(&writer->changed);
+    }
+    return NULL;
+}
+
+// Outputs opened after this write from a background thread. The thread
+// lives until the process exits; every closeOutput waits for its own data.
+void startOutputWriter(void)
+{
+    static OutputWriter writer;
+    if (outputWriter)
+        return;
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.changed, NULL);
+    if (pthread_create(&writer.thread, NULL, outputWriterThread, &writer) != 0)
+        return;
+    pthread_detach(writer.thread);
+    outputWriter = &writer;
+}
+
+int openOutput(OutputBuffer *out, const char *path)
+{
+    memset(out, 0, sizeof(*out));
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out->fd < 0)
+        return 0;
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->data = (char *)malloc(out->capacity);
+    if (!out->data)
+    {
+        close(out->fd);
+        errno = ENOMEM;
+        return 0;
+    }
+    out->writer = outputWriter;
+    return 1;
+}
+
+// With a writer thread the full buffer is queued and a spare block takes
+// its place; failures surface in a later flush, drainOutput or closeOutput.
+int flushOutput(OutputBuffer *out)
+{
+    OutputWriter *writer = out->writer;
+    if (!writer)
+    {
+        if (!out->failed && !writeAll(out->fd, out->data, out->size))
+            out->failed = 1;
+        out->written += out->size;
+        out->size = 0;
+        return !out->failed;
+    }
+    if (out->size == 0)
+        return !out->failed;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->count == OUTPUT_RING_SLOTS)
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    OutputBlock *block = &writer->ring[(writer->head + writer->count++) % OUTPUT_RING_SLOTS];
+    block->out = out;
+    block->data = out->data;
+    block->size = out->size;
+    block->capacity = out->capacity;
+    out->pending++;
+    out->data = NULL;
+    if (writer->spareCount > 0)
+    {
+        OutputBlock *spare = &writer->spares[--writer->spareCount];
+        out->data = spare->data;
+        out->capacity = spare->capacity;
+    }
+    int failed = out->failed;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+
+    if (!out->data)
+    {
+        out->capacity = OUTPUT_BUFFER_SIZE;
+        out->data = (char *)malloc(out->capacity);
+        if (!out->data)
+        {
+            fprintf(stderr, "Memory allocation error for output buffer\n");
+            exit(1);
+        }
+    }
+    out->written += out->size;
+    out->size = 0;
+    return !failed;
+}
+
+// Flushes and waits until the writer thread has written every block of
+// this buffer; blocks other outputs have queued do not hold it up.
+int drainOutput(OutputBuffer *out)
+{
+    int ok = flushOutput(out);
+    OutputWriter *writer = out->writer;
+    if (!writer)
+        return ok;
+    pthread_mutex_lock(&writer->lock);
+    while (out->pending > 0)
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    ok = !out->failed;
+    pthread_mutex_unlock(&writer->lock);
+    return ok;
+}
+
+char *reserveOutput(OutputBuffer *out, size_t length)
+{
+    if (out->size + length > out->capacity)
+    {
+        flushOutput(out);
+        if (length > out->capacity)
+        {
+            out->capacity = length;
+            out->data = (char *)realloc(out->data, out->capacity);
+            if (!out->data)
+            {
+                fprintf(stderr, "Memory allocation error for output buffer\n");
+                exit(1);
+            }
+        }
+    }
+    return out->data + out->size;
+}
+
+void writeOutput(OutputBuffer *out, const char *data, size_t length)
+{
+    memcpy(reserveOutput(out, length), data, length);
+    out->size += length;
+}
+
+int closeOutput(OutputBuffer *out)
+{
+    int ok = drainOutput(out);
+    ok = close(out->fd) == 0 && ok;
+    free(out->data);
+    out->data = NULL;
+    return ok;
+}
+
+// Overwrites bytes already written, such as a length only known at the end.
+int patchOutput(OutputBuffer *out, size_t offset, const char *data, size_t length)
+{
+    if (!drainOutput(out))
+        return 0;
+    if (pwrite(out->fd, data, length, (off_t)offset) != (ssize_t)length)
+        out->failed = 1;
+    return !out->failed;
+}
+
+void writeHex(char *out, unsigned int value, int digits)
+{
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        out[i] = hexDigits[value & 0xF];
+        value >>= 4;
+    }
+}
+
+// The hex and whitespace kernels below have SSE2 and AVX2 versions chosen
+// by the CPU the program runs on; SIC_SIMD=scalar|sse2|avx2 lowers the
+// choice for testing. Each vector kernel handles whole blocks and leaves the
+// tail, and every input shorter than SIMD_MIN_BYTES, to the scalar code.
+int detectSimdLevel(void)
+{
+    int level = SIMD_SCALAR;
+#ifdef SIC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        level = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        level = SIMD_SSE2;
+#endif
+    const char *forced = getenv("SIC_SIMD");
+    for (int i = 0; forced && i < level; i++)
+    {
+        if (strcmp(forced, simdLevelNames[i]) == 0)
+            level = i;
+    }
+    return level;
+}
+
+int currentSimdLevel(void)
+{
+    int level = atomic_load_explicit(&simdLevel, memory_order_relaxed);
+    if (level < 0)
+    {
+        level = detectSimdLevel();
+        atomic_store_explicit(&simdLevel, level, memory_order_relaxed);
+    }
+    return level;
+}
+
+#ifdef SIC_X86
+// Nibbles become '0'-'9' by adding '0' and 'A'-'F' by adding 7 more.
+__attribute__((target("sse2"))) size_t encodeHexSse2(char *out, const unsigned char *bytes, size_t count)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letters = _mm_set1_epi8('A' - '9' - 1);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        __m128i low = _mm_and_si128(v, mask);
+        high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letters));
+        low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letters));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+    }
+    return i;
+}
+
+// The unpacks work within 128-bit lanes, so the halves are put back in order.
+__attribute__((target("avx2"))) size_t encodeHexAvx2(char *out, const unsigned char *bytes, size_t count)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i letters = _mm256_set1_epi8('A' - '9' - 1);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+        __m256i low = _mm256_and_si256(v, mask);
+        high = _mm256_add_epi8(_mm256_add_epi8(high, zero), _mm256_and_si256(_mm256_cmpgt_epi8(high, nine), letters));
+        low = _mm256_add_epi8(_mm256_add_epi8(low, zero), _mm256_and_si256(_mm256_cmpgt_epi8(low, nine), letters));
+        __m256i first = _mm256_unpacklo_epi8(high, low);
+        __m256i second = _mm256_unpackhi_epi8(high, low);
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    return i;
+}
+
+// Digits and either case of A-F become nibbles; anything else clears its
+// byte of the valid mask. Bytes of 0x80 and up compare as negative and fail
+// both ranges. Each 16-bit pair is then folded into one byte and packed.
+__attribute__((target("sse2"))) long decodeHexSse2(const char *text, size_t length, unsigned char *bytes)
+{
+    const __m128i belowZero = _mm_set1_epi8('0' - 1), aboveNine = _mm_set1_epi8('9' + 1);
+    const __m128i belowA = _mm_set1_epi8('a' - 1), aboveF = _mm_set1_epi8('f' + 1);
+    const __m128i lower = _mm_set1_epi8(0x20), zero = _mm_set1_epi8('0'), letter = _mm_set1_epi8('a' - 10);
+    const __m128i lowByte = _mm_set1_epi16(0x00F0);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m128i packed[2];
+        for (int half = 0; half < 2; half++)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i *)(text + i + 16 * half));
+            __m128i folded = _mm_or_si128(c, lower);
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, belowZero), _mm_cmplt_epi8(c, aboveNine));
+            __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, belowA), _mm_cmplt_epi8(folded, aboveF));
+            if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xFFFF)
+                return -1;
+            __m128i value = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, zero)),
+                                         _mm_and_si128(alpha, _mm_sub_epi8(folded, letter)));
+            packed[half] = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(value, 4), lowByte), _mm_srli_epi16(value, 8));
+        }
+        _mm_storeu_si128((__m128i *)(bytes + i / 2), _mm_packus_epi16(packed[0], packed[1]));
+    }
+    return (long)i;
+}
+
+__attribute__((target("avx2"))) long decodeHexAvx2(const char *text, size_t length, unsigned char *bytes)
+{
+    const __m256i belowZero = _mm256_set1_epi8('0' - 1), aboveNine = _mm256_set1_epi8('9' + 1);
+    const __m256i belowA = _mm256_set1_epi8('a' - 1), aboveF = _mm256_set1_epi8('f' + 1);
+    const __m256i lower = _mm256_set1_epi8(0x20), zero = _mm256_set1_epi8('0'), letter = _mm256_set1_epi8('a' - 10);
+    const __m256i lowByte = _mm256_set1_epi16(0x00F0);
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m256i packed[2];
+        for (int half = 0; half < 2; half++)
+        {
+            __m256i c = _mm256_loadu_si256((const __m256i *)(text + i + 32 * half));
+            __m256i folded = _mm256_or_si256(c, lower);
+            __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, belowZero), _mm256_cmpgt_epi8(aboveNine, c));
+            __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(folded, belowA), _mm256_cmpgt_epi8(aboveF, folded));
+            if (_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != -1)
+                return -1;
+            __m256i value = _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, zero)),
+                                            _mm256_and_si256(alpha, _mm256_sub_epi8(folded, letter)));
+            packed[half] =
+                _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(value, 4), lowByte), _mm256_srli_epi16(value, 8));
+        }
+        // packus interleaves the lanes of its two inputs; restore their order.
+        __m256i result = _mm256_permute4x64_epi64(_mm256_packus_epi16(packed[0], packed[1]), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(bytes + i / 2), result);
+    }
+    return (long)i;
+}
+
+// Finds the first of ' ', '\t' and '\n' through '\r' at or after pos; with
+// blanksOnly, the first byte that is not one of them or is a newline.
+// Returns the position of the block end when no block matches.
+__attribute__((target("sse2"))) size_t findSpaceSse2(const char *data, size_t pos, size_t size, int blanksOnly)
+{
+    const __m128i space = _mm_set1_epi8(' '), newline = _mm_set1_epi8('\n');
+    const __m128i belowTab = _mm_set1_epi8('\t' - 1), aboveReturn = _mm_set1_epi8('\r' + 1);
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(data + pos));
+        __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(c, space),
+                                     _mm_and_si128(_mm_cmpgt_epi8(c, belowTab), _mm_cmplt_epi8(c, aboveReturn)));
+        int mask = _mm_movemask_epi8(blank);
+        if (blanksOnly)
+            mask = (~mask & 0xFFFF) | _mm_movemask_epi8(_mm_cmpeq_epi8(c, newline));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return pos;
+}
+
+__attribute__((target("avx2"))) size_t findSpaceAvx2(const char *data, size_t pos, size_t size, int blanksOnly)
+{
+    const __m256i space = _mm256_set1_epi8(' '), newline = _mm256_set1_epi8('\n');
+    const __m256i belowTab = _mm256_set1_epi8('\t' - 1), aboveReturn = _mm256_set1_epi8('\r' + 1);
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(data + pos));
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(c, space), _mm256_and_si256(_mm256_cmpgt_epi8(c, belowTab),
+                                                                                      _mm256_cmpgt_epi8(aboveReturn, c)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(blank);
+        if (blanksOnly)
+            mask = ~mask | (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, newline));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return pos;
+}
+#endif
+
+// The end of the token at pos: the first whitespace byte, newline included.
+size_t findSpace(const char *data, size_t pos, size_t size)
+{
+#ifdef SIC_X86
+    if (size - pos >= SIMD_MIN_BYTES)
+    {
+        int level = currentSimdLevel();
+        if (level == SIMD_AVX2)
+            pos = findSpaceAvx2(data, pos, size, 0);
+        else if (level == SIMD_SSE2)
+            pos = findSpaceSse2(data, pos, size, 0);
+    }
+#endif
+    while (pos < size && !isspace((unsigned char)data[pos]))
+        pos++;
+    return pos;
+}
+
+// The next token or newline after the blanks at pos.
+size_t skipBlanks(const char *data, size_t pos, size_t size)
+{
+#ifdef SIC_X86
+    if (size - pos >= SIMD_MIN_BYTES)
+    {
+        int level = currentSimdLevel();
+        if (level == SIMD_AVX2)
+            pos = findSpaceAvx2(data, pos, size, 1);
+        else if (level == SIMD_SSE2)
+            pos = findSpaceSse2(data, pos, size, 1);
+    }
+#endif
+    while (pos < size && data[pos] != '\n' && isspace((unsigned char)data[pos]))
+        pos++;
+    return pos;
+}
+
+void encodeHex(char *out, const unsigned char *bytes, size_t count)
+{
+#ifdef SIC_X86
+    if (count >= SIMD_MIN_BYTES)
+    {
+        int level = currentSimdLevel();
+        size_t done = level == SIMD_AVX2 ? encodeHexAvx2(out, bytes, count)
+                      : level == SIMD_SSE2 ? encodeHexSse2(out, bytes, count)
+                                           : 0;
+        out += 2 * done;
+        bytes += done;
+        count -= done;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        memcpy(out + 2 * i, &hexPairs[2 * bytes[i]], 2);
+}
+
+char *writeField(char *out, const char *text, int length, int width, int upper)
+{
+    for (int i = 0; i < length; i++)
+        out[i] = upper ? toupper((unsigned char)text[i]) : text[i];
+    for (int i = length; i < width; i++)
+        out[i] = ' ';
+    return out + (length > width ? length : width);
+}
+
+// The listing copy of each record is optional; the linker writes none. A
+// binary writer has written its own record and only lists this one.
+void writeRecord(RecordWriter *writer, const char *record, size_t length)
+{
+    if (!writer->binary)
+        writeOutput(writer->obj, record, length);
+    if (writer->lst)
+        writeOutput(writer->lst, record, length);
+}
+
+void writeHeaderRecord(RecordWriter *writer, const char *name, int start, int length)
+{
+    int nameLength = (int)strlen(name);
+    char *line, *p;
+    if (writer->binary)
+    {
+        if (writer->obj->written + writer->obj->size == 0)
+            writeBinaryHeader(writer->obj, 0, 0);
+        writeBinaryRecord(writer->obj, 'H', 0, name, nameLength, start, length, NULL);
+        writer->sections++;
+    }
+    else
+    {
+        line = reserveOutput(writer->obj, nameLength + 20);
+        p = writeField(line + 1, name, nameLength, 6, 0);
+        line[0] = 'H';
+        writeHex(p, start & 0xFFFFFF, 6);
+        writeHex(p + 6, length & 0xFFFFFF, 6);
+        p[12] = '\n';
+        writer->obj->size += p + 13 - line;
+    }
+    if (!writer->lst)
+        return;
+
+    line = reserveOutput(writer->lst, nameLength + 20);
+    p = writeField(line + 1, name, nameLength, 6, 0);
+    line[0] = 'H';
+    p[0] = ' ';
+    writeHex(p + 1, start & 0xFFFFFF, 6);
+    p[7] = ' ';
+    writeHex(p + 8, length & 0xFFFFFF, 6);
+    p[14] = '\n';
+    writer->lst->size += p + 15 - line;
+}
+
+// Binary text goes out in runs of up to MAX_BINARY_TEXT bytes, one record
+// each; the listing still gets the 30-byte text records.
+void flushTextRecord(RecordWriter *writer)
+{
+    flushBinaryText(writer);
+    flushTextLine(writer);
+}
+
+void flushBinaryText(RecordWriter *writer)
+{
+    if (writer->text.size == 0)
+        return;
+    writeBinaryRecord(writer->obj, 'T', 0, NULL, 0, writer->textAddress, (int)writer->text.size,
+                      (const unsigned char *)writer->text.data);
+    writer->textBytes += writer->text.size;
+    writer->text.size = 0;
+}
+
+void flushTextLine(RecordWriter *writer)
+{
+    if (writer->recordBytes == 0)
+        return;
+    if (writer->cache)
+    {
+        AssemblyCache *cache = writer->cache;
+        growArray((void **)&cache->records, cache->recordCount, &cache->recordCapacity, sizeof(CachedRecord), "cache records");
+        CachedRecord *record = &cache->records[cache->recordCount++];
+        record->address = writer->recordAddress;
+        record->count = writer->recordBytes;
+        record->objOffset = writer->obj->written + writer->obj->size;
+        record->lstOffset = writer->lst ? writer->lst->written + writer->lst->size : 0;
+    }
+    writeHex(writer->record + 7, writer->recordBytes, 2);
+    int length = 9 + 2 * writer->recordBytes;
+    writer->record[length++] = '\n';
+    writeRecord(writer, writer->record, length);
+    writer->recordBytes = 0;
+}
+
+void appendTextRecord(RecordWriter *writer, int address, const unsigned char *bytes, int count)
+{
+    if (writer->binary)
+    {
+        if (address != writer->textAddress + (int)writer->text.size || writer->text.size + count > MAX_BINARY_TEXT)
+            flushBinaryText(writer);
+        if (writer->text.size == 0)
+            writer->textAddress = address;
+        reserveText(&writer->text, count);
+        memcpy(writer->text.data + writer->text.size, bytes, count);
+        writer->text.size += count;
+        if (!writer->lst)
+            return;
+    }
+    while (count > 0)
+    {
+        if (writer->recordBytes > 0 &&
+            (address != writer->recordAddress + writer->recordBytes ||
+             writer->recordBytes + count > MAX_RECORD_BYTES))
+            flushTextLine(writer);
+        if (writer->recordBytes == 0)
+        {
+            writer->record[0] = 'T';
+            writeHex(writer->record + 1, address & 0xFFFFFF, 6);
+            writer->recordAddress = address;
+        }
+
+        int take = MAX_RECORD_BYTES - writer->recordBytes;
+        if (take > count)
+            take = count;
+        encodeHex(writer->record + 9 + 2 * writer->recordBytes, bytes, take);
+        writer->recordBytes += take;
+        bytes += take;
+        count -= take;
+        address += take;
+    }
+}
+
+// Only the section holding the entry point names it; others end with a bare E.
+void writeEndRecord(RecordWriter *writer, int address)
+{
+    char line[10];
+    line[0] = 'E';
+    if (writer->binary)
+        writeBinaryRecord(writer->obj, 'E', address >= 0, NULL, 0, address < 0 ? 0 : address, 0, NULL);
+    if (address < 0)
+    {
+        line[1] = '\n';
+        writeRecord(writer, line, 2);
+        return;
+    }
+    writeHex(line + 1, address & 0xFFFFFF, 6);
+    line[7] = '\n';
+    if (!writer->binary)
+        writeOutput(writer->obj, line, 8);
+    if (!writer->lst)
+        return;
+
+    line[1] = ' ';
+    writeHex(line + 2, address & 0xFFFFFF, 6);
+    line[8] = '\n';
+    writeOutput(writer->lst, line, 9);
+}
+
+// A binary object file starts with a placeholder header that gets the
+// section count and text size once everything is written.
+void finishRecords(RecordWriter *writer)
+{
+    if (writer->binary)
+        writeBinaryHeader(writer->obj, writer->sections, writer->textBytes);
+}
+
+void freeRecordWriter(RecordWriter *writer)
+{
+    free(writer->modRecords.data);
+    free(writer->text.data);
+    free(writer->binaryMods.data);
+}
+
+int hexDigitValue(unsigned char c)
+{
+    if ((unsigned char)(c - '0') < 10)
+        return c - '0';
+    c |= 0x20;
+    if ((unsigned char)(c - 'a') < 6)
+        return c - 'a' + 10;
+    return -1;
+}
+
+int parseHexBytes(const char *text, size_t length, unsigned char *bytes)
+{
+    if (length % 2 != 0)
+        return 0;
+    size_t i = 0;
+#ifdef SIC_X86
+    if (length >= 2 * SIMD_MIN_BYTES)
+    {
+        int level = currentSimdLevel();
+        long done = level == SIMD_AVX2 ? decodeHexAvx2(text, length, bytes)
+                    : level == SIMD_SSE2 ? decodeHexSse2(text, length, bytes)
+                                         : 0;
+        if (done < 0)
+            return 0;
+        i = (size_t)done;
+    }
+#endif
+    for (; i < length; i += 2)
+    {
+        int high = hexDigitValue(text[i]);
+        int low = hexDigitValue(text[i + 1]);
+        if ((high | low) < 0)
+            return 0;
+        bytes[i / 2] = (unsigned char)((high << 4) | low);
+    }
+    return 1;
+}
+
+// In one-pass mode a symbol or literal without an address yet is a forward
+// reference: the field is encoded with the placeholder and noted in the chunk
+// so the caller can chain it for patching.
+int resolveTarget(const AssemblyContext *ctx, PassTwoChunk *chunk, TokenView view, int literal, int kind, int placeholder)
+{
+    int address = literal ? lookupLiteral(ctx, chunk->pool, view) : lookupSymbolView(ctx, chunk->section, view);
+    if (!chunk->onePass || (address != -1 && address > FORWARD_PENDING))
+        return address;
+    chunk->forwardKind = kind;
+    chunk->forwardLiteral = literal;
+    chunk->forwardName = view;
+    return placeholder;
+}
+
+int encodeLine(const AssemblyContext *ctx, PassTwoChunk *chunk, const LineInfo *currentLine, unsigned char *objCode, int *objLength,
+               Modification *mod)
+{
+    const SourceFile *source = &ctx->source;
+    const char *operand = viewText(source, currentLine->operand);
+    int operandLength = currentLine->operand.length;
+    *objLength = 0;
+    mod->halfBytes = 0;
+    mod->expression = 0;
+
+    if (currentLine->directive == DIR_START ||
+        currentLine->directive == DIR_END ||
+        currentLine->directive == DIR_EXTDEF ||
+        currentLine->directive == DIR_EXTREF)
+        return 0;
+
+    if (currentLine->directive == DIR_CSECT)
+    {
+        chunk->section++;
+        chunk->pool++;
+        chunk->useBase = 0;
+        chunk->baseName.length = 0;
+        return 0;
+    }
+
+    if (currentLine->directive == DIR_LTORG)
+    {
+        chunk->pool++;
+        return 0;
+    }
+
+    if (currentLine->directive == DIR_LITERAL)
+    {
+        *objLength = parseLiteral(operand, operandLength, objCode);
+        return 1;
+    }
+
+    if (currentLine->directive == DIR_BYTE)
+    {
+        if (currentLine->operandKind == OPERAND_CHARS)
+        {
+            *objLength = operandLength - 3;
+            memcpy(objCode, &operand[2], *objLength);
+        }
+        else if (currentLine->operandKind == OPERAND_HEX)
+        {
+            if (parseHexBytes(&operand[2], operandLength - 3, objCode))
+                *objLength = (operandLength - 3) / 2;
+            else
+                addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Invalid hex constant '%.*s'", operandLength, operand);
+        }
+    }
+    else if (currentLine->directive == DIR_WORD)
+    {
+        int value;
+        if (currentLine->operandKind == OPERAND_EXPRESSION)
+        {
+            ExpressionValue result;
+            int status = evaluateExpression(ctx, chunk->section, currentLine->address, currentLine->operand, &result);
+            if (status == EXPR_EXTERNAL && result.externals > 0)
+            {
+                mod->address = currentLine->address;
+                mod->halfBytes = 6;
+                mod->symbol = currentLine->operand;
+                mod->expression = 1;
+                mod->relative = (signed char)result.relative;
+                status = EXPR_OK;
+            }
+            else if (status != EXPR_OK)
+                reportExpression(&chunk->diagnostics, currentLine->lineNum, source, currentLine->operand, status, &result);
+            else if (result.relative)
+            {
+                mod->address = currentLine->address;
+                mod->halfBytes = 6;
+                mod->symbol.length = 0;
+            }
+            value = status == EXPR_OK ? result.value : 0;
+        }
+        else if (currentLine->operandKind == OPERAND_SYMBOL)
+        {
+            // A symbolic WORD holds an address, so it is relocated by the loader.
+            value = resolveTarget(ctx, chunk, currentLine->operand, 0, FORWARD_WORD, 0);
+            if (value == -1)
+            {
+                addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Undefined symbol '%.*s'", operandLength, operand);
+                value = 0;
+            }
+            else if (value == EXTERNAL_ADDRESS || !isAbsoluteSymbol(ctx, chunk->section, currentLine->operand))
+            {
+                mod->address = currentLine->address;
+                mod->halfBytes = 6;
+                mod->symbol = currentLine->operand;
+                if (value == EXTERNAL_ADDRESS)
+                    value = 0;
+                else
+                    mod->symbol.length = 0;
+            }
+        }
+        else if (!parseNumber(operand, operandLength, 10, &value))
+        {
+            addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Invalid operand '%.*s'", operandLength, operand);
+            value = 0;
+        }
+        objCode[0] = (value >> 16) & 0xFF;
+        objCode[1] = (value >> 8) & 0xFF;
+        objCode[2] = value & 0xFF;
+        *objLength = 3;
+    }
+    else if (currentLine->directive == DIR_BASE)
+    {
+        // A forward BASE is not usable until its symbol is defined; fields
+        // patched later look the base up again by name.
+        int address = currentLine->operandKind == OPERAND_EXPRESSION ? operandAddress(ctx, chunk->section, currentLine)
+                                                                     : resolveTarget(ctx, chunk, currentLine->operand, 0, FORWARD_BASE, -1);
+        chunk->baseName = currentLine->operand;
+        if (address >= 0)
+        {
+            chunk->baseAddress = address;
+            chunk->useBase = 1;
+        }
+        else if (chunk->forwardKind == FORWARD_BASE)
+            chunk->useBase = 0;
+        else
+            addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Undefined symbol '%.*s' for BASE directive", operandLength, operand);
+        return 0;
+    }
+    else if (currentLine->directive == DIR_NOBASE)
+    {
+        chunk->useBase = 0;
+        chunk->baseName.length = 0;
+        return 0;
+    }
+    else if (currentLine->directive == DIR_NONE && currentLine->format != 0)
+    {
+        int opcodeValue = currentLine->opcode;
+        int format = currentLine->format;
+        if (format == 1)
+        {
+            objCode[0] = opcodeValue;
+            *objLength = 1;
+        }
+        else if (format == 2)
+        {
+            int r1, r2;
+            if (!parseRegisterOperands(operand, operandLength, opcodeValue, &r1, &r2))
+            {
+                addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Invalid register operand '%.*s'", operandLength, operand);
+                r1 = r2 = 0;
+            }
+            objCode[0] = opcodeValue;
+            objCode[1] = (r1 << 4) | r2;
+            *objLength = 2;
+        }
+        else if (format == 3 || format == 4)
+        {
+            int ni = currentLine->addressing;
+            int x = currentLine->indexed, b = 0, p = 0, e = format == 4;
+            int disp = 0;
+
+            TokenView target = operandTarget(currentLine);
+            const char *targetText = viewText(source, target);
+            int targetAddress = 0;
+            int constant = currentLine->operandKind == OPERAND_NUMBER;
+            int literal = currentLine->operandKind == OPERAND_LITERAL;
+            if (currentLine->operandKind == OPERAND_EXPRESSION)
+            {
+                // Absolute expressions are constants; relative ones are
+                // addresses that format 4 relocates.
+                ExpressionValue result;
+                int status = evaluateExpression(ctx, chunk->section, currentLine->address, target, &result);
+                if (status == EXPR_EXTERNAL && result.externals > 0 && format == 4)
+                {
+                    mod->address = currentLine->address + 1;
+                    mod->halfBytes = 5;
+                    mod->symbol = target;
+                    mod->expression = 1;
+                    mod->relative = (signed char)result.relative;
+                    result.relative = 1;
+                }
+                else if (status == EXPR_EXTERNAL && result.externals > 0)
+                {
+                    addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "External symbol '%.*s' requires format 4",
+                                  (int)result.term.length, viewText(source, result.term));
+                    chunk->needsFormat4 = 1;
+                    result.value = currentLine->address + 3;
+                    result.relative = 1;
+                }
+                else if (status != EXPR_OK)
+                {
+                    reportExpression(&chunk->diagnostics, currentLine->lineNum, source, target, status, &result);
+                    result.value = format == 4 ? 0 : currentLine->address + 3;
+                    result.relative = 1;
+                }
+                else if (format == 4 && result.relative)
+                {
+                    mod->address = currentLine->address + 1;
+                    mod->halfBytes = 5;
+                    mod->symbol.length = 0;
+                }
+                targetAddress = result.value;
+                constant = !result.relative;
+            }
+            else if (constant)
+            {
+                if (!parseNumber(targetText, target.length, 10, &targetAddress))
+                {
+                    addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Invalid operand '%.*s'", operandLength, operand);
+                    targetAddress = 0;
+                }
+            }
+            else if (currentLine->operandKind != OPERAND_NONE)
+            {
+                // Pass one has already reported a malformed literal.
+                targetAddress = resolveTarget(ctx, chunk, target, literal,
+                                              format == 4 ? FORWARD_EXTENDED : FORWARD_PC_RELATIVE,
+                                              format == 4 ? 0 : currentLine->address + 3);
+                if (targetAddress == -1 && literal)
+                    targetAddress = currentLine->address + 3;
+                else if (targetAddress == -1)
+                    addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Undefined symbol '%.*s'",
+                                  (int)target.length, targetText);
+                else if (targetAddress >= 0 && isAbsoluteSymbol(ctx, chunk->section, target))
+                {
+                    targetAddress = signExtend24(targetAddress);
+                    constant = 1;
+                }
+                else if (format == 4)
+                {
+                    // Format 4 addresses are absolute, so the loader must relocate
+                    // them or fill in the external symbol.
+                    mod->address = currentLine->address + 1;
+                    mod->halfBytes = 5;
+                    mod->symbol = target;
+                    if (targetAddress == EXTERNAL_ADDRESS)
+                        targetAddress = 0;
+                    else
+                        mod->symbol.length = 0;
+                }
+                else if (targetAddress == EXTERNAL_ADDRESS)
+                {
+                    addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "External symbol '%.*s' requires format 4",
+                                  (int)target.length, targetText);
+                    chunk->needsFormat4 = 1;
+                    targetAddress = currentLine->address + 3;
+                }
+            }
+
+            if (format == 3 && (constant || target.length == 0))
+            {
+                disp = targetAddress;
+                if (disp < 0 || disp > 4095)
+                {
+                    disp = 0;
+                    addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Constant out of range '%.*s'", operandLength, operand);
+                    chunk->needsFormat4 = 1;
+                }
+            }
+            else if (format == 3)
+            {
+                disp = targetAddress - (currentLine->address + 3);
+                if (disp >= -2048 && disp <= 2047)
+                {
+                    p = 1;
+                }
+                else if (chunk->useBase && (targetAddress - chunk->baseAddress) >= 0 && (targetAddress - chunk->baseAddress) <= 4095)
+                {
+                    disp = targetAddress - chunk->baseAddress;
+                    b = 1;
+                }
+                else
+                {
+                    disp = 0;
+                    addDiagnostic(&chunk->diagnostics, currentLine->lineNum, "Displacement out of range for symbol '%.*s'",
+                                  (int)target.length, targetText);
+                    chunk->needsFormat4 = 1;
+                }
+            }
+            else
+            {
+                disp = targetAddress;
+            }
+
+            int xbpe = (x << 3) | (b << 2) | (p << 1) | e;
+            objCode[0] = (opcodeValue & 0xFC) | ni;
+            if (format == 3)
+            {
+                objCode[1] = (xbpe << 4) | ((disp >> 8) & 0xF);
+                objCode[2] = disp & 0xFF;
+                *objLength = 3;
+            }
+            else
+            {
+                objCode[1] = (xbpe << 4) | ((disp >> 16) & 0xF);
+                objCode[2] = (disp >> 8) & 0xFF;
+                objCode[3] = disp & 0xFF;
+                *objLength = 4;
+            }
+        }
+    }
+    return 1;
+}
+
+// With cycles >= 0 (--cost), the object code is padded to 8 columns and
+// followed by the instruction's estimated cycles. Under -R the '+' of the
+// listed mnemonic follows the format chosen, not the source.
+void formatListingLine(TextBuffer *listing, const SourceFile *source, const LineInfo *currentLine,
+                       const unsigned char *objCode, int objLength, int cycles)
+{
+    int labelLength = currentLine->label.length;
+    int mnemonicLength = currentLine->mnemonic.length;
+    int operandLength = currentLine->operand.length;
+    reserveText(listing, 60 + labelLength + mnemonicLength + operandLength + 2 * objLength);
+
+    char *line = listing->data + listing->size;
+    char *p = line;
+    int digits = 4;
+    while (digits < 8 && ((unsigned int)currentLine->address >> (4 * digits)) != 0)
+        digits++;
+    writeHex(p, currentLine->address, digits);
+    p += digits;
+    *p++ = ' ';
+    *p++ = ' ';
+    p = writeField(p, viewText(source, currentLine->label), labelLength, 6, 0);
+    *p++ = ' ';
+    const char *mnemonic = viewText(source, currentLine->mnemonic);
+    int extended = mnemonicLength > 0 && mnemonic[0] == '+';
+    if (currentLine->format >= 3 && currentLine->directive == DIR_NONE && extended != (currentLine->format == 4))
+    {
+        if (extended)
+            p = writeField(p, mnemonic + 1, mnemonicLength - 1, 6, 1);
+        else
+        {
+            *p++ = '+';
+            p = writeField(p, mnemonic, mnemonicLength, 5, 1);
+        }
+    }
+    else
+        p = writeField(p, mnemonic, mnemonicLength, 6, 1);
+    *p++ = ' ';
+    p = writeField(p, viewText(source, currentLine->operand), operandLength, 10, 0);
+    *p++ = ' ';
+    encodeHex(p, objCode, objLength);
+    p += 2 * objLength;
+    if (cycles >= 0)
+    {
+        for (int i = 2 * objLength; i < 8; i++)
+            *p++ = ' ';
+        *p++ = ' ';
+        p = writeDecimal(p, cycles, 0);
+    }
+    *p++ = '\n';
+    listing->size += p - line;
+}
+
+void encodeChunk(void *arg, int job)
+{
+    PassTwoWave *wave = (PassTwoWave *)arg;
+    const AssemblyContext *ctx = wave->ctx;
+    const SourceFile *source = &ctx->source;
+    PassTwoChunk *chunk = &wave->chunks[job];
+    unsigned char objCode[MAX_LINE_LENGTH];
+    int objLength;
+    Modification mod;
+
+    chunk->objBytes.size = 0;
+    chunk->listing.size = 0;
+    chunk->modCount = 0;
+
+    for (int i = chunk->first; i < chunk->last; i++)
+    {
+        const LineInfo *currentLine = &ctx->lines.lines[i];
+        int listed = encodeLine(ctx, chunk, currentLine, objCode, &objLength, &mod);
+
+        if (mod.halfBytes != 0)
+        {
+            if (chunk->modCount == chunk->modCapacity)
+            {
+                chunk->modCapacity = chunk->modCapacity ? chunk->modCapacity * 2 : 256;
+                chunk->mods = (Modification *)realloc(chunk->mods, chunk->modCapacity * sizeof(Modification));
+                if (!chunk->mods)
+                {
+                    fprintf(stderr, "Memory allocation error for modification records\n");
+                    exit(1);
+                }
+            }
+            mod.line = i;
+            chunk->mods[chunk->modCount++] = mod;
+        }
+
+        if (objLength > 0)
+        {
+            reserveText(&chunk->objBytes, objLength);
+            memcpy(chunk->objBytes.data + chunk->objBytes.size, objCode, objLength);
+            chunk->objBytes.size += objLength;
+        }
+        chunk->objEnd[i - chunk->first] = (unsigned int)chunk->objBytes.size;
+
+        if (listed && wave->listing)
+            formatListingLine(&chunk->listing, source, currentLine, objCode, objLength,
+                              ctx->costReport && currentLine->format != 0 ? instructionCycles(currentLine) : -1);
+        chunk->listingEnd[i - chunk->first] = (unsigned int)chunk->listing.size;
+    }
+}
+
+void writeSectionHeader(const AssemblyContext *ctx, RecordWriter *writer, int index)
+{
+    const ControlSection *section = &ctx->sections[index];
+    writeHeaderRecord(writer, section->name, section->startAddress, section->length);
+    writeExternalRecords(ctx, writer, index);
+}
+
+void writeExternalRecords(const AssemblyContext *ctx, RecordWriter *writer, int index)
+{
+    const ControlSection *section = &ctx->sections[index];
+    char record[1 + 12 * 6 + 1];
+    int length = 0;
+
+    for (int i = 0; i < section->defCount; i++)
+    {
+        TokenView name = section->defs[i].name;
+        int address = lookupSymbolView(ctx, index, name);
+        if (address < 0)
+            continue;
+        if (length == 0)
+            record[length++] = 'D';
+        writeField(record + length, viewText(&ctx->source, name), name.length, 6, 1);
+        if (writer->binary)
+            writeBinaryRecord(writer->obj, 'D', 0, record + length, name.length, address, 0, NULL);
+        writeHex(record + length + 6, address & 0xFFFFFF, 6);
+        length += 12;
+        if (length == 1 + 6 * 12)
+        {
+            record[length++] = '\n';
+            writeRecord(writer, record, length);
+            length = 0;
+        }
+    }
+    if (length > 0)
+    {
+        record[length++] = '\n';
+        writeRecord(writer, record, length);
+        length = 0;
+    }
+
+    for (int i = 0; i < section->refCount; i++)
+    {
+        TokenView name = section->refs[i].name;
+        if (length == 0)
+            record[length++] = 'R';
+        writeField(record + length, viewText(&ctx->source, name), name.length, 6, 1);
+        if (writer->binary)
+            writeBinaryRecord(writer->obj, 'R', 0, record + length, name.length, 0, 0, NULL);
+        length += 6;
+        if (length == 1 + 12 * 6 || i == section->refCount - 1)
+        {
+            record[length++] = '\n';
+            writeRecord(writer, record, length);
+            length = 0;
+        }
+    }
+}
+
+// A binary M record takes in each following field of the same width, sign
+// and symbol, so a section's relocations are mostly four bytes apiece.
+void writeModificationRecord(RecordWriter *writer, int address, int halfBytes, char sign, const char *name, int nameLength)
+{
+    if (writer->binary)
+    {
+        TextBuffer *records = &writer->binaryMods;
+        unsigned char *group = (unsigned char *)records->data + writer->modGroup;
+        int same = records->size > 0 && group[1] == (sign == '-') && (int)getLittle32(group + 4) == halfBytes &&
+                   (group[2] | group[3] << 8) == nameLength;
+        for (int i = 0; same && i < nameLength; i++)
+            same = group[BINARY_RECORD_SIZE + i] == toupper((unsigned char)name[i]);
+        if (!same)
+        {
+            size_t size = (BINARY_RECORD_SIZE + nameLength + 3) & ~(size_t)3;
+            reserveText(records, size);
+            writer->modGroup = records->size;
+            group = (unsigned char *)records->data + writer->modGroup;
+            memset(group, 0, size);
+            group[0] = 'M';
+            group[1] = sign == '-';
+            group[2] = nameLength & 0xFF;
+            group[3] = nameLength >> 8 & 0xFF;
+            putLittle32(group + 4, (unsigned int)halfBytes);
+            writeField((char *)group + BINARY_RECORD_SIZE, name, nameLength, 0, 1);
+            records->size += size;
+        }
+        reserveText(records, 4);
+        group = (unsigned char *)records->data + writer->modGroup;
+        putLittle32(group + 8, getLittle32(group + 8) + 1);
+        putLittle32((unsigned char *)records->data + records->size, (unsigned int)address);
+        records->size += 4;
+        if (!writer->lst)
+            return;
+    }
+
+    TextBuffer *records = &writer->modRecords;
+    reserveText(records, 12 + nameLength);
+    char *p = records->data + records->size;
+    p[0] = 'M';
+    writeHex(p + 1, address & 0xFFFFFF, 6);
+    writeHex(p + 7, halfBytes, 2);
+    p[9] = sign;
+    writeField(p + 10, name, nameLength, 0, 1);
+    p[10 + nameLength] = '\n';
+    records->size += 11 + nameLength;
+}
+
+void appendModificationRecord(RecordWriter *writer, const AssemblyContext *ctx, int section, const Modification *mod)
+{
+    const char *sectionName = ctx->sections[section].name;
+    if (!mod->expression)
+    {
+        const char *name = mod->symbol.length > 0 ? viewText(&ctx->source, mod->symbol) : sectionName;
+        writeModificationRecord(writer, mod->address, mod->halfBytes, '+', name,
+                                mod->symbol.length > 0 ? (int)mod->symbol.length : (int)strlen(name));
+        return;
+    }
+
+    // evaluateExpression has checked that every external term stands alone
+    // between + and - signs, so splitting on those finds them all.
+    if (mod->relative)
+        writeModificationRecord(writer, mod->address, mod->halfBytes, mod->relative > 0 ? '+' : '-', sectionName,
+                                (int)strlen(sectionName));
+    const char *text = viewText(&ctx->source, mod->symbol);
+    char sign = '+';
+    for (unsigned int pos = 0, start = 0; pos <= mod->symbol.length; pos++)
+    {
+        if (pos < mod->symbol.length && text[pos] != '+' && text[pos] != '-')
+            continue;
+        TokenView term = {mod->symbol.offset + start, pos - start};
+        if (term.length > 0 && (isalpha((unsigned char)text[start]) || text[start] == '_') &&
+            lookupSymbolView(ctx, section, term) == EXTERNAL_ADDRESS)
+            writeModificationRecord(writer, mod->address, mod->halfBytes, sign, text + start, (int)term.length);
+        if (pos < mod->symbol.length)
+            sign = text[pos];
+        start = pos + 1;
+    }
+}
+
+void writeModificationRecords(RecordWriter *writer)
+{
+    // The buffers stay unallocated until a section has an M record.
+    if (writer->binary && writer->binaryMods.size > 0)
+        writeOutput(writer->obj, writer->binaryMods.data, writer->binaryMods.size);
+    writer->binaryMods.size = 0;
+    if (writer->modRecords.size > 0)
+        writeRecord(writer, writer->modRecords.data, writer->modRecords.size);
+    writer->modRecords.size = 0;
+}
+
+void finishSection(RecordWriter *writer, int execAddress)
+{
+    flushTextRecord(writer);
+    writeModificationRecords(writer);
+    writeEndRecord(writer, execAddress);
+}
+
+void passTwo(AssemblyContext *ctx, OutputBuffer *objFile, OutputBuffer *lstFile)
+{
+    LineStore *store = &ctx->lines;
+    int threads = ctx->passTwoThreads > 1 ? ctx->passTwoThreads : 1;
+    PassTwoChunk *chunks = (PassTwoChunk *)calloc(threads, sizeof(PassTwoChunk));
+    if (!chunks)
+    {
+        fprintf(stderr, "Memory allocation error for pass two chunks\n");
+        exit(1);
+    }
+    for (int c = 0; c < threads; c++)
+    {
+        chunks[c].objEnd = (unsigned int *)malloc(PASS_TWO_CHUNK_LINES * sizeof(unsigned int));
+        chunks[c].listingEnd = (unsigned int *)malloc(PASS_TWO_CHUNK_LINES * sizeof(unsigned int));
+        if (!chunks[c].objEnd || !chunks[c].listingEnd)
+        {
+            fprintf(stderr, "Memory allocation error for pass two chunks\n");
+            exit(1);
+        }
+    }
+    PassTwoWave wave = {ctx, chunks, lstFile != NULL};
+    RecordWriter writer = {0};
+    writer.obj = objFile;
+    writer.lst = lstFile;
+    writer.cache = ctx->cache;
+    writer.binary = ctx->binaryObject;
+    int cacheBase = -1;
+
+    int baseAddress = 0;
+    int useBase = 0;
+    int section = 0;
+    int pool = 0;
+    int writtenSection = 0;
+
+    writeSectionHeader(ctx, &writer, 0);
+
+    // Lines are encoded in waves of up to one chunk per thread; the waves are
+    // then stitched into records serially, so the output does not depend on
+    // the thread count. Only BASE/NOBASE, CSECT and LTORG carry state between
+    // lines, and the state entering each chunk is found with a cheap serial scan.
+    for (int next = 0; next < store->count;)
+    {
+        int chunkCount = 0;
+        while (chunkCount < threads && next < store->count)
+        {
+            PassTwoChunk *chunk = &chunks[chunkCount++];
+            chunk->first = next;
+            chunk->last = next + PASS_TWO_CHUNK_LINES < store->count ? next + PASS_TWO_CHUNK_LINES : store->count;
+            chunk->useBase = useBase;
+            chunk->baseAddress = baseAddress;
+            chunk->section = section;
+            chunk->pool = pool;
+            for (int i = chunk->first; i < chunk->last; i++)
+            {
+                if (store->lines[i].directive == DIR_BASE)
+                {
+                    int address = operandAddress(ctx, section, &store->lines[i]);
+                    if (address >= 0)
+                    {
+                        baseAddress = address;
+                        useBase = 1;
+                    }
+                }
+                else if (store->lines[i].directive == DIR_NOBASE)
+                {
+                    useBase = 0;
+                }
+                else if (store->lines[i].directive == DIR_CSECT)
+                {
+                    useBase = 0;
+                    section++;
+                    pool++;
+                }
+                else if (store->lines[i].directive == DIR_LTORG)
+                {
+                    pool++;
+                }
+            }
+            next = chunk->last;
+        }
+
+        runWorkerPool(chunkCount, chunkCount, encodeChunk, &wave);
+
+        for (int c = 0; c < chunkCount; c++)
+        {
+            PassTwoChunk *chunk = &chunks[c];
+            unsigned int objStart = 0;
+            unsigned int listingStart = 0;
+            int mod = 0;
+
+            for (int i = chunk->first; i < chunk->last; i++)
+            {
+                LineInfo *currentLine = &store->lines[i];
+                const unsigned char *objCode = (const unsigned char *)chunk->objBytes.data + objStart;
+                int objLength = chunk->objEnd[i - chunk->first] - objStart;
+                objStart = chunk->objEnd[i - chunk->first];
+
+                if (currentLine->directive == DIR_CSECT)
+                {
+                    finishSection(&writer, writtenSection == 0 ? ctx->execAddress : -1);
+                    writeSectionHeader(ctx, &writer, ++writtenSection);
+                    continue;
+                }
+                if (currentLine->directive == DIR_START ||
+                    currentLine->directive == DIR_END)
+                {
+                    flushTextRecord(&writer);
+                    if (ctx->cache)
+                        cacheLine(ctx->cache, currentLine, cacheBase, objCode, 0, 0, 0, 0);
+                    continue;
+                }
+
+                if (objLength > 0)
+                    appendTextRecord(&writer, currentLine->address, objCode, objLength);
+                int modification = 0;
+                while (mod < chunk->modCount && chunk->mods[mod].line == i)
+                {
+                    modification = chunk->mods[mod].halfBytes | (chunk->mods[mod].symbol.length > 0 ? 0x80 : 0);
+                    appendModificationRecord(&writer, ctx, writtenSection, &chunk->mods[mod++]);
+                }
+
+                if (!lstFile)
+                    continue;
+                unsigned int listingEnd = chunk->listingEnd[i - chunk->first];
+                if (ctx->cache)
+                {
+                    cacheLine(ctx->cache, currentLine, cacheBase, objCode, objLength, modification,
+                              lstFile->written + lstFile->size, listingEnd - listingStart);
+                    if (currentLine->directive == DIR_BASE && operandAddress(ctx, 0, currentLine) >= 0)
+                        cacheBase = operandAddress(ctx, 0, currentLine);
+                    else if (currentLine->directive == DIR_NOBASE)
+                        cacheBase = -1;
+                }
+                writeOutput(lstFile, chunk->listing.data + listingStart, listingEnd - listingStart);
+                listingStart = listingEnd;
+            }
+
+            for (int d = 0; d < chunk->diagnostics.count; d++)
+                addDiagnostic(&ctx->diagnostics, chunk->diagnostics.items[d].lineNum, "%s", chunk->diagnostics.items[d].message);
+            freeDiagnostics(&chunk->diagnostics);
+        }
+    }
+
+    finishSection(&writer, writtenSection == 0 ? ctx->execAddress : -1);
+    finishRecords(&writer);
+    if (lstFile && ctx->costReport)
+        writeCostReport(ctx, lstFile);
+
+    for (int c = 0; c < threads; c++)
+    {
+        free(chunks[c].objBytes.data);
+        free(chunks[c].listing.data);
+        free(chunks[c].objEnd);
+        free(chunks[c].listingEnd);
+        free(chunks[c].mods);
+    }
+    free(chunks);
+    freeRecordWriter(&writer);
+}
+
+// The --cost model: a cycle per instruction byte fetched, COST_MEMORY_CYCLES
+// per operand word read or written (two words for the 48-bit floating-point
+// operand, one more for the address an indirect operand reads first and
+// none for an immediate), a cycle for indexing, and the extra cycles of the
+// slow multiply, divide, floating-point and device instructions. It ranks
+// code against other code; it does not time any real machine.
+int instructionCycles(const LineInfo *line)
+{
+    int cycles = line->format;
+    switch (line->opcode)
+    {
+    case 0x20: // MUL
+    case 0x98: // MULR
+        cycles += 4;
+        break;
+    case 0x24: // DIV
+    case 0x9C: // DIVR
+        cycles += 8;
+        break;
+    case 0x58: // ADDF
+    case 0x5C: // SUBF
+    case 0x88: // COMPF
+    case 0xC0: // FLOAT
+    case 0xC4: // FIX
+    case 0xC8: // NORM
+        cycles += 2;
+        break;
+    case 0x60: // MULF
+        cycles += 6;
+        break;
+    case 0x64: // DIVF
+        cycles += 10;
+        break;
+    case 0xB0: // SVC
+    case 0xD8: // RD
+    case 0xDC: // WD
+    case 0xE0: // TD
+    case 0xF0: // SIO
+    case 0xF4: // HIO
+    case 0xF8: // TIO
+        cycles += 20;
+        break;
+    }
+    if (line->format < 3)
+        return cycles;
+
+    int words = 1;
+    if (isJump(line->opcode) || line->opcode == 0x4C) // RSUB
+        words = 0;
+    else if (line->opcode == 0x70 || line->opcode == 0x80 || line->opcode == 0x58 || line->opcode == 0x5C ||
+             line->opcode == 0x60 || line->opcode == 0x64 || line->opcode == 0x88) // LDF STF ADDF SUBF MULF DIVF COMPF
+        words = 2;
+    if (line->addressing == MODE_IMMEDIATE)
+        words = 0;
+    else if (line->addressing == MODE_INDIRECT)
+        words++;
+    return cycles + COST_MEMORY_CYCLES * words + line->indexed;
+}
+
+// J, JEQ, JGT, JLT and JSUB; RSUB returns to wherever the caller was.
+int isJump(int opcode)
+{
+    return opcode == 0x3C || opcode == 0x30 || opcode == 0x34 || opcode == 0x38 || opcode == 0x48;
+}
+
+// The address a jump lands on, or -1 when it is indirect, indexed, external
+// or otherwise not known before the program runs.
+int jumpTarget(const AssemblyContext *ctx, int section, const LineInfo *line)
+{
+    if (line->addressing == MODE_INDIRECT || line->indexed)
+        return -1;
+    TokenView target = operandTarget(line);
+    int value;
+    if (line->operandKind == OPERAND_NUMBER)
+        return parseNumber(viewText(&ctx->source, target), target.length, 10, &value) ? value : -1;
+    if (line->operandKind == OPERAND_SYMBOL)
+        return lookupSymbolView(ctx, section, target);
+    ExpressionValue result;
+    if (line->operandKind != OPERAND_EXPRESSION ||
+        evaluateExpression(ctx, section, line->address, target, &result) != EXPR_OK)
+        return -1;
+    return result.value;
+}
+
+int compareCostSites(const void *a, const void *b)
+{
+    const CostSite *x = (const CostSite *)a, *y = (const CostSite *)b;
+    if (x->section != y->section)
+        return x->section - y->section;
+    if (x->address != y->address)
+        return x->address < y->address ? -1 : 1;
+    return x->index - y->index;
+}
+
+// The first site assembled at address in section, or -1.
+int findCostSite(const CostSite *sorted, int count, int section, int address)
+{
+    int low = 0, high = count;
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (sorted[middle].section < section || (sorted[middle].section == section && sorted[middle].address < address))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < count && sorted[low].section == section && sorted[low].address == address ? sorted[low].index : -1;
+}
+
+// Splits the instructions into basic blocks and links them. A block starts
+// at the first instruction of a section, after a jump or RSUB, where the
+// code stops being contiguous (data, RESW, ORG) and wherever a resolved jump
+// lands. It falls through unless it ends in J or RSUB, and a jump adds an
+// edge to its target; a JSUB is followed into the subroutine as well as
+// past it, since the return comes back there. J to itself halts.
+void buildCostGraph(const AssemblyContext *ctx, CostGraph *graph)
+{
+    const LineStore *store = &ctx->lines;
+    memset(graph, 0, sizeof(*graph));
+    graph->sites = (CostSite *)malloc((store->count + 1) * sizeof(CostSite));
+    unsigned char *leader = (unsigned char *)calloc(store->count + 1, 1);
+    if (!graph->sites || !leader)
+    {
+        fprintf(stderr, "Memory allocation error for cost graph\n");
+        exit(1);
+    }
+
+    int section = 0;
+    for (int i = 0; i < store->count; i++)
+    {
+        const LineInfo *line = &store->lines[i];
+        if (line->directive == DIR_CSECT)
+            section++;
+        if (line->directive != DIR_NONE || line->format == 0)
+            continue;
+        CostSite *site = &graph->sites[graph->siteCount];
+        site->line = i;
+        site->section = section;
+        site->address = line->address;
+        site->target = isJump(line->opcode) ? jumpTarget(ctx, section, line) : -1;
+        site->index = graph->siteCount++;
+    }
+    // Without ORG the sites are already in address order.
+    int count = graph->siteCount;
+    CostSite *sorted = graph->sites, *copy = NULL;
+    for (int k = 1; k < count && !copy; k++)
+    {
+        if (compareCostSites(&graph->sites[k - 1], &graph->sites[k]) > 0)
+        {
+            copy = (CostSite *)malloc(count * sizeof(CostSite));
+            if (!copy)
+            {
+                fprintf(stderr, "Memory allocation error for cost graph\n");
+                exit(1);
+            }
+            memcpy(copy, graph->sites, count * sizeof(CostSite));
+            qsort(copy, count, sizeof(CostSite), compareCostSites);
+            sorted = copy;
+        }
+    }
+
+    for (int k = 0; k < count; k++)
+    {
+        const CostSite *site = &graph->sites[k];
+        const LineInfo *previous = k > 0 ? &store->lines[graph->sites[k - 1].line] : NULL;
+        if (!previous || graph->sites[k - 1].section != site->section ||
+            previous->address + previous->format != site->address || isJump(previous->opcode) ||
+            previous->opcode == 0x4C)
+            leader[k] = 1;
+        if (site->target >= 0)
+        {
+            int target = findCostSite(sorted, count, site->section, site->target);
+            if (target >= 0)
+                leader[target] = 1;
+        }
+    }
+
+    for (int k = 0; k < count; k++)
+        graph->blockCount += leader[k];
+    graph->blocks = (BasicBlock *)calloc(graph->blockCount + 1, sizeof(BasicBlock));
+    graph->edges = (int *)malloc((2 * graph->blockCount + 1) * sizeof(int));
+    if (!graph->blocks || !graph->edges)
+    {
+        fprintf(stderr, "Memory allocation error for cost graph\n");
+        exit(1);
+    }
+    int block = -1;
+    for (int k = 0; k < count; k++)
+    {
+        if (leader[k])
+            graph->blocks[++block].first = k;
+        graph->sites[k].block = block;
+        graph->blocks[block].count++;
+        graph->blocks[block].cycles += instructionCycles(&store->lines[graph->sites[k].line]);
+    }
+
+    for (int b = 0; b < graph->blockCount; b++)
+    {
+        BasicBlock *current = &graph->blocks[b];
+        int last = current->first + current->count - 1;
+        const CostSite *site = &graph->sites[last];
+        const LineInfo *line = &store->lines[site->line];
+        current->edgeStart = graph->edgeCount;
+        if (line->opcode != 0x3C && line->opcode != 0x4C && last + 1 < count &&
+            graph->sites[last + 1].section == site->section &&
+            line->address + line->format == graph->sites[last + 1].address)
+            graph->edges[graph->edgeCount++] = graph->sites[last + 1].block;
+        int target = site->target >= 0 ? findCostSite(sorted, count, site->section, site->target) : -1;
+        if (target >= 0 && !(line->opcode == 0x3C && site->target == line->address))
+            graph->edges[graph->edgeCount++] = graph->sites[target].block;
+        current->edgeCount = graph->edgeCount - current->edgeStart;
+    }
+
+    // Predecessor lists, for walking loop bodies backwards from their latches.
+    graph->predStart = (int *)calloc(graph->blockCount + 1, sizeof(int));
+    graph->preds = (int *)malloc((graph->edgeCount + 1) * sizeof(int));
+    if (!graph->predStart || !graph->preds)
+    {
+        fprintf(stderr, "Memory allocation error for cost graph\n");
+        exit(1);
+    }
+    for (int e = 0; e < graph->edgeCount; e++)
+        graph->predStart[graph->edges[e] + 1]++;
+    for (int b = 0; b < graph->blockCount; b++)
+        graph->predStart[b + 1] += graph->predStart[b];
+    int *fill = (int *)malloc((graph->blockCount + 1) * sizeof(int));
+    if (!fill)
+    {
+        fprintf(stderr, "Memory allocation error for cost graph\n");
+        exit(1);
+    }
+    memcpy(fill, graph->predStart, graph->blockCount * sizeof(int));
+    for (int b = 0; b < graph->blockCount; b++)
+    {
+        for (int e = graph->blocks[b].edgeStart; e < graph->blocks[b].edgeStart + graph->blocks[b].edgeCount; e++)
+            graph->preds[fill[graph->edges[e]]++] = b;
+    }
+    free(fill);
+    free(copy);
+    free(leader);
+}
+
+// Finds the loops of the graph: a depth-first walk from every unvisited
+// block marks the edges that go back to a block still on the walk's stack,
+// and each header's loop body is what reaches those back edges' sources
+// without passing through the header. A block's depth is the number of
+// loops around it.
+void findCostLoops(CostGraph *graph)
+{
+    int blocks = graph->blockCount;
+    unsigned char *color = (unsigned char *)calloc(blocks + 1, 1);
+    int *stack = (int *)malloc((blocks + 1) * sizeof(int));
+    int *nextEdge = (int *)malloc((blocks + 1) * sizeof(int));
+    int *backStart = (int *)calloc(blocks + 2, sizeof(int));
+    int *backFrom = (int *)malloc((graph->edgeCount + 1) * sizeof(int));
+    int *backTo = (int *)malloc((graph->edgeCount + 1) * sizeof(int));
+    if (!color || !stack || !nextEdge || !backStart || !backFrom || !backTo)
+    {
+        fprintf(stderr, "Memory allocation error for cost loops\n");
+        exit(1);
+    }
+
+    int backCount = 0;
+    for (int root = 0; root < blocks; root++)
+    {
+        if (color[root])
+            continue;
+        int depth = 0;
+        stack[depth] = root;
+        nextEdge[depth++] = graph->blocks[root].edgeStart;
+        color[root] = 1;
+        while (depth > 0)
+        {
+            const BasicBlock *top = &graph->blocks[stack[depth - 1]];
+            if (nextEdge[depth - 1] == top->edgeStart + top->edgeCount)
+            {
+                color[stack[--depth]] = 2;
+                continue;
+            }
+            int successor = graph->edges[nextEdge[depth - 1]++];
+            if (color[successor] == 1)
+            {
+                backFrom[backCount] = stack[depth - 1];
+                backTo[backCount++] = successor;
+                backStart[successor + 1]++;
+            }
+            else if (color[successor] == 0)
+            {
+                color[successor] = 1;
+                stack[depth] = successor;
+                nextEdge[depth++] = graph->blocks[successor].edgeStart;
+            }
+        }
+    }
+
+    // Group the back edges by header, headers in source order.
+    for (int b = 0; b < blocks; b++)
+        backStart[b + 1] += backStart[b];
+    int *latches = (int *)malloc((backCount + 1) * sizeof(int));
+    int *fill = nextEdge;
+    if (!latches)
+    {
+        fprintf(stderr, "Memory allocation error for cost loops\n");
+        exit(1);
+    }
+    memcpy(fill, backStart, blocks * sizeof(int));
+    for (int e = 0; e < backCount; e++)
+        latches[fill[backTo[e]]++] = backFrom[e];
+
+    int *mark = (int *)calloc(blocks + 1, sizeof(int));
+    int loopCapacity = 0;
+    if (!mark)
+    {
+        fprintf(stderr, "Memory allocation error for cost loops\n");
+        exit(1);
+    }
+    for (int header = 0; header < blocks; header++)
+    {
+        if (backStart[header] == backStart[header + 1])
+            continue;
+        growArray((void **)&graph->loops, graph->loopCount, &loopCapacity, sizeof(CostLoop), "cost loops");
+        CostLoop *loop = &graph->loops[graph->loopCount++];
+        int stamp = graph->loopCount;
+        loop->header = header;
+        loop->backEdges = backStart[header + 1] - backStart[header];
+        loop->blocks = 0;
+        loop->instructions = 0;
+        loop->cycles = 0;
+
+        int pending = 0;
+        mark[header] = stamp;
+        stack[pending++] = header;
+        for (int e = backStart[header]; e < backStart[header + 1]; e++)
+        {
+            if (mark[latches[e]] != stamp)
+            {
+                mark[latches[e]] = stamp;
+                stack[pending++] = latches[e];
+            }
+        }
+        for (int next = 0; next < pending; next++)
+        {
+            int b = stack[next];
+            BasicBlock *body = &graph->blocks[b];
+            body->depth++;
+            loop->blocks++;
+            loop->instructions += body->count;
+            loop->cycles += body->cycles;
+            if (b == header)
+                continue;
+            for (int p = graph->predStart[b]; p < graph->predStart[b + 1]; p++)
+            {
+                if (mark[graph->preds[p]] != stamp)
+                {
+                    mark[graph->preds[p]] = stamp;
+                    stack[pending++] = graph->preds[p];
+                }
+            }
+        }
+    }
+
+    for (int b = 0; b < blocks; b++)
+    {
+        BasicBlock *block = &graph->blocks[b];
+        block->weighted = block->cycles;
+        for (int d = 0; d < block->depth && d < COST_MAX_DEPTH; d++)
+            block->weighted *= COST_LOOP_WEIGHT;
+    }
+
+    free(color);
+    free(stack);
+    free(nextEdge);
+    free(backStart);
+    free(backFrom);
+    free(backTo);
+    free(latches);
+    free(mark);
+}
+
+// Hottest first; equal blocks in source order.
+int compareBlockHeat(const void *a, const void *b)
+{
+    const BasicBlock *x = (const BasicBlock *)a, *y = (const BasicBlock *)b;
+    if (x->weighted != y->weighted)
+        return x->weighted > y->weighted ? -1 : 1;
+    return x->first - y->first;
+}
+
+// value right-aligned in width columns after a blank.
+char *writeCount(char *out, long long value, int width)
+{
+    char digits[24];
+    int length = 0;
+    do
+        digits[length++] = '0' + value % 10;
+    while ((value /= 10) > 0);
+    *out++ = ' ';
+    for (int i = length; i < width; i++)
+        *out++ = ' ';
+    while (length > 0)
+        *out++ = digits[--length];
+    return out;
+}
+
+// The address, label and section columns both --cost tables start with.
+char *writeCostSite(char *out, const AssemblyContext *ctx, const CostSite *site)
+{
+    const LineInfo *line = &ctx->lines.lines[site->line];
+    const char *section = ctx->sections[site->section].name;
+    int digits = 4;
+    while (digits < 8 && ((unsigned int)site->address >> (4 * digits)) != 0)
+        digits++;
+    *out++ = '.';
+    *out++ = ' ';
+    writeHex(out, site->address, digits);
+    out = writeField(out + digits, "", 0, 8 - digits, 0);
+    *out++ = ' ';
+    out = writeField(out, viewText(&ctx->source, line->label), line->label.length, 8, 0);
+    *out++ = ' ';
+    return writeField(out, section, (int)strlen(section), 8, 0);
+}
+
+void printOutput(OutputBuffer *out, const char *format, ...)
+{
+    char line[MAX_LINE_LENGTH];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0)
+        writeOutput(out, line, length < (int)sizeof(line) ? (size_t)length : sizeof(line) - 1);
+}
+
+// Appends the --cost report to the listing: every basic block, hottest
+// first, then every loop. Each line starts with '.', so the report reads as
+// comments to anything that parses the listing.
+void writeCostReport(AssemblyContext *ctx, OutputBuffer *out)
+{
+    CostGraph graph;
+    buildCostGraph(ctx, &graph);
+    findCostLoops(&graph);
+    ctx->costBlocks = graph.blockCount;
+    ctx->costLoops = graph.loopCount;
+
+    BasicBlock *hottest = (BasicBlock *)malloc((graph.blockCount + 1) * sizeof(BasicBlock));
+    if (!hottest)
+    {
+        fprintf(stderr, "Memory allocation error for cost report\n");
+        exit(1);
+    }
+    memcpy(hottest, graph.blocks, graph.blockCount * sizeof(BasicBlock));
+    qsort(hottest, graph.blockCount, sizeof(BasicBlock), compareBlockHeat);
+
+    printOutput(out, ".\n. Estimated cycles: %d basic block(s), %d loop(s). WEIGHTED is one pass through\n",
+                graph.blockCount, graph.loopCount);
+    printOutput(out, ". the block times %d for each loop around it.\n.\n", COST_LOOP_WEIGHT);
+    printOutput(out, ". %-8s %-8s %-8s %6s %6s %5s %12s\n", "ADDRESS", "LABEL", "SECTION", "INSTRS", "CYCLES", "LOOPS",
+                "WEIGHTED");
+    for (int b = 0; b < graph.blockCount; b++)
+    {
+        const BasicBlock *block = &hottest[b];
+        const CostSite *site = &graph.sites[block->first];
+        char *line = reserveOutput(out, 100 + MAX_OPERAND + ctx->lines.lines[site->line].label.length);
+        char *p = writeCostSite(line, ctx, site);
+        p = writeCount(p, block->count, 6);
+        p = writeCount(p, block->cycles, 6);
+        p = writeCount(p, block->depth, 5);
+        p = writeCount(p, block->weighted, 12);
+        *p++ = '\n';
+        out->size += p - line;
+    }
+
+    if (graph.loopCount > 0)
+    {
+        printOutput(out, ".\n. %-8s %-8s %-8s %6s %6s %6s %10s\n", "LOOP", "LABEL", "SECTION", "BLOCKS", "INSTRS",
+                    "CYCLES", "BACKEDGES");
+        for (int l = 0; l < graph.loopCount; l++)
+        {
+            const CostLoop *loop = &graph.loops[l];
+            const CostSite *site = &graph.sites[graph.blocks[loop->header].first];
+            char *line = reserveOutput(out, 100 + MAX_OPERAND + ctx->lines.lines[site->line].label.length);
+            char *p = writeCostSite(line, ctx, site);
+            p = writeCount(p, loop->blocks, 6);
+            p = writeCount(p, loop->instructions, 6);
+            p = writeCount(p, loop->cycles, 6);
+            p = writeCount(p, loop->backEdges, 10);
+            *p++ = '\n';
+            out->size += p - line;
+        }
+    }
+
+    free(hottest);
+    freeCostGraph(&graph);
+}
+
+void freeCostGraph(CostGraph *graph)
+{
+    free(graph->sites);
+    free(graph->blocks);
+    free(graph->edges);
+    free(graph->predStart);
+    free(graph->preds);
+    free(graph->loops);
+}
+
+void storeOnePassBytes(AssemblyContext *ctx, int lineNum, int address, const unsigned char *bytes, int count)
+{
+    OnePassState *state = ctx->onePass;
+    RecordWriter *writer = &state->writer;
+    if (state->machine)
+    {
+        if (address < 0 || address + count > MEMORY_SIZE)
+            addDiagnostic(&ctx->diagnostics, lineNum, "Address %X is outside machine memory", address);
+        else
+            memcpy(state->machine->memory + address, bytes, count);
+    }
+    // A patch inside the record still being built is made in place; older
+    // fields get a later T record, which the loader applies on top.
+    else if (writer->binary && address >= writer->textAddress &&
+             address + count <= writer->textAddress + (int)writer->text.size)
+        memcpy(writer->text.data + (address - writer->textAddress), bytes, count);
+    else if (!writer->binary && address >= writer->recordAddress &&
+             address + count <= writer->recordAddress + writer->recordBytes)
+        encodeHex(writer->record + 9 + 2 * (address - writer->recordAddress), bytes, count);
+    else
+        appendTextRecord(writer, address, bytes, count);
+}
+
+void addForwardRef(AssemblyContext *ctx, const LineInfo *line, const unsigned char *objCode)
+{
+    OnePassState *state = ctx->onePass;
+    PassTwoChunk *chunk = &state->chunk;
+    const char *name = viewText(&ctx->source, chunk->forwardName);
+    Literal *literal = NULL;
+    if (chunk->forwardLiteral)
+    {
+        // Pass one has already reported a malformed literal.
+        unsigned char bytes[MAX_LINE_LENGTH];
+        int length = parseLiteral(name, chunk->forwardName.length, bytes);
+        literal = length > 0 ? findLiteral(&ctx->literals, bytes, length, chunk->pool) : NULL;
+        if (!literal)
+            return;
+    }
+
+    int index = state->freeRef;
+    if (index >= 0)
+        state->freeRef = state->refs[index].next;
+    else
+    {
+        growArray((void **)&state->refs, state->refCount, &state->refCapacity, sizeof(ForwardRef), "forward references");
+        index = state->refCount++;
+    }
+    ForwardRef *ref = &state->refs[index];
+    ref->address = line->address;
+    ref->lineNum = line->lineNum;
+    ref->kind = (unsigned char)chunk->forwardKind;
+    ref->flags = chunk->forwardKind == FORWARD_WORD || chunk->forwardKind == FORWARD_BASE ? 0 : objCode[1] & 0xF0;
+    ref->base = chunk->baseName;
+
+    if (literal)
+    {
+        ref->next = literal->forwardRefs;
+        literal->forwardRefs = index;
+        return;
+    }
+    SymbolTable *symbols = &ctx->sections[chunk->section].symbols;
+    Symbol *symbol = findSymbol(symbols, name, chunk->forwardName.length);
+    if (symbol)
+    {
+        ref->next = FORWARD_PENDING - symbol->address;
+        symbol->address = FORWARD_PENDING - index;
+    }
+    else
+    {
+        ref->next = -1;
+        insertSymbol(symbols, name, chunk->forwardName.length, FORWARD_PENDING - index);
+    }
+}
+
+void patchForwardRef(AssemblyContext *ctx, const ForwardRef *ref, TokenView name, int value)
+{
+    unsigned char bytes[3];
+    int offset = 1;
+    int count = 3;
+
+    if (ref->kind == FORWARD_BASE)
+        return;
+    if (ref->kind == FORWARD_PC_RELATIVE)
+    {
+        int disp = value - (ref->address + 3);
+        int flags = (ref->flags & 0x80) | 0x20;
+        if (disp < -2048 || disp > 2047)
+        {
+            int base = ref->base.length > 0 ? lookupSymbolView(ctx, ctx->onePass->chunk.section, ref->base) : -1;
+            if (base < 0 || value - base < 0 || value - base > 4095)
+            {
+                addDiagnostic(&ctx->diagnostics, ref->lineNum, "Displacement out of range for symbol '%.*s'",
+                              (int)name.length, viewText(&ctx->source, name));
+                return;
+            }
+            disp = value - base;
+            flags = (ref->flags & 0x80) | 0x40;
+        }
+        bytes[0] = flags | ((disp >> 8) & 0xF);
+        bytes[1] = disp & 0xFF;
+        count = 2;
+    }
+    else
+    {
+        bytes[0] = ref->kind == FORWARD_EXTENDED ? ref->flags | ((value >> 16) & 0xF) : (value >> 16) & 0xFF;
+        bytes[1] = (value >> 8) & 0xFF;
+        bytes[2] = value & 0xFF;
+        if (ref->kind == FORWARD_WORD)
+            offset = 0;
+    }
+    storeOnePassBytes(ctx, ref->lineNum, ref->address + offset, bytes, count);
+}
+
+void resolveForwardRefs(AssemblyContext *ctx, int head, TokenView name, int value)
+{
+    OnePassState *state = ctx->onePass;
+    while (head >= 0)
+    {
+        ForwardRef *ref = &state->refs[head];
+        int next = ref->next;
+        patchForwardRef(ctx, ref, name, value);
+        ref->next = state->freeRef;
+        state->freeRef = head;
+        head = next;
+    }
+}
+
+void startOnePassOutput(AssemblyContext *ctx)
+{
+    OnePassState *state = ctx->onePass;
+    const ControlSection *section = &ctx->sections[0];
+    state->started = 1;
+    if (state->machine)
+        return;
+
+    int nameLength = (int)strlen(section->name);
+    OutputBuffer *obj = state->writer.obj;
+    if (state->writer.binary)
+        state->lengthOffset = BINARY_HEADER_SIZE + 8;
+    else
+        state->lengthOffset = obj->written + obj->size + 7 + (nameLength > 6 ? nameLength : 6);
+    writeHeaderRecord(&state->writer, section->name, section->startAddress, 0);
+}
+
+// Encodes the lines pass one has stored since the last call and drops them.
+void emitOnePassLines(AssemblyContext *ctx)
+{
+    OnePassState *state = ctx->onePass;
+    PassTwoChunk *chunk = &state->chunk;
+    LineStore *store = &ctx->lines;
+    unsigned char objCode[MAX_LINE_LENGTH];
+    int objLength;
+    Modification mod;
+
+    if (store->count == 0)
+        return;
+    if (!state->started)
+        startOnePassOutput(ctx);
+
+    for (int i = 0; i < store->count; i++)
+    {
+        const LineInfo *line = &store->lines[i];
+        chunk->forwardKind = -1;
+        encodeLine(ctx, chunk, line, objCode, &objLength, &mod);
+        if (objLength > 0)
+            storeOnePassBytes(ctx, line->lineNum, line->address, objCode, objLength);
+        // Load-and-go places the program at its assembled addresses.
+        if (mod.halfBytes != 0 && !state->machine)
+            appendModificationRecord(&state->writer, ctx, 0, &mod);
+        else if (mod.halfBytes != 0 && mod.symbol.length > 0)
+            addDiagnostic(&ctx->diagnostics, line->lineNum, "External symbol '%.*s' in load-and-go program",
+                          (int)mod.symbol.length, viewText(&ctx->source, mod.symbol));
+        if (chunk->forwardKind >= 0)
+            addForwardRef(ctx, line, objCode);
+    }
+    // The store is emptied here, so --stats takes the line count from this.
+    ctx->drainedLines = store->lines[store->count - 1].lineNum;
+    store->count = 0;
+
+    for (int d = 0; d < chunk->diagnostics.count; d++)
+        addDiagnostic(&ctx->diagnostics, chunk->diagnostics.items[d].lineNum, "%s", chunk->diagnostics.items[d].message);
+    freeDiagnostics(&chunk->diagnostics);
+}
+
+void finishOnePass(AssemblyContext *ctx)
+{
+    OnePassState *state = ctx->onePass;
+    emitOnePassLines(ctx);
+    if (!state->started)
+        startOnePassOutput(ctx);
+
+    for (int s = 0; s < ctx->sectionCount; s++)
+    {
+        const SymbolTable *symbols = &ctx->sections[s].symbols;
+        for (unsigned int slot = 0; slot < symbols->capacity; slot++)
+        {
+            const Symbol *symbol = &symbols->entries[slot];
+            if (!symbol->label || symbol->address > FORWARD_PENDING)
+                continue;
+            for (int ref = FORWARD_PENDING - symbol->address; ref >= 0; ref = state->refs[ref].next)
+                addDiagnostic(&ctx->diagnostics, state->refs[ref].lineNum, "Undefined symbol '%s'", symbol->label);
+        }
+    }
+
+    if (state->machine)
+    {
+        Machine *machine = state->machine;
+        snprintf(machine->progName, sizeof(machine->progName), "%s", ctx->sections[0].name);
+        machine->startAddress = ctx->sections[0].startAddress;
+        machine->progLength = ctx->sections[0].length;
+        machine->execAddress = ctx->execAddress;
+        return;
+    }
+    flushTextRecord(&state->writer);
+    writeExternalRecords(ctx, &state->writer, 0);
+    finishSection(&state->writer, ctx->execAddress);
+    finishRecords(&state->writer);
+}
+
+// Assembles while reading: each statement is encoded as soon as pass one has
+// placed it, and a field naming a symbol that is not defined yet is chained
+// to that symbol and patched when the definition arrives. Memory grows with
+// the outstanding forward references rather than with the program. Without a
+// machine the result is an object file with no listing.
+int assembleOnePass(AssemblyContext *ctx, Machine *machine)
+{
+    PhaseTimer timer;
+    startPhaseTimer(&timer);
+    if (!openSourceFile(ctx->sourcePath, &ctx->source))
+    {
+        fprintf(stderr, "Error opening source file '%s': %s\n", ctx->sourcePath, strerror(errno));
+        return 0;
+    }
+    endPhase(&timer, STAT_READ);
+
+    OnePassState state = {0};
+    OutputBuffer objFile;
+    state.machine = machine;
+    state.chunk.onePass = 1;
+    state.freeRef = -1;
+    if (!machine)
+    {
+        if (!openOutput(&objFile, ctx->objPath))
+        {
+            fprintf(stderr, "Error creating object file '%s': %s\n", ctx->objPath, strerror(errno));
+            return 0;
+        }
+        state.writer.obj = &objFile;
+        state.writer.binary = ctx->binaryObject;
+    }
+
+    ctx->onePass = &state;
+    passOne(ctx);
+    finishOnePass(ctx);
+    ctx->onePass = NULL;
+    endPhase(&timer, STAT_PASS_ONE);
+
+    int ok = 1;
+    if (!machine)
+    {
+        char length[6];
+        writeHex(length, ctx->sections[0].length & 0xFFFFFF, 6);
+        if (state.writer.binary)
+            putLittle32((unsigned char *)length, (unsigned int)ctx->sections[0].length);
+        ok = patchOutput(&objFile, state.lengthOffset, length, state.writer.binary ? 4 : sizeof(length));
+        ok = closeOutput(&objFile) && ok;
+        if (!ok)
+            fprintf(stderr, "Error writing output for '%s': %s\n", ctx->sourcePath, strerror(errno));
+    }
+    endPhase(&timer, STAT_OUTPUT);
+    recordAssemblyStats(ctx, &timer, machine ? NULL : &objFile, NULL);
+    free(state.refs);
+    freeRecordWriter(&state.writer);
+    return ok;
+}
+
+uint64_t contentHash(const char *text, size_t length)
+{
+    uint64_t hash = 0xCBF29CE484222325ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, text + i, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 0x100000001B3ull;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// One hash per physical line, numbered the way pass one counts them.
+void hashSourceLines(const SourceFile *source, AssemblyCache *cache)
+{
+    cache->sourceLines = 0;
+    for (size_t pos = 0; pos < source->size;)
+    {
+        const char *newline = (const char *)memchr(source->data + pos, '\n', source->size - pos);
+        size_t end = newline ? (size_t)(newline - source->data) : source->size;
+        growArray((void **)&cache->lineHashes, cache->sourceLines, &cache->hashCapacity, sizeof(uint64_t), "line hashes");
+        cache->lineHashes[cache->sourceLines++] = contentHash(source->data + pos, end - pos);
+        pos = end + 1;
+    }
+}
+
+void cacheLine(AssemblyCache *cache, const LineInfo *line, int baseAddress, const unsigned char *objCode, int objLength,
+               int modification, unsigned long long listingOffset, unsigned int listingLength)
+{
+    growArray((void **)&cache->lines, cache->lineCount, &cache->lineCapacity, sizeof(CachedLine), "cache lines");
+    CachedLine *cached = &cache->lines[cache->lineCount++];
+    memset(cached, 0, sizeof(*cached));
+    cached->lineNum = line->lineNum;
+    cached->address = line->address;
+    cached->baseAddress = baseAddress;
+    cached->objLength = objLength;
+    cached->bytesOffset = (unsigned int)cache->bytes.size;
+    cached->directive = line->directive;
+    cached->labeled = line->label.length > 0;
+    cached->modification = (unsigned char)modification;
+    cached->listingLength = listingLength;
+    cached->listingOffset = listingOffset;
+    if (objLength > 0)
+    {
+        reserveText(&cache->bytes, objLength);
+        memcpy(cache->bytes.data + cache->bytes.size, objCode, objLength);
+        cache->bytes.size += objLength;
+    }
+}
+
+long long fileModified(const char *path, unsigned long long *size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return -1;
+    *size = (unsigned long long)st.st_size;
+    return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// Only a clean single-section program without macros or literals is cached;
+// anything else removes a stale cache. The output sizes and times are kept
+// so a cache never patches outputs that were rewritten without it.
+int writeAssemblyCache(const AssemblyContext *ctx, AssemblyCache *cache, const char *path)
+{
+    if (ctx->diagnostics.count > 0 || ctx->sectionCount != 1 || ctx->literals.count > 0 || ctx->macroDefinitions > 0 ||
+        ctx->relax)
+    {
+        unlink(path);
+        return 0;
+    }
+    if (cache->sourceLines == 0)
+        hashSourceLines(&ctx->source, cache);
+
+    TextBuffer symbols = {0};
+    const SymbolTable *table = &ctx->sections[0].symbols;
+    for (unsigned int slot = 0; slot < table->capacity; slot++)
+    {
+        const Symbol *symbol = &table->entries[slot];
+        if (!symbol->label)
+            continue;
+        // The top bit of the length marks an absolute EQU symbol.
+        unsigned short length = (unsigned short)strlen(symbol->label);
+        unsigned short flagged = length;
+        const SymbolTable *absolutes = &ctx->sections[0].absolutes;
+        if (absolutes->count > 0 && findSymbol(absolutes, symbol->label, length))
+            flagged |= 0x8000;
+        reserveText(&symbols, sizeof(int) + sizeof(length) + length);
+        memcpy(symbols.data + symbols.size, &symbol->address, sizeof(int));
+        memcpy(symbols.data + symbols.size + sizeof(int), &flagged, sizeof(flagged));
+        memcpy(symbols.data + symbols.size + sizeof(int) + sizeof(length), symbol->label, length);
+        symbols.size += sizeof(int) + sizeof(length) + length;
+    }
+
+    CacheHeader *header = &cache->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "SICINC2", 8);
+    header->sourceLines = cache->sourceLines;
+    header->lineCount = cache->lineCount;
+    header->recordCount = cache->recordCount;
+    header->symbolCount = table->count;
+    header->bytesSize = cache->bytes.size;
+    header->symbolBytes = symbols.size;
+    header->objModified = fileModified(ctx->objPath, &header->objSize);
+    header->lstModified = fileModified(ctx->lstPath, &header->lstSize);
+
+    char *temporary = (char *)malloc(strlen(path) + 5);
+    if (!temporary)
+    {
+        fprintf(stderr, "Memory allocation error for cache path\n");
+        exit(1);
+    }
+    sprintf(temporary, "%s.tmp", path);
+    FILE *file = fopen(temporary, "wb");
+    int ok = file && fwrite(header, sizeof(*header), 1, file) == 1 &&
+             fwrite(cache->lineHashes, sizeof(uint64_t), cache->sourceLines, file) == (size_t)cache->sourceLines &&
+             fwrite(cache->lines, sizeof(CachedLine), cache->lineCount, file) == (size_t)cache->lineCount &&
+             fwrite(cache->records, sizeof(CachedRecord), cache->recordCount, file) == (size_t)cache->recordCount &&
+             fwrite(cache->bytes.data, 1, cache->bytes.size, file) == cache->bytes.size &&
+             fwrite(symbols.data, 1, symbols.size, file) == symbols.size;
+    if (file)
+        ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok)
+    {
+        unlink(temporary);
+        unlink(path);
+    }
+    free(temporary);
+    free(symbols.data);
+    return ok;
+}
+
+// Reads a cache written by writeAssemblyCache and enters its symbols as
+// section 0 of the context.
+int loadAssemblyCache(AssemblyContext *ctx, AssemblyCache *cache, const char *path)
+{
+    SourceFile file = {0};
+    if (!openSourceFile(path, &file))
+        return 0;
+
+    const CacheHeader *header = (const CacheHeader *)file.data;
+    size_t hashesSize = 0, linesSize = 0, recordsSize = 0;
+    int ok = file.size >= sizeof(CacheHeader) && memcmp(header->magic, "SICINC2", 8) == 0;
+    if (ok)
+    {
+        hashesSize = (size_t)header->sourceLines * sizeof(uint64_t);
+        linesSize = (size_t)header->lineCount * sizeof(CachedLine);
+        recordsSize = (size_t)header->recordCount * sizeof(CachedRecord);
+        ok = file.size == sizeof(CacheHeader) + hashesSize + linesSize + recordsSize + header->bytesSize + header->symbolBytes;
+    }
+    if (!ok)
+    {
+        closeSourceFile(&file);
+        return 0;
+    }
+
+    const char *p = file.data + sizeof(CacheHeader);
+    cache->header = *header;
+    cache->sourceLines = cache->hashCapacity = header->sourceLines;
+    cache->lineCount = cache->lineCapacity = header->lineCount;
+    cache->recordCount = cache->recordCapacity = header->recordCount;
+    cache->lineHashes = (uint64_t *)malloc(hashesSize + 1);
+    cache->lines = (CachedLine *)malloc(linesSize + 1);
+    cache->records = (CachedRecord *)malloc(recordsSize + 1);
+    cache->bytes.data = (char *)malloc(header->bytesSize + 1);
+    if (!cache->lineHashes || !cache->lines || !cache->records || !cache->bytes.data)
+    {
+        fprintf(stderr, "Memory allocation error for cache\n");
+        exit(1);
+    }
+    memcpy(cache->lineHashes, p, hashesSize);
+    memcpy(cache->lines, p += hashesSize, linesSize);
+    memcpy(cache->records, p += linesSize, recordsSize);
+    memcpy(cache->bytes.data, p += recordsSize, header->bytesSize);
+    cache->bytes.size = cache->bytes.capacity = header->bytesSize;
+    p += header->bytesSize;
+
+    // The symbols come in slot order; inserting them into a smaller table
+    // would pile every one onto the same few clusters.
+    ControlSection *section = beginSection(ctx, 0);
+    while ((header->symbolCount + 1) * 8 > section->symbols.capacity * 7)
+        growSymbolTable(&section->symbols);
+    for (unsigned int i = 0; i < header->symbolCount; i++)
+    {
+        int address;
+        unsigned short length;
+        memcpy(&address, p, sizeof(int));
+        memcpy(&length, p + sizeof(int), sizeof(length));
+        const char *label = p + sizeof(int) + sizeof(length);
+        if (length & 0x8000)
+        {
+            length &= 0x7FFF;
+            insertSymbol(&section->absolutes, label, length, address);
+        }
+        insertSymbol(&section->symbols, label, length, address);
+        p += sizeof(int) + sizeof(length) + length;
+    }
+    closeSourceFile(&file);
+    return 1;
+}
+
+void freeAssemblyCache(AssemblyCache *cache)
+{
+    free(cache->lineHashes);
+    free(cache->lines);
+    free(cache->records);
+    free(cache->bytes.data);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// The location counter advance of a statement an edit may touch without
+// reassembling everything, or -1 for any other statement.
+int statementSize(const AssemblyContext *ctx, const LineInfo *line)
+{
+    const char *operand = viewText(&ctx->source, line->operand);
+    int operandLength = line->operand.length;
+    int value;
+    switch (line->directive)
+    {
+    case DIR_NONE:
+        return line->format != 0 && line->operandKind != OPERAND_LITERAL ? line->format : -1;
+    case DIR_BYTE:
+        if (line->operandKind == OPERAND_CHARS)
+            return operandLength - 3;
+        if (line->operandKind == OPERAND_HEX)
+            return (operandLength - 3) / 2;
+        return 0;
+    case DIR_WORD:
+        return 3;
+    case DIR_RESW:
+    case DIR_RESB:
+        if (!parseNumber(operand, operandLength, 10, &value))
+            return -1;
+        return line->directive == DIR_RESW ? 3 * value : value;
+    default:
+        return -1;
+    }
+}
+
+// Rewrites the hex of bytes already in T records, in the object file and in
+// the record copy of the listing (in memory when the listing is rebuilt).
+void patchCachedBytes(const AssemblyCache *cache, int objFd, int lstFd, char *listing, int address,
+                      const unsigned char *bytes, int count)
+{
+    char hex[2 * MAX_RECORD_BYTES];
+    int low = 0, high = cache->recordCount - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if (cache->records[middle].address <= address)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    for (int r = low; count > 0 && r < cache->recordCount; r++)
+    {
+        const CachedRecord *record = &cache->records[r];
+        int take = record->address + record->count - address;
+        if (take <= 0)
+            continue;
+        if (take > count)
+            take = count;
+        size_t offset = 9 + 2 * (size_t)(address - record->address);
+        encodeHex(hex, bytes, take);
+        if (pwrite(objFd, hex, 2 * take, record->objOffset + offset) != 2 * take)
+            fprintf(stderr, "Error patching object file: %s\n", strerror(errno));
+        if (listing)
+            memcpy(listing + record->lstOffset + offset, hex, 2 * take);
+        else if (pwrite(lstFd, hex, 2 * take, record->lstOffset + offset) != 2 * take)
+            fprintf(stderr, "Error patching listing file: %s\n", strerror(errno));
+        address += take;
+        bytes += take;
+        count -= take;
+    }
+}
+
+// The shift a size-changing edit gives a symbol's value, from its value
+// before the edit: labels of the edited statements move with them, and
+// everything from the end of the edit on moves by delta.
+int symbolShift(const AssemblyContext *ctx, const CacheShift *shift, TokenView name)
+{
+    if (isAbsoluteSymbol(ctx, 0, name))
+        return 0;
+    int address = lookupSymbolView(ctx, 0, name);
+    if (address < 0)
+        return UNKNOWN_SHIFT;
+    if (address >= shift->oldEnd)
+        return shift->delta;
+    if (address < shift->oldStart)
+        return 0;
+    for (int i = 0; i < shift->regionCount; i++)
+    {
+        const LineInfo *line = &ctx->lines.lines[i];
+        if (line->label.length == name.length &&
+            labelsEqual(viewText(&ctx->source, line->label), viewText(&ctx->source, name), name.length))
+            return line->address - address;
+    }
+    return UNKNOWN_SHIFT;
+}
+
+// How far an operand's value moves, adding up its terms; * and / between
+// terms give UNKNOWN_SHIFT.
+int operandShift(const AssemblyContext *ctx, const CacheShift *shift, const LineInfo *line, int lineShift)
+{
+    TokenView view = line->directive == DIR_NONE ? operandTarget(line) : line->operand;
+    if (line->operandKind == OPERAND_SYMBOL)
+        return symbolShift(ctx, shift, view);
+    if (line->operandKind != OPERAND_EXPRESSION)
+        return 0;
+
+    const char *text = viewText(&ctx->source, view);
+    int total = 0, sign = 1;
+    for (unsigned int pos = 0, start = 0; pos <= view.length; pos++)
+    {
+        if (pos < view.length && text[pos] != '+' && text[pos] != '-')
+            continue;
+        TokenView term = {view.offset + start, pos - start};
+        if (term.length == 1 && text[start] == '*')
+            total += sign * lineShift;
+        else if (memchr(text + start, '*', term.length) || memchr(text + start, '/', term.length))
+            return UNKNOWN_SHIFT;
+        else if (term.length > 0 && (isalpha((unsigned char)text[start]) || text[start] == '_'))
+        {
+            int moved = symbolShift(ctx, shift, term);
+            if (moved == UNKNOWN_SHIFT)
+                return UNKNOWN_SHIFT;
+            total += sign * moved;
+        }
+        if (pos < view.length)
+            sign = text[pos] == '-' ? -1 : 1;
+        start = pos + 1;
+    }
+    return total;
+}
+
+// Reads the program name, start, length and entry point back from the H and
+// E records of a text object file.
+int readObjectBounds(const char *path, char *name, size_t nameSize, int *start, int *length, int *execAddress)
+{
+    SourceFile file = {0};
+    if (!openSourceFile(path, &file))
+        return 0;
+    size_t pos = 0, size = 0;
+    int lineNum = 0, ok = 0;
+    const char *line = nextRecord(&file, &pos, &size, &lineNum);
+    if (line && line[0] == 'H' && size >= 13 && parseNumber(line + size - 12, 6, 16, start) &&
+        parseNumber(line + size - 6, 6, 16, length))
+    {
+        snprintf(name, nameSize, "%.*s", (int)trimmedLength(line + 1, size - 13), line + 1);
+        while ((line = nextRecord(&file, &pos, &size, &lineNum)) != NULL)
+            ok = line[0] == 'E' && size == 7 && parseNumber(line + 1, 6, 16, execAddress);
+    }
+    closeSourceFile(&file);
+    return ok;
+}
+
+// Takes an edit that changes the size of the edited statements, which
+// reassembleFromCache has parsed into ctx->lines. Every later address moves
+// by the difference; only the lines whose operand value or displacement
+// moves with it are encoded again, and the object file and listing are
+// written afresh from the cached bytes and listing lines. A program with ORG,
+// relative EQU or external names, or an edit that adds or drops labels,
+// returns 0 for a full assembly.
+int shiftCachedAssembly(AssemblyContext *ctx, AssemblyCache *cache, const char *path, CacheShift *shift,
+                        PhaseTimer *timer)
+{
+    int a = shift->a, b = shift->b;
+    if (b >= cache->lineCount)
+        return 0;
+    shift->oldStart = cache->lines[a].address;
+    shift->oldEnd = cache->lines[b].address;
+    shift->delta = shift->regionEnd - shift->oldEnd;
+
+    // The edit must swap plain statements for plain statements with the same
+    // labels, and those labels must be the only symbols from oldStart up to
+    // oldEnd, so that symbolShift can tell them by value.
+    int oldLabels = 0, newLabels = 0, inRange = 0;
+    for (int k = a; k < b; k++)
+    {
+        const CachedLine *cached = &cache->lines[k];
+        if (cached->directive != DIR_NONE && cached->directive != DIR_BYTE && cached->directive != DIR_WORD &&
+            cached->directive != DIR_RESW && cached->directive != DIR_RESB)
+            return 0;
+        oldLabels += cached->labeled;
+    }
+    for (int k = a - 1; k >= 0 && cache->lines[k].address == shift->oldEnd; k--)
+        if (cache->lines[k].labeled)
+            return 0;
+    for (int i = 0; i < shift->regionCount; i++)
+    {
+        const LineInfo *line = &ctx->lines.lines[i];
+        if (line->label.length == 0)
+            continue;
+        int address = lookupSymbolView(ctx, 0, line->label);
+        if (address < shift->oldStart || address >= shift->oldEnd || isAbsoluteSymbol(ctx, 0, line->label))
+            return 0;
+        for (int j = 0; j < i; j++)
+            if (ctx->lines.lines[j].label.length == line->label.length &&
+                labelsEqual(viewText(&ctx->source, ctx->lines.lines[j].label), viewText(&ctx->source, line->label),
+                            line->label.length))
+                return 0;
+        newLabels++;
+    }
+    const ControlSection *section = &ctx->sections[0];
+    for (unsigned int slot = 0; slot < section->symbols.capacity; slot++)
+    {
+        const Symbol *symbol = &section->symbols.entries[slot];
+        if (symbol->label && symbol->address >= shift->oldStart && symbol->address < shift->oldEnd &&
+            !(section->absolutes.count > 0 && findSymbol(&section->absolutes, symbol->label, strlen(symbol->label))))
+            inRange++;
+    }
+    if (newLabels != oldLabels || inRange != oldLabels)
+        return 0;
+
+    // Walk the whole source against the cache with the old symbol values,
+    // building the new cached lines and collecting, after the edited
+    // statements in ctx->lines, each line whose encoding moves.
+    int newCount = cache->lineCount - (b - a) + shift->regionCount;
+    CachedLine *lines = (CachedLine *)malloc((newCount + 1) * sizeof(CachedLine));
+    int *sourceLine = (int *)malloc((newCount + 1) * sizeof(int));
+    if (!lines || !sourceLine)
+    {
+        fprintf(stderr, "Memory allocation error for cache lines\n");
+        exit(1);
+    }
+    int ok = 1, k = 0, n = 0, lineNum = 0, baseShift = 0, endShift = 0;
+    for (size_t pos = 0; ok && pos < ctx->source.size;)
+    {
+        TokenView tokens[MAX_TOKENS];
+        int tokenCount;
+        pos = tokenizeLine(&ctx->source, pos, tokens, &tokenCount);
+        lineNum++;
+        if (lineNum == shift->firstLine)
+        {
+            // The edited statements enter with the base of the line they replace.
+            ok = k == a;
+            for (int i = 0; i < shift->regionCount; i++, n++)
+            {
+                memset(&lines[n], 0, sizeof(CachedLine));
+                lines[n].lineNum = ctx->lines.lines[i].lineNum;
+                lines[n].address = ctx->lines.lines[i].address;
+                lines[n].baseAddress = cache->lines[a].baseAddress < 0 ? -1 : cache->lines[a].baseAddress + baseShift;
+                lines[n].directive = ctx->lines.lines[i].directive;
+                lines[n].labeled = ctx->lines.lines[i].label.length > 0;
+                sourceLine[n] = i;
+            }
+            k = b;
+        }
+        if (tokenCount == 0 || (lineNum >= shift->firstLine && lineNum <= shift->lastLine))
+            continue;
+
+        const CachedLine *cached = &cache->lines[k];
+        int after = k >= b;
+        LineInfo line;
+        parseLine(&ctx->source, tokens, tokenCount, &line);
+        line.lineNum = lineNum;
+        line.address = cached->address + (after ? shift->delta : 0);
+        ok = k < cache->lineCount && cached->lineNum + (after ? shift->lineShift : 0) == lineNum &&
+             cached->directive == line.directive && line.directive != DIR_ORG && line.directive != DIR_CSECT &&
+             line.directive != DIR_EXTDEF && line.directive != DIR_EXTREF &&
+             (line.directive != DIR_EQU || isAbsoluteSymbol(ctx, 0, line.label));
+        if (!ok)
+            break;
+
+        lines[n] = *cached;
+        lines[n].lineNum = lineNum;
+        lines[n].address = line.address;
+        if (cached->baseAddress >= 0)
+            lines[n].baseAddress = cached->baseAddress + baseShift;
+        sourceLine[n] = -1;
+
+        int lineShift = after ? shift->delta : 0;
+        int moved = operandShift(ctx, shift, &line, lineShift);
+        int encode = 0;
+        if (line.directive == DIR_BASE)
+        {
+            ok = moved != UNKNOWN_SHIFT;
+            baseShift = moved;
+        }
+        else if (line.directive == DIR_END)
+        {
+            ok = moved != UNKNOWN_SHIFT;
+            endShift = moved;
+        }
+        else if (line.directive == DIR_WORD || (line.directive == DIR_NONE && cached->objLength == 4))
+            encode = moved != 0;
+        else if (line.directive == DIR_NONE && cached->objLength == 3)
+        {
+            // The cached x b p e bits say how the field was addressed; a base
+            // relative field is redone when pc relative might now reach.
+            const unsigned char *bytes = (const unsigned char *)cache->bytes.data + cached->bytesOffset;
+            if ((bytes[0] & 3) != 0 && (bytes[1] & 0x60) == 0x20)
+                encode = moved != lineShift;
+            else if ((bytes[0] & 3) != 0 && (bytes[1] & 0x60) == 0x40)
+                encode = moved != baseShift || moved != lineShift;
+            else
+                encode = moved != 0;
+        }
+        if (encode)
+        {
+            LineInfo *stored = appendLine(&ctx->lines);
+            *stored = line;
+            sourceLine[n] = ctx->lines.count - 1;
+        }
+        n++;
+        k++;
+    }
+    ok = ok && n == newCount && k == cache->lineCount;
+
+    // The symbols take their new values, and the collected lines are encoded.
+    if (ok)
+    {
+        SymbolTable *symbols = &ctx->sections[0].symbols;
+        for (unsigned int slot = 0; slot < symbols->capacity; slot++)
+        {
+            Symbol *symbol = &symbols->entries[slot];
+            if (symbol->label && symbol->address >= shift->oldEnd &&
+                !(section->absolutes.count > 0 && findSymbol(&section->absolutes, symbol->label, strlen(symbol->label))))
+                symbol->address += shift->delta;
+        }
+        for (int i = 0; i < shift->regionCount; i++)
+        {
+            const LineInfo *line = &ctx->lines.lines[i];
+            if (line->label.length > 0)
+                findSymbol(symbols, viewText(&ctx->source, line->label), line->label.length)->address = line->address;
+        }
+    }
+    endPhase(timer, STAT_PASS_ONE);
+
+    PassTwoChunk chunk = {0};
+    TextBuffer encoded = {0}, listing = {0};
+    unsigned int *encodedEnd = (unsigned int *)malloc((ctx->lines.count + 1) * sizeof(unsigned int));
+    unsigned int *listingEnd = (unsigned int *)malloc((ctx->lines.count + 1) * sizeof(unsigned int));
+    if (!encodedEnd || !listingEnd)
+    {
+        fprintf(stderr, "Memory allocation error for cache lines\n");
+        exit(1);
+    }
+    for (int m = 0; ok && m < n; m++)
+    {
+        int i = sourceLine[m];
+        if (i < 0)
+            continue;
+        const LineInfo *line = &ctx->lines.lines[i];
+        unsigned char objCode[MAX_LINE_LENGTH];
+        int objLength;
+        Modification mod;
+        chunk.useBase = lines[m].baseAddress >= 0;
+        chunk.baseAddress = lines[m].baseAddress;
+        unsigned int listingStart = (unsigned int)listing.size;
+        if (encodeLine(ctx, &chunk, line, objCode, &objLength, &mod))
+            formatListingLine(&listing, &ctx->source, line, objCode, objLength, -1);
+        int modification = mod.halfBytes ? mod.halfBytes | (mod.symbol.length > 0 ? 0x80 : 0) : 0;
+        if (i < shift->regionCount)
+        {
+            lines[m].objLength = objLength;
+            lines[m].modification = (unsigned char)modification;
+        }
+        ok = chunk.diagnostics.count == 0 && objLength == lines[m].objLength && modification == lines[m].modification &&
+             !(modification & 0x80);
+        if (objLength > 0)
+        {
+            reserveText(&encoded, objLength);
+            memcpy(encoded.data + encoded.size, objCode, objLength);
+            encoded.size += objLength;
+        }
+        encodedEnd[i] = (unsigned int)encoded.size;
+        listingEnd[i] = (unsigned int)listing.size;
+        lines[m].listingLength = listingEnd[i] - listingStart;
+    }
+    freeDiagnostics(&chunk.diagnostics);
+    endPhase(timer, STAT_PASS_TWO);
+
+    // Replays the record stitching of passTwo into fresh outputs.
+    char name[MAX_OPERAND];
+    int start, length, execAddress;
+    SourceFile oldListing = {0};
+    ok = ok && readObjectBounds(ctx->objPath, name, sizeof(name), &start, &length, &execAddress) &&
+         openSourceFile(ctx->lstPath, &oldListing);
+    char *objTemporary = (char *)malloc(strlen(ctx->objPath) + 5);
+    char *lstTemporary = (char *)malloc(strlen(ctx->lstPath) + 5);
+    if (!objTemporary || !lstTemporary)
+    {
+        fprintf(stderr, "Memory allocation error for output path\n");
+        exit(1);
+    }
+    sprintf(objTemporary, "%s.tmp", ctx->objPath);
+    sprintf(lstTemporary, "%s.tmp", ctx->lstPath);
+    OutputBuffer objFile, lstFile;
+    int opened = ok && openOutput(&objFile, objTemporary);
+    opened += opened && openOutput(&lstFile, lstTemporary);
+    ok = opened == 2;
+
+    TextBuffer bytes = {0};
+    if (ok)
+    {
+        RecordWriter writer = {0};
+        writer.obj = &objFile;
+        writer.lst = &lstFile;
+        writer.cache = cache;
+        cache->recordCount = 0;
+        snprintf(ctx->sections[0].name, sizeof(ctx->sections[0].name), "%s", name);
+        writeHeaderRecord(&writer, name, start, length + shift->delta);
+        for (int m = 0; m < n; m++)
+        {
+            CachedLine *line = &lines[m];
+            int i = sourceLine[m];
+            const char *objCode = i < 0 ? cache->bytes.data + line->bytesOffset
+                                        : encoded.data + encodedEnd[i] - line->objLength;
+            line->bytesOffset = (unsigned int)bytes.size;
+            if (line->objLength > 0)
+            {
+                reserveText(&bytes, line->objLength);
+                memcpy(bytes.data + bytes.size, objCode, line->objLength);
+                bytes.size += line->objLength;
+            }
+            if (line->directive == DIR_START || line->directive == DIR_END)
+            {
+                flushTextRecord(&writer);
+                continue;
+            }
+
+            if (line->objLength > 0)
+                appendTextRecord(&writer, line->address, (const unsigned char *)objCode, line->objLength);
+            if (line->modification)
+            {
+                Modification mod = {0};
+                mod.halfBytes = line->modification;
+                mod.address = line->address + (mod.halfBytes == 5);
+                appendModificationRecord(&writer, ctx, 0, &mod);
+            }
+
+            unsigned long long offset = lstFile.written + lstFile.size;
+            if (i >= 0)
+                writeOutput(&lstFile, listing.data + listingEnd[i] - line->listingLength, line->listingLength);
+            else if (line->listingLength > 0)
+            {
+                // A line that kept its bytes only needs its new address.
+                const char *text = oldListing.data + line->listingOffset;
+                int address = line->address - (m >= shift->a + shift->regionCount ? shift->delta : 0);
+                int oldDigits = 4, digits = 4;
+                while (oldDigits < 8 && ((unsigned int)address >> (4 * oldDigits)) != 0)
+                    oldDigits++;
+                while (digits < 8 && ((unsigned int)line->address >> (4 * digits)) != 0)
+                    digits++;
+                char hex[8];
+                writeHex(hex, line->address, digits);
+                writeOutput(&lstFile, hex, digits);
+                writeOutput(&lstFile, text + oldDigits, line->listingLength - oldDigits);
+                line->listingLength += digits - oldDigits;
+            }
+            line->listingOffset = offset;
+        }
+        finishSection(&writer, execAddress + endShift);
+        freeRecordWriter(&writer);
+        ok = closeOutput(&objFile);
+        ok = closeOutput(&lstFile) && ok;
+        ok = ok && rename(objTemporary, ctx->objPath) == 0 && rename(lstTemporary, ctx->lstPath) == 0;
+        cache->objWritten = objFile.written;
+        cache->lstWritten = lstFile.written;
+    }
+    else if (opened == 1)
+        closeOutput(&objFile);
+    if (!ok)
+    {
+        unlink(objTemporary);
+        unlink(lstTemporary);
+    }
+    if (oldListing.data)
+        closeSourceFile(&oldListing);
+
+    if (ok)
+    {
+        free(cache->lines);
+        cache->lines = lines;
+        cache->lineCount = cache->lineCapacity = n;
+        free(cache->bytes.data);
+        cache->bytes = bytes;
+        ok = writeAssemblyCache(ctx, cache, path);
+        endPhase(timer, STAT_OUTPUT);
+    }
+    else
+    {
+        free(lines);
+        free(bytes.data);
+    }
+    free(sourceLine);
+    free(encoded.data);
+    free(listing.data);
+    free(encodedEnd);
+    free(listingEnd);
+    free(objTemporary);
+    free(lstTemporary);
+    return ok;
+}
+
+// Reassembles only the lines that differ from the cached source. This works
+// when the edited statements are data or instructions. If they keep every
+// address, label, relocation and object length, their new object code is
+// patched into the T records in place and their listing lines replaced;
+// if their size changes, shiftCachedAssembly moves the rest of the program.
+// Anything else returns 0 and leaves the context for a full assembly.
+int reassembleFromCache(AssemblyContext *ctx, AssemblyCache *cache, const char *path, PhaseTimer *timer)
+{
+    unsigned long long objSize = 0, lstSize = 0;
+    if (!loadAssemblyCache(ctx, cache, path) ||
+        fileModified(ctx->objPath, &objSize) != cache->header.objModified || objSize != cache->header.objSize ||
+        fileModified(ctx->lstPath, &lstSize) != cache->header.lstModified || lstSize != cache->header.lstSize ||
+        !openSourceFile(ctx->sourcePath, &ctx->source))
+    {
+        resetAssembly(ctx);
+        freeAssemblyCache(cache);
+        return 0;
+    }
+    endPhase(timer, STAT_READ);
+
+    uint64_t *oldHashes = cache->lineHashes;
+    int oldLines = cache->sourceLines;
+    cache->lineHashes = NULL;
+    cache->hashCapacity = 0;
+    hashSourceLines(&ctx->source, cache);
+    int newLines = cache->sourceLines;
+    int first = 0, last = 0;
+    while (first < oldLines && first < newLines && oldHashes[first] == cache->lineHashes[first])
+        first++;
+    while (last < oldLines - first && last < newLines - first &&
+           oldHashes[oldLines - 1 - last] == cache->lineHashes[newLines - 1 - last])
+        last++;
+    free(oldHashes);
+    if (first == oldLines && oldLines == newLines)
+    {
+        endPhase(timer, STAT_PASS_ONE);
+        return 1;
+    }
+
+    // The cached lines of the edited region, and the region's new statements.
+    int a = 0, b;
+    for (int high = cache->lineCount; a < high;)
+    {
+        int middle = (a + high) / 2;
+        if (cache->lines[middle].lineNum <= first)
+            a = middle + 1;
+        else
+            high = middle;
+    }
+    for (b = a; b < cache->lineCount && cache->lines[b].lineNum <= oldLines - last; b++)
+        ;
+
+    size_t pos = 0;
+    for (int i = 0; i < first; i++)
+    {
+        const char *newline = (const char *)memchr(ctx->source.data + pos, '\n', ctx->source.size - pos);
+        pos = newline ? (size_t)(newline - ctx->source.data) + 1 : ctx->source.size;
+    }
+    int address = a < cache->lineCount ? cache->lines[a].address : 0;
+    int ok = 1, sized = 1;
+    for (int lineNum = first + 1; sized && lineNum <= newLines - last; lineNum++)
+    {
+        TokenView tokens[MAX_TOKENS];
+        int tokenCount;
+        pos = tokenizeLine(&ctx->source, pos, tokens, &tokenCount);
+        if (tokenCount == 0)
+            continue;
+        const CachedLine *cached = &cache->lines[a + ctx->lines.count];
+        LineInfo *line = appendLine(&ctx->lines);
+        parseLine(&ctx->source, tokens, tokenCount, line);
+        line->lineNum = lineNum;
+        line->address = address;
+        int size = statementSize(ctx, line);
+        sized = size >= 0;
+        ok = ok && sized && a + ctx->lines.count <= b && cached->address == address &&
+             cached->directive == line->directive && cached->labeled == (line->label.length > 0) &&
+             (line->label.length == 0 || lookupSymbolView(ctx, 0, line->label) == address);
+        address += size;
+    }
+    ok = ok && a + ctx->lines.count == b && (b == cache->lineCount || cache->lines[b].address == address);
+    if (!ok && sized)
+    {
+        CacheShift shift = {0};
+        shift.firstLine = first + 1;
+        shift.lastLine = newLines - last;
+        shift.lineShift = newLines - oldLines;
+        shift.a = a;
+        shift.b = b;
+        shift.regionCount = ctx->lines.count;
+        shift.regionEnd = address;
+        ok = a < cache->lineCount && shiftCachedAssembly(ctx, cache, path, &shift, timer);
+        if (!ok)
+        {
+            resetAssembly(ctx);
+            freeAssemblyCache(cache);
+        }
+        return ok;
+    }
+    endPhase(timer, STAT_PASS_ONE);
+
+    PassTwoChunk chunk = {0};
+    TextBuffer listing = {0};
+    unsigned int *listingEnd = (unsigned int *)malloc((ctx->lines.count + 1) * sizeof(unsigned int));
+    if (!listingEnd)
+    {
+        fprintf(stderr, "Memory allocation error for cache lines\n");
+        exit(1);
+    }
+    int sameLengths = 1;
+    for (int k = 0; ok && k < ctx->lines.count; k++)
+    {
+        CachedLine *cached = &cache->lines[a + k];
+        unsigned char objCode[MAX_LINE_LENGTH];
+        int objLength;
+        Modification mod;
+        chunk.useBase = cached->baseAddress >= 0;
+        chunk.baseAddress = cached->baseAddress;
+        if (encodeLine(ctx, &chunk, &ctx->lines.lines[k], objCode, &objLength, &mod))
+            formatListingLine(&listing, &ctx->source, &ctx->lines.lines[k], objCode, objLength, -1);
+        listingEnd[k] = (unsigned int)listing.size;
+        int modification = mod.halfBytes ? mod.halfBytes | (mod.symbol.length > 0 ? 0x80 : 0) : 0;
+        ok = chunk.diagnostics.count == 0 && objLength == cached->objLength && modification == cached->modification &&
+             !(modification & 0x80);
+        if (ok)
+            memcpy(cache->bytes.data + cached->bytesOffset, objCode, objLength);
+        sameLengths = sameLengths && listingEnd[k] - (k ? listingEnd[k - 1] : 0) == cached->listingLength;
+    }
+    freeDiagnostics(&chunk.diagnostics);
+    endPhase(timer, STAT_PASS_TWO);
+
+    int objFd = ok ? open(ctx->objPath, O_WRONLY) : -1;
+    int lstFd = objFd >= 0 ? open(ctx->lstPath, sameLengths ? O_WRONLY : O_RDONLY) : -1;
+    char *oldListing = NULL;
+    if (lstFd >= 0 && !sameLengths)
+    {
+        oldListing = (char *)malloc(lstSize + 1);
+        if (!oldListing)
+        {
+            fprintf(stderr, "Memory allocation error for listing\n");
+            exit(1);
+        }
+        size_t got = 0;
+        ssize_t n = 1;
+        while (got < lstSize && (n = pread(lstFd, oldListing + got, lstSize - got, got)) > 0)
+            got += (size_t)n;
+        if (got != lstSize)
+        {
+            close(lstFd);
+            lstFd = -1;
+        }
+    }
+    ok = lstFd >= 0;
+
+    for (int k = 0; ok && k < ctx->lines.count; k++)
+    {
+        const CachedLine *cached = &cache->lines[a + k];
+        patchCachedBytes(cache, objFd, lstFd, oldListing, cached->address,
+                         (const unsigned char *)cache->bytes.data + cached->bytesOffset, cached->objLength);
+        unsigned int start = k ? listingEnd[k - 1] : 0;
+        if (sameLengths && pwrite(lstFd, listing.data + start, listingEnd[k] - start, cached->listingOffset) !=
+                               (ssize_t)(listingEnd[k] - start))
+            ok = 0;
+        cache->objWritten += 2 * cached->objLength;
+        cache->lstWritten += sameLengths ? 2 * cached->objLength + listingEnd[k] - start : 0;
+    }
+
+    if (ok && !sameLengths)
+    {
+        // Listing lines changed length: splice them into a new listing and
+        // move the offsets of everything after them.
+        char *temporary = (char *)malloc(strlen(ctx->lstPath) + 5);
+        if (!temporary)
+        {
+            fprintf(stderr, "Memory allocation error for listing path\n");
+            exit(1);
+        }
+        sprintf(temporary, "%s.tmp", ctx->lstPath);
+        OutputBuffer out;
+        ok = openOutput(&out, temporary);
+        size_t copied = 0;
+        for (int k = 0; ok && k < ctx->lines.count; k++)
+        {
+            const CachedLine *cached = &cache->lines[a + k];
+            unsigned int start = k ? listingEnd[k - 1] : 0;
+            writeOutput(&out, oldListing + copied, cached->listingOffset - copied);
+            writeOutput(&out, listing.data + start, listingEnd[k] - start);
+            copied = cached->listingOffset + cached->listingLength;
+        }
+        if (ok)
+        {
+            writeOutput(&out, oldListing + copied, lstSize - copied);
+            ok = closeOutput(&out) && rename(temporary, ctx->lstPath) == 0;
+            cache->lstWritten = out.written;
+        }
+        if (!ok)
+            unlink(temporary);
+        free(temporary);
+
+        long long delta = 0;
+        int k = 0;
+        for (int r = 0; r < cache->recordCount; r++)
+        {
+            for (; k < ctx->lines.count && cache->lines[a + k].listingOffset < cache->records[r].lstOffset; k++)
+                delta += (long long)(listingEnd[k] - (k ? listingEnd[k - 1] : 0)) - cache->lines[a + k].listingLength;
+            cache->records[r].lstOffset += delta;
+        }
+        delta = 0;
+        for (k = 0; k < ctx->lines.count; k++)
+        {
+            CachedLine *cached = &cache->lines[a + k];
+            cached->listingOffset += delta;
+            delta += (long long)(listingEnd[k] - (k ? listingEnd[k - 1] : 0)) - cached->listingLength;
+        }
+        for (int i = b; i < cache->lineCount; i++)
+            cache->lines[i].listingOffset += delta;
+    }
+
+    if (objFd >= 0)
+        close(objFd);
+    if (lstFd >= 0)
+        close(lstFd);
+    if (ok)
+    {
+        for (int k = 0; k < ctx->lines.count; k++)
+        {
+            cache->lines[a + k].lineNum = ctx->lines.lines[k].lineNum;
+            cache->lines[a + k].listingLength = listingEnd[k] - (k ? listingEnd[k - 1] : 0);
+        }
+        for (int i = b; i < cache->lineCount; i++)
+            cache->lines[i].lineNum += newLines - oldLines;
+        writeAssemblyCache(ctx, cache, path);
+        endPhase(timer, STAT_OUTPUT);
+    }
+    free(oldListing);
+    free(listing.data);
+    free(listingEnd);
+    if (!ok)
+    {
+        resetAssembly(ctx);
+        freeAssemblyCache(cache);
+    }
+    return ok;
+}
+
+// -i keeps a cache next to the object file and tries it before assembling
+// everything; the full assembly then records a fresh cache.
+int assembleIncremental(AssemblyContext *ctx)
+{
+    AssemblyCache cache = {0};
+    char *cachePath = outputPath(ctx->objPath, NULL, ".cache");
+    PhaseTimer timer;
+    startPhaseTimer(&timer);
+    int ok = reassembleFromCache(ctx, &cache, cachePath, &timer);
+    if (ok)
+        addAssemblyStats(ctx, &timer, cache.sourceLines, (long long)cache.objWritten, (long long)cache.lstWritten);
+    else
+    {
+        ctx->cache = &cache;
+        ok = assembleFile(ctx);
+        ctx->cache = NULL;
+        if (!ok)
+            unlink(cachePath);
+        else
+            writeAssemblyCache(ctx, &cache, cachePath);
+    }
+    freeAssemblyCache(&cache);
+    free(cachePath);
+    return ok;
+}
+
+int assembleFile(AssemblyContext *ctx)
+{
+    // Nothing reads the lines a second time when there is no listing, unless
+    // the caller asked for two passes without one.
+    if (!ctx->lstPath && !ctx->noListing)
+        return assembleOnePass(ctx, NULL);
+    // The cache patches text records in place, so binary objects are always
+    // assembled in full.
+    if (ctx->incremental && !ctx->cache && !ctx->noListing && !ctx->costReport && !ctx->binaryObject)
+        return assembleIncremental(ctx);
+
+    PhaseTimer timer;
+    startPhaseTimer(&timer);
+    if (!openSourceFile(ctx->sourcePath, &ctx->source))
+    {
+        fprintf(stderr, "Error opening source file '%s': %s\n", ctx->sourcePath, strerror(errno));
+        return 0;
+    }
+    endPhase(&timer, STAT_READ);
+
+    passOne(ctx);
+    if (ctx->relax)
+        relaxFormats(ctx);
+    endPhase(&timer, STAT_PASS_ONE);
+
+    OutputBuffer objFile, lstFile;
+    if (!openOutput(&objFile, ctx->objPath))
+    {
+        fprintf(stderr, "Error creating object file '%s': %s\n", ctx->objPath, strerror(errno));
+        return 0;
+    }
+
+    OutputBuffer *listing = ctx->noListing ? NULL : &lstFile;
+    if (listing && !openOutput(listing, ctx->lstPath))
+    {
+        fprintf(stderr, "Error creating listing file '%s': %s\n", ctx->lstPath, strerror(errno));
+        closeOutput(&objFile);
+        return 0;
+    }
+
+    endPhase(&timer, STAT_OUTPUT);
+    passTwo(ctx, &objFile, listing);
+    endPhase(&timer, STAT_PASS_TWO);
+    int ok = closeOutput(&objFile);
+    ok = (!listing || closeOutput(listing)) && ok;
+    endPhase(&timer, STAT_OUTPUT);
+    if (!ok)
+        fprintf(stderr, "Error writing output for '%s': %s\n", ctx->sourcePath, strerror(errno));
+    recordAssemblyStats(ctx, &timer, &objFile, listing);
+    return ok;
+}
+
+// Writes the listing of a two-pass assembly still held in ctx, such as one
+// made with noListing, by running pass two again with the object records
+// discarded. The diagnostics of the rerun are dropped; the first run kept them.
+int writeListing(AssemblyContext *ctx, const char *path)
+{
+    OutputBuffer objFile, lstFile;
+    if (!openOutput(&objFile, "/dev/null"))
+        return 0;
+    if (!openOutput(&lstFile, path))
+    {
+        fprintf(stderr, "Error creating listing file '%s': %s\n", path, strerror(errno));
+        closeOutput(&objFile);
+        return 0;
+    }
+    int diagnostics = ctx->diagnostics.count;
+    passTwo(ctx, &objFile, &lstFile);
+    ctx->diagnostics.count = diagnostics;
+    int ok = closeOutput(&objFile);
+    return closeOutput(&lstFile) && ok;
+}
+
+// Empties the context for another source but keeps its arrays, tables and
+// arena blocks, so a long-running server does not reallocate them.
+void resetAssembly(AssemblyContext *ctx)
+{
+    ctx->lines.count = 0;
+    ctx->drainedLines = 0;
+    resetLiteralTable(&ctx->literals);
+    closeSourceFile(&ctx->source);
+    for (int i = 0; i < ctx->sectionCount; i++)
+    {
+        resetSymbolTable(&ctx->sections[i].symbols);
+        resetSymbolTable(&ctx->sections[i].absolutes);
+        ctx->sections[i].defCount = 0;
+        ctx->sections[i].refCount = 0;
+    }
+    ctx->sectionCount = 0;
+    ctx->diagnostics.count = 0;
+    arenaReset(&ctx->diagnostics.text);
+    ctx->execAddress = 0;
+    ctx->failed = 0;
+}
+
+void releaseAssembly(AssemblyContext *ctx)
+{
+    freeLineStore(&ctx->lines);
+    freeLiteralTable(&ctx->literals);
+    closeSourceFile(&ctx->source);
+    for (int i = 0; i < ctx->sectionsAllocated; i++)
+    {
+        freeSymbolTable(&ctx->sections[i].symbols);
+        freeSymbolTable(&ctx->sections[i].absolutes);
+        free(ctx->sections[i].defs);
+        free(ctx->sections[i].refs);
+    }
+    free(ctx->sections);
+    ctx->sections = NULL;
+    ctx->sectionCount = 0;
+    ctx->sectionCapacity = 0;
+    ctx->sectionsAllocated = 0;
+}
+
+void *workerThread(void *arg)
+{
+    WorkerPool *pool = (WorkerPool *)arg;
+    int job;
+    while ((job = atomic_fetch_add(&pool->nextJob, 1)) < pool->jobCount)
+        pool->run(pool->arg, job);
+    return NULL;
+}
+
+void runWorkerPool(int threadCount, int jobCount, void (*run)(void *arg, int job), void *arg)
+{
+    WorkerPool pool;
+    pool.jobCount = jobCount;
+    atomic_init(&pool.nextJob, 0);
+    pool.run = run;
+    pool.arg = arg;
+
+    if (threadCount > jobCount)
+        threadCount = jobCount;
+    if (threadCount <= 1)
+    {
+        workerThread(&pool);
+        return;
+    }
+
+    // The calling thread works the queue too, so only threadCount - 1 are spawned.
+    pthread_t *threads = (pthread_t *)malloc((threadCount - 1) * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < threadCount - 1 &&
+           pthread_create(&threads[started], NULL, workerThread, &pool) == 0)
+        started++;
+    workerThread(&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+void assembleJob(void *arg, int job)
+{
+    AssemblyContext *ctx = &((AssemblyContext *)arg)[job];
+    ctx->failed = !assembleFile(ctx);
+    releaseAssembly(ctx);
+}
+
+char *outputPath(const char *sourcePath, const char *outputDir, const char *extension)
+{
+    const char *slash = strrchr(sourcePath, '/');
+    const char *base = slash ? slash + 1 : sourcePath;
+    const char *dot = strrchr(base, '.');
+    size_t stemLength = (dot && dot != base) ? (size_t)(dot - base) : strlen(base);
+
+    const char *dir = outputDir ? outputDir : sourcePath;
+    size_t dirLength = outputDir ? strlen(outputDir) : (size_t)(base - sourcePath);
+    int needsSlash = outputDir && dirLength > 0 && outputDir[dirLength - 1] != '/';
+
+    char *path = (char *)malloc(dirLength + needsSlash + stemLength + strlen(extension) + 1);
+    if (!path)
+    {
+        fprintf(stderr, "Memory allocation error for output path\n");
+        exit(1);
+    }
+    sprintf(path, "%.*s%s%.*s%s", (int)dirLength, dir, needsSlash ? "/" : "", (int)stemLength, base, extension);
+    return path;
+}
+
+int compareObjectPaths(const void *a, const void *b)
+{
+    const AssemblyContext *x = *(const AssemblyContext *const *)a, *y = *(const AssemblyContext *const *)b;
+    int order = strcmp(x->objPath, y->objPath);
+    return order != 0 ? order : (x < y ? -1 : x > y);
+}
+
+// Sources with the same name in different directories get the same output
+// paths under -o, and two workers would then write the same object, listing
+// and cache files. Reports each such pair; returns how many there are.
+int reportOutputCollisions(AssemblyContext *contexts, int count)
+{
+    AssemblyContext **sorted = (AssemblyContext **)malloc((count + 1) * sizeof(AssemblyContext *));
+    if (!sorted)
+    {
+        fprintf(stderr, "Memory allocation error for output paths\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++)
+        sorted[i] = &contexts[i];
+    qsort(sorted, count, sizeof(AssemblyContext *), compareObjectPaths);
+    int collisions = 0;
+    for (int i = 1; i < count; i++)
+    {
+        if (strcmp(sorted[i - 1]->objPath, sorted[i]->objPath) == 0)
+        {
+            fprintf(stderr, "Error: '%s' and '%s' would both be assembled into '%s'\n", sorted[i - 1]->sourcePath,
+                    sorted[i]->sourcePath, sorted[i]->objPath);
+            collisions++;
+        }
+    }
+    free(sorted);
+    return collisions;
+}
+
+void appendPath(PathList *list, const char *path)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->items = (char **)realloc(list->items, list->capacity * sizeof(char *));
+        if (!list->items)
+        {
+            fprintf(stderr, "Memory allocation error for source list\n");
+            exit(1);
+        }
+    }
+    list->items[list->count++] = strdup(path);
+}
+
+int readManifest(const char *path, PathList *list)
+{
+    FILE *manifest = fopen(path, "r");
+    if (!manifest)
+        return 0;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), manifest))
+    {
+        trim(line);
+        if (line[0] != '\0' && line[0] != ';')
+            appendPath(list, line);
+    }
+    fclose(manifest);
+    return 1;
+}
+
+// Answers the requests on one connection, a line each:
+//   <source>\t<object path>[\t<listing path>]
+// with "OK 0", or "ERROR n" / "FAILED n" followed by n diagnostic lines.
+// Without a listing path the source is assembled in one pass. A line
+// reading SHUTDOWN stops the server; the return value says whether to go on.
+int serveClient(AssemblyContext *ctx, int client)
+{
+    int writeFd = dup(client);
+    FILE *in = fdopen(client, "r");
+    FILE *out = writeFd >= 0 ? fdopen(writeFd, "w") : NULL;
+    if (!in || !out)
+    {
+        if (in)
+            fclose(in);
+        else
+            close(client);
+        if (out)
+            fclose(out);
+        else if (writeFd >= 0)
+            close(writeFd);
+        return 1;
+    }
+
+    char *line = NULL;
+    char *source = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    int keepRunning = 1;
+    int kept = 0;
+    while ((length = getline(&line, &lineCapacity, in)) > 0)
+    {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (strcmp(line, "SHUTDOWN") == 0)
+        {
+            fprintf(out, "OK 0\n");
+            keepRunning = 0;
+            break;
+        }
+        // A listing path of "*" keeps the assembly so that a later
+        // "LISTING\t<path>" can write its listing without reassembling.
+        if (strncmp(line, "LISTING\t", 8) == 0)
+        {
+            if (!kept)
+                fprintf(out, "FAILED 1\nError: No assembly kept for a listing\n");
+            else if (!writeListing(ctx, line + 8))
+                fprintf(out, "FAILED 1\nError: Cannot write listing '%s': %s\n", line + 8, strerror(errno ? errno : EIO));
+            else
+                fprintf(out, "OK 0\n");
+            fflush(out);
+            continue;
+        }
+        if (kept)
+        {
+            resetAssembly(ctx);
+            kept = 0;
+        }
+
+        char *objPath = strchr(line, '\t');
+        char *lstPath = objPath ? strchr(objPath + 1, '\t') : NULL;
+        if (!objPath || objPath == line || objPath[1] == '\0' || objPath + 1 == lstPath)
+        {
+            fprintf(out, "FAILED 1\nError: Expected <source>\\t<object>[\\t<listing>]\n");
+            fflush(out);
+            continue;
+        }
+        *objPath++ = '\0';
+        if (lstPath)
+            *lstPath++ = '\0';
+
+        // The context points at the paths, and the next getline reuses line.
+        free(source);
+        source = (char *)malloc(length + 1);
+        if (!source)
+        {
+            fprintf(stderr, "Memory allocation error for request\n");
+            exit(1);
+        }
+        memcpy(source, line, length + 1);
+        ctx->sourcePath = source;
+        ctx->objPath = source + (objPath - line);
+        ctx->lstPath = lstPath && lstPath[0] ? source + (lstPath - line) : NULL;
+        ctx->noListing = ctx->lstPath && strcmp(ctx->lstPath, "*") == 0;
+        errno = 0;
+        int ok = assembleFile(ctx);
+        if (!ok)
+            fprintf(out, "FAILED 1\nError: Cannot assemble '%s': %s\n", line, strerror(errno ? errno : EIO));
+        else
+        {
+            fprintf(out, "%s %d\n", ctx->diagnostics.count ? "ERROR" : "OK", ctx->diagnostics.count);
+            printDiagnostics(ctx, out, 0);
+        }
+        fflush(out);
+        kept = ok && ctx->noListing;
+        if (!kept)
+            resetAssembly(ctx);
+        ctx->noListing = 0;
+    }
+
+    if (kept)
+        resetAssembly(ctx);
+    free(source);
+    free(line);
+    fclose(in);
+    fclose(out);
+    return keepRunning;
+}
+
+// Stops accepting and ends every connection's reads, so each finishes the
+// request it is on and then sees end of file. Called with the lock held.
+void stopServer(AssemblyServer *server)
+{
+    if (server->stopping)
+        return;
+    server->stopping = 1;
+    shutdown(server->listener, SHUT_RDWR);
+    for (int i = 0; i < server->clientCount; i++)
+        shutdown(server->clients[i], SHUT_RD);
+}
+
+// Serves one connection on its own thread with a context from the pool.
+// serveClient closes the duplicate it is given; the original stays open
+// until the connection is off the list, so stopServer never shuts down a
+// descriptor that accept has reused.
+void *serveConnection(void *arg)
+{
+    ServerConnection *connection = (ServerConnection *)arg;
+    AssemblyServer *server = connection->server;
+    int client = connection->client;
+    free(connection);
+
+    pthread_mutex_lock(&server->lock);
+    AssemblyContext *ctx = server->contextCount > 0 ? server->contexts[--server->contextCount] : NULL;
+    pthread_mutex_unlock(&server->lock);
+    if (!ctx)
+    {
+        ctx = (AssemblyContext *)calloc(1, sizeof(AssemblyContext));
+        if (!ctx)
+        {
+            fprintf(stderr, "Memory allocation error for server context\n");
+            exit(1);
+        }
+        ctx->passOneThreads = server->sourceThreads;
+        ctx->passTwoThreads = server->sourceThreads;
+    }
+
+    int served = dup(client);
+    int running = served < 0 || serveClient(ctx, served);
+
+    pthread_mutex_lock(&server->lock);
+    if (!running)
+        stopServer(server);
+    growArray((void **)&server->contexts, server->contextCount, &server->contextCapacity, sizeof(AssemblyContext *),
+              "server contexts");
+    server->contexts[server->contextCount++] = ctx;
+    for (int i = 0; i < server->clientCount; i++)
+    {
+        if (server->clients[i] == client)
+        {
+            server->clients[i] = server->clients[--server->clientCount];
+            break;
+        }
+    }
+    close(client);
+    pthread_cond_broadcast(&server->idle);
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+// Keeps one process, and the tables of its contexts, warm for many small
+// assemblies. Each connection is served on its own thread, so a client that
+// holds its connection open idle does not keep the others waiting.
+int runServer(const char *socketPath, int sourceThreads)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path too long '%s'\n", socketPath);
+        return 0;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // Only a socket left by an earlier server is replaced; anything else at
+    // the path is the user's.
+    struct stat st;
+    if (lstat(socketPath, &st) == 0 && !S_ISSOCK(st.st_mode))
+    {
+        fprintf(stderr, "Error listening on '%s': the path exists and is not a socket\n", socketPath);
+        return 0;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener >= 0)
+        unlink(socketPath);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+    {
+        fprintf(stderr, "Error listening on '%s': %s\n", socketPath, strerror(errno));
+        if (listener >= 0)
+            close(listener);
+        return 0;
+    }
+    // A client that disconnects early must not take the server down.
+    signal(SIGPIPE, SIG_IGN);
+
+    AssemblyServer server = {0};
+    server.listener = listener;
+    server.sourceThreads = sourceThreads;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.idle, NULL);
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    int failed = 0;
+    for (;;)
+    {
+        int client = accept(listener, NULL, NULL);
+        pthread_mutex_lock(&server.lock);
+        if (server.stopping)
+        {
+            pthread_mutex_unlock(&server.lock);
+            if (client >= 0)
+                close(client);
+            break;
+        }
+        if (client < 0)
+        {
+            pthread_mutex_unlock(&server.lock);
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error accepting on '%s': %s\n", socketPath, strerror(errno));
+            failed = 1;
+            break;
+        }
+        growArray((void **)&server.clients, server.clientCount, &server.clientCapacity, sizeof(int), "server clients");
+        server.clients[server.clientCount++] = client;
+        pthread_mutex_unlock(&server.lock);
+
+        ServerConnection *connection = (ServerConnection *)malloc(sizeof(ServerConnection));
+        if (!connection)
+        {
+            fprintf(stderr, "Memory allocation error for server connection\n");
+            exit(1);
+        }
+        connection->server = &server;
+        connection->client = client;
+        pthread_t thread;
+        // Without a thread the connection is served here, the others waiting.
+        if (pthread_create(&thread, &attributes, serveConnection, connection) != 0)
+            serveConnection(connection);
+    }
+
+    // Let the connections finish the requests they are on.
+    pthread_mutex_lock(&server.lock);
+    stopServer(&server);
+    while (server.clientCount > 0)
+        pthread_cond_wait(&server.idle, &server.lock);
+    pthread_mutex_unlock(&server.lock);
+
+    pthread_attr_destroy(&attributes);
+    close(listener);
+    unlink(socketPath);
+    for (int i = 0; i < server.contextCount; i++)
+    {
+        releaseAssembly(server.contexts[i]);
+        freeDiagnostics(&server.contexts[i]->diagnostics);
+        free(server.contexts[i]);
+    }
+    free(server.contexts);
+    free(server.clients);
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.idle);
+    return !failed;
+}
+
+double monotonicSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Process-wide, so pass two's worker threads are included; in batch mode it
+// also includes whatever the other jobs did during the phase.
+double cpuSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void startPhaseTimer(PhaseTimer *timer)
+{
+    if (!activeStats)
+        return;
+    memset(timer, 0, sizeof(*timer));
+    timer->lastWall = monotonicSeconds();
+    timer->lastCpu = cpuSeconds();
+}
+
+void endPhase(PhaseTimer *timer, StatPhase phase)
+{
+    if (!activeStats)
+        return;
+    double wall = monotonicSeconds();
+    double cpu = cpuSeconds();
+    timer->wall[phase] += wall - timer->lastWall;
+    timer->cpu[phase] += cpu - timer->lastCpu;
+    timer->lastWall = wall;
+    timer->lastCpu = cpu;
+}
+
+void recordAssemblyStats(const AssemblyContext *ctx, const PhaseTimer *timer, const OutputBuffer *objFile,
+                         const OutputBuffer *lstFile)
+{
+    if (!activeStats)
+        return;
+    long long lines = ctx->lines.count > 0 ? ctx->lines.lines[ctx->lines.count - 1].lineNum : ctx->drainedLines;
+    addAssemblyStats(ctx, timer, lines, objFile ? (long long)objFile->written : 0,
+                     lstFile ? (long long)lstFile->written : 0);
+}
+
+// The cache path passes its own counts: the lines of the whole new source and
+// only the bytes it patched or rewrote.
+void addAssemblyStats(const AssemblyContext *ctx, const PhaseTimer *timer, long long lines, long long objBytes,
+                      long long lstBytes)
+{
+    AssemblyStats *stats = activeStats;
+    if (!stats)
+        return;
+
+    pthread_mutex_lock(&stats->lock);
+    for (int p = 0; p < STAT_PHASE_COUNT; p++)
+    {
+        stats->wall[p] += timer->wall[p];
+        stats->cpu[p] += timer->cpu[p];
+    }
+    stats->files++;
+    stats->lines += lines;
+    stats->sourceBytes += ctx->source.size;
+    stats->objBytes += objBytes;
+    stats->lstBytes += lstBytes;
+    for (int i = 0; i < ctx->sectionCount; i++)
+    {
+        const SymbolTable *table = &ctx->sections[i].symbols;
+        stats->symbols += table->count;
+        stats->symbolCapacity += table->capacity;
+        for (unsigned int slot = 0; slot < table->capacity; slot++)
+        {
+            if (!table->entries[slot].label)
+                continue;
+            unsigned int probe = (slot - table->entries[slot].hash) & (table->capacity - 1);
+            stats->probeTotal += probe;
+            if (probe > stats->maxProbe)
+                stats->maxProbe = probe;
+        }
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+void printStats(const AssemblyStats *stats, FILE *out, int json)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double wall = 0, cpu = 0;
+    for (int p = 0; p < STAT_PHASE_COUNT; p++)
+    {
+        wall += stats->wall[p];
+        cpu += stats->cpu[p];
+    }
+    double loadFactor = stats->symbolCapacity ? (double)stats->symbols / stats->symbolCapacity : 0;
+    double averageProbe = stats->symbols ? (double)stats->probeTotal / stats->symbols : 0;
+    double linesPerSecond = wall > 0 ? stats->lines / wall : 0;
+
+    if (json)
+    {
+        fprintf(out, "{\"files\": %d, \"lines\": %lld, \"source_bytes\": %lld, \"phases\": {", stats->files,
+                stats->lines, stats->sourceBytes);
+        for (int p = 0; p < STAT_PHASE_COUNT; p++)
+            fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", p ? ", " : "", statPhaseNames[p],
+                    stats->wall[p] * 1e3, stats->cpu[p] * 1e3);
+        fprintf(out, "}, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"lines_per_sec\": %.0f, ", wall * 1e3, cpu * 1e3,
+                linesPerSecond);
+        fprintf(out, "\"symbols\": %lld, \"symbol_capacity\": %lld, \"load_factor\": %.3f, ", stats->symbols,
+                stats->symbolCapacity, loadFactor);
+        fprintf(out, "\"avg_probe\": %.3f, \"max_probe\": %u, ", averageProbe, stats->maxProbe);
+        fprintf(out, "\"opcode_lookups\": %lld, \"symbol_lookups\": %lld, ", (long long)stats->opcodeLookups,
+                (long long)stats->symbolLookups);
+        fprintf(out, "\"obj_bytes\": %lld, \"lst_bytes\": %lld, \"peak_rss_kb\": %ld}\n", stats->objBytes,
+                stats->lstBytes, usage.ru_maxrss);
+        return;
+    }
+
+    fprintf(out, "\n%-10s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (int p = 0; p < STAT_PHASE_COUNT; p++)
+        fprintf(out, "%-10s %12.3f %12.3f\n", statPhaseNames[p], stats->wall[p] * 1e3, stats->cpu[p] * 1e3);
+    fprintf(out, "%-10s %12.3f %12.3f\n", "total", wall * 1e3, cpu * 1e3);
+    fprintf(out, "lines:          %lld in %d file(s), %.0f lines/s, %.1f MB/s\n", stats->lines, stats->files,
+            linesPerSecond, wall > 0 ? stats->sourceBytes / wall / 1e6 : 0);
+    fprintf(out, "symbol table:   %lld symbols, capacity %lld, load %.2f, avg probe %.2f, max probe %u\n",
+            stats->symbols, stats->symbolCapacity, loadFactor, averageProbe, stats->maxProbe);
+    fprintf(out, "lookups:        %lld opcode, %lld symbol\n", (long long)stats->opcodeLookups,
+            (long long)stats->symbolLookups);
+    fprintf(out, "output:         %lld obj bytes, %lld lst bytes\n", stats->objBytes, stats->lstBytes);
+    fprintf(out, "peak memory:    %ld KB\n", usage.ru_maxrss);
+}
+
+int signExtend24(int value)
+{
+    return (int)((unsigned int)value << 8) >> 8;
+}
+
+int readWord(const unsigned char *memory, int address)
+{
+    return signExtend24((memory[address] << 16) | (memory[address + 1] << 8) | memory[address + 2]);
+}
+
+void writeWord(Machine *machine, int address, int value)
+{
+    machine->memory[address] = (value >> 16) & 0xFF;
+    machine->memory[address + 1] = (value >> 8) & 0xFF;
+    machine->memory[address + 2] = value & 0xFF;
+    invalidateDecoded(machine, address, 3);
+}
+
+void invalidateDecoded(Machine *machine, int address, int length)
+{
+    // An instruction starting up to three bytes earlier may cover the bytes.
+    int first = address >= 3 ? address - 3 : 0;
+    for (int i = first; i < address + length; i++)
+        machine->decoded[i].kind = 0;
+}
+
+double readFloat(const unsigned char *memory, int address)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < 6; i++)
+        bits = (bits << 8) | memory[address + i];
+    uint64_t fraction = bits & 0xFFFFFFFFFull;
+    if (fraction == 0)
+        return 0.0;
+
+    // 1 sign bit, 11 exponent bits biased by 1024, 36 fraction bits 0.f
+    int exponent = (int)((bits >> 36) & 0x7FF) - 1024;
+    while (!(fraction & 0x800000000ull))
+    {
+        fraction <<= 1;
+        exponent--;
+    }
+    int ieeeExponent = exponent + 1022;
+    if (ieeeExponent <= 0)
+        return 0.0;
+    uint64_t ieee = ((bits >> 47) << 63) | ((uint64_t)ieeeExponent << 52) | ((fraction & 0x7FFFFFFFFull) << 17);
+    double value;
+    memcpy(&value, &ieee, sizeof(value));
+    return value;
+}
+
+void writeFloat(Machine *machine, int address, double value)
+{
+    uint64_t ieee;
+    memcpy(&ieee, &value, sizeof(ieee));
+    uint64_t bits = 0;
+    int ieeeExponent = (int)((ieee >> 52) & 0x7FF);
+    if (ieeeExponent != 0)
+    {
+        int exponent = ieeeExponent + 2;
+        if (exponent > 0x7FF)
+            exponent = 0x7FF;
+        bits = ((ieee >> 63) << 47) | ((uint64_t)exponent << 36) | 0x800000000ull | ((ieee >> 17) & 0x7FFFFFFFFull);
+    }
+    for (int i = 5; i >= 0; i--)
+    {
+        machine->memory[address + i] = bits & 0xFF;
+        bits >>= 8;
+    }
+    invalidateDecoded(machine, address, 6);
+}
+
+int initMachine(Machine *machine)
+{
+    memset(machine, 0, sizeof(*machine));
+    // Guard bytes let word and float accesses at the top of memory run off the end.
+    machine->memory = (unsigned char *)calloc(MEMORY_SIZE + 8, 1);
+    machine->decoded = (DecodedInstruction *)calloc(MEMORY_SIZE + 8, sizeof(DecodedInstruction));
+    if (!machine->memory || !machine->decoded)
+    {
+        fprintf(stderr, "Memory allocation error for machine memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < sizeof(opcodeTable) / sizeof(opcodeTable[0]); i++)
+        machine->formats[opcodeTable[i].opcode >> 2] = opcodeTable[i].format;
+    machine->reg[REG_L] = RETURN_ADDRESS;
+    return 1;
+}
+
+void freeMachine(Machine *machine)
+{
+    free(machine->memory);
+    free(machine->decoded);
+    machine->memory = NULL;
+    machine->decoded = NULL;
+}
+
+const char *nextRecord(const SourceFile *file, size_t *pos, size_t *length, int *lineNum)
+{
+    while (*pos < file->size)
+    {
+        const char *line = file->data + *pos;
+        const char *end = memchr(line, '\n', file->size - *pos);
+        size_t size = end ? (size_t)(end - line) : file->size - *pos;
+        *pos += size + 1;
+        (*lineNum)++;
+        while (size > 0 && (line[size - 1] == '\r' || line[size - 1] == ' '))
+            size--;
+        if (size > 0)
+        {
+            *length = size;
+            return line;
+        }
+    }
+    return NULL;
+}
+
+size_t trimmedLength(const char *text, size_t length)
+{
+    while (length > 0 && text[length - 1] == ' ')
+        length--;
+    return length;
+}
+
+void addSegment(Linker *linker, int address, int length)
+{
+    growArray((void **)&linker->segments, linker->segmentCount, &linker->segmentCapacity, sizeof(Segment),
+              "text segments");
+    linker->segments[linker->segmentCount].address = address;
+    linker->segments[linker->segmentCount++].length = length;
+}
+
+void addFixup(Linker *linker, int address, int halfBytes, int value)
+{
+    growArray((void **)&linker->fixups, linker->fixupCount, &linker->fixupCapacity, sizeof(Fixup), "fixups");
+    Fixup *fixup = &linker->fixups[linker->fixupCount++];
+    fixup->address = address & MEMORY_MASK;
+    fixup->halfBytes = halfBytes;
+    fixup->value = value;
+}
+
+// The binary twin of one module's pass in scanObjectModules. The module is
+// normally mapped, so a T record is a single copy from the file into memory.
+int scanBinaryModule(Machine *machine, Linker *linker, int m, int pass, int *csaddr, int *sections)
+{
+    const SourceFile *file = &linker->modules[m];
+    BinaryRecord record = {0};
+    const char *name = NULL;
+    int nameLength = 0;
+    int start = 0, length = 0;
+    int inSection = 0;
+    size_t pos = BINARY_HEADER_SIZE, offset = pos;
+    int status;
+
+    for (; (status = nextBinaryRecord(file, &pos, &record)) > 0; offset = pos)
+    {
+        const char *error = NULL;
+        if (record.type == 'H')
+        {
+            if (inSection)
+                error = "Invalid header record";
+            else
+            {
+                name = record.name;
+                nameLength = record.nameLength;
+                start = record.address;
+                length = record.length;
+                inSection = 1;
+                if ((*sections)++ == 0 && m == 0)
+                {
+                    *csaddr = start;
+                    machine->startAddress = start;
+                    machine->execAddress = start;
+                    snprintf(machine->progName, sizeof(machine->progName), "%.*s", nameLength, name);
+                }
+                if (pass == 1 && !insertSymbol(&linker->estab, name, nameLength, *csaddr))
+                    error = "Duplicate external symbol";
+            }
+        }
+        else if (!inSection)
+            error = "Record outside a control section";
+        else if (record.type == 'D')
+        {
+            if (pass == 1 &&
+                !insertSymbol(&linker->estab, record.name, record.nameLength, *csaddr + record.address - start))
+                error = "Duplicate external symbol";
+        }
+        else if (record.type == 'T')
+        {
+            int address = record.address + *csaddr - start;
+            if (address < 0 || address + record.length > MEMORY_SIZE)
+                error = "Invalid text record";
+            else if (pass == 2)
+            {
+                memcpy(machine->memory + address, record.data, record.length);
+                addSegment(linker, address, record.length);
+            }
+        }
+        else if (record.type == 'M')
+        {
+            if (record.length != 5 && record.length != 6)
+                error = "Invalid modification record";
+            else if (pass == 2)
+            {
+                int value;
+                Symbol *symbol;
+                if (record.nameLength == nameLength && labelsEqual(record.name, name, nameLength))
+                    value = *csaddr - start;
+                else if ((symbol = findSymbol(&linker->estab, record.name, record.nameLength)) != NULL)
+                    value = symbol->address;
+                else
+                {
+                    fprintf(stderr, "Error: Undefined external symbol '%.*s' at offset %zu of '%s'\n",
+                            record.nameLength, record.name, offset, linker->paths[m]);
+                    return 0;
+                }
+                for (int i = 0; i < record.count; i++)
+                    addFixup(linker, (int)getLittle32(record.data + 4 * i) + *csaddr - start, record.length,
+                             record.flags ? -value : value);
+            }
+        }
+        else if (record.type == 'E')
+        {
+            if (record.flags && pass == 2 && m == 0 && *sections == 1)
+                machine->execAddress = record.address + *csaddr - start;
+            *csaddr += length;
+            inSection = 0;
+        }
+
+        if (error)
+        {
+            fprintf(stderr, "Error: %s at offset %zu of '%s'\n", error, offset, linker->paths[m]);
+            return 0;
+        }
+    }
+    if (status < 0)
+    {
+        fprintf(stderr, "Error: Invalid binary record at offset %zu of '%s'\n", offset, linker->paths[m]);
+        return 0;
+    }
+    if (inSection)
+    {
+        fprintf(stderr, "Error: Missing end record in '%s'\n", linker->paths[m]);
+        return 0;
+    }
+    return 1;
+}
+
+// Pass 1 lays the control sections out one after another from the first
+// section's start address and enters section names and D record symbols in
+// ESTAB. Pass 2 copies T records into memory and resolves every M record to
+// a Fixup; the fixups are then applied in one sweep over the image.
+int scanObjectModules(Machine *machine, Linker *linker, int pass)
+{
+    int csaddr = machine->startAddress;
+    int sections = 0;
+
+    for (int m = 0; m < linker->moduleCount; m++)
+    {
+        const SourceFile *file = &linker->modules[m];
+        if (isBinaryObject(file))
+        {
+            if (!scanBinaryModule(machine, linker, m, pass, &csaddr, &sections))
+                return 0;
+            continue;
+        }
+
+        const char *name = NULL;
+        size_t nameLength = 0;
+        int start = 0, length = 0;
+        int inSection = 0;
+        int lineNum = 0;
+        size_t pos = 0, size;
+        const char *line;
+
+        while ((line = nextRecord(file, &pos, &size, &lineNum)) != NULL)
+        {
+            const char *error = NULL;
+            int address, count;
+
+            if (line[0] == 'H')
+            {
+                // The name is normally six columns but may be longer, so the
+                // two address fields are taken from the end of the record.
+                if (inSection || size < 13 ||
+                    !parseNumber(line + size - 12, 6, 16, &start) ||
+                    !parseNumber(line + size - 6, 6, 16, &length))
+                    error = "Invalid header record";
+                else
+                {
+                    name = line + 1;
+                    nameLength = trimmedLength(name, size - 13);
+                    inSection = 1;
+                    if (sections++ == 0 && m == 0)
+                    {
+                        csaddr = start;
+                        machine->startAddress = start;
+                        machine->execAddress = start;
+                        snprintf(machine->progName, sizeof(machine->progName), "%.*s", (int)nameLength, name);
+                    }
+                    if (pass == 1 && !insertSymbol(&linker->estab, name, nameLength, csaddr))
+                        error = "Duplicate external symbol";
+                }
+            }
+            else if (!inSection)
+                error = "Record outside a control section";
+            else if (line[0] == 'D')
+            {
+                for (size_t i = 1; pass == 1 && i < size && !error; i += 12)
+                {
+                    if (i + 12 > size || !parseNumber(line + i + 6, 6, 16, &address))
+                        error = "Invalid define record";
+                    else if (!insertSymbol(&linker->estab, line + i, trimmedLength(line + i, 6), csaddr + address - start))
+                        error = "Duplicate external symbol";
+                }
+            }
+            else if (line[0] == 'R')
+            {
+                // References are resolved through the M records that use them.
+            }
+            else if (line[0] == 'T')
+            {
+                if (size < 9 || !parseNumber(line + 1, 6, 16, &address) || !parseNumber(line + 7, 2, 16, &count) ||
+                    size != 9 + 2 * (size_t)count)
+                    error = "Invalid text record";
+                else if (pass == 2)
+                {
+                    address += csaddr - start;
+                    if (address < 0 || address + count > MEMORY_SIZE ||
+                        !parseHexBytes(line + 9, 2 * count, machine->memory + address))
+                        error = "Invalid text record";
+                    else
+                        addSegment(linker, address, count);
+                }
+            }
+            else if (line[0] == 'M')
+            {
+                if (size < 11 || !parseNumber(line + 1, 6, 16, &address) || !parseNumber(line + 7, 2, 16, &count) ||
+                    (count != 5 && count != 6) || (line[9] != '+' && line[9] != '-'))
+                    error = "Invalid modification record";
+                else if (pass == 2)
+                {
+                    // A section names itself to be relocated by its own load offset.
+                    int value;
+                    Symbol *symbol;
+                    if (size - 10 == nameLength && labelsEqual(line + 10, name, nameLength))
+                        value = csaddr - start;
+                    else if ((symbol = findSymbol(&linker->estab, line + 10, size - 10)) != NULL)
+                        value = symbol->address;
+                    else
+                    {
+                        fprintf(stderr, "Error: Undefined external symbol '%.*s' at line %d of '%s'\n",
+                                (int)(size - 10), line + 10, lineNum, linker->paths[m]);
+                        return 0;
+                    }
+                    addFixup(linker, address + csaddr - start, count, line[9] == '-' ? -value : value);
+                }
+            }
+            else if (line[0] == 'E')
+            {
+                if (size > 1 && (size < 7 || !parseNumber(line + 1, 6, 16, &address)))
+                    error = "Invalid end record";
+                else
+                {
+                    if (size > 1 && pass == 2 && m == 0 && sections == 1)
+                        machine->execAddress = address + csaddr - start;
+                    csaddr += length;
+                    inSection = 0;
+                }
+            }
+            else
+                error = "Unknown record type";
+
+            if (error)
+            {
+                fprintf(stderr, "Error: %s at line %d of '%s'\n", error, lineNum, linker->paths[m]);
+                return 0;
+            }
+        }
+        if (inSection)
+        {
+            fprintf(stderr, "Error: Missing end record in '%s'\n", linker->paths[m]);
+            return 0;
+        }
+    }
+
+    linker->sectionCount = sections;
+    machine->progLength = csaddr - machine->startAddress;
+    if (csaddr > MEMORY_SIZE)
+    {
+        fprintf(stderr, "Error: Linked program does not fit in memory\n");
+        return 0;
+    }
+    return 1;
+}
+
+void applyFixups(Machine *machine, const Linker *linker)
+{
+    unsigned char *memory = machine->memory;
+    for (int i = 0; i < linker->fixupCount; i++)
+    {
+        const Fixup *fixup = &linker->fixups[i];
+        unsigned char *field = memory + fixup->address;
+        unsigned int word = (field[0] << 16) | (field[1] << 8) | field[2];
+        if (fixup->halfBytes == 5)
+            word = (word & 0xF00000) | ((word + fixup->value) & 0x0FFFFF);
+        else
+            word = (word + fixup->value) & 0xFFFFFF;
+        field[0] = word >> 16;
+        field[1] = word >> 8;
+        field[2] = word;
+    }
+}
+
+int linkObjectModules(Machine *machine, Linker *linker, char *const paths[], int count)
+{
+    memset(linker, 0, sizeof(*linker));
+    linker->paths = paths;
+    linker->modules = (SourceFile *)calloc(count, sizeof(SourceFile));
+    if (!linker->modules)
+    {
+        fprintf(stderr, "Memory allocation error for object modules\n");
+        exit(1);
+    }
+    for (; linker->moduleCount < count; linker->moduleCount++)
+    {
+        if (!openSourceFile(paths[linker->moduleCount], &linker->modules[linker->moduleCount]))
+        {
+            fprintf(stderr, "Error opening object file '%s': %s\n", paths[linker->moduleCount], strerror(errno));
+            return 0;
+        }
+    }
+
+    if (!scanObjectModules(machine, linker, 1) || !scanObjectModules(machine, linker, 2))
+        return 0;
+    applyFixups(machine, linker);
+    for (int i = 0; i < linker->segmentCount; i++)
+        invalidateDecoded(machine, linker->segments[i].address, linker->segments[i].length);
+    return 1;
+}
+
+void freeLinker(Linker *linker)
+{
+    for (int i = 0; i < linker->moduleCount; i++)
+        closeSourceFile(&linker->modules[i]);
+    free(linker->modules);
+    free(linker->fixups);
+    free(linker->segments);
+    freeSymbolTable(&linker->estab);
+}
+
+int writeLinkedProgram(const Machine *machine, const Linker *linker, const char *path, int binary)
+{
+    OutputBuffer obj;
+    if (!openOutput(&obj, path))
+    {
+        fprintf(stderr, "Error creating object file '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    if (binary)
+    {
+        // Segments loaded back to back become one T record however long.
+        unsigned int textBytes = 0;
+        writeBinaryHeader(&obj, 1, 0);
+        writeBinaryRecord(&obj, 'H', 0, machine->progName, (int)strlen(machine->progName), machine->startAddress,
+                          machine->progLength, NULL);
+        for (int i = 0; i < linker->segmentCount;)
+        {
+            int address = linker->segments[i].address;
+            int end = address + linker->segments[i++].length;
+            while (i < linker->segmentCount && linker->segments[i].address == end)
+                end += linker->segments[i++].length;
+            writeBinaryRecord(&obj, 'T', 0, NULL, 0, address, end - address, machine->memory + address);
+            textBytes += end - address;
+        }
+        writeBinaryRecord(&obj, 'E', 1, NULL, 0, machine->execAddress, 0, NULL);
+        writeBinaryHeader(&obj, 1, textBytes);
+    }
+    else
+    {
+        RecordWriter writer = {0};
+        writer.obj = &obj;
+        writeHeaderRecord(&writer, machine->progName, machine->startAddress, machine->progLength);
+        for (int i = 0; i < linker->segmentCount; i++)
+            appendTextRecord(&writer, linker->segments[i].address, machine->memory + linker->segments[i].address,
+                             linker->segments[i].length);
+        flushTextRecord(&writer);
+        writeEndRecord(&writer, machine->execAddress);
+    }
+
+    if (!closeOutput(&obj))
+    {
+        fprintf(stderr, "Error writing object file '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// Binary object files hold the same H/D/R/T/M/E records as the text format
+// in little-endian binary. A 16-byte header ("SICB", version, section count,
+// total T bytes) is followed by records of a 12-byte fixed part
+//
+//   type, flags, name length (2), address (4), length (4)
+//
+// then the name and, for T records, the bytes themselves, padded to a
+// multiple of four. T records are not split at 30 bytes: a contiguous run
+// of text, up to MAX_BINARY_TEXT bytes from the assembler, is one record
+// that the loader copies in one go. An M record lists every field it
+// modifies: its address holds the width in half bytes, its length the
+// number of fields, and the name, padded to four, is followed by the
+// address of each field.
+void putLittle32(unsigned char *out, unsigned int value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+unsigned int getLittle32(const unsigned char *in)
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+int isBinaryObject(const SourceFile *file)
+{
+    return file->size >= BINARY_HEADER_SIZE && memcmp(file->data, BINARY_OBJECT_MAGIC, 4) == 0;
+}
+
+// Returns 1 with the next record, 0 at the end of the file and -1 for a
+// record that runs past the end or has an unknown type or version.
+int nextBinaryRecord(const SourceFile *file, size_t *pos, BinaryRecord *record)
+{
+    const unsigned char *data = (const unsigned char *)file->data;
+    if (*pos == BINARY_HEADER_SIZE && getLittle32(data + 4) != BINARY_OBJECT_VERSION)
+        return -1;
+    if (*pos >= file->size)
+        return 0;
+    if (file->size - *pos < BINARY_RECORD_SIZE)
+        return -1;
+
+    const unsigned char *fixed = data + *pos;
+    record->type = fixed[0];
+    record->flags = fixed[1];
+    record->nameLength = fixed[2] | (fixed[3] << 8);
+    record->address = (int)getLittle32(fixed + 4);
+    record->length = (int)getLittle32(fixed + 8);
+    record->name = (const char *)fixed + BINARY_RECORD_SIZE;
+    record->data = fixed + BINARY_RECORD_SIZE + record->nameLength;
+    record->count = 0;
+    if (!strchr("HDRTME", record->type) || record->type == 0 || record->address < 0 || record->length < 0)
+        return -1;
+
+    size_t size = BINARY_RECORD_SIZE + record->nameLength + (record->type == 'T' ? (size_t)record->length : 0);
+    size = (size + 3) & ~(size_t)3;
+    if (record->type == 'M')
+    {
+        record->data = fixed + size;
+        size += 4 * (size_t)record->length;
+    }
+    if (size > file->size - *pos || (record->type == 'M' && record->length == 0))
+        return -1;
+    if (record->type == 'M')
+    {
+        record->count = record->length;
+        record->length = record->address;
+        record->address = (int)getLittle32(record->data);
+    }
+    *pos += size;
+    return 1;
+}
+
+// Written once with placeholders and patched with the totals at the end.
+void writeBinaryHeader(OutputBuffer *out, int sections, unsigned int textBytes)
+{
+    unsigned char header[BINARY_HEADER_SIZE];
+    memcpy(header, BINARY_OBJECT_MAGIC, 4);
+    putLittle32(header + 4, BINARY_OBJECT_VERSION);
+    putLittle32(header + 8, (unsigned int)sections);
+    putLittle32(header + 12, textBytes);
+    if (out->written + out->size == 0)
+        writeOutput(out, (const char *)header, sizeof(header));
+    else
+        patchOutput(out, 0, (const char *)header, sizeof(header));
+}
+
+void writeBinaryRecord(OutputBuffer *out, int type, int flags, const char *name, int nameLength, int address, int length,
+                       const unsigned char *data)
+{
+    static const char padding[4] = {0};
+    unsigned char fixed[BINARY_RECORD_SIZE];
+    fixed[0] = (unsigned char)type;
+    fixed[1] = (unsigned char)flags;
+    fixed[2] = nameLength & 0xFF;
+    fixed[3] = nameLength >> 8 & 0xFF;
+    putLittle32(fixed + 4, (unsigned int)address);
+    putLittle32(fixed + 8, (unsigned int)length);
+    writeOutput(out, (const char *)fixed, sizeof(fixed));
+    // T and E records have no name to copy.
+    if (nameLength > 0)
+        writeOutput(out, name, nameLength);
+    size_t size = BINARY_RECORD_SIZE + nameLength;
+    if (data)
+    {
+        writeOutput(out, (const char *)data, length);
+        size += length;
+    }
+    writeOutput(out, padding, (4 - size % 4) % 4);
+}
+
+// Text records are checked the way the linker checks them.
+int nextObjectRecord(ObjectReader *reader, BinaryRecord *record)
+{
+    if (reader->binary)
+    {
+        if (reader->pos == 0)
+            reader->pos = BINARY_HEADER_SIZE;
+        // The fields of an M record come out one at a time, like the names
+        // of a text D record.
+        if (reader->field < (size_t)reader->group.count)
+        {
+            *record = reader->group;
+            record->address = (int)getLittle32(record->data + 4 * reader->field++);
+            return 1;
+        }
+        reader->offset = reader->pos;
+        int status = nextBinaryRecord(reader->file, &reader->pos, record);
+        if (status < 0)
+            reader->error = "Invalid binary record";
+        else if (status > 0 && record->type == 'M')
+        {
+            reader->group = *record;
+            reader->field = 1;
+        }
+        return status;
+    }
+
+    while (!reader->line)
+    {
+        reader->line = nextRecord(reader->file, &reader->pos, &reader->size, &reader->lineNum);
+        if (!reader->line)
+            return 0;
+        reader->field = 1;
+        if ((reader->line[0] == 'D' || reader->line[0] == 'R') && reader->size == 1)
+            reader->line = NULL;
+    }
+    const char *line = reader->line;
+    size_t size = reader->size, i = reader->field;
+    int address, count;
+    memset(record, 0, sizeof(*record));
+    record->type = line[0];
+    reader->field = size;
+
+    if (line[0] == 'H')
+    {
+        if (size < 13 || !parseNumber(line + size - 12, 6, 16, &record->address) ||
+            !parseNumber(line + size - 6, 6, 16, &record->length))
+            reader->error = "Invalid header record";
+        record->name = line + 1;
+        record->nameLength = (int)trimmedLength(line + 1, size < 13 ? 0 : size - 13);
+    }
+    else if (line[0] == 'D')
+    {
+        if (i + 12 > size || !parseNumber(line + i + 6, 6, 16, &record->address))
+            reader->error = "Invalid define record";
+        else
+        {
+            record->name = line + i;
+            record->nameLength = (int)trimmedLength(line + i, 6);
+            reader->field = i + 12;
+        }
+    }
+    else if (line[0] == 'R')
+    {
+        size_t width = size - i < 6 ? size - i : 6;
+        record->name = line + i;
+        record->nameLength = (int)trimmedLength(line + i, width);
+        reader->field = i + 6;
+    }
+    else if (line[0] == 'T')
+    {
+        if (size < 9 || !parseNumber(line + 1, 6, 16, &address) || !parseNumber(line + 7, 2, 16, &count) ||
+            size != 9 + 2 * (size_t)count)
+            reader->error = "Invalid text record";
+        else
+        {
+            reader->bytes.size = 0;
+            reserveText(&reader->bytes, count);
+            if (!parseHexBytes(line + 9, 2 * count, (unsigned char *)reader->bytes.data))
+                reader->error = "Invalid text record";
+            record->address = address;
+            record->length = count;
+            record->data = (const unsigned char *)reader->bytes.data;
+        }
+    }
+    else if (line[0] == 'M')
+    {
+        if (size < 11 || !parseNumber(line + 1, 6, 16, &record->address) ||
+            !parseNumber(line + 7, 2, 16, &record->length) || (line[9] != '+' && line[9] != '-'))
+            reader->error = "Invalid modification record";
+        record->flags = line[9] == '-';
+        record->name = line + 10;
+        record->nameLength = size < 11 ? 0 : (int)(size - 10);
+    }
+    else if (line[0] == 'E')
+    {
+        if (size > 1 && (size < 7 || !parseNumber(line + 1, 6, 16, &record->address)))
+            reader->error = "Invalid end record";
+        record->flags = size > 1;
+    }
+    else
+        reader->error = "Unknown record type";
+    if (reader->field >= size)
+        reader->line = NULL;
+    return reader->error ? -1 : 1;
+}
+
+void reportObjectError(const ObjectReader *reader, const char *path)
+{
+    if (reader->binary)
+        fprintf(stderr, "Error: %s at offset %zu of '%s'\n", reader->error, reader->offset, path);
+    else
+        fprintf(stderr, "Error: %s at line %d of '%s'\n", reader->error, reader->lineNum, path);
+}
+
+// Goes through a binary RecordWriter, so consecutive T records that
+// continue one another are merged and M records grouped as the assembler
+// would write them.
+int textToBinaryObject(const SourceFile *file, const char *path, OutputBuffer *out)
+{
+    ObjectReader reader = {0};
+    RecordWriter writer = {0};
+    BinaryRecord record;
+    int status;
+
+    reader.file = file;
+    writer.obj = out;
+    writer.binary = 1;
+    writeBinaryHeader(out, 0, 0);
+    while ((status = nextObjectRecord(&reader, &record)) > 0)
+    {
+        if (record.type == 'H')
+        {
+            char name[MAX_OPERAND];
+            snprintf(name, sizeof(name), "%.*s", record.nameLength, record.name);
+            writeHeaderRecord(&writer, name, record.address, record.length);
+        }
+        else if (record.type == 'T')
+            appendTextRecord(&writer, record.address, record.data, record.length);
+        else if (record.type == 'M')
+            writeModificationRecord(&writer, record.address, record.length, record.flags ? '-' : '+', record.name,
+                                    record.nameLength);
+        else if (record.type == 'E')
+            finishSection(&writer, record.flags ? record.address : -1);
+        else
+        {
+            flushTextRecord(&writer);
+            writeBinaryRecord(out, record.type, record.flags, record.name, record.nameLength, record.address,
+                              record.length, NULL);
+        }
+    }
+    flushTextRecord(&writer);
+    writeModificationRecords(&writer);
+    free(reader.bytes.data);
+    if (status < 0)
+    {
+        reportObjectError(&reader, path);
+        freeRecordWriter(&writer);
+        return 0;
+    }
+    finishRecords(&writer);
+    freeRecordWriter(&writer);
+    return 1;
+}
+
+// Writes the records back in the assembler's own layout: six symbols to a D
+// record, twelve to an R record and T records of up to 30 bytes.
+int binaryToTextObject(const SourceFile *file, const char *path, OutputBuffer *out)
+{
+    RecordWriter writer = {0};
+    BinaryRecord record;
+    char line[1 + 12 * 6 + 1];
+    int length = 0;
+    int lineType = 0;
+    size_t pos = BINARY_HEADER_SIZE, offset = pos;
+    int status;
+
+    writer.obj = out;
+    for (; (status = nextBinaryRecord(file, &pos, &record)) > 0; offset = pos)
+    {
+        if (length > 0 && (record.type != lineType || length == 1 + 12 * 6))
+        {
+            line[length++] = '\n';
+            writeRecord(&writer, line, length);
+            length = 0;
+        }
+        if (record.type != 'T')
+            flushTextRecord(&writer);
+
+        if (record.type == 'H')
+        {
+            char name[MAX_OPERAND];
+            snprintf(name, sizeof(name), "%.*s", record.nameLength, record.name);
+            writeHeaderRecord(&writer, name, record.address, record.length);
+        }
+        else if (record.type == 'D' || record.type == 'R')
+        {
+            if (length == 0)
+                line[length++] = (char)record.type;
+            writeField(line + length, record.name, record.nameLength > 6 ? 6 : record.nameLength, 6, 0);
+            length += 6;
+            if (record.type == 'D')
+            {
+                writeHex(line + length, record.address & 0xFFFFFF, 6);
+                length += 6;
+            }
+            lineType = record.type;
+        }
+        else if (record.type == 'T')
+            appendTextRecord(&writer, record.address, record.data, record.length);
+        else if (record.type == 'M')
+        {
+            for (int i = 0; i < record.count; i++)
+            {
+                char *p = reserveOutput(out, 12 + record.nameLength);
+                p[0] = 'M';
+                writeHex(p + 1, getLittle32(record.data + 4 * i) & 0xFFFFFF, 6);
+                writeHex(p + 7, record.length, 2);
+                p[9] = record.flags ? '-' : '+';
+                memcpy(p + 10, record.name, record.nameLength);
+                p[10 + record.nameLength] = '\n';
+                out->size += 11 + record.nameLength;
+            }
+        }
+        else if (record.type == 'E')
+            writeEndRecord(&writer, record.flags ? record.address : -1);
+    }
+    if (status < 0)
+    {
+        fprintf(stderr, "Error: Invalid binary record at offset %zu of '%s'\n", offset, path);
+        return 0;
+    }
+    if (length > 0)
+    {
+        line[length++] = '\n';
+        writeRecord(&writer, line, length);
+    }
+    flushTextRecord(&writer);
+    return 1;
+}
+
+// Converts an object file to binary or back to text. The output goes to a
+// temporary file renamed over outPath, so a file can be converted in place.
+int convertObjectFile(const char *inPath, const char *outPath, int toBinary)
+{
+    SourceFile file;
+    if (!openSourceFile(inPath, &file))
+    {
+        fprintf(stderr, "Error opening object file '%s': %s\n", inPath, strerror(errno));
+        return 0;
+    }
+    int convert = isBinaryObject(&file) != toBinary;
+    if (!convert && strcmp(inPath, outPath) == 0)
+    {
+        closeSourceFile(&file);
+        return 1;
+    }
+
+    size_t pathLength = strlen(outPath);
+    char *tempPath = (char *)malloc(pathLength + 5);
+    if (!tempPath)
+    {
+        fprintf(stderr, "Memory allocation error for object path\n");
+        exit(1);
+    }
+    memcpy(tempPath, outPath, pathLength);
+    memcpy(tempPath + pathLength, ".tmp", 5);
+
+    OutputBuffer out;
+    int ok = openOutput(&out, tempPath);
+    if (!ok)
+        fprintf(stderr, "Error creating object file '%s': %s\n", tempPath, strerror(errno));
+    else
+    {
+        if (!convert)
+            writeOutput(&out, file.data, file.size);
+        else
+            ok = toBinary ? textToBinaryObject(&file, inPath, &out) : binaryToTextObject(&file, inPath, &out);
+        if (!closeOutput(&out) && ok)
+        {
+            fprintf(stderr, "Error writing object file '%s': %s\n", tempPath, strerror(errno));
+            ok = 0;
+        }
+    }
+    closeSourceFile(&file);
+    if (ok && rename(tempPath, outPath) != 0)
+    {
+        fprintf(stderr, "Error replacing object file '%s': %s\n", outPath, strerror(errno));
+        ok = 0;
+    }
+    if (!ok)
+        unlink(tempPath);
+    free(tempPath);
+    return ok;
+}
+
+void initDisassemblyTable(void)
+{
+    for (size_t i = 0; i < sizeof(opcodeTable) / sizeof(opcodeTable[0]); i++)
+    {
+        const OpcodeEntry *entry = &opcodeTable[i];
+        for (int ni = 0; ni < (entry->format == 3 ? 4 : 1); ni++)
+        {
+            disassemblyTable[entry->opcode | ni].mnemonic = entry->mnemonic;
+            disassemblyTable[entry->opcode | ni].format = entry->format;
+        }
+    }
+}
+
+void addAddressName(AddressName **names, int *count, int *capacity, int address, int value, const char *name,
+                    int nameLength)
+{
+    growArray((void **)names, *count, capacity, sizeof(AddressName), "address names");
+    AddressName *entry = &(*names)[(*count)++];
+    entry->address = address;
+    entry->value = value;
+    entry->name = name;
+    entry->nameLength = nameLength;
+}
+
+int compareAddressNames(const void *a, const void *b)
+{
+    const AddressName *x = (const AddressName *)a, *y = (const AddressName *)b;
+    if (x->address != y->address)
+        return x->address < y->address ? -1 : 1;
+    int shorter = x->nameLength < y->nameLength ? x->nameLength : y->nameLength;
+    int order = shorter > 0 ? memcmp(x->name, y->name, shorter) : 0;
+    return order != 0 ? order : x->nameLength - y->nameLength;
+}
+
+// The first of the sorted names at address, or NULL.
+const AddressName *findAddressName(const AddressName *names, int count, int address)
+{
+    int low = 0, high = count;
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (names[middle].address < address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < count && names[low].address == address ? &names[low] : NULL;
+}
+
+// Sorts the section's symbols and indexes those inside it by offset, since
+// nearly every operand looks one up.
+void indexSymbols(DisassemblySection *section)
+{
+    qsort(section->symbols, section->symbolCount, sizeof(AddressName), compareAddressNames);
+    memset(section->symbolAt, 0, section->length * sizeof(int));
+    for (int i = section->symbolCount - 1; i >= 0; i--)
+    {
+        int offset = section->symbols[i].address - section->start;
+        if (offset >= 0 && offset < section->length)
+            section->symbolAt[offset] = i + 1;
+    }
+}
+
+const AddressName *symbolAt(const DisassemblySection *section, int address)
+{
+    int offset = address - section->start;
+    if (offset < 0 || offset >= section->length)
+        return findAddressName(section->symbols, section->symbolCount, address);
+    return section->symbolAt[offset] ? &section->symbols[section->symbolAt[offset] - 1] : NULL;
+}
+
+// Reads one control section, from its H record to its E record, into
+// section. Returns 1 for a section, 0 at the end of the file and -1 after
+// reporting a bad record.
+int loadObjectSection(ObjectReader *reader, const char *path, DisassemblySection *section)
+{
+    BinaryRecord record;
+    int status;
+    int started = 0;
+
+    section->symbolCount = 0;
+    section->fieldCount = 0;
+    while ((status = nextObjectRecord(reader, &record)) > 0)
+    {
+        if (started == (record.type == 'H'))
+        {
+            reader->error = started ? "Missing end record" : "Missing header record";
+            status = -1;
+            break;
+        }
+
+        if (record.type == 'H')
+        {
+            started = 1;
+            section->name = record.name;
+            section->nameLength = record.nameLength;
+            section->start = record.address;
+            section->length = record.length;
+            section->execAddress = -1;
+            if (record.length > section->capacity)
+            {
+                section->capacity = record.length;
+                section->bytes = (unsigned char *)realloc(section->bytes, section->capacity);
+                section->kinds = (unsigned char *)realloc(section->kinds, section->capacity);
+                section->symbolAt = (int *)realloc(section->symbolAt, section->capacity * sizeof(int));
+                if (!section->bytes || !section->kinds || !section->symbolAt)
+                {
+                    fprintf(stderr, "Memory allocation error for section image\n");
+                    exit(1);
+                }
+            }
+            memset(section->kinds, IMAGE_UNLOADED, record.length);
+        }
+        else if (record.type == 'D')
+            addAddressName(&section->symbols, &section->symbolCount, &section->symbolCapacity, record.address, 0,
+                           record.name, record.nameLength);
+        else if (record.type == 'T')
+        {
+            int offset = record.address - section->start;
+            if (offset < 0 || record.length > section->length - offset)
+            {
+                reader->error = "Text record outside its section";
+                status = -1;
+                break;
+            }
+            memcpy(section->bytes + offset, record.data, record.length);
+            memset(section->kinds + offset, IMAGE_LOADED, record.length);
+        }
+        else if (record.type == 'M')
+            addAddressName(&section->fields, &section->fieldCount, &section->fieldCapacity, record.address,
+                           record.length, record.name, record.nameLength);
+        else if (record.type == 'E')
+        {
+            if (record.flags)
+                section->execAddress = record.address;
+            return 1;
+        }
+    }
+    if (status == 0 && started)
+    {
+        reader->error = "Missing end record";
+        status = -1;
+    }
+    if (status < 0)
+        reportObjectError(reader, path);
+    return status;
+}
+
+// An instruction may not run past the section or into a byte that is
+// unloaded or known to start another statement.
+int instructionFits(const DisassemblySection *section, int offset, int length)
+{
+    if (length > section->length - offset)
+        return 0;
+    for (int i = 1; i < length; i++)
+    {
+        if (section->kinds[offset + i] != IMAGE_LOADED)
+            return 0;
+    }
+    return 1;
+}
+
+// Operands are written for every instruction, so this stands in for
+// sprintf's %d (and %+d when sign is set); the text is NUL-terminated.
+char *writeDecimal(char *out, int value, int sign)
+{
+    char digits[12];
+    int count = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    if (value < 0)
+        *out++ = '-';
+    else if (sign)
+        *out++ = '+';
+    do
+    {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    while (count > 0)
+        *out++ = digits[--count];
+    *out = '\0';
+    return out;
+}
+
+// Writes target as the symbol there, else relative to the statement when it
+// is relocatable, else as a number.
+char *writeTarget(char *out, const DisassemblySection *section, int target, int address, int relative)
+{
+    const AddressName *symbol = symbolAt(section, target);
+    if (symbol)
+    {
+        memcpy(out, symbol->name, symbol->nameLength);
+        out[symbol->nameLength] = '\0';
+        return out + symbol->nameLength;
+    }
+    if (!relative)
+        return writeDecimal(out, target, 0);
+    *out++ = '*';
+    *out = '\0';
+    return target == address ? out : writeDecimal(out, target - address, 1);
+}
+
+// Decodes the instruction at offset into mnemonic and operand text the
+// assembler would accept back, given the BASE disassembleSection writes
+// after each LDB #, and returns its length; 0 means the bytes there are not
+// an instruction that fits. A NULL operand skips the operand text. base is
+// the base register, or -1 when no LDB # has set one; target, if
+// given, gets the target address or immediate value of a format 3 or 4
+// instruction, else -1.
+int disassembleInstruction(const DisassemblySection *section, int offset, int base, char *mnemonic, char *operand,
+                           int *target)
+{
+    const unsigned char *code = section->bytes + offset;
+    const DisassemblyEntry *entry = &disassemblyTable[code[0]];
+    int address = section->start + offset;
+    int length = entry->format;
+    int ni = code[0] & 3;
+    if (length == 3 && ni != 0 && offset + 1 < section->length && (code[1] & 0x10))
+        length = 4;
+    if (length == 0 || !instructionFits(section, offset, length))
+        return 0;
+
+    int flags = code[1];
+    int r1 = flags >> 4, r2 = flags & 0xF;
+    int svc = code[0] == 0xB0, shift = code[0] == 0xA4 || code[0] == 0xA8;
+    int first = r1 < REGISTER_COUNT && registerNames[r1][0], second = r2 < REGISTER_COUNT && registerNames[r2][0];
+    if (length == 2 && (svc ? r2 != 0 : !first || (!shift && !second)))
+        return 0;
+    if ((length == 4 && (flags & 0x60)) || (length == 3 && ni != 0 && (flags & 0x60) == 0x60))
+        return 0;
+    mnemonic[0] = '+';
+    strcpy(mnemonic + (length == 4), entry->mnemonic);
+    if (target)
+        *target = -1;
+    if (!operand)
+        return length;
+
+    char *p = operand;
+    *p = '\0';
+    if (length == 1)
+        return 1;
+    if (length == 2)
+    {
+        if (svc) // SVC n
+            sprintf(operand, "%d", r1);
+        else if (shift) // SHIFTL/SHIFTR r1,n
+            sprintf(operand, "%s,%d", registerNames[r1], r2 + 1);
+        else if (r2 == 0 && (code[0] == 0xB4 || code[0] == 0xB8)) // CLEAR/TIXR r1
+            strcpy(operand, registerNames[r1]);
+        else
+            sprintf(operand, "%s,%s", registerNames[r1], registerNames[r2]);
+        return 2;
+    }
+
+    int value = -1;
+    int indexed = flags & 0x80;
+    if (ni != 0 && ni != MODE_SIMPLE)
+        *p++ = ni == MODE_IMMEDIATE ? '#' : '@';
+    if (ni == 0)
+    {
+        // SIC instructions carry a 15-bit address after the x bit.
+        value = (flags & 0x7F) << 8 | code[2];
+        p = writeTarget(p, section, value, address, 0);
+    }
+    else if (length == 4)
+    {
+        value = (flags & 0xF) << 16 | code[2] << 8 | code[3];
+        const AddressName *field = findAddressName(section->fields, section->fieldCount, address + 1);
+        if (field && !(field->nameLength == section->nameLength &&
+                       memcmp(field->name, section->name, field->nameLength) == 0))
+        {
+            p += sprintf(p, "%.*s", field->nameLength, field->name);
+            if (value != 0)
+                p = writeDecimal(p, value, 1);
+            value = -1;
+        }
+        else
+            p = writeTarget(p, section, value, address, field != NULL);
+    }
+    else
+    {
+        int displacement = (flags & 0xF) << 8 | code[2];
+        if (flags & 0x20)
+            p = writeTarget(p, section, value = address + 3 + (displacement ^ 0x800) - 0x800, address, 1);
+        else if ((flags & 0x40) && base >= 0)
+            p = writeTarget(p, section, value = base + displacement, address, 1);
+        else if (flags & 0x40)
+            p += sprintf(p, "(B)+%d", displacement);
+        else if ((code[0] & 0xFC) == 0x4C && ni == MODE_SIMPLE && !indexed && displacement == 0) // RSUB
+            p = operand;
+        else
+            p = writeDecimal(p, value = displacement, 0);
+    }
+    strcpy(p, indexed ? ",X" : "");
+    if (target)
+        *target = value;
+    return length;
+}
+
+// One listing column: the token starting at pos, if any, and the position
+// past its padding and separating blank.
+size_t listingField(const SourceFile *file, const char *line, size_t pos, size_t size, int width, TokenView *view)
+{
+    size_t start = pos < size ? pos : size, end = start;
+    while (end < size && line[end] != ' ')
+        end++;
+    view->offset = (unsigned int)(line + start - file->data);
+    view->length = (unsigned int)(end - start);
+    return pos + (end - start > (size_t)width ? end - start : (size_t)width) + 1;
+}
+
+// Splits a listing line laid out by formatListingLine into its columns.
+// Returns 0 for the record copies between statements and anything else that
+// is neither a statement with a known mnemonic nor a literal.
+int parseListingStatement(const SourceFile *file, const char *line, size_t size, ListingStatement *statement)
+{
+    size_t digits = 0;
+    while (digits < size && digits < 8 && isxdigit((unsigned char)line[digits]))
+        digits++;
+    if (digits < 4 || digits + 2 > size || line[digits] != ' ' || line[digits + 1] != ' ' ||
+        !parseNumber(line, digits, 16, &statement->address))
+        return 0;
+
+    size_t pos = listingField(file, line, digits + 2, size, 6, &statement->label);
+    pos = listingField(file, line, pos, size, 6, &statement->mnemonic);
+    pos = listingField(file, line, pos, size, 10, &statement->operand);
+    listingField(file, line, pos, size, 0, &statement->hex);
+
+    const char *hex = viewText(file, statement->hex);
+    if (statement->hex.length % 2 != 0 || (statement->label.length > 0 && isdigit((unsigned char)line[digits + 2])))
+        return 0;
+    for (unsigned int i = 0; i < statement->hex.length; i++)
+    {
+        if (!isxdigit((unsigned char)hex[i]))
+            return 0;
+    }
+
+    statement->directive = DIR_NONE;
+    statement->opcode = 0;
+    statement->name[0] = '\0';
+    if (statement->mnemonic.length == 0)
+        return statement->hex.length > 0 && statement->operand.length > 0 && viewText(file, statement->operand)[0] == '=';
+    if (statement->mnemonic.length >= sizeof(statement->name))
+        return 0;
+    const char *mnemonic = viewText(file, statement->mnemonic);
+    for (unsigned int i = 0; i < statement->mnemonic.length; i++)
+        statement->name[i] = toupper((unsigned char)mnemonic[i]);
+    statement->name[statement->mnemonic.length] = '\0';
+    statement->directive = lookupDirective(statement->name);
+    statement->opcode = statement->directive == DIR_NONE && lookupOpcode(statement->name, NULL, NULL);
+    return statement->directive != DIR_NONE || statement->opcode;
+}
+
+void reportListingMismatch(ListingCheck *check, const char *format, ...)
+{
+    if (check->mismatches++ >= DISASSEMBLY_REPORT_LIMIT)
+        return;
+    va_list args;
+    fprintf(stderr, "Mismatch at line %d of '%s': ", check->lineNum, check->path);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+// Reads the listing's statements for section, up to the next header copy.
+// Labels become symbols and BASE statements base events; each statement
+// with object code is compared with the image and marks where code or data
+// starts. Returns 0 when the listing has no section left.
+int checkListingSection(ListingCheck *check, DisassemblySection *section)
 {
-    strcpy(opcodeTable[opcodeCount].mnemonic, "CLEAR");
-    strcpy(opcodeTable[opcodeCount].opcode, "B4");
-    opcodeTable[opcodeCount].format = 2;
-    opcodeCount++;
+    const SourceFile *file = &check->file;
+    ListingStatement statement;
+    char mnemonic[MAX_MNEMONIC + 1];
+    const char *line;
+    size_t size;
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "TIXR");
-    strcpy(opcodeTable[opcodeCount].opcode, "B8");
-    opcodeTable[opcodeCount].format = 2;
-    opcodeCount++;
+    while ((line = nextRecord(file, &check->pos, &size, &check->lineNum)) != NULL && (line[0] != 'H' || size < 15))
+        ;
+    if (!line)
+        return 0;
+    int nameLength = (int)trimmedLength(line + 1, size - 15);
+    if (nameLength != section->nameLength || memcmp(line + 1, section->name, nameLength) != 0)
+        reportListingMismatch(check, "section %.*s is %.*s in the object", nameLength, line + 1, section->nameLength,
+                              section->name);
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "LDA");
-    strcpy(opcodeTable[opcodeCount].opcode, "00");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+    for (;;)
+    {
+        size_t pos = check->pos;
+        int lineNum = check->lineNum;
+        line = nextRecord(file, &check->pos, &size, &check->lineNum);
+        if (!line || line[0] == 'H')
+        {
+            check->pos = pos;
+            check->lineNum = lineNum;
+            break;
+        }
+        if (!parseListingStatement(file, line, size, &statement))
+            continue;
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "STA");
-    strcpy(opcodeTable[opcodeCount].opcode, "0C");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+        if (statement.label.length > 0 && statement.directive != DIR_EQU)
+        {
+            const char *label = viewText(file, statement.label);
+            addAddressName(&section->symbols, &section->symbolCount, &section->symbolCapacity, statement.address, 0,
+                           label, statement.label.length);
+        }
+        if (statement.hex.length == 0)
+            continue;
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "STL");
-    strcpy(opcodeTable[opcodeCount].opcode, "14");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+        int count = statement.hex.length / 2;
+        int offset = statement.address - section->start;
+        check->statements++;
+        check->bytes.size = 0;
+        reserveText(&check->bytes, count);
+        unsigned char *bytes = (unsigned char *)check->bytes.data;
+        parseHexBytes(viewText(file, statement.hex), statement.hex.length, bytes);
+        int loaded = offset >= 0 && count <= section->length - offset;
+        for (int i = 0; loaded && i < count; i++)
+            loaded = section->kinds[offset + i] != IMAGE_UNLOADED;
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "JSUB");
-    strcpy(opcodeTable[opcodeCount].opcode, "48");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+        if (!loaded)
+            reportListingMismatch(check, "%04X is not loaded by the object", statement.address);
+        else if (memcmp(section->bytes + offset, bytes, count) != 0)
+            reportListingMismatch(check, "the object code at %04X differs from the object", statement.address);
+        else if (statement.opcode)
+        {
+            // -R may have chosen a format the source did not ask for.
+            int length = disassembleInstruction(section, offset, -1, mnemonic, NULL, NULL);
+            const char *listed = statement.name + (statement.name[0] == '+');
+            if (length != count || strcmp(mnemonic + (mnemonic[0] == '+'), listed) != 0)
+                reportListingMismatch(check, "%s at %04X decodes as %s", statement.name, statement.address,
+                                      length ? mnemonic : "data");
+            section->kinds[offset] = IMAGE_CODE;
+        }
+        else
+            section->kinds[offset] = statement.directive == DIR_WORD ? IMAGE_WORD : IMAGE_DATA;
+    }
+    return 1;
+}
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "COMP");
-    strcpy(opcodeTable[opcodeCount].opcode, "28");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+// A NULL operand writes the bytes as a hex BYTE constant.
+void writeDisassemblyLine(OutputBuffer *out, int address, const AddressName *label, const char *mnemonic,
+                          const char *operand, const unsigned char *bytes, int count)
+{
+    int labelLength = label ? label->nameLength : 0;
+    int mnemonicLength = (int)strlen(mnemonic);
+    int operandLength = operand ? (int)strlen(operand) : 2 * count + 3;
+    char *line = reserveOutput(out, 40 + labelLength + mnemonicLength + operandLength + 2 * count);
+    char *p = line;
+    int digits = 4;
+    while (digits < 8 && ((unsigned int)address >> (4 * digits)) != 0)
+        digits++;
+    writeHex(p, address, digits);
+    p += digits;
+    *p++ = ' ';
+    *p++ = ' ';
+    p = writeField(p, label ? label->name : NULL, labelLength, 6, 0);
+    *p++ = ' ';
+    p = writeField(p, mnemonic, mnemonicLength, 6, 0);
+    *p++ = ' ';
+    if (operand)
+        p = writeField(p, operand, operandLength, 10, 0);
+    else
+    {
+        p[0] = 'X';
+        p[1] = '\'';
+        encodeHex(p + 2, bytes, count);
+        p[operandLength - 1] = '\'';
+        p = writeField(p, p, operandLength, 10, 0);
+    }
+    *p++ = ' ';
+    encodeHex(p, bytes, count);
+    p += 2 * count;
+    *p++ = '\n';
+    out->size += p - line;
+}
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "JEQ");
-    strcpy(opcodeTable[opcodeCount].opcode, "30");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+// Statements the listing marked start where it says. Other bytes decode as
+// instructions where they can and become BYTE constants where they cannot,
+// and the gaps between T records become RESB.
+void disassembleSection(const DisassemblySection *section, OutputBuffer *out, int first, int *instructions,
+                        int *dataBytes)
+{
+    char mnemonic[MAX_MNEMONIC + 1], operand[MAX_LINE_LENGTH] = "";
+    const AddressName *label = section->symbols, *lastLabel = section->symbols + section->symbolCount;
+    const AddressName *field = section->fields, *lastField = section->fields + section->fieldCount;
+    AddressName name = {section->start, 0, section->name, section->nameLength};
+    const unsigned char *bytes = section->bytes;
+    int base = -1;
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "J");
-    strcpy(opcodeTable[opcodeCount].opcode, "3C");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+    if (first)
+        sprintf(operand, "%X", section->start);
+    writeDisassemblyLine(out, section->start, &name, first ? "START" : "CSECT", operand, NULL, 0);
+    for (int offset = 0, length; offset < section->length; offset += length)
+    {
+        int address = section->start + offset;
+        while (label < lastLabel && label->address < address)
+            label++;
+        const AddressName *here = label < lastLabel && label->address == address ? label : NULL;
+        if (here && here->nameLength == name.nameLength && memcmp(here->name, name.name, name.nameLength) == 0)
+            here = NULL;
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "LDL");
-    strcpy(opcodeTable[opcodeCount].opcode, "08");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+        // Runs of data or reserved bytes stop at the next label.
+        const AddressName *next = label;
+        while (next < lastLabel && next->address == address)
+            next++;
+        int limit = next < lastLabel && next->address - section->start < section->length ? next->address - section->start
+                                                                                           : section->length;
+        while (field < lastField && field->address < address)
+            field++;
+        int kind = section->kinds[offset];
+        int words = field < lastField && field->address == address && field->value == 6;
+        int target;
+        if (kind == IMAGE_UNLOADED)
+        {
+            for (length = 1; offset + length < limit && section->kinds[offset + length] == IMAGE_UNLOADED; length++)
+                ;
+            writeDecimal(operand, length, 0);
+            writeDisassemblyLine(out, address, here, "RESB", operand, NULL, 0);
+        }
+        else if (kind == IMAGE_DATA)
+        {
+            for (length = 1; offset + length < limit && section->kinds[offset + length] == IMAGE_LOADED; length++)
+                ;
+            writeDisassemblyLine(out, address, here, "BYTE", NULL, bytes + offset, length);
+            *dataBytes += length;
+        }
+        else if ((kind == IMAGE_WORD || (kind == IMAGE_LOADED && words)) && instructionFits(section, offset, 3))
+        {
+            int value = bytes[offset] << 16 | bytes[offset + 1] << 8 | bytes[offset + 2];
+            if (words && !(field->nameLength == section->nameLength &&
+                           memcmp(field->name, section->name, field->nameLength) == 0))
+                sprintf(operand, value ? "%.*s%+d" : "%.*s", field->nameLength, field->name, value);
+            else if (words)
+                writeTarget(operand, section, value, address, 1);
+            else
+                writeDecimal(operand, (value ^ 0x800000) - 0x800000, 0);
+            length = 3;
+            writeDisassemblyLine(out, address, here, "WORD", operand, bytes + offset, length);
+            *dataBytes += length;
+        }
+        else if ((length = disassembleInstruction(section, offset, base, mnemonic, operand, &target)) > 0)
+        {
+            writeDisassemblyLine(out, address, here, mnemonic, operand, bytes + offset, length);
+            (*instructions)++;
+            // The listing has no BASE statements, so LDB # is taken to set the
+            // base the next instructions use, and a BASE to match is written.
+            if (bytes[offset] == 0x69 && target >= 0)
+            {
+                base = target;
+                if (operand[1] != '*')
+                    memmove(operand, operand + 1, strlen(operand));
+                else
+                    writeTarget(operand, section, target, address + length, 1);
+                writeDisassemblyLine(out, address + length, NULL, "BASE", operand, NULL, 0);
+            }
+        }
+        else
+        {
+            for (length = 1; length < 16 && offset + length < limit && section->kinds[offset + length] == IMAGE_LOADED &&
+                             !disassembleInstruction(section, offset + length, base, mnemonic, NULL, NULL);
+                 length++)
+                ;
+            writeDisassemblyLine(out, address, here, "BYTE", NULL, bytes + offset, length);
+            *dataBytes += length;
+        }
+    }
+}
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "RSUB");
-    strcpy(opcodeTable[opcodeCount].opcode, "4C");
-    opcodeTable[opcodeCount].format = 3;
-    opcodeCount++;
+// Writes a listing-style disassembly of an object file of either format.
+// With a listing, its labels name what the records cannot, and each of its
+// statements is checked against the records.
+int disassembleObject(const char *objPath, const char *outPath, const char *lstPath)
+{
+    ObjectReader reader = {0};
+    ListingCheck check = {0};
+    DisassemblySection section = {0};
+    SourceFile file;
+    OutputBuffer out;
+    char operand[MAX_LINE_LENGTH] = "";
+    int sections = 0, instructions = 0, dataBytes = 0, end = 0, status;
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "+JSUB");
-    strcpy(opcodeTable[opcodeCount].opcode, "48");
-    opcodeTable[opcodeCount].format = 4;
-    opcodeCount++;
+    if (!openSourceFile(objPath, &file))
+    {
+        fprintf(stderr, "Error opening object file '%s': %s\n", objPath, strerror(errno));
+        return 0;
+    }
+    if (lstPath && !openSourceFile(lstPath, &check.file))
+    {
+        fprintf(stderr, "Error opening listing file '%s': %s\n", lstPath, strerror(errno));
+        closeSourceFile(&file);
+        return 0;
+    }
+    if (!openOutput(&out, outPath))
+    {
+        fprintf(stderr, "Error creating disassembly file '%s': %s\n", outPath, strerror(errno));
+        closeSourceFile(&file);
+        if (lstPath)
+            closeSourceFile(&check.file);
+        return 0;
+    }
 
-    strcpy(opcodeTable[opcodeCount].mnemonic, "+LDA");
-    strcpy(opcodeTable[opcodeCount].opcode, "00");
-    opcodeTable[opcodeCount].format = 4;
-    opcodeCount++;
-}
+    initDisassemblyTable();
+    reader.file = &file;
+    reader.binary = isBinaryObject(&file);
+    check.path = lstPath;
+    while ((status = loadObjectSection(&reader, objPath, &section)) > 0)
+    {
+        if (lstPath && !checkListingSection(&check, &section))
+            reportListingMismatch(&check, "no section %.*s", section.nameLength, section.name);
+        indexSymbols(&section);
+        if (section.fieldCount > 0)
+            qsort(section.fields, section.fieldCount, sizeof(AddressName), compareAddressNames);
+        disassembleSection(&section, &out, sections == 0, &instructions, &dataBytes);
+        if (section.execAddress == section.start &&
+            !symbolAt(&section, section.execAddress))
+            sprintf(operand, "%.*s", section.nameLength, section.name);
+        else if (section.execAddress >= 0)
+            writeTarget(operand, &section, section.execAddress, -1, 0);
+        end = section.start + section.length;
+        sections++;
+    }
+    if (status == 0)
+        writeDisassemblyLine(&out, end, NULL, "END", operand, NULL, 0);
 
-int lookupOpcode(const char *mnemonic, char *opcode, int *format)
-{
-    for (int i = 0; i < opcodeCount; i++)
+    const char *line;
+    size_t size;
+    while (lstPath && status == 0 && (line = nextRecord(&check.file, &check.pos, &size, &check.lineNum)) != NULL)
     {
-        if (strcmp(opcodeTable[i].mnemonic, mnemonic) == 0)
+        if (line[0] == 'H')
         {
-            if (opcode != NULL)
-                strcpy(opcode, opcodeTable[i].opcode);
-            if (format != NULL)
-                *format = opcodeTable[i].format;
-            return 1;
+            reportListingMismatch(&check, "section %.*s is not in the object", (int)trimmedLength(line + 1, size - 1),
+                                  line + 1);
+            break;
         }
     }
-    return 0;
+
+    int ok = closeOutput(&out);
+    if (!ok)
+        fprintf(stderr, "Error writing disassembly file '%s': %s\n", outPath, strerror(errno));
+    ok = ok && status == 0;
+    if (ok)
+        printf("Disassembled %d section(s) of '%s' into '%s': %d instructions, %d data bytes\n", sections, objPath,
+               outPath, instructions, dataBytes);
+    if (ok && lstPath)
+        printf("Checked %d listing statements against '%s': %d mismatch(es)\n", check.statements, lstPath,
+               check.mismatches);
+
+    free(section.bytes);
+    free(section.kinds);
+    free(section.symbolAt);
+    free(section.symbols);
+    free(section.fields);
+    free(reader.bytes.data);
+    free(check.bytes.data);
+    closeSourceFile(&file);
+    if (lstPath)
+        closeSourceFile(&check.file);
+    return ok && check.mismatches == 0;
 }
 
-int addSymbol(const char *label, int address)
+void decodeInstruction(const Machine *machine, int address, DecodedInstruction *decoded)
 {
-    if (strlen(label) == 0)
-        return 1;
+    const unsigned char *code = machine->memory + address;
+    int opcode = code[0] & 0xFC;
+    decoded->flags = 0;
+    decoded->target = 0;
 
-    unsigned int index = hash(label);
-    Symbol *current = symbolTable[index];
-    while (current)
+    switch (machine->formats[opcode >> 2])
     {
-        if (strcmp(current->label, label) == 0)
+    case 1:
+        decoded->length = 1;
+        break;
+    case 2:
+        decoded->length = 2;
+        decoded->mode = code[1] >> 4;
+        decoded->flags = code[1] & 0xF;
+        break;
+    case 3:
+        decoded->mode = code[0] & 3;
+        if (code[1] & 0x80)
+            decoded->flags |= ADDR_INDEX;
+        if (decoded->mode == 0)
         {
-            return 0;
+            // Standard SIC: simple addressing with a 15-bit address.
+            decoded->length = 3;
+            decoded->mode = MODE_SIMPLE;
+            decoded->target = ((code[1] & 0x7F) << 8) | code[2];
+        }
+        else if (code[1] & 0x10)
+        {
+            decoded->length = 4;
+            decoded->target = ((code[1] & 0xF) << 16) | (code[2] << 8) | code[3];
+        }
+        else
+        {
+            int disp = ((code[1] & 0xF) << 8) | code[2];
+            decoded->length = 3;
+            if (code[1] & 0x20)
+                decoded->target = (address + 3 + ((disp << 20) >> 20)) & MEMORY_MASK;
+            else if (code[1] & 0x40)
+            {
+                decoded->target = disp;
+                decoded->flags |= ADDR_BASE;
+            }
+            else
+                decoded->target = disp;
         }
-        current = current->next;
+        break;
+    default:
+        decoded->kind = KIND_INVALID;
+        decoded->length = 1;
+        return;
     }
+    decoded->kind = (opcode >> 2) + 1;
+}
 
-    Symbol *newSymbol = (Symbol *)malloc(sizeof(Symbol));
-    if (!newSymbol)
-    {
-        fprintf(stderr, "Memory allocation error for symbol '%s'\n", label);
-        exit(1);
-    }
-    strcpy(newSymbol->label, label);
-    newSymbol->address = address;
-    newSymbol->next = symbolTable[index];
-    symbolTable[index] = newSymbol;
-    return 1;
+int effectiveAddress(const DecodedInstruction *d, const int *reg)
+{
+    int address = d->target;
+    if (d->flags & ADDR_BASE)
+        address += reg[REG_B];
+    if (d->flags & ADDR_INDEX)
+        address += reg[REG_X];
+    return address & MEMORY_MASK;
 }
 
-int lookupSymbol(const char *label)
+int operandValue(const DecodedInstruction *d, const unsigned char *memory, const int *reg)
 {
-    unsigned int index = hash(label);
-    Symbol *current = symbolTable[index];
-    while (current)
-    {
-        if (strcmp(current->label, label) == 0)
-            return current->address;
-        current = current->next;
-    }
-    return -1;
+    int address = effectiveAddress(d, reg);
+    if (d->mode == MODE_IMMEDIATE)
+        return address;
+    if (d->mode == MODE_INDIRECT)
+        address = readWord(memory, address) & MEMORY_MASK;
+    return readWord(memory, address);
+}
+
+int storeAddress(const DecodedInstruction *d, const unsigned char *memory, const int *reg)
+{
+    int address = effectiveAddress(d, reg);
+    if (d->mode == MODE_INDIRECT)
+        address = readWord(memory, address) & MEMORY_MASK;
+    return address;
 }
 
-void parseLine(char *line, LineInfo *lineInfo)
+int conditionCode(int left, int right)
 {
-    lineInfo->lineNum = 0;
-    lineInfo->label[0] = '\0';
-    lineInfo->opcode[0] = '\0';
-    lineInfo->operand[0] = '\0';
-    lineInfo->objectCode[0] = '\0';
-    lineInfo->errorMsg[0] = '\0';
+    return left < right ? CC_LT : left > right ? CC_GT : CC_EQ;
+}
 
-    char *token = strtok(line, " \t\n");
-    if (!token)
-        return;
+// Executes from machine->pc until the program halts, faults or reaches
+// limit instructions (0 for no limit). Each address is decoded once into
+// machine->decoded and dispatched through a computed-goto table; stores
+// invalidate the decoded entries they overlap, so self-modifying code works.
+int runMachine(Machine *machine, long long limit)
+{
+    // Indexed by decoded kind: 0 is an undecoded address, 1 + opcode / 4 an
+    // instruction, and KIND_INVALID an opcode that is not in the table.
+    static void *const handlers[KIND_COUNT] = {
+        &&opDecode,
+        &&opLDA, &&opLDX, &&opLDL, &&opSTA,          // 00
+        &&opSTX, &&opSTL, &&opADD, &&opSUB,          // 10
+        &&opMUL, &&opDIV, &&opCOMP, &&opTIX,         // 20
+        &&opJEQ, &&opJGT, &&opJLT, &&opJ,            // 30
+        &&opAND, &&opOR, &&opJSUB, &&opRSUB,         // 40
+        &&opLDCH, &&opSTCH, &&opADDF, &&opSUBF,      // 50
+        &&opMULF, &&opDIVF, &&opLDB, &&opLDS,        // 60
+        &&opLDF, &&opLDT, &&opSTB, &&opSTS,          // 70
+        &&opSTF, &&opSTT, &&opCOMPF, &&opInvalid,    // 80
+        &&opADDR, &&opSUBR, &&opMULR, &&opDIVR,      // 90
+        &&opCOMPR, &&opSHIFTL, &&opSHIFTR, &&opRMO,  // A0
+        &&opSVC, &&opCLEAR, &&opTIXR, &&opInvalid,   // B0
+        &&opFLOAT, &&opFIX, &&opNOP, &&opInvalid,    // C0  NORM
+        &&opNOP, &&opNOP, &&opRD, &&opWD,            // D0  LPS STI
+        &&opTD, &&opInvalid, &&opSTSW, &&opNOP,      // E0  SSK
+        &&opNOP, &&opNOP, &&opNOP, &&opInvalid,      // F0  SIO HIO TIO
+        &&opInvalid,
+    };
+
+    unsigned char *memory = machine->memory;
+    DecodedInstruction *decoded = machine->decoded;
+    DecodedInstruction *d;
+    int reg[REG_COUNT];
+    memcpy(reg, machine->reg, sizeof(reg));
+    double f = machine->f;
+    int pc = machine->pc;
+    long long remaining = limit > 0 ? limit : -1;
+    long long executed = 0;
+    int status = HALT_STEP_LIMIT;
+    int address, value;
 
-    char tempMnemonic[MAX_MNEMONIC];
-    strcpy(tempMnemonic, token);
-    toUpperCase(tempMnemonic);
+// pc holds the address of the instruction being executed; NEXT() steps
+// past it and jumps assign it directly.
+#define DISPATCH()                                  \
+    do                                              \
+    {                                               \
+        if ((unsigned int)pc >= MEMORY_SIZE)        \
+            goto outOfRange;                        \
+        if (executed == remaining)                  \
+            goto done;                              \
+        executed++;                                 \
+        d = &decoded[pc];                           \
+        goto *handlers[d->kind];                    \
+    } while (0)
+#define NEXT()             \
+    do                     \
+    {                      \
+        pc += d->length;   \
+        DISPATCH();        \
+    } while (0)
+#define JUMP_TARGET() (d->mode == MODE_INDIRECT ? readWord(memory, effectiveAddress(d, reg)) & MEMORY_MASK : effectiveAddress(d, reg))
+#define R1 (d->mode)
+#define R2 (d->flags)
 
-    if (lookupOpcode(tempMnemonic, NULL, NULL) ||
-        strcmp(tempMnemonic, "START") == 0 ||
-        strcmp(tempMnemonic, "END") == 0 ||
-        strcmp(tempMnemonic, "BYTE") == 0 ||
-        strcmp(tempMnemonic, "WORD") == 0 ||
-        strcmp(tempMnemonic, "RESW") == 0 ||
-        strcmp(tempMnemonic, "RESB") == 0 ||
-        strcmp(tempMnemonic, "BASE") == 0 ||
-        strcmp(tempMnemonic, "NOBASE") == 0)
+    DISPATCH();
+
+opDecode:
+    decodeInstruction(machine, pc, d);
+    goto *handlers[d->kind];
+opInvalid:
+    status = HALT_INVALID_OPCODE;
+    goto done;
+opADD:
+    reg[REG_A] = signExtend24(reg[REG_A] + operandValue(d, memory, reg));
+    NEXT();
+opSUB:
+    reg[REG_A] = signExtend24(reg[REG_A] - operandValue(d, memory, reg));
+    NEXT();
+opMUL:
+    reg[REG_A] = signExtend24((int)((long long)reg[REG_A] * operandValue(d, memory, reg)));
+    NEXT();
+opDIV:
+    value = operandValue(d, memory, reg);
+    if (value == 0)
+        goto divideByZero;
+    reg[REG_A] = signExtend24(reg[REG_A] / value);
+    NEXT();
+opAND:
+    reg[REG_A] = signExtend24(reg[REG_A] & operandValue(d, memory, reg));
+    NEXT();
+opOR:
+    reg[REG_A] = signExtend24(reg[REG_A] | operandValue(d, memory, reg));
+    NEXT();
+opCOMP:
+    reg[REG_SW] = conditionCode(reg[REG_A], operandValue(d, memory, reg));
+    NEXT();
+opTIX:
+    reg[REG_X] = signExtend24(reg[REG_X] + 1);
+    reg[REG_SW] = conditionCode(reg[REG_X], operandValue(d, memory, reg));
+    NEXT();
+opLDA:
+    reg[REG_A] = operandValue(d, memory, reg);
+    NEXT();
+opLDB:
+    reg[REG_B] = operandValue(d, memory, reg);
+    NEXT();
+opLDL:
+    reg[REG_L] = operandValue(d, memory, reg);
+    NEXT();
+opLDS:
+    reg[REG_S] = operandValue(d, memory, reg);
+    NEXT();
+opLDT:
+    reg[REG_T] = operandValue(d, memory, reg);
+    NEXT();
+opLDX:
+    reg[REG_X] = operandValue(d, memory, reg);
+    NEXT();
+opLDCH:
+    address = effectiveAddress(d, reg);
+    value = d->mode == MODE_IMMEDIATE ? address : memory[storeAddress(d, memory, reg)];
+    reg[REG_A] = (reg[REG_A] & ~0xFF) | (value & 0xFF);
+    NEXT();
+opSTA:
+    writeWord(machine, storeAddress(d, memory, reg), reg[REG_A]);
+    NEXT();
+opSTB:
+    writeWord(machine, storeAddress(d, memory, reg), reg[REG_B]);
+    NEXT();
+opSTL:
+    writeWord(machine, storeAddress(d, memory, reg), reg[REG_L]);
+    NEXT();
+opSTS:
+    writeWord(machine, storeAddress(d, memory, reg), reg[REG_S]);
+    NEXT();
+opSTT:
+    writeWord(machine, storeAddress(d, memory, reg), reg[REG_T]);
+    NEXT();
+opSTX:
+    writeWord(machine, storeAddress(d, memory, reg), reg[REG_X]);
+    NEXT();
+opSTSW:
+    writeWord(machine, storeAddress(d, memory, reg), reg[REG_SW]);
+    NEXT();
+opSTCH:
+    address = storeAddress(d, memory, reg);
+    memory[address] = reg[REG_A] & 0xFF;
+    invalidateDecoded(machine, address, 1);
+    NEXT();
+opLDF:
+    f = d->mode == MODE_IMMEDIATE ? (double)effectiveAddress(d, reg) : readFloat(memory, storeAddress(d, memory, reg));
+    NEXT();
+opSTF:
+    writeFloat(machine, storeAddress(d, memory, reg), f);
+    NEXT();
+opADDF:
+    f += readFloat(memory, storeAddress(d, memory, reg));
+    NEXT();
+opSUBF:
+    f -= readFloat(memory, storeAddress(d, memory, reg));
+    NEXT();
+opMULF:
+    f *= readFloat(memory, storeAddress(d, memory, reg));
+    NEXT();
+opDIVF:
     {
-        strcpy(lineInfo->opcode, tempMnemonic);
-        token = strtok(NULL, " \t\n");
-        if (token)
-            strcpy(lineInfo->operand, token);
+        double divisor = readFloat(memory, storeAddress(d, memory, reg));
+        if (divisor == 0.0)
+            goto divideByZero;
+        f /= divisor;
     }
-    else
+    NEXT();
+opCOMPF:
     {
-        strcpy(lineInfo->label, token);
-        token = strtok(NULL, " \t\n");
-        if (token)
-        {
-            strcpy(lineInfo->opcode, token);
-            toUpperCase(lineInfo->opcode);
-            token = strtok(NULL, " \t\n");
-            if (token)
-                strcpy(lineInfo->operand, token);
-        }
+        double other = readFloat(memory, storeAddress(d, memory, reg));
+        reg[REG_SW] = f < other ? CC_LT : f > other ? CC_GT : CC_EQ;
+    }
+    NEXT();
+opFIX:
+    reg[REG_A] = signExtend24((int)f);
+    NEXT();
+opFLOAT:
+    f = reg[REG_A];
+    NEXT();
+opJ:
+    address = JUMP_TARGET();
+    if (address == pc)
+    {
+        status = HALT_JUMP_TO_SELF;
+        goto done;
     }
+    pc = address;
+    DISPATCH();
+opJEQ:
+    pc = reg[REG_SW] == CC_EQ ? JUMP_TARGET() : pc + d->length;
+    DISPATCH();
+opJGT:
+    pc = reg[REG_SW] == CC_GT ? JUMP_TARGET() : pc + d->length;
+    DISPATCH();
+opJLT:
+    pc = reg[REG_SW] == CC_LT ? JUMP_TARGET() : pc + d->length;
+    DISPATCH();
+opJSUB:
+    reg[REG_L] = pc + d->length;
+    pc = JUMP_TARGET();
+    DISPATCH();
+opRSUB:
+    pc = reg[REG_L] & 0xFFFFFF;
+    DISPATCH();
+opADDR:
+    reg[R2] = signExtend24(reg[R2] + reg[R1]);
+    NEXT();
+opSUBR:
+    reg[R2] = signExtend24(reg[R2] - reg[R1]);
+    NEXT();
+opMULR:
+    reg[R2] = signExtend24((int)((long long)reg[R2] * reg[R1]));
+    NEXT();
+opDIVR:
+    if (reg[R1] == 0)
+        goto divideByZero;
+    reg[R2] = signExtend24(reg[R2] / reg[R1]);
+    NEXT();
+opCOMPR:
+    reg[REG_SW] = conditionCode(reg[R1], reg[R2]);
+    NEXT();
+opCLEAR:
+    reg[R1] = 0;
+    NEXT();
+opRMO:
+    reg[R2] = reg[R1];
+    NEXT();
+opTIXR:
+    reg[REG_X] = signExtend24(reg[REG_X] + 1);
+    reg[REG_SW] = conditionCode(reg[REG_X], reg[R1]);
+    NEXT();
+opSHIFTL:
+    value = reg[R1] & 0xFFFFFF;
+    reg[R1] = signExtend24((value << (R2 + 1)) | (value >> (23 - R2)));
+    NEXT();
+opSHIFTR:
+    reg[R1] = reg[R1] >> (R2 + 1);
+    NEXT();
+opTD:
+    reg[REG_SW] = CC_LT;
+    NEXT();
+opRD:
+    value = getchar();
+    reg[REG_A] = (reg[REG_A] & ~0xFF) | (value == EOF ? 0 : value);
+    NEXT();
+opWD:
+    putchar(reg[REG_A] & 0xFF);
+    NEXT();
+opNOP:
+    NEXT();
+opSVC:
+    status = HALT_SVC;
+    goto done;
+
+divideByZero:
+    status = HALT_DIVIDE_BY_ZERO;
+    goto done;
+outOfRange:
+    status = pc == RETURN_ADDRESS ? HALT_RETURN : HALT_OUT_OF_RANGE;
+    goto finish;
+done:
+    // Halting instructions are dispatched but not counted as executed.
+    if (status != HALT_STEP_LIMIT)
+        executed--;
+finish:
+
+#undef DISPATCH
+#undef NEXT
+#undef JUMP_TARGET
+#undef R1
+#undef R2
+
+    memcpy(machine->reg, reg, sizeof(reg));
+    machine->f = f;
+    machine->pc = pc;
+    machine->instructions += executed;
+    return status;
 }
 
-int isCommentOrEmpty(const char *line)
+// Runs a loaded program from its entry point and reports how it halted.
+int runProgram(Machine *machine, long long limit)
 {
-    while (*line && isspace(*line))
-        line++;
-    if (*line == ';' || *line == '\0')
-        return 1;
-    return 0;
+    machine->pc = machine->execAddress;
+    double start = monotonicSeconds();
+    int status = runMachine(machine, limit);
+    double seconds = monotonicSeconds() - start;
+    fflush(stdout);
+
+    // A return leaves pc just past memory, which names no instruction.
+    if (status == HALT_RETURN)
+        fprintf(stderr, "\nProgram %s halted: %s\n", machine->progName, haltReasons[status]);
+    else
+        fprintf(stderr, "\nProgram %s halted at %06X: %s\n", machine->progName, machine->pc, haltReasons[status]);
+    fprintf(stderr, "Executed %lld instructions in %.3f s (%.1f M instructions/sec)\n",
+            machine->instructions, seconds, seconds > 0 ? machine->instructions / seconds / 1e6 : 0.0);
+    fprintf(stderr, "A=%06X X=%06X L=%06X B=%06X S=%06X T=%06X SW=%06X F=%g\n",
+            machine->reg[REG_A] & 0xFFFFFF, machine->reg[REG_X] & 0xFFFFFF, machine->reg[REG_L] & 0xFFFFFF,
+            machine->reg[REG_B] & 0xFFFFFF, machine->reg[REG_S] & 0xFFFFFF, machine->reg[REG_T] & 0xFFFFFF,
+            machine->reg[REG_SW] & 0xFFFFFF, machine->f);
+    return status < HALT_INVALID_OPCODE;
 }
 
-void passOne(FILE *srcFile, LineInfo lines[], int *lineCount, int *startAddress, int *progLength, char *progName)
+int linkObjectProgram(char *const paths[], int count, const char *linkPath, int binary, int run, long long limit)
 {
-    char line[MAX_LINE_LENGTH];
-    int locctr = 0;
-    int lineNum = 0;
-    int firstExecAddress = 0;
-    int programStarted = 0;
+    Machine machine;
+    Linker linker;
+    initMachine(&machine);
 
-    while (fgets(line, sizeof(line), srcFile))
-    {
-        lineNum++;
-        if (isCommentOrEmpty(line))
-            continue;
+    double start = monotonicSeconds();
+    int ok = linkObjectModules(&machine, &linker, paths, count);
+    if (ok && linkPath)
+        ok = writeLinkedProgram(&machine, &linker, linkPath, binary);
+    double seconds = monotonicSeconds() - start;
+    if (ok && (linkPath || count > 1))
+        fprintf(stderr, "Linked %d control section(s) from %d module(s), %d modification(s), in %.3f s\n",
+                linker.sectionCount, count, linker.fixupCount, seconds);
+    freeLinker(&linker);
+    if (ok && run)
+        ok = runProgram(&machine, limit);
+    freeMachine(&machine);
+    return ok;
+}
 
-        parseLine(line, &lines[*lineCount]);
-        lines[*lineCount].lineNum = lineNum;
+#ifndef SIC_NO_MAIN
+int main(int argc, char *argv[])
+{
+    PathList sources = {0};
+    const char *outputDir = NULL;
+    int threadCount = 0;
+    int sourceThreads = 1;
+    int batch = 0;
+    int execute = 0;
+    int onePass = 0;
+    int incremental = 0;
+    int relax = 0;
+    int binary = 0;
+    int noListing = 0;
+    int costReport = 0;
+    int runObjects = 0;
+    const char *convertPaths[2] = {NULL, NULL};
+    const char *disassemblePaths[3] = {NULL, NULL, NULL};
+    const char *linkPath = NULL;
+    const char *socketPath = NULL;
+    long long stepLimit = 0;
+    int statsMode = 0;
+    AssemblyStats stats = {0};
 
-        if (strcmp(lines[*lineCount].opcode, "START") == 0)
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=json") == 0)
         {
-            if (lines[*lineCount].operand[0] != '\0')
-            {
-                locctr = (int)strtol(lines[*lineCount].operand, NULL, 16);
-                *startAddress = locctr;
-                if (strlen(lines[*lineCount].label) > 0)
-                    strcpy(progName, lines[*lineCount].label);
-                else
-                    strcpy(progName, DEFAULT_PROG_NAME);
-            }
-            else
-            {
-                locctr = DEFAULT_START_ADDR;
-                strcpy(progName, DEFAULT_PROG_NAME);
-            }
-            lines[*lineCount].address = locctr;
-            (*lineCount)++;
-            programStarted = 1;
-            break;
+            statsMode = argv[i][7] ? 2 : 1;
+            pthread_mutex_init(&stats.lock, NULL);
+            activeStats = &stats;
         }
-        else
+        else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
         {
-            locctr = DEFAULT_START_ADDR;
-            strcpy(progName, DEFAULT_PROG_NAME);
-            break;
+            socketPath = argv[++i];
         }
-    }
-
-    while (fgets(line, sizeof(line), srcFile))
-    {
-        lineNum++;
-        if (isCommentOrEmpty(line))
-            continue;
-
-        parseLine(line, &lines[*lineCount]);
-        lines[*lineCount].lineNum = lineNum;
-        lines[*lineCount].address = locctr;
-
-        if (lines[*lineCount].label[0] != '\0')
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
         {
-            if (!addSymbol(lines[*lineCount].label, locctr))
-            {
-                snprintf(lines[*lineCount].errorMsg, sizeof(lines[*lineCount].errorMsg),
-                         "Duplicate or invalid symbol '%s'", lines[*lineCount].label);
-            }
+            threadCount = atoi(argv[++i]);
+            batch = 1;
         }
-
-        if (strcmp(lines[*lineCount].opcode, "END") == 0)
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
         {
-            if (lines[*lineCount].operand[0] != '\0')
-            {
-                firstExecAddress = lookupSymbol(lines[*lineCount].operand);
-                if (firstExecAddress == -1)
-                {
-                    snprintf(lines[*lineCount].errorMsg, sizeof(lines[*lineCount].errorMsg),
-                             "Undefined symbol '%s'", lines[*lineCount].operand);
-                }
-            }
-            (*lineCount)++;
-            break;
+            sourceThreads = atoi(argv[++i]);
         }
-        else if (strcmp(lines[*lineCount].opcode, "BYTE") == 0)
+        else if (strcmp(argv[i], "-x") == 0)
         {
-            char constant[MAX_OPERAND];
-            strcpy(constant, lines[*lineCount].operand);
-            if (constant[0] == 'C')
-            {
-                int len = strlen(constant) - 3;
-                locctr += len;
-            }
-            else if (constant[0] == 'X')
-            {
-                int len = (strlen(constant) - 3) / 2;
-                locctr += len;
-            }
+            execute = 1;
         }
-        else if (strcmp(lines[*lineCount].opcode, "WORD") == 0)
+        else if (strcmp(argv[i], "-1") == 0)
         {
-            locctr += 3;
+            onePass = 1;
         }
-        else if (strcmp(lines[*lineCount].opcode, "RESW") == 0)
+        else if (strcmp(argv[i], "-i") == 0)
         {
-            locctr += 3 * atoi(lines[*lineCount].operand);
+            incremental = 1;
         }
-        else if (strcmp(lines[*lineCount].opcode, "RESB") == 0)
+        else if (strcmp(argv[i], "-R") == 0)
         {
-            locctr += atoi(lines[*lineCount].operand);
+            relax = 1;
         }
-        else if (strcmp(lines[*lineCount].opcode, "BASE") == 0 ||
-                 strcmp(lines[*lineCount].opcode, "NOBASE") == 0)
+        else if (strcmp(argv[i], "-b") == 0)
         {
+            binary = 1;
         }
-        else
+        else if (strcmp(argv[i], "--no-listing") == 0)
         {
-            char opcodeStr[3];
-            int format;
-            if (lookupOpcode(lines[*lineCount].opcode, opcodeStr, &format))
-            {
-                locctr += format;
-            }
-            else
-            {
-                snprintf(lines[*lineCount].errorMsg, sizeof(lines[*lineCount].errorMsg),
-                         "Invalid opcode '%s'", lines[*lineCount].opcode);
-            }
+            noListing = 1;
         }
-
-        (*lineCount)++;
-    }
-
-    *progLength = locctr - *startAddress;
-}
-
-void passTwo(LineInfo lines[], int lineCount, int startAddress, int progLength, const char *progName, FILE *objFile, FILE *lstFile)
-{
-    int baseAddress = 0;
-    int useBase = 0;
-
-    fprintf(objFile, "H%-6s%06X%06X\n", progName, startAddress, progLength);
-    fprintf(lstFile, "H%-6s %06X %06X\n", progName, startAddress, progLength);
-
-    char textRecord[70] = "T";
-    int currentRecordStart = 0;
-    int currentRecordLength = 0;
-
-    int firstExecAddress = startAddress;
-
-    for (int i = 0; i < lineCount; i++)
-    {
-        if (strcmp(lines[i].opcode, "START") != 0 &&
-            strcmp(lines[i].opcode, "END") != 0 &&
-            lines[i].objectCode[0] != '\0')
+        else if (strcmp(argv[i], "--cost") == 0)
         {
-            firstExecAddress = lines[i].address;
-            break;
+            costReport = 1;
         }
-    }
-
-    for (int i = 0; i < lineCount; i++)
-    {
-        LineInfo *currentLine = &lines[i];
-        char objCode[MAX_OBJECT_CODE] = "";
-
-        if (strcmp(currentLine->opcode, "START") == 0 ||
-            strcmp(currentLine->opcode, "END") == 0)
+        else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc)
         {
-            if (currentRecordLength > 0)
-            {
-                sprintf(&textRecord[7], "%02X", currentRecordLength);
-                fprintf(objFile, "%s\n", textRecord);
-                fprintf(lstFile, "%s\n", textRecord);
-                // Reset text record
-                strcpy(textRecord, "T");
-                currentRecordLength = 0;
-            }
-            continue;
+            convertPaths[0] = argv[++i];
+            convertPaths[1] = argv[++i];
         }
-
-        if (strcmp(currentLine->opcode, "BYTE") == 0)
+        else if (strcmp(argv[i], "--disassemble") == 0 && i + 2 < argc)
         {
-            char constant[MAX_OPERAND];
-            strcpy(constant, currentLine->operand);
-            if (constant[0] == 'C')
-            {
-                char hexStr[2 * MAX_OPERAND] = "";
-                for (int j = 2; j < strlen(constant) - 1; j++)
-                {
-                    char temp[3];
-                    sprintf(temp, "%02X", constant[j]);
-                    strcat(hexStr, temp);
-                }
-                strcpy(objCode, hexStr);
-            }
-            else if (constant[0] == 'X')
-            {
-                strcpy(objCode, &constant[2]);
-            }
+            disassemblePaths[0] = argv[++i];
+            disassemblePaths[1] = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                disassemblePaths[2] = argv[++i];
         }
-        else if (strcmp(currentLine->opcode, "WORD") == 0)
+        else if (strcmp(argv[i], "-r") == 0)
         {
-            int value = atoi(currentLine->operand);
-            sprintf(objCode, "%06X", value);
+            runObjects = 1;
         }
-        else if (strcmp(currentLine->opcode, "BASE") == 0)
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
         {
-            if (lookupSymbol(currentLine->operand) != -1)
-            {
-                baseAddress = lookupSymbol(currentLine->operand);
-                useBase = 1;
-            }
-            else
-            {
-                fprintf(stderr, "Error: Undefined symbol '%s' for BASE directive at line %d\n",
-                        currentLine->operand, currentLine->lineNum);
-            }
-            continue;
+            linkPath = argv[++i];
         }
-        else if (strcmp(currentLine->opcode, "NOBASE") == 0)
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
         {
-            useBase = 0;
-            continue;
+            stepLimit = atoll(argv[++i]);
         }
-        else
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
         {
-            char opcodeStr[3];
-            int format;
-            if (lookupOpcode(currentLine->opcode, opcodeStr, &format))
-            {
-                if (format == 1)
-                {
-                    strcpy(objCode, opcodeStr);
-                }
-                else if (format == 2)
-                {
-
-                    strcpy(objCode, opcodeStr);
-                }
-                else if (format == 3 || format == 4)
-                {
-                    int ni = 3;
-                    int x = 0, b = 0, p = 0, e = 0;
-                    int disp = 0;
-
-                    if (currentLine->opcode[0] == '+')
-                    {
-                        e = 1;
-                        format = 4;
-                    }
-
-                    char operandCopy[MAX_OPERAND];
-                    strcpy(operandCopy, currentLine->operand);
-                    toUpperCase(operandCopy);
-
-                    if (operandCopy[0] == '#')
-                    {
-                        ni = 1;
-                        strcpy(operandCopy, &operandCopy[1]);
-                    }
-                    else if (operandCopy[0] == '@')
-                    {
-                        ni = 2;
-                        strcpy(operandCopy, &operandCopy[1]);
-                    }
-                    else
-                    {
-                        ni = 3;
-                    }
-
-                    int targetAddress = 0;
-                    if (strcmp(operandCopy, "") != 0)
-                    {
-                        targetAddress = lookupSymbol(operandCopy);
-                        if (targetAddress == -1)
-                        {
-                            fprintf(stderr, "Error: Undefined symbol '%s' at line %d\n",
-                                    operandCopy, currentLine->lineNum);
-                        }
-                    }
-
-                    if (format == 3)
-                    {
-                        disp = targetAddress - (currentLine->address + 3);
-                        if (disp >= -2048 && disp <= 2047)
-                        {
-                            p = 1;
-                        }
-                        else if (useBase && (targetAddress - baseAddress) >= 0 && (targetAddress - baseAddress) <= 4095)
-                        {
-                            disp = targetAddress - baseAddress;
-                            b = 1;
-                        }
-                        else
-                        {
-                            disp = 0;
-                            fprintf(stderr, "Error: Displacement out of range for symbol '%s' at line %d\n",
-                                    operandCopy, currentLine->lineNum);
-                        }
-                    }
-                    else if (format == 4)
-                    {
-                        disp = targetAddress;
-                        b = 0;
-                        p = 0;
-                    }
-
-                    int opcodeInt = (int)strtol(opcodeStr, NULL, 16);
-                    opcodeInt = (opcodeInt & 0xFC) | ni;
-
-                    if (format == 3)
-                    {
-                        int xbpe = (x << 3) | (b << 2) | (p << 1) | e;
-                        sprintf(objCode, "%02X%04X", opcodeInt, (xbpe << 12) | (disp & 0xFFF));
-                    }
-                    else if (format == 4)
-                    {
-                        e = 1;
-                        sprintf(objCode, "%02X%05X", opcodeInt, disp);
-                    }
-                }
-            }
-            else
-            {
-            }
+            outputDir = argv[++i];
+            batch = 1;
         }
-
-        if (objCode[0] != '\0')
+        else if (argv[i][0] == '@')
         {
-            if (currentRecordLength == 0)
-            {
-                sprintf(textRecord + 1, "%06X", currentLine->address);
-                strcat(textRecord, "00");
-                strcat(textRecord, objCode);
-                currentRecordLength += strlen(objCode) / 2;
-            }
-            else
+            if (!readManifest(argv[i] + 1, &sources))
             {
-                if ((currentRecordLength + strlen(objCode) / 2) > 30)
-                {
-                    sprintf(&textRecord[7], "%02X", currentRecordLength);
-                    fprintf(objFile, "%s\n", textRecord);
-                    fprintf(lstFile, "%s\n", textRecord);
-
-                    strcpy(textRecord, "T");
-                    sprintf(textRecord + 1, "%06X", currentLine->address);
-                    strcat(textRecord, "00");
-                    strcat(textRecord, objCode);
-                    currentRecordLength = strlen(objCode) / 2;
-                }
-                else
-                {
-                    strcat(textRecord, objCode);
-                    currentRecordLength += strlen(objCode) / 2;
-                }
+                perror("Error opening manifest file");
+                return 1;
             }
+            batch = 1;
+        }
+        else
+        {
+            appendPath(&sources, argv[i]);
         }
+    }
 
-        fprintf(lstFile, "%04X  %-6s %-6s %-10s %s\n",
-                currentLine->address,
-                currentLine->label,
-                currentLine->opcode,
-                currentLine->operand,
-                currentLine->objectCode);
+    // Pass two then only formats output; the writes happen on another thread.
+    startOutputWriter();
 
-        strcpy(currentLine->objectCode, objCode);
+    if (socketPath)
+    {
+        for (int i = 0; i < sources.count; i++)
+            free(sources.items[i]);
+        free(sources.items);
+        return runServer(socketPath, sourceThreads) ? 0 : 1;
     }
 
-    if (currentRecordLength > 0)
+    if (convertPaths[0])
     {
-        sprintf(&textRecord[7], "%02X", currentRecordLength);
-        fprintf(objFile, "%s\n", textRecord);
-        fprintf(lstFile, "%s\n", textRecord);
+        SourceFile file;
+        int toBinary = 1;
+        if (openSourceFile(convertPaths[0], &file))
+        {
+            toBinary = !isBinaryObject(&file);
+            closeSourceFile(&file);
+        }
+        int ok = convertObjectFile(convertPaths[0], convertPaths[1], toBinary);
+        if (ok)
+            printf("Converted '%s' to %s object file '%s'\n", convertPaths[0], toBinary ? "a binary" : "a text",
+                   convertPaths[1]);
+        return ok ? 0 : 1;
     }
 
-    fprintf(objFile, "E%06X\n", firstExecAddress);
-    fprintf(lstFile, "E %06X\n", firstExecAddress);
-}
+    if (disassemblePaths[0])
+        return disassembleObject(disassemblePaths[0], disassemblePaths[1], disassemblePaths[2]) ? 0 : 1;
 
-int main(int argc, char *argv[])
-{
-    if (argc < 2)
+    if ((runObjects || linkPath) && sources.count > 0)
+    {
+        int ok = linkObjectProgram(sources.items, sources.count, linkPath, binary, runObjects, stepLimit);
+        for (int i = 0; i < sources.count; i++)
+            free(sources.items[i]);
+        free(sources.items);
+        return ok ? 0 : 1;
+    }
+
+    if (sources.count == 0)
     {
         printf("Usage: %s <source file path>\n", argv[0]);
+        printf("       %s [-j threads] [-o output dir] <source>... | @manifest\n", argv[0]);
+        printf("       %s [-r] [-L linked.obj] <object file>...\n", argv[0]);
+        printf("       %s [-t threads] --server <socket path>\n", argv[0]);
+        printf("  -t threads   parse pass one and encode pass two on this many threads per source\n");
+        printf("  -x           run the object program after assembling it\n");
+        printf("  -1           assemble in one pass with no listing; with -x, load and go\n");
+        printf("  -i           reassemble only the lines changed since the last -i run\n");
+        printf("  -R           choose format 3 or 4 for each instruction, ignoring '+'\n");
+        printf("  -b           write binary object files (also for -L)\n");
+        printf("  --no-listing assemble in two passes but write no listing\n");
+        printf("  --cost       give each listed instruction its estimated cycles and end the listing\n");
+        printf("               with its basic blocks, hottest first, and its loops\n");
+        printf("  -r           link the object files and run the program\n");
+        printf("  -L file      link the object files into one absolute object program\n");
+        printf("  -n count     stop a run after this many instructions\n");
+        printf("  --convert in out  convert an object file between the text and binary formats\n");
+        printf("  --disassemble obj out [lst]  write an object file of either format as listing lines,\n");
+        printf("                 checking each statement of its listing against the records\n");
+        printf("  --server path  serve \"<source>\\t<obj>[\\t<lst>]\" requests on a Unix socket; a listing\n");
+        printf("                 path of * defers the listing to a later \"LISTING\\t<lst>\" request\n");
+        printf("  --stats[=json] report phase times, lookup counts, output sizes and peak memory\n");
         return 1;
     }
 
-    initializeOpcodeTable();
-
-    FILE *srcFile = fopen(argv[1], "r");
-    if (!srcFile)
+    if (relax && onePass)
     {
-        perror("Error opening source file");
-        return 1;
+        fprintf(stderr, "Warning: -R needs two passes and is ignored with -1\n");
+        relax = 0;
+    }
+    if (costReport && (onePass || noListing))
+    {
+        fprintf(stderr, "Warning: --cost writes to the listing and is ignored with -1 and --no-listing\n");
+        costReport = 0;
     }
 
-    LineInfo lines[MAX_LINES];
-    int lineCount = 0;
-    int startAddress = 0;
-    int progLength = 0;
-    char progName[MAX_OPERAND] = DEFAULT_PROG_NAME;
+    if (!batch && sources.count == 1)
+    {
+        AssemblyContext ctx = {0};
+        ctx.sourcePath = sources.items[0];
+        ctx.objPath = strdup("output.obj");
+        ctx.lstPath = onePass || noListing ? NULL : strdup("output.lst");
+        ctx.noListing = noListing && !onePass;
+        ctx.passOneThreads = sourceThreads;
+        ctx.passTwoThreads = sourceThreads;
+        ctx.incremental = incremental;
+        ctx.relax = relax;
+        ctx.costReport = costReport;
+        ctx.binaryObject = binary;
+
+        Machine machine;
+        int loadAndGo = onePass && execute;
+        if (loadAndGo)
+            initMachine(&machine);
+        int ok = loadAndGo ? assembleOnePass(&ctx, &machine) : assembleFile(&ctx);
+        int errors = ctx.diagnostics.count;
+        printDiagnostics(&ctx, stderr, 0);
+        if (relax && errors == 0)
+            printf("%d of %d instructions need format 4 (%d round(s)), %d bytes saved over all format 4\n",
+                   ctx.relaxPromoted, ctx.relaxCandidates, ctx.relaxRounds, ctx.relaxCandidates - ctx.relaxPromoted);
+        if (costReport && ok)
+            printf("%d basic block(s), %d loop(s); estimated cycles are in the listing\n", ctx.costBlocks,
+                   ctx.costLoops);
+        if (statsMode)
+            printStats(&stats, stderr, statsMode == 2);
+        releaseAssembly(&ctx);
+        freeDiagnostics(&ctx.diagnostics);
+        free(ctx.objPath);
+        free(ctx.lstPath);
+        free(sources.items[0]);
+        free(sources.items);
+        if (loadAndGo)
+        {
+            ok = ok && errors == 0 && runProgram(&machine, stepLimit);
+            freeMachine(&machine);
+            return ok ? 0 : 1;
+        }
+        if (!ok || errors > 0)
+            return 1;
+
+        printf("\nAssembly completed successfully.\n");
+        printf("Object Program Generated: output.obj\n");
+        if (!onePass && !noListing)
+            printf("Listing File Generated: output.lst\n");
+        if (execute)
+        {
+            char *objPath = "output.obj";
+            return linkObjectProgram(&objPath, 1, NULL, 0, 1, stepLimit) ? 0 : 1;
+        }
+        return 0;
+    }
 
-    passOne(srcFile, lines, &lineCount, &startAddress, &progLength, progName);
-    fclose(srcFile);
+    if (threadCount <= 0)
+        threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
 
-    FILE *objFile = fopen("output.obj", "w");
-    if (!objFile)
+    AssemblyContext *contexts = (AssemblyContext *)calloc(sources.count, sizeof(AssemblyContext));
+    if (!contexts)
     {
-        perror("Error creating object file");
+        fprintf(stderr, "Memory allocation error for batch contexts\n");
         return 1;
     }
+    for (int i = 0; i < sources.count; i++)
+    {
+        contexts[i].sourcePath = sources.items[i];
+        contexts[i].objPath = outputPath(sources.items[i], outputDir, ".obj");
+        contexts[i].lstPath = onePass || noListing ? NULL : outputPath(sources.items[i], outputDir, ".lst");
+        contexts[i].noListing = noListing && !onePass;
+        contexts[i].passOneThreads = sourceThreads;
+        contexts[i].passTwoThreads = sourceThreads;
+        contexts[i].incremental = incremental;
+        contexts[i].relax = relax;
+        contexts[i].costReport = costReport;
+        contexts[i].binaryObject = binary;
+    }
 
-    FILE *lstFile = fopen("output.lst", "w");
-    if (!lstFile)
+    if (reportOutputCollisions(contexts, sources.count) > 0)
     {
-        perror("Error creating listing file");
-        fclose(objFile);
+        for (int i = 0; i < sources.count; i++)
+        {
+            free(contexts[i].objPath);
+            free(contexts[i].lstPath);
+            free(sources.items[i]);
+        }
+        free(contexts);
+        free(sources.items);
         return 1;
     }
 
-    passTwo(lines, lineCount, startAddress, progLength, progName, objFile, lstFile);
-    fclose(objFile);
-    fclose(lstFile);
+    runWorkerPool(threadCount, sources.count, assembleJob, contexts);
 
-    printf("\nAssembly completed successfully.\n");
-    printf("Object Program Generated: output.obj\n");
-    printf("Listing File Generated: output.lst\n");
-    return 0;
+    int failed = 0;
+    int withErrors = 0;
+    int promoted = 0, candidates = 0;
+    for (int i = 0; i < sources.count; i++)
+    {
+        printDiagnostics(&contexts[i], stderr, 1);
+        promoted += contexts[i].relaxPromoted;
+        candidates += contexts[i].relaxCandidates;
+        failed += contexts[i].failed;
+        withErrors += contexts[i].diagnostics.count > 0;
+        freeDiagnostics(&contexts[i].diagnostics);
+        free(contexts[i].objPath);
+        free(contexts[i].lstPath);
+        free(sources.items[i]);
+    }
+    printf("Assembled %d of %d file(s) on %d thread(s), %d with errors\n",
+           sources.count - failed, sources.count, threadCount, withErrors);
+    if (relax)
+        printf("%d of %d instructions need format 4, %d bytes saved over all format 4\n",
+               promoted, candidates, candidates - promoted);
+    if (statsMode)
+        printStats(&stats, stderr, statsMode == 2);
+
+    free(contexts);
+    free(sources.items);
+    return failed || withErrors ? 1 : 0;
 }
+#endif